@@ -33,9 +33,12 @@
 
 #include <glib.h>
 
+#include "ringbuffer.h"
 #include "qmi.h"
 #include "ctl.h"
 
+#define QMI_BUFFER_SIZE 4096
+
 typedef void (*qmi_message_func_t)(uint16_t message, uint16_t length,
 					const void *buffer, void *user_data);
 
@@ -46,9 +49,11 @@ struct qmi_device {
 	bool close_on_unref;
 	guint read_watch;
 	guint write_watch;
+	bool destroyed;		/* Freed once the read watch is gone */
+	struct ring_buffer *buf;
 	GQueue *req_queue;
-	GQueue *control_queue;
-	GQueue *service_queue;
+	GHashTable *control_table;
+	GHashTable *service_table;
 	uint8_t next_control_tid;
 	uint16_t next_service_tid;
 	qmi_debug_func_t debug_func;
@@ -72,6 +77,7 @@ struct qmi_service {
 	uint8_t client_id;
 	uint16_t next_notify_id;
 	GList *notify_list;
+	GHashTable *notify_table;
 };
 
 struct qmi_param {
@@ -85,10 +91,13 @@ struct qmi_result {
 	uint16_t error;
 	const void *data;
 	uint16_t length;
+	bool indexed;
+	uint16_t tlv_offset[256];
 };
 
 struct qmi_request {
 	uint16_t tid;
+	uint8_t service;
 	uint8_t client;
 	void *buf;
 	size_t len;
@@ -166,6 +175,7 @@ static struct qmi_request *__request_alloc(uint8_t service,
 		return NULL;
 	}
 
+	req->service = service;
 	req->client = client;
 
 	hdr = req->buf;
@@ -201,12 +211,10 @@ static void __request_free(gpointer data, gpointer user_data)
 	g_free(req);
 }
 
-static gint __request_compare(gconstpointer a, gconstpointer b)
+static void __request_table_free(gpointer key, gpointer value,
+							gpointer user_data)
 {
-	const struct qmi_request *req = a;
-	uint16_t tid = GPOINTER_TO_UINT(b);
-
-	return req->tid - tid;
+	__request_free(value, user_data);
 }
 
 static void __notify_free(gpointer data, gpointer user_data)
@@ -219,6 +227,12 @@ static void __notify_free(gpointer data, gpointer user_data)
 	g_free(notify);
 }
 
+static void __notify_table_free(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	g_list_free(value);
+}
+
 static gint __notify_compare(gconstpointer a, gconstpointer b)
 {
 	const struct qmi_notify *notify = a;
@@ -594,7 +608,6 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 							gpointer user_data)
 {
 	struct qmi_device *device = user_data;
-	struct qmi_mux_hdr *hdr;
 	struct qmi_request *req;
 	ssize_t bytes_written;
 
@@ -612,13 +625,7 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 	__debug_msg(' ', req->buf, bytes_written,
 				device->debug_func, device->debug_data);
 
-	hdr = req->buf;
-
-	if (hdr->service == QMI_SERVICE_CONTROL)
-		g_queue_push_tail(device->control_queue, req);
-	else
-		g_queue_push_tail(device->service_queue, req);
-
+	/* Still pending in the transaction table, marked as sent */
 	g_free(req->buf);
 	req->buf = NULL;
 
@@ -645,31 +652,114 @@ static void wakeup_writer(struct qmi_device *device)
 				can_write_data, device, write_watch_destroy);
 }
 
+static GHashTable *__request_table(struct qmi_device *device, uint8_t service)
+{
+	if (service == QMI_SERVICE_CONTROL)
+		return device->control_table;
+
+	return device->service_table;
+}
+
+static uint8_t __control_tid_next(struct qmi_device *device)
+{
+	unsigned int i;
+
+	/* Skip the transactions still pending after a wrap around */
+	for (i = 0; i < 0xff; i++) {
+		if (device->next_control_tid < 1)
+			device->next_control_tid = 1;
+
+		if (!g_hash_table_lookup(device->control_table,
+				GUINT_TO_POINTER(device->next_control_tid)))
+			break;
+
+		device->next_control_tid++;
+	}
+
+	return device->next_control_tid++;
+}
+
+static uint16_t __service_tid_next(struct qmi_device *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < 0xffff; i++) {
+		if (device->next_service_tid < 256)
+			device->next_service_tid = 256;
+
+		if (!g_hash_table_lookup(device->service_table,
+				GUINT_TO_POINTER(device->next_service_tid)))
+			break;
+
+		device->next_service_tid++;
+	}
+
+	return device->next_service_tid++;
+}
+
+/*
+ * Requests stay in the transaction table from submission until they are
+ * answered or cancelled.  Those not written yet are also on req_queue.
+ */
 static void __request_submit(struct qmi_device *device,
 				struct qmi_request *req, uint16_t transaction)
 {
 	req->tid = transaction;
 
+	g_hash_table_insert(__request_table(device, req->service),
+				GUINT_TO_POINTER(req->tid), req);
+
 	g_queue_push_tail(device->req_queue, req);
 
 	wakeup_writer(device);
 }
 
+static void __request_remove(struct qmi_device *device,
+				struct qmi_request *req)
+{
+	g_hash_table_remove(__request_table(device, req->service),
+				GUINT_TO_POINTER(req->tid));
+
+	/* Not written yet */
+	if (req->buf)
+		g_queue_remove(device->req_queue, req);
+}
+
 static void service_notify(gpointer key, gpointer value, gpointer user_data)
 {
 	struct qmi_service *service = value;
 	struct qmi_result *result = user_data;
 	GList *list;
+	GList *next;
+
+	list = g_hash_table_lookup(service->notify_table,
+					GUINT_TO_POINTER(result->message));
 
-	for (list = g_list_first(service->notify_list); list;
-						list = g_list_next(list)) {
+	for (; list; list = next) {
 		struct qmi_notify *notify = list->data;
 
-		if (notify->message == result->message)
-			notify->callback(result, notify->user_data);
+		next = list->next;
+
+		notify->callback(result, notify->user_data);
 	}
 }
 
+struct broadcast_data {
+	uint8_t type;
+	struct qmi_result *result;
+};
+
+static void service_broadcast(gpointer key, gpointer value, gpointer user_data)
+{
+	struct qmi_service *service = value;
+	struct broadcast_data *data = user_data;
+
+	if (service->type != data->type)
+		return;
+
+	service_notify(key, value, data->result);
+}
+
 static void handle_indication(struct qmi_device *device,
 			uint8_t service_type, uint8_t client_id,
 			uint16_t message, uint16_t length, const void *data)
@@ -686,10 +776,17 @@ static void handle_indication(struct qmi_device *device,
 	result.message = message;
 	result.data = data;
 	result.length = length;
+	result.indexed = false;
 
+	/* Broadcast to all the clients of the service */
 	if (client_id == 0xff) {
+		struct broadcast_data data = {
+			.type = service_type,
+			.result = &result,
+		};
+
 		g_hash_table_foreach(device->service_list,
-						service_notify, &result);
+						service_broadcast, &data);
 		return;
 	}
 
@@ -714,7 +811,6 @@ static void handle_packet(struct qmi_device *device,
 		const struct qmi_control_hdr *control = buf;
 		const struct qmi_message_hdr *msg;
 		unsigned int tid;
-		GList *list;
 
 		/* Ignore control messages with client identifier */
 		if (hdr->client != 0x00)
@@ -735,19 +831,12 @@ static void handle_packet(struct qmi_device *device,
 			return;
 		}
 
-		list = g_queue_find_custom(device->control_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
-			return;
-
-		req = list->data;
-
-		g_queue_delete_link(device->control_queue, list);
+		req = g_hash_table_lookup(device->control_table,
+						GUINT_TO_POINTER(tid));
 	} else {
 		const struct qmi_service_hdr *service = buf;
 		const struct qmi_message_hdr *msg;
 		unsigned int tid;
-		GList *list;
 
 		msg = buf + QMI_SERVICE_HDR_SIZE;
 
@@ -764,15 +853,15 @@ static void handle_packet(struct qmi_device *device,
 			return;
 		}
 
-		list = g_queue_find_custom(device->service_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
-			return;
+		req = g_hash_table_lookup(device->service_table,
+						GUINT_TO_POINTER(tid));
+	}
 
-		req = list->data;
+	/* Ignore replies to requests that have not been sent yet */
+	if (!req || req->buf)
+		return;
 
-		g_queue_delete_link(device->service_queue, list);
-	}
+	__request_remove(device, req);
 
 	if (req->callback)
 		req->callback(message, length, data, req->user_data);
@@ -780,54 +869,78 @@ static void handle_packet(struct qmi_device *device,
 	__request_free(req, NULL);
 }
 
+static void handle_frame(struct qmi_device *device, const unsigned char *frame,
+							unsigned int len)
+{
+	__hexdump('<', frame, len, device->debug_func, device->debug_data);
+
+	__debug_msg(' ', frame, len, device->debug_func, device->debug_data);
+
+	handle_packet(device, (const void *) frame, frame + QMI_MUX_HDR_SIZE);
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 							gpointer user_data)
 {
 	struct qmi_device *device = user_data;
-	struct qmi_mux_hdr *hdr;
-	unsigned char buf[2048];
-	ssize_t bytes_read;
-	uint16_t offset;
+	struct ring_buffer *buf = device->buf;
+	unsigned char hdr_buf[QMI_MUX_HDR_SIZE];
+	const struct qmi_mux_hdr *hdr = (const void *) hdr_buf;
+	unsigned char *frame;
+	unsigned int len;
+	unsigned int i;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
-	bytes_read = read(device->fd, buf, sizeof(buf));
-	if (bytes_read < 0)
+	if (ring_buffer_fill(buf, device->fd) < 0)
 		return TRUE;
 
-	__hexdump('<', buf, bytes_read,
-				device->debug_func, device->debug_data);
-
-	offset = 0;
-
-	while (offset < bytes_read) {
-		uint16_t len;
+	/* A callback might drop the last reference to the device */
+	qmi_device_ref(device);
 
-		/* Check if QMI mux header fits into packet */
-		if (bytes_read - offset < QMI_MUX_HDR_SIZE)
-			break;
+	/*
+	 * Handle all the frames read so far.  A frame split across reads
+	 * stays in the buffer until the rest of it arrives.
+	 */
+	while (ring_buffer_len(buf) >= QMI_MUX_HDR_SIZE) {
+		for (i = 0; i < QMI_MUX_HDR_SIZE; i++)
+			hdr_buf[i] = *ring_buffer_read_ptr(buf, i);
 
-		hdr = (void *) (buf + offset);
+		len = GUINT16_FROM_LE(hdr->length) + 1;
 
 		/* Check for fixed frame and flags value */
-		if (hdr->frame != 0x01 || hdr->flags != 0x80)
+		if (hdr->frame != 0x01 || hdr->flags != 0x80 ||
+				len < QMI_MUX_HDR_SIZE) {
+			__debug_device(device, "discarding %d bytes",
+						ring_buffer_len(buf));
+			ring_buffer_reset(buf);
 			break;
+		}
 
-		len = GUINT16_FROM_LE(hdr->length) + 1;
+		if ((unsigned int) ring_buffer_len(buf) < len) {
+			/* Make room for frames larger than the buffer */
+			if ((unsigned int) ring_buffer_capacity(buf) < len)
+				ring_buffer_resize(buf, len);
 
-		/* Check that packet size matches frame size */
-		if (bytes_read - offset < len)
 			break;
+		}
 
-		__debug_msg(' ', buf + offset, len,
-				device->debug_func, device->debug_data);
-
-		handle_packet(device, hdr, buf + offset + QMI_MUX_HDR_SIZE);
+		if ((unsigned int) ring_buffer_len_no_wrap(buf) >= len) {
+			handle_frame(device, ring_buffer_read_ptr(buf, 0), len);
+			ring_buffer_drain(buf, len);
+			continue;
+		}
 
-		offset += len;
+		/* The frame wraps around the end of the buffer */
+		frame = g_malloc(len);
+		ring_buffer_read(buf, frame, len);
+		handle_frame(device, frame, len);
+		g_free(frame);
 	}
 
+	qmi_device_unref(device);
+
 	return TRUE;
 }
 
@@ -836,6 +949,9 @@ static void read_watch_destroy(gpointer user_data)
 	struct qmi_device *device = user_data;
 
 	device->read_watch = 0;
+
+	if (device->destroyed)
+		g_free(device);
 }
 
 static void service_destroy(gpointer data)
@@ -877,6 +993,12 @@ struct qmi_device *qmi_device_new(int fd)
 		}
 	}
 
+	device->buf = ring_buffer_new(QMI_BUFFER_SIZE);
+	if (!device->buf) {
+		g_free(device);
+		return NULL;
+	}
+
 	device->io = g_io_channel_unix_new(device->fd);
 
 	g_io_channel_set_encoding(device->io, NULL, NULL);
@@ -889,8 +1011,8 @@ struct qmi_device *qmi_device_new(int fd)
 	g_io_channel_unref(device->io);
 
 	device->req_queue = g_queue_new();
-	device->control_queue = g_queue_new();
-	device->service_queue = g_queue_new();
+	device->control_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	device->service_table = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	device->service_list = g_hash_table_new_full(g_direct_hash,
 					g_direct_equal, NULL, service_destroy);
@@ -918,20 +1040,19 @@ void qmi_device_unref(struct qmi_device *device)
 
 	__debug_device(device, "device %p free", device);
 
-	g_queue_foreach(device->control_queue, __request_free, NULL);
-	g_queue_free(device->control_queue);
+	/* Every request on req_queue is in one of the tables as well */
+	g_queue_free(device->req_queue);
 
-	g_queue_foreach(device->service_queue, __request_free, NULL);
-	g_queue_free(device->service_queue);
+	g_hash_table_foreach(device->control_table, __request_table_free, NULL);
+	g_hash_table_destroy(device->control_table);
 
-	g_queue_foreach(device->req_queue, __request_free, NULL);
-	g_queue_free(device->req_queue);
+	g_hash_table_foreach(device->service_table, __request_table_free, NULL);
+	g_hash_table_destroy(device->service_table);
 
 	if (device->write_watch > 0)
 		g_source_remove(device->write_watch);
 
-	if (device->read_watch > 0)
-		g_source_remove(device->read_watch);
+	ring_buffer_free(device->buf);
 
 	if (device->close_on_unref)
 		close(device->fd);
@@ -941,6 +1062,17 @@ void qmi_device_unref(struct qmi_device *device)
 	g_free(device->version_str);
 	g_free(device->version_list);
 
+	/*
+	 * The last reference may be dropped from within received_data().
+	 * glib delays the destroy notify of a watch until its dispatch
+	 * returns, so leave freeing the device to read_watch_destroy().
+	 */
+	if (device->read_watch > 0) {
+		device->destroyed = true;
+		g_source_remove(device->read_watch);
+		return;
+	}
+
 	g_free(device);
 }
 
@@ -1138,11 +1270,8 @@ bool qmi_device_discover(struct qmi_device *device, qmi_discover_func_t func,
 		return false;
 	}
 
-	if (device->next_control_tid < 1)
-		device->next_control_tid = 1;
-
 	hdr->type = 0x00;
-	hdr->transaction = device->next_control_tid++;
+	hdr->transaction = __control_tid_next(device);
 
 	__request_submit(device, req, hdr->transaction);
 
@@ -1168,11 +1297,8 @@ static void release_client(struct qmi_device *device,
 		return;
 	}
 
-	if (device->next_control_tid < 1)
-		device->next_control_tid = 1;
-
 	hdr->type = 0x00;
-	hdr->transaction = device->next_control_tid++;
+	hdr->transaction = __control_tid_next(device);
 
 	__request_submit(device, req, hdr->transaction);
 }
@@ -1392,24 +1518,87 @@ const char *qmi_result_get_error(struct qmi_result *result)
 	return __error_to_string(result->error);
 }
 
+/*
+ * The TLV chain is walked once, on the first lookup, and the offset of
+ * each type is remembered.  Every further lookup is a table access.
+ */
+static void result_build_index(struct qmi_result *result)
+{
+	unsigned int offset = 0;
+
+	memset(result->tlv_offset, 0, sizeof(result->tlv_offset));
+	result->indexed = true;
+
+	while (offset + QMI_TLV_HDR_SIZE < result->length) {
+		const struct qmi_tlv_hdr *tlv = result->data + offset;
+		uint16_t tlv_length = GUINT16_FROM_LE(tlv->length);
+
+		if (offset + QMI_TLV_HDR_SIZE + tlv_length > result->length)
+			break;
+
+		/* Offsets are stored plus one, zero marks a missing type */
+		if (!result->tlv_offset[tlv->type])
+			result->tlv_offset[tlv->type] = offset + 1;
+
+		offset += QMI_TLV_HDR_SIZE + tlv_length;
+	}
+}
+
+static const void *result_tlv_get(struct qmi_result *result, uint8_t type,
+							uint16_t *length)
+{
+	const struct qmi_tlv_hdr *tlv;
+	uint16_t offset;
+
+	if (!result->indexed)
+		result_build_index(result);
+
+	offset = result->tlv_offset[type];
+	if (!offset)
+		return NULL;
+
+	tlv = result->data + offset - 1;
+
+	if (length)
+		*length = GUINT16_FROM_LE(tlv->length);
+
+	return tlv->value;
+}
+
 const void *qmi_result_get(struct qmi_result *result, uint8_t type,
 							uint16_t *length)
 {
 	if (!result || !type)
 		return NULL;
 
-	return tlv_get(result->data, result->length, type, length);
+	return result_tlv_get(result, type, length);
 }
 
-char *qmi_result_get_string(struct qmi_result *result, uint8_t type)
+const char *qmi_result_get_string_view(struct qmi_result *result,
+					uint8_t type, uint16_t *length)
 {
-	const void *ptr;
+	const char *ptr;
 	uint16_t len;
 
 	if (!result || !type)
 		return NULL;
 
-	ptr = tlv_get(result->data, result->length, type, &len);
+	ptr = result_tlv_get(result, type, &len);
+	if (!ptr)
+		return NULL;
+
+	if (length)
+		*length = strnlen(ptr, len);
+
+	return ptr;
+}
+
+char *qmi_result_get_string(struct qmi_result *result, uint8_t type)
+{
+	const char *ptr;
+	uint16_t len;
+
+	ptr = qmi_result_get_string_view(result, type, &len);
 	if (!ptr)
 		return NULL;
 
@@ -1425,7 +1614,7 @@ bool qmi_result_get_uint8(struct qmi_result *result, uint8_t type,
 	if (!result || !type)
 		return false;
 
-	ptr = tlv_get(result->data, result->length, type, &len);
+	ptr = result_tlv_get(result, type, &len);
 	if (!ptr)
 		return false;
 
@@ -1444,7 +1633,7 @@ bool qmi_result_get_uint16(struct qmi_result *result, uint8_t type,
 	if (!result || !type)
 		return false;
 
-	ptr = tlv_get(result->data, result->length, type, &len);
+	ptr = result_tlv_get(result, type, &len);
 	if (!ptr)
 		return false;
 
@@ -1466,7 +1655,7 @@ bool qmi_result_get_uint32(struct qmi_result *result, uint8_t type,
 	if (!result || !type)
 		return false;
 
-	ptr = tlv_get(result->data, result->length, type, &len);
+	ptr = result_tlv_get(result, type, &len);
 	if (!ptr)
 		return false;
 
@@ -1488,7 +1677,7 @@ bool qmi_result_get_uint64(struct qmi_result *result, uint8_t type,
 	if (!result || !type)
 		return false;
 
-	ptr = tlv_get(result->data, result->length, type, &len);
+	ptr = result_tlv_get(result, type, &len);
 	if (!ptr)
 		return false;
 
@@ -1562,6 +1751,8 @@ static void service_create_callback(uint16_t message, uint16_t length,
 
 	service->ref_count = 1;
 	service->device = data->device;
+	service->notify_table = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
 	service->shared = data->shared;
 
 	service->type = data->type;
@@ -1621,11 +1812,8 @@ static void service_create_discover(uint8_t count,
 		return;
 	}
 
-	if (device->next_control_tid < 1)
-		device->next_control_tid = 1;
-
 	hdr->type = 0x00;
-	hdr->transaction = device->next_control_tid++;
+	hdr->transaction = __control_tid_next(device);
 
 	__request_submit(device, req, hdr->transaction);
 }
@@ -1738,6 +1926,15 @@ bool qmi_service_create_shared(struct qmi_device *device,
 	return service_create(device, true, type, func, user_data, destroy);
 }
 
+static void service_free(struct qmi_service *service)
+{
+	qmi_service_unregister_all(service);
+
+	g_hash_table_destroy(service->notify_table);
+
+	g_free(service);
+}
+
 static void service_release_callback(uint16_t message, uint16_t length,
 					const void *buffer, void *user_data)
 {
@@ -1746,7 +1943,7 @@ static void service_release_callback(uint16_t message, uint16_t length,
 	if (service->device)
 		service->device->release_users--;
 
-	g_free(service);
+	service_free(service);
 }
 
 struct qmi_service *qmi_service_ref(struct qmi_service *service)
@@ -1770,7 +1967,7 @@ void qmi_service_unref(struct qmi_service *service)
 		return;
 
 	if (!service->device) {
-		g_free(service);
+		service_free(service);
 		return;
 	}
 
@@ -1840,8 +2037,9 @@ static void service_send_callback(uint16_t message, uint16_t length,
 	result.message = message;
 	result.data = buffer;
 	result.length = length;
+	result.indexed = false;
 
-	result_code = tlv_get(buffer, length, 0x02, &len);
+	result_code = result_tlv_get(&result, 0x02, &len);
 	if (!result_code)
 		goto done;
 
@@ -1898,11 +2096,8 @@ uint16_t qmi_service_send(struct qmi_service *service,
 		return 0;
 	}
 
-	if (device->next_service_tid < 256)
-		device->next_service_tid = 256;
-
 	hdr->type = 0x00;
-	hdr->transaction = device->next_service_tid++;
+	hdr->transaction = __service_tid_next(device);
 
 	__request_submit(device, req, hdr->transaction);
 
@@ -1914,7 +2109,6 @@ bool qmi_service_cancel(struct qmi_service *service, uint16_t id)
 	unsigned int tid = id;
 	struct qmi_device *device;
 	struct qmi_request *req;
-	GList *list;
 
 	if (!service || !tid)
 		return false;
@@ -1926,22 +2120,11 @@ bool qmi_service_cancel(struct qmi_service *service, uint16_t id)
 	if (!device)
 		return false;
 
-	list = g_queue_find_custom(device->req_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-	if (list) {
-		req = list->data;
-
-		g_queue_delete_link(device->req_queue, list);
-	} else {
-		list = g_queue_find_custom(device->service_queue,
-				GUINT_TO_POINTER(tid), __request_compare);
-		if (!list)
-			return false;
-
-		req = list->data;
+	req = g_hash_table_lookup(device->service_table, GUINT_TO_POINTER(tid));
+	if (!req)
+		return false;
 
-		g_queue_delete_link(device->service_queue, list);
-	}
+	__request_remove(device, req);
 
 	service_send_free(req->user_data);
 
@@ -1950,40 +2133,11 @@ bool qmi_service_cancel(struct qmi_service *service, uint16_t id)
 	return true;
 }
 
-static GQueue *remove_client(GQueue *queue, uint8_t client)
-{
-	GQueue *new_queue;
-	GList *list;
-
-	new_queue = g_queue_new();
-
-	while (1) {
-		struct qmi_request *req;
-
-		list = g_queue_pop_head_link(queue);
-		if (!list)
-			break;
-
-		req = list->data;
-
-		if (!req->client || req->client != client) {
-			g_queue_push_tail_link(new_queue, list);
-			continue;
-		}
-
-		service_send_free(req->user_data);
-
-		__request_free(req, NULL);
-	}
-
-	g_queue_free(queue);
-
-	return new_queue;
-}
-
 bool qmi_service_cancel_all(struct qmi_service *service)
 {
 	struct qmi_device *device;
+	GHashTableIter iter;
+	gpointer value;
 
 	if (!service)
 		return false;
@@ -1995,11 +2149,24 @@ bool qmi_service_cancel_all(struct qmi_service *service)
 	if (!device)
 		return false;
 
-	device->req_queue = remove_client(device->req_queue,
-						service->client_id);
+	g_hash_table_iter_init(&iter, device->service_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct qmi_request *req = value;
+
+		if (req->service != service->type ||
+				req->client != service->client_id)
+			continue;
+
+		g_hash_table_iter_remove(&iter);
 
-	device->service_queue = remove_client(device->service_queue,
-							service->client_id);
+		if (req->buf)
+			g_queue_remove(device->req_queue, req);
+
+		service_send_free(req->user_data);
+
+		__request_free(req, NULL);
+	}
 
 	return true;
 }
@@ -2009,6 +2176,7 @@ uint16_t qmi_service_register(struct qmi_service *service,
 				void *user_data, qmi_destroy_func_t destroy)
 {
 	struct qmi_notify *notify;
+	GList *list;
 
 	if (!service || !func)
 		return 0;
@@ -2028,6 +2196,12 @@ uint16_t qmi_service_register(struct qmi_service *service,
 
 	service->notify_list = g_list_append(service->notify_list, notify);
 
+	list = g_hash_table_lookup(service->notify_table,
+					GUINT_TO_POINTER(message));
+	list = g_list_append(list, notify);
+	g_hash_table_insert(service->notify_table,
+				GUINT_TO_POINTER(message), list);
+
 	return notify->id;
 }
 
@@ -2049,6 +2223,17 @@ bool qmi_service_unregister(struct qmi_service *service, uint16_t id)
 
 	service->notify_list = g_list_delete_link(service->notify_list, list);
 
+	list = g_hash_table_lookup(service->notify_table,
+					GUINT_TO_POINTER(notify->message));
+	list = g_list_remove(list, notify);
+
+	if (list)
+		g_hash_table_insert(service->notify_table,
+				GUINT_TO_POINTER(notify->message), list);
+	else
+		g_hash_table_remove(service->notify_table,
+				GUINT_TO_POINTER(notify->message));
+
 	__notify_free(notify, NULL);
 
 	return true;
@@ -2059,6 +2244,9 @@ bool qmi_service_unregister_all(struct qmi_service *service)
 	if (!service)
 		return false;
 
+	g_hash_table_foreach(service->notify_table, __notify_table_free, NULL);
+	g_hash_table_remove_all(service->notify_table);
+
 	g_list_foreach(service->notify_list, __notify_free, NULL);
 	g_list_free(service->notify_list);
 
@@ -109,6 +109,8 @@ const char *qmi_result_get_error(struct qmi_result *result);
 
 const void *qmi_result_get(struct qmi_result *result, uint8_t type,
 							uint16_t *length);
+const char *qmi_result_get_string_view(struct qmi_result *result,
+					uint8_t type, uint16_t *length);
 char *qmi_result_get_string(struct qmi_result *result, uint8_t type);
 bool qmi_result_get_uint8(struct qmi_result *result, uint8_t type,
 							uint8_t *value);
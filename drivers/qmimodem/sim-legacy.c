@@ -65,8 +65,10 @@ static void get_iccid_cb(struct qmi_result *result, void *user_data)
 	struct cb_data *cbd = user_data;
 	ofono_sim_read_cb_t cb = cbd->cb;
 	unsigned char iccid[10];
-	int iccid_len, len;
-	char *str;
+	char str[21];
+	const char *ptr;
+	int iccid_len;
+	uint16_t len;
 
 	DBG("");
 
@@ -75,23 +77,18 @@ static void get_iccid_cb(struct qmi_result *result, void *user_data)
 		return;
 	}
 
-	str = qmi_result_get_string(result, QMI_DMS_RESULT_ICCID);
-	if (!str) {
+	ptr = qmi_result_get_string_view(result, QMI_DMS_RESULT_ICCID, &len);
+	if (!ptr || len > 20) {
 		CALLBACK_WITH_FAILURE(cb, NULL, 0, cbd->data);
 		return;
 	}
 
-	len = strlen(str);
-	if (len > 20) {
-		CALLBACK_WITH_FAILURE(cb, NULL, 0, cbd->data);
-		return;
-	}
+	memcpy(str, ptr, len);
+	str[len] = '\0';
 
 	sim_encode_bcd_number(str, iccid);
 	iccid_len = len / 2;
 
-	qmi_free(str);
-
 	CALLBACK_WITH_SUCCESS(cb, iccid, iccid_len, cbd->data);
 }
 
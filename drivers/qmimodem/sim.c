@@ -510,6 +510,7 @@ static void qmi_sim_remove(struct ofono_sim *sim)
 
 static struct ofono_sim_driver driver = {
 	.name			= "qmimodem",
+	.max_pending_reads	= 4,
 	.probe			= qmi_sim_probe,
 	.remove			= qmi_sim_remove,
 	.read_file_info		= qmi_read_attributes,
@@ -59,3 +59,55 @@ const guint16 crc_ccitt_table[256] = {
 	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
 	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
 };
+
+/*
+ * Slice-by-8 tables: crc_ccitt_slice[k][n] is the CRC contribution of byte n
+ * followed by k + 1 zero bytes, so eight input bytes can be folded in with
+ * independent table lookups instead of a serial chain of eight.
+ */
+static guint16 crc_ccitt_slice[7][256];
+static gboolean crc_ccitt_slice_ready;
+
+static void crc_ccitt_slice_init(void)
+{
+	unsigned int i, k;
+	guint16 crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc_ccitt_table[i];
+
+		for (k = 0; k < 7; k++) {
+			crc = (crc >> 8) ^ crc_ccitt_table[crc & 0xff];
+			crc_ccitt_slice[k][i] = crc;
+		}
+	}
+
+	crc_ccitt_slice_ready = TRUE;
+}
+
+guint16 crc_ccitt(guint16 crc, const guint8 *buf, gsize len)
+{
+	if (len >= 8 && crc_ccitt_slice_ready == FALSE)
+		crc_ccitt_slice_init();
+
+	while (len >= 8) {
+		crc ^= buf[0] | (buf[1] << 8);
+
+		crc = crc_ccitt_slice[6][crc & 0xff] ^
+			crc_ccitt_slice[5][crc >> 8] ^
+			crc_ccitt_slice[4][buf[2]] ^
+			crc_ccitt_slice[3][buf[3]] ^
+			crc_ccitt_slice[2][buf[4]] ^
+			crc_ccitt_slice[1][buf[5]] ^
+			crc_ccitt_slice[0][buf[6]] ^
+			crc_ccitt_table[buf[7]];
+
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc_ccitt_byte(crc, *buf++);
+
+	return crc;
+}
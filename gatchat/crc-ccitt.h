@@ -27,6 +27,8 @@
 
 extern guint16 const crc_ccitt_table[256];
 
+guint16 crc_ccitt(guint16 crc, const guint8 *buf, gsize len);
+
 static inline guint16 crc_ccitt_byte(guint16 crc, const guint8 c)
 {
 	return (crc >> 8) ^ crc_ccitt_table[(crc ^ c) & 0xff];
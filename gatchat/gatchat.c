@@ -70,9 +70,24 @@ struct at_notify_node {
 typedef gboolean (*node_remove_func)(struct at_notify_node *node,
 					gpointer user_data);
 
+struct at_notify_trie;
+
 struct at_notify {
 	GSList *nodes;
 	gboolean pdu;
+	struct at_notify_trie *trie;		/* Node for our prefix */
+};
+
+/*
+ * Prefix trie over all registered notifications, so that matching a line
+ * only costs as much as walking its first few characters.  Nodes are not
+ * pruned when a notification goes away, they only get freed on cleanup.
+ */
+struct at_notify_trie {
+	char c;
+	struct at_notify *notify;		/* Notify ending here, if any */
+	struct at_notify_trie *child;		/* Next character */
+	struct at_notify_trie *sibling;		/* Alternative character */
 };
 
 struct at_chat {
@@ -84,6 +99,7 @@ struct at_chat {
 	GQueue *command_queue;			/* Command queue */
 	guint cmd_bytes_written;		/* bytes written from cmd */
 	GHashTable *notify_list;		/* List of notification reg */
+	struct at_notify_trie *notify_trie;	/* Notify prefix trie */
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	guint read_so_far;			/* Number of bytes processed */
@@ -151,11 +167,87 @@ static void at_notify_destroy(gpointer user_data)
 {
 	struct at_notify *notify = user_data;
 
+	if (notify->trie)
+		notify->trie->notify = NULL;
+
 	g_slist_foreach(notify->nodes, at_notify_node_destroy, NULL);
 	g_slist_free(notify->nodes);
 	g_free(notify);
 }
 
+static struct at_notify_trie *at_notify_trie_insert(
+					struct at_notify_trie **list,
+					const char *prefix)
+{
+	struct at_notify_trie *node = NULL;
+
+	for (; *prefix; prefix++) {
+		for (node = *list; node; node = node->sibling)
+			if (node->c == *prefix)
+				break;
+
+		if (node == NULL) {
+			node = g_try_new0(struct at_notify_trie, 1);
+			if (node == NULL)
+				return NULL;
+
+			node->c = *prefix;
+			node->sibling = *list;
+			*list = node;
+		}
+
+		list = &node->child;
+	}
+
+	return node;
+}
+
+/*
+ * Returns the node of the next registered prefix of *line that is longer
+ * than the one ending at from, or NULL if there is none.  Pass from as
+ * NULL to start at the root.  *line is advanced past the matched prefix.
+ */
+static struct at_notify_trie *at_notify_trie_next(struct at_notify_trie *root,
+						struct at_notify_trie *from,
+						const char **line)
+{
+	struct at_notify_trie *node = from ? from->child : root;
+	const char *s = *line;
+
+	while (node && *s) {
+		while (node && node->c != *s)
+			node = node->sibling;
+
+		if (node == NULL)
+			break;
+
+		s++;
+
+		if (node->notify) {
+			*line = s;
+			return node;
+		}
+
+		node = node->child;
+	}
+
+	return NULL;
+}
+
+static void at_notify_trie_free(struct at_notify_trie *node)
+{
+	struct at_notify_trie *sibling;
+
+	while (node) {
+		sibling = node->sibling;
+
+		at_notify_trie_free(node->child);
+		g_free(node);
+
+		node = sibling;
+	}
+}
+
 static gint at_command_compare_by_id(gconstpointer a, gconstpointer b)
 {
 	const struct at_command *command = a;
@@ -333,6 +425,9 @@ static void chat_cleanup(struct at_chat *chat)
 	g_hash_table_destroy(chat->notify_list);
 	chat->notify_list = NULL;
 
+	at_notify_trie_free(chat->notify_trie);
+	chat->notify_trie = NULL;
+
 	if (chat->pdu_notify) {
 		g_free(chat->pdu_notify);
 		chat->pdu_notify = NULL;
@@ -386,23 +481,20 @@ static void at_notify_call_callback(gpointer data, gpointer user_data)
 
 static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 {
-	GHashTableIter iter;
+	struct at_notify_trie *node = NULL;
 	struct at_notify *notify;
-	gpointer key, value;
+	const char *rest = line;
 	gboolean ret = FALSE;
 	GAtResult result;
 
-	g_hash_table_iter_init(&iter, chat->notify_list);
 	result.lines = 0;
 	result.final_or_pdu = 0;
 
 	chat->in_notify = TRUE;
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		notify = value;
-
-		if (!g_str_has_prefix(line, key))
-			continue;
+	while ((node = at_notify_trie_next(chat->notify_trie, node,
+							&rest)) != NULL) {
+		notify = node->notify;
 
 		if (notify->pdu) {
 			chat->pdu_notify = line;
@@ -614,22 +706,16 @@ done:
 
 static void have_notify_pdu(struct at_chat *p, char *pdu, GAtResult *result)
 {
-	GHashTableIter iter;
+	struct at_notify_trie *node = NULL;
 	struct at_notify *notify;
-	char *prefix;
-	gpointer key, value;
+	const char *rest = p->pdu_notify;
 	gboolean called = FALSE;
 
 	p->in_notify = TRUE;
 
-	g_hash_table_iter_init(&iter, p->notify_list);
-
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		prefix = key;
-		notify = value;
-
-		if (!g_str_has_prefix(p->pdu_notify, prefix))
-			continue;
+	while ((node = at_notify_trie_next(p->notify_trie, node,
+							&rest)) != NULL) {
+		notify = node->notify;
 
 		if (!notify->pdu)
 			continue;
@@ -1067,6 +1153,14 @@ static struct at_notify *at_notify_create(struct at_chat *chat,
 		return 0;
 	}
 
+	notify->trie = at_notify_trie_insert(&chat->notify_trie, prefix);
+	if (notify->trie == NULL) {
+		g_free(notify);
+		g_free(key);
+		return 0;
+	}
+
+	notify->trie->notify = notify;
 	notify->pdu = pdu;
 
 	g_hash_table_insert(chat->notify_list, key, notify);
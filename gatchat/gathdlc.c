@@ -27,11 +27,17 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "crc-ccitt.h"
 #include "ringbuffer.h"
 #include "gatio.h"
@@ -40,6 +46,8 @@
 
 #define BUFFER_SIZE	(2 * 2048)
 #define MAX_BUFFERS	64	/* Maximum number of in-flight write buffers */
+#define MAX_FREE_BUFFERS 4	/* Spare write buffers kept for reuse */
+#define MAX_WRITE_IOV	32	/* Maximum number of iovecs per writev */
 #define HDLC_OVERHEAD	256	/* Rough estimate of HDLC protocol overhead */
 
 #define HDLC_FLAG	0x7e	/* Flag sequence */
@@ -57,6 +65,8 @@ struct _GAtHDLC {
 	gint ref_count;
 	GAtIO *io;
 	GQueue *write_queue;	/* Write buffer queue */
+	GSList *free_buffers;	/* Spare write buffers */
+	guint num_free_buffers;
 	unsigned char *decode_buffer;
 	guint decode_offset;
 	guint16 decode_fcs;
@@ -242,6 +252,54 @@ static gboolean check_escape(GAtHDLC *hdlc, struct ring_buffer *rbuf)
 	return TRUE;
 }
 
+#define HDLC_SPECIAL(c, accm) ((c) == HDLC_FLAG || (c) == HDLC_ESCAPE || \
+				((c) < 0x20 && ((accm) & (1 << (c)))))
+
+/*
+ * Return the number of leading bytes in buf which can be taken as-is: no
+ * flag, no escape and no control character to be dropped by the ACCM.
+ */
+static unsigned int hdlc_plain_run(const unsigned char *buf,
+					unsigned int len, guint32 accm)
+{
+	unsigned int n = 0;
+
+#ifdef __SSE2__
+	const __m128i flag = _mm_set1_epi8(HDLC_FLAG);
+	const __m128i escape = _mm_set1_epi8(HDLC_ESCAPE);
+	const __m128i ctrl = _mm_set1_epi8(0x1f);
+
+	/*
+	 * Find the first block holding a flag, an escape or, unless the
+	 * ACCM is empty, any control character.  The scalar loop below
+	 * then settles the exact position.
+	 */
+	while (n + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + n));
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, flag),
+						_mm_cmpeq_epi8(v, escape));
+		int mask;
+
+		if (accm)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(
+						_mm_min_epu8(v, ctrl), v));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask) {
+			n += __builtin_ctz(mask);
+			break;
+		}
+
+		n += 16;
+	}
+#endif
+
+	while (n < len && !HDLC_SPECIAL(buf[n], accm))
+		n++;
+
+	return n;
+}
+
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
 	GAtHDLC *hdlc = user_data;
@@ -272,6 +330,44 @@ static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 	hdlc->in_read_handler = TRUE;
 
 	while (pos < len) {
+		/* Frames that overrun the decode buffer are dropped */
+		if (hdlc->decode_offset == BUFFER_SIZE) {
+			hdlc->decode_fcs = HDLC_INITFCS;
+			hdlc->decode_offset = 0;
+		}
+
+		/*
+		 * Fast path: copy a run of bytes which need no unescaping
+		 * and update the FCS over it in one go.  Everything else,
+		 * including the NO CARRIER check below, goes byte by byte.
+		 */
+		if (hdlc->decode_escape == FALSE && (hdlc->decode_offset > 0 ||
+					hdlc->no_carrier_detect == FALSE)) {
+			unsigned int run = (pos < wrap ? wrap : len) - pos;
+
+			run = MIN(run, BUFFER_SIZE - hdlc->decode_offset);
+			run = hdlc_plain_run(buf, run, hdlc->recv_accm);
+
+			if (run > 0) {
+				memcpy(hdlc->decode_buffer + hdlc->decode_offset,
+								buf, run);
+				hdlc->decode_fcs = crc_ccitt(hdlc->decode_fcs,
+								buf, run);
+				hdlc->decode_offset += run;
+
+				buf += run;
+				pos += run;
+
+				if (pos == wrap) {
+					buf = ring_buffer_read_ptr(rbuf, pos);
+					hdlc_record(hdlc, TRUE, buf,
+								len - wrap);
+				}
+
+				continue;
+			}
+		}
+
 		/*
 		 * We try to detect NO CARRIER conditions here.  We
 		 * (ab) use the fact that a HDLC_FLAG must be followed
@@ -438,6 +534,9 @@ void g_at_hdlc_unref(GAtHDLC *hdlc)
 
 	g_queue_free(hdlc->write_queue);
 
+	g_slist_free_full(hdlc->free_buffers,
+				(GDestroyNotify) ring_buffer_free);
+
 	g_free(hdlc->decode_buffer);
 
 	g_timer_destroy(hdlc->timer);
@@ -467,41 +566,109 @@ void g_at_hdlc_set_receive(GAtHDLC *hdlc, GAtReceiveFunc func,
 	hdlc->receive_data = user_data;
 }
 
+static struct ring_buffer *write_buffer_get(GAtHDLC *hdlc)
+{
+	struct ring_buffer *write_buffer;
+
+	if (hdlc->free_buffers == NULL)
+		return ring_buffer_new(BUFFER_SIZE);
+
+	write_buffer = hdlc->free_buffers->data;
+	hdlc->free_buffers = g_slist_delete_link(hdlc->free_buffers,
+							hdlc->free_buffers);
+	hdlc->num_free_buffers--;
+
+	ring_buffer_reset(write_buffer);
+
+	return write_buffer;
+}
+
+static void write_buffer_put(GAtHDLC *hdlc, struct ring_buffer *write_buffer)
+{
+	if (hdlc->num_free_buffers >= MAX_FREE_BUFFERS) {
+		ring_buffer_free(write_buffer);
+		return;
+	}
+
+	hdlc->free_buffers = g_slist_prepend(hdlc->free_buffers, write_buffer);
+	hdlc->num_free_buffers++;
+}
+
 static gboolean can_write_data(gpointer data)
 {
 	GAtHDLC *hdlc = data;
-	unsigned int len;
-	unsigned char *buf;
+	struct iovec iov[MAX_WRITE_IOV];
+	struct ring_buffer *write_buffer;
+	unsigned int len, wrap;
 	gsize bytes_written;
-	struct ring_buffer* write_buffer;
+	gsize remaining;
+	GList *l;
+	int iovcnt = 0;
+	int i;
 
-	/* Write data out from the head of the queue */
-	write_buffer = g_queue_peek_head(hdlc->write_queue);
+	/* Gather everything queued, up to both halves of each buffer */
+	for (l = hdlc->write_queue->head; l; l = l->next) {
+		write_buffer = l->data;
+		len = ring_buffer_len(write_buffer);
+		wrap = ring_buffer_len_no_wrap(write_buffer);
 
-	len = ring_buffer_len_no_wrap(write_buffer);
-	buf = ring_buffer_read_ptr(write_buffer, 0);
+		if (len == 0)
+			continue;
 
-	bytes_written = g_at_io_write(hdlc->io, (gchar *) buf, len);
-	hdlc_record(hdlc, FALSE, buf, bytes_written);
-	ring_buffer_drain(write_buffer, bytes_written);
+		if (iovcnt + 2 > MAX_WRITE_IOV)
+			break;
 
-	if (ring_buffer_len(write_buffer) > 0)
-		return TRUE;
+		iov[iovcnt].iov_base = ring_buffer_read_ptr(write_buffer, 0);
+		iov[iovcnt].iov_len = wrap;
+		iovcnt++;
+
+		if (len == wrap)
+			continue;
+
+		iov[iovcnt].iov_base = ring_buffer_read_ptr(write_buffer, wrap);
+		iov[iovcnt].iov_len = len - wrap;
+		iovcnt++;
+	}
+
+	if (iovcnt == 0)
+		return FALSE;
+
+	bytes_written = g_at_io_writev(hdlc->io, iov, iovcnt);
+
+	remaining = bytes_written;
+
+	for (i = 0; i < iovcnt && remaining > 0; i++) {
+		len = MIN(iov[i].iov_len, remaining);
+		hdlc_record(hdlc, FALSE, iov[i].iov_base, len);
+		remaining -= len;
+	}
 
-	/* All data in current buffer is written, free it
-	 * unless it's the last buffer in the queue.
+	/*
+	 * Drain what was written.  Emptied buffers go back on the free
+	 * list, except for the last one which takes the next frames.
 	 */
-	if ((ring_buffer_len(write_buffer) == 0) &&
-			(g_queue_get_length(hdlc->write_queue) > 1)) {
-		write_buffer = g_queue_pop_head(hdlc->write_queue);
-		ring_buffer_free(write_buffer);
+	remaining = bytes_written;
+
+	while (remaining > 0) {
 		write_buffer = g_queue_peek_head(hdlc->write_queue);
+		len = MIN((gsize) ring_buffer_len(write_buffer), remaining);
+
+		ring_buffer_drain(write_buffer, len);
+		remaining -= len;
+
+		if (ring_buffer_len(write_buffer) > 0 ||
+				g_queue_get_length(hdlc->write_queue) == 1)
+			break;
+
+		write_buffer_put(hdlc, g_queue_pop_head(hdlc->write_queue));
 	}
 
+	write_buffer = g_queue_peek_head(hdlc->write_queue);
+
 	if (ring_buffer_len(write_buffer) > 0)
 		return TRUE;
 
-	return FALSE;
+	return g_queue_get_length(hdlc->write_queue) > 1;
 }
 
 void g_at_hdlc_set_xmit_accm(GAtHDLC *hdlc, guint32 accm)
@@ -528,7 +695,7 @@ GAtIO *g_at_hdlc_get_io(GAtHDLC *hdlc)
 	return hdlc->io;
 }
 
-#define NEED_ESCAPE(xmit_accm, c) xmit_accm[c >> 5] & (1 << (c & 0x1f))
+#define NEED_ESCAPE(xmit_accm, c) (xmit_accm[c >> 5] & (1 << (c & 0x1f)))
 
 gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 {
@@ -547,7 +714,7 @@ gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 		if (g_queue_get_length(hdlc->write_queue) > MAX_BUFFERS)
 			return FALSE;	/* Too many pending buffers */
 
-		write_buffer = ring_buffer_new(BUFFER_SIZE);
+		write_buffer = write_buffer_get(hdlc);
 		if (write_buffer == NULL)
 			return FALSE;
 
@@ -579,6 +746,33 @@ gboolean g_at_hdlc_send(GAtHDLC *hdlc, const unsigned char *data, gsize size)
 	}
 
 	while (pos < avail && i < size) {
+		/* Copy runs that need no escaping straight through */
+		if (escape == FALSE) {
+			unsigned int run = (pos < wrap ? wrap : avail) - pos;
+			unsigned int n = 0;
+
+			run = MIN(run, size - i);
+
+			while (n < run && !NEED_ESCAPE(hdlc->xmit_accm,
+								data[i + n]))
+				n++;
+
+			if (n > 0) {
+				fcs = crc_ccitt(fcs, data + i, n);
+				memcpy(buf, data + i, n);
+
+				buf += n;
+				pos += n;
+				i += n;
+
+				if (pos == wrap)
+					buf = ring_buffer_write_ptr(
+							write_buffer, pos);
+
+				continue;
+			}
+		}
+
 		if (escape == TRUE) {
 			fcs = HDLC_FCS(fcs, data[i]);
 			*buf = data[i++] ^ HDLC_TRANS;
@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
@@ -36,6 +37,9 @@
 #include "gatio.h"
 #include "gatutil.h"
 
+#define BUFFER_SIZE	8192
+#define MAX_BUFFER_SIZE	65536
+
 struct _GAtIO {
 	gint ref_count;				/* Ref count */
 	guint read_watch;			/* GSource read id, 0 if no */
@@ -44,6 +48,7 @@ struct _GAtIO {
 	GAtDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
 	struct ring_buffer *buf;		/* Current read buffer */
+	int fd;					/* fd for raw reads, or -1 */
 	guint max_read_attempts;		/* max reads / select */
 	GAtIOReadFunc read_handler;		/* Read callback */
 	gpointer read_data;			/* Read callback userdata */
@@ -79,6 +84,35 @@ static void read_watcher_destroy_notify(gpointer user_data)
 		io->user_disconnect(io->user_disconnect_data);
 }
 
+static gsize read_raw(GAtIO *io, GIOStatus *status)
+{
+	unsigned int len = ring_buffer_len(io->buf);
+	unsigned int wrap = ring_buffer_avail_no_wrap(io->buf);
+	int rbytes;
+
+	rbytes = ring_buffer_fill(io->buf, io->fd);
+	if (rbytes < 0) {
+		*status = errno == EAGAIN ? G_IO_STATUS_AGAIN :
+							G_IO_STATUS_ERROR;
+		return 0;
+	}
+
+	*status = rbytes > 0 ? G_IO_STATUS_NORMAL : G_IO_STATUS_EOF;
+
+	/* The read may have landed on both sides of the wrap point */
+	g_at_util_debug_chat(TRUE, (char *) ring_buffer_read_ptr(io->buf, len),
+				MIN((unsigned int) rbytes, wrap),
+				io->debugf, io->debug_data);
+
+	if ((unsigned int) rbytes > wrap)
+		g_at_util_debug_chat(TRUE, (char *) ring_buffer_read_ptr(
+							io->buf, len + wrap),
+					rbytes - wrap,
+					io->debugf, io->debug_data);
+
+	return rbytes;
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 				gpointer data)
 {
@@ -89,35 +123,51 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	gsize toread;
 	gsize total_read = 0;
 	guint read_count = 0;
+	guint grow = 0;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
 	/* Regardless of condition, try to read all the data available */
 	do {
-		toread = ring_buffer_avail_no_wrap(io->buf);
+		if (io->fd >= 0) {
+			if (ring_buffer_avail(io->buf) == 0)
+				break;
+
+			rbytes = read_raw(io, &status);
+		} else {
+			toread = ring_buffer_avail_no_wrap(io->buf);
 
-		if (toread == 0)
-			break;
+			if (toread == 0)
+				break;
 
-		rbytes = 0;
-		buf = ring_buffer_write_ptr(io->buf, 0);
+			rbytes = 0;
+			buf = ring_buffer_write_ptr(io->buf, 0);
 
-		status = g_io_channel_read_chars(channel, (char *) buf,
+			status = g_io_channel_read_chars(channel, (char *) buf,
 							toread, &rbytes, NULL);
-		g_at_util_debug_chat(TRUE, (char *)buf, rbytes,
-					io->debugf, io->debug_data);
+			g_at_util_debug_chat(TRUE, (char *)buf, rbytes,
+						io->debugf, io->debug_data);
+
+			if (rbytes > 0)
+				ring_buffer_write_advance(io->buf, rbytes);
+		}
 
 		read_count++;
 
 		total_read += rbytes;
 
-		if (rbytes > 0)
-			ring_buffer_write_advance(io->buf, rbytes);
-
 	} while (status == G_IO_STATUS_NORMAL && rbytes > 0 &&
 					read_count < io->max_read_attempts);
 
+	/*
+	 * A full buffer means the link delivers more than we take per
+	 * wakeup, so give it more room once the handler has had its go.
+	 */
+	if (ring_buffer_avail(io->buf) == 0 &&
+			ring_buffer_capacity(io->buf) < MAX_BUFFER_SIZE)
+		grow = ring_buffer_capacity(io->buf) * 2;
+
 	if (total_read > 0 && io->read_handler)
 		io->read_handler(io->buf, io->read_data);
 
@@ -127,6 +177,9 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	if (read_count > 0 && rbytes == 0 && status != G_IO_STATUS_AGAIN)
 		return FALSE;
 
+	if (grow > 0)
+		ring_buffer_resize(io->buf, grow);
+
 	/* We're overflowing the buffer, shutdown the socket */
 	if (ring_buffer_avail(io->buf) == 0)
 		return FALSE;
@@ -153,6 +206,42 @@ gsize g_at_io_write(GAtIO *io, const gchar *data, gsize count)
 	return bytes_written;
 }
 
+gsize g_at_io_writev(GAtIO *io, const struct iovec *iov, int iovcnt)
+{
+	ssize_t bytes_written;
+	gsize remaining;
+	int fd, i;
+
+	if (io->channel == NULL)
+		return 0;
+
+	fd = g_io_channel_unix_get_fd(io->channel);
+
+	do {
+		bytes_written = writev(fd, iov, iovcnt);
+	} while (bytes_written < 0 && errno == EINTR);
+
+	if (bytes_written < 0 && errno == EAGAIN)
+		return 0;
+
+	if (bytes_written <= 0) {
+		g_source_remove(io->read_watch);
+		return 0;
+	}
+
+	remaining = bytes_written;
+
+	for (i = 0; i < iovcnt && remaining > 0; i++) {
+		gsize len = MIN(iov[i].iov_len, remaining);
+
+		g_at_util_debug_chat(FALSE, iov[i].iov_base, len,
+					io->debugf, io->debug_data);
+		remaining -= len;
+	}
+
+	return bytes_written;
+}
+
 static void write_watcher_destroy_notify(gpointer user_data)
 {
 	GAtIO *io = user_data;
@@ -204,7 +293,7 @@ static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 		io->use_write_watch = FALSE;
 	}
 
-	io->buf = ring_buffer_new(8192);
+	io->buf = ring_buffer_new(BUFFER_SIZE);
 
 	if (!io->buf)
 		goto error;
@@ -212,6 +301,8 @@ static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 	if (!g_at_util_setup_io(channel, flags))
 		goto error;
 
+	io->fd = g_at_util_get_raw_fd(channel);
+
 	io->channel = channel;
 	io->read_watch = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT,
 				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
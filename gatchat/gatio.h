@@ -33,6 +33,7 @@ struct _GAtIO;
 typedef struct _GAtIO GAtIO;
 
 struct ring_buffer;
+struct iovec;
 
 typedef void (*GAtIOReadFunc)(struct ring_buffer *buffer, gpointer user_data);
 typedef gboolean (*GAtIOWriteFunc)(gpointer user_data);
@@ -55,6 +56,7 @@ void g_at_io_set_write_done(GAtIO *io, GAtDisconnectFunc func,
 void g_at_io_drain_ring_buffer(GAtIO *io, guint len);
 
 gsize g_at_io_write(GAtIO *io, const gchar *data, gsize count);
+gsize g_at_io_writev(GAtIO *io, const struct iovec *iov, int iovcnt);
 
 gboolean g_at_io_set_disconnect_function(GAtIO *io,
 			GAtDisconnectFunc disconnect, gpointer user_data);
@@ -28,11 +28,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <alloca.h>
 
 #include <glib.h>
 
 #include "ringbuffer.h"
+#include "gatutil.h"
 #include "gatmux.h"
 #include "gsm0710.h"
 
@@ -52,6 +54,8 @@ typedef void (*GAtMuxWriteFrame)(GAtMux *mux, guint8 dlc, guint8 control,
 #define BITMAP_SIZE 8
 #define MUX_CHANNEL_BUFFER_SIZE 4096
 #define MUX_BUFFER_SIZE 4096
+#define MUX_TX_BUFFER_SIZE 8192
+#define MUX_MAX_READ_ATTEMPTS 3
 
 struct _GAtMuxChannel
 {
@@ -86,6 +90,14 @@ struct _GAtMux {
 	void *driver_data;			/* Driver data */
 	char buf[MUX_BUFFER_SIZE];		/* Buffer on the main mux */
 	int buf_used;				/* Bytes of buf being used */
+	int fd;					/* fd for raw reads, or -1 */
+	guint max_read_attempts;		/* max reads / select */
+	gboolean tx_batching;			/* Hold writes until flush */
+	guint8 tx_dlc;				/* DLC of pending tx data */
+	guint8 tx_pending[MUX_BUFFER_SIZE];	/* Unframed tx data */
+	int tx_pending_len;			/* Bytes of tx_pending used */
+	guint8 tx_buf[MUX_TX_BUFFER_SIZE];	/* Framed tx data */
+	int tx_used;				/* Bytes of tx_buf used */
 	gboolean shutdown;
 };
 
@@ -178,37 +190,108 @@ static void dispatch_sources(GAtMuxChannel *channel, GIOCondition condition)
 	}
 }
 
+/*
+ * DLCs that got data in this round are only drained once it is done, so
+ * never read more than the fullest of them can still take.  Payload is
+ * never longer than the raw bytes it came in, but the partial frame left
+ * in mux->buf counts as well.
+ */
+static gsize read_limit(GAtMux *mux)
+{
+	gsize limit = sizeof(mux->buf) - mux->buf_used;
+	int avail;
+	int i;
+
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(mux->newdata[i / 8] & (1 << (i % 8))))
+			continue;
+
+		if (mux->dlcs[i-1] == NULL)
+			continue;
+
+		avail = ring_buffer_avail(mux->dlcs[i-1]->buffer);
+
+		if (avail <= mux->buf_used)
+			return 0;
+
+		if ((gsize) (avail - mux->buf_used) < limit)
+			limit = avail - mux->buf_used;
+	}
+
+	return limit;
+}
+
+static GIOStatus read_data(GAtMux *mux, gsize count, gsize *bytes_read)
+{
+	ssize_t len;
+
+	if (mux->fd < 0)
+		return g_io_channel_read_chars(mux->channel,
+					mux->buf + mux->buf_used, count,
+					bytes_read, NULL);
+
+	do {
+		len = read(mux->fd, mux->buf + mux->buf_used, count);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		*bytes_read = 0;
+		return errno == EAGAIN ? G_IO_STATUS_AGAIN : G_IO_STATUS_ERROR;
+	}
+
+	*bytes_read = len;
+
+	return len > 0 ? G_IO_STATUS_NORMAL : G_IO_STATUS_EOF;
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 							gpointer data)
 {
 	GAtMux *mux = data;
 	int i;
-	GIOStatus status;
+	GIOStatus status = G_IO_STATUS_NORMAL;
 	gsize bytes_read;
+	gsize total_read = 0;
+	guint read_count = 0;
+	gsize count;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
 
 	debug(mux, "received data");
 
-	bytes_read = 0;
-	status = g_io_channel_read_chars(mux->channel, mux->buf + mux->buf_used,
-					sizeof(mux->buf) - mux->buf_used,
-					&bytes_read, NULL);
+	memset(mux->newdata, 0, BITMAP_SIZE);
 
-	mux->buf_used += bytes_read;
+	/*
+	 * Extract every complete frame from as much data as we can get,
+	 * and only then wake up each DLC that received something, once.
+	 */
+	while ((count = read_limit(mux)) > 0) {
+		bytes_read = 0;
+		status = read_data(mux, count, &bytes_read);
 
-	if (bytes_read > 0 && mux->driver->feed_data) {
-		int nread;
+		mux->buf_used += bytes_read;
+		total_read += bytes_read;
+		read_count++;
 
-		memset(mux->newdata, 0, BITMAP_SIZE);
+		if (bytes_read > 0 && mux->driver->feed_data) {
+			int nread;
 
-		nread = mux->driver->feed_data(mux, mux->buf, mux->buf_used);
-		mux->buf_used -= nread;
+			nread = mux->driver->feed_data(mux, mux->buf,
+							mux->buf_used);
+			mux->buf_used -= nread;
 
-		if (mux->buf_used > 0)
-			memmove(mux->buf, mux->buf + nread, mux->buf_used);
+			if (mux->buf_used > 0)
+				memmove(mux->buf, mux->buf + nread,
+							mux->buf_used);
+		}
 
+		if (status != G_IO_STATUS_NORMAL || bytes_read == 0 ||
+				read_count >= mux->max_read_attempts)
+			break;
+	}
+
+	if (total_read > 0 && mux->driver->feed_data) {
 		for (i = 1; i <= MAX_CHANNELS; i++) {
 			int offset = i / 8;
 			int bit = i % 8;
@@ -242,10 +325,53 @@ static void write_watcher_destroy_notify(gpointer user_data)
 	mux->write_watch = 0;
 }
 
+static void raw_write(GAtMux *mux, const void *data, int towrite)
+{
+	gsize bytes_written;
+	GIOStatus status;
+
+	while (towrite > 0) {
+		status = g_io_channel_write_chars(mux->channel, (gchar *) data,
+						towrite, &bytes_written, NULL);
+		if (status != G_IO_STATUS_NORMAL)
+			break;
+
+		data += bytes_written;
+		towrite -= bytes_written;
+	}
+}
+
+static void flush_tx_pending(GAtMux *mux)
+{
+	int len = mux->tx_pending_len;
+
+	if (len == 0)
+		return;
+
+	mux->tx_pending_len = 0;
+
+	if (mux->driver->write)
+		mux->driver->write(mux, mux->tx_dlc, mux->tx_pending, len);
+}
+
+static void flush_tx(GAtMux *mux)
+{
+	flush_tx_pending(mux);
+
+	mux->tx_batching = FALSE;
+
+	if (mux->tx_used == 0)
+		return;
+
+	raw_write(mux, mux->tx_buf, mux->tx_used);
+	mux->tx_used = 0;
+}
+
 static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
 	GAtMux *mux = data;
+	gboolean more = FALSE;
 	int dlc;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
@@ -253,6 +379,13 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 
 	debug(mux, "can write data");
 
+	/*
+	 * Whatever the DLCs write from here on is held back, so that
+	 * consecutive small writes to one DLC share a frame and all the
+	 * frames go out in a single write at the end.
+	 */
+	mux->tx_batching = TRUE;
+
 	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
 		GAtMuxChannel *channel = mux->dlcs[dlc];
 
@@ -269,7 +402,9 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 		dispatch_sources(channel, G_IO_OUT);
 	}
 
-	for (dlc = 0; dlc < MAX_CHANNELS; dlc += 1) {
+	flush_tx(mux);
+
+	for (dlc = 0; dlc < MAX_CHANNELS && more == FALSE; dlc += 1) {
 		GAtMuxChannel *channel = mux->dlcs[dlc];
 		GSList *l;
 		GAtMuxWatch *source;
@@ -283,12 +418,14 @@ static gboolean can_write_data(GIOChannel *chan, GIOCondition cond,
 		for (l = channel->sources; l; l = l->next) {
 			source = l->data;
 
-			if (source->condition & G_IO_OUT)
-				return TRUE;
+			if (source->condition & G_IO_OUT) {
+				more = TRUE;
+				break;
+			}
 		}
 	}
 
-	return FALSE;
+	return more;
 }
 
 static void wakeup_writer(GAtMux *mux)
@@ -310,6 +447,19 @@ int g_at_mux_raw_write(GAtMux *mux, const void *data, int towrite)
 	gssize count = towrite;
 	gsize bytes_written;
 
+	if (mux->tx_batching) {
+		if (mux->tx_used + towrite > (int) sizeof(mux->tx_buf)) {
+			raw_write(mux, mux->tx_buf, mux->tx_used);
+			mux->tx_used = 0;
+		}
+
+		if (towrite <= (int) sizeof(mux->tx_buf)) {
+			memcpy(mux->tx_buf + mux->tx_used, data, towrite);
+			mux->tx_used += towrite;
+			return towrite;
+		}
+	}
+
 	g_io_channel_write_chars(mux->channel, (gchar *) data,
 					count, &bytes_written, NULL);
 
@@ -456,10 +606,31 @@ static GIOStatus channel_write(GIOChannel *channel, const gchar *buf,
 	GAtMuxChannel *mux_channel = (GAtMuxChannel *) channel;
 	GAtMux *mux = mux_channel->mux;
 
-	if (mux->driver->write)
-		mux->driver->write(mux, mux_channel->dlc, buf, count);
 	*bytes_written = count;
 
+	if (mux->tx_batching == FALSE) {
+		if (mux->driver->write)
+			mux->driver->write(mux, mux_channel->dlc, buf, count);
+
+		return G_IO_STATUS_NORMAL;
+	}
+
+	/* Merge with what this DLC has written so far in this round */
+	if (mux->tx_pending_len > 0 && (mux->tx_dlc != mux_channel->dlc ||
+			mux->tx_pending_len + count > sizeof(mux->tx_pending)))
+		flush_tx_pending(mux);
+
+	if (count > sizeof(mux->tx_pending)) {
+		if (mux->driver->write)
+			mux->driver->write(mux, mux_channel->dlc, buf, count);
+
+		return G_IO_STATUS_NORMAL;
+	}
+
+	memcpy(mux->tx_pending + mux->tx_pending_len, buf, count);
+	mux->tx_pending_len += count;
+	mux->tx_dlc = mux_channel->dlc;
+
 	return G_IO_STATUS_NORMAL;
 }
 
@@ -476,6 +647,9 @@ static GIOStatus channel_close(GIOChannel *channel, GError **err)
 
 	debug(mux, "closing channel: %d", mux_channel->dlc);
 
+	if (mux->tx_pending_len > 0 && mux->tx_dlc == mux_channel->dlc)
+		flush_tx_pending(mux);
+
 	dispatch_sources(mux_channel, G_IO_NVAL);
 
 	if (mux->driver->close_dlc)
@@ -563,6 +737,13 @@ GAtMux *g_at_mux_new(GIOChannel *channel, const GAtMuxDriver *driver)
 	mux->driver = driver;
 	mux->shutdown = TRUE;
 
+	mux->fd = g_at_util_get_raw_fd(channel);
+
+	if (mux->fd >= 0)
+		mux->max_read_attempts = MUX_MAX_READ_ATTEMPTS;
+	else
+		mux->max_read_attempts = 1;
+
 	mux->channel = channel;
 	g_io_channel_ref(channel);
 
@@ -631,6 +812,8 @@ gboolean g_at_mux_shutdown(GAtMux *mux)
 	if (mux->read_watch > 0)
 		g_source_remove(mux->read_watch);
 
+	flush_tx(mux);
+
 	for (i = 0; i < MAX_CHANNELS; i++) {
 		if (mux->dlcs[i] == NULL)
 			continue;
@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include <glib.h>
 
@@ -198,3 +199,25 @@ gboolean g_at_util_setup_io(GIOChannel *io, GIOFlags flags)
 
 	return TRUE;
 }
+
+/*
+ * Returns the descriptor behind a non-blocking channel so it can be read
+ * directly, or -1.  Only channels backed by a real file descriptor take
+ * G_IO_FLAG_NONBLOCK; the virtual channels of GAtMux report no flags.
+ */
+int g_at_util_get_raw_fd(GIOChannel *io)
+{
+	int fd;
+	int flags;
+
+	if (!(g_io_channel_get_flags(io) & G_IO_FLAG_NONBLOCK))
+		return -1;
+
+	fd = g_io_channel_unix_get_fd(io);
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || !(flags & O_NONBLOCK))
+		return -1;
+
+	return fd;
+}
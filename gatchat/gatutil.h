@@ -38,6 +38,7 @@ void g_at_util_debug_hexdump(gboolean in, const unsigned char *buf, gsize len,
 				GAtDebugFunc debugf, gpointer user_data);
 
 gboolean g_at_util_setup_io(GIOChannel *io, GIOFlags flags);
+int g_at_util_get_raw_fd(GIOChannel *io);
 
 #ifdef __cplusplus
 }
@@ -101,46 +101,57 @@ int gsm0710_advanced_extract_frame(guint8 *buf, int len,
 	int posn = 0;
 	int posn2;
 	int framelen;
+	int run;
+	guint8 *flag;
+	guint8 *escape;
 	guint8 dlc;
 	guint8 control;
 
 	while (posn < len) {
-		if (buf[posn] != 0x7E) {
-			posn += 1;
-			continue;
+		flag = memchr(buf + posn, 0x7E, len - posn);
+		if (flag == NULL) {
+			posn = len;
+			break;
 		}
 
+		posn = flag - buf;
+
 		/* Skip additional 0x7E bytes between frames */
 		while ((posn + 1) < len && buf[posn + 1] == 0x7E)
 			posn += 1;
 
 		/* Search for the end of the packet (the next 0x7E byte) */
-		framelen = posn + 1;
-		while (framelen < len && buf[framelen] != 0x7E)
-			framelen += 1;
-
-		if (framelen >= len)
+		flag = memchr(buf + posn + 1, 0x7E, len - posn - 1);
+		if (flag == NULL)
 			break;
 
+		framelen = flag - buf;
+
 		if (framelen < 4) {
 			posn = framelen;
 			continue;
 		}
 
-		/* Undo control byte quoting in the packet */
+		/* Undo control byte quoting in the packet, a run at a time */
 		posn2 = 0;
 		++posn;
 		while (posn < framelen) {
-			if (buf[posn] == 0x7D) {
-				++posn;
+			escape = memchr(buf + posn, 0x7D, framelen - posn);
+			run = (escape ? escape - buf : framelen) - posn;
 
-				if (posn >= framelen)
-					break;
+			memmove(buf + posn2, buf + posn, run);
+			posn2 += run;
+			posn += run;
 
-				buf[posn2++] = buf[posn++] ^ 0x20;
-			} else {
-				buf[posn2++] = buf[posn++];
-			}
+			if (escape == NULL)
+				break;
+
+			++posn;
+
+			if (posn >= framelen)
+				break;
+
+			buf[posn2++] = buf[posn++] ^ 0x20;
 		}
 
 		/* Validate the checksum on the packet header */
@@ -225,14 +236,20 @@ int gsm0710_basic_extract_frame(guint8 *buf, int len,
 	int posn = 0;
 	int framelen;
 	int header_size;
+	guint8 *flag;
 	guint8 fcs;
 	guint8 dlc;
 	guint8 type;
 
 	while (posn < len) {
 		if (buf[posn] != 0xF9) {
-			posn += 1;
-			continue;
+			flag = memchr(buf + posn, 0xF9, len - posn);
+			if (flag == NULL) {
+				posn = len;
+				break;
+			}
+
+			posn = flag - buf;
 		}
 
 		/* Skip additional 0xF9 bytes between frames */
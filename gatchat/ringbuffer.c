@@ -24,6 +24,8 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include <glib.h>
 
@@ -205,3 +207,63 @@ void ring_buffer_free(struct ring_buffer *buf)
 	g_slice_free1(buf->size, buf->buffer);
 	g_slice_free1(sizeof(struct ring_buffer), buf);
 }
+
+int ring_buffer_fill(struct ring_buffer *buf, int fd)
+{
+	struct iovec iov[2];
+	unsigned int avail = buf->size - buf->in + buf->out;
+	unsigned int offset = buf->in & buf->mask;
+	unsigned int end = MIN(avail, buf->size - offset);
+	ssize_t len;
+
+	if (avail == 0)
+		return 0;
+
+	iov[0].iov_base = buf->buffer + offset;
+	iov[0].iov_len = end;
+	iov[1].iov_base = buf->buffer;
+	iov[1].iov_len = avail - end;
+
+	do {
+		len = readv(fd, iov, avail > end ? 2 : 1);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		return -1;
+
+	buf->in += len;
+
+	return len;
+}
+
+int ring_buffer_resize(struct ring_buffer *buf, unsigned int size)
+{
+	unsigned int real_size = 1;
+	unsigned int len = buf->in - buf->out;
+	unsigned char *buffer;
+
+	while (real_size < size && real_size < MAX_SIZE)
+		real_size = real_size << 1;
+
+	if (real_size < len)
+		return -1;
+
+	if (real_size == buf->size)
+		return real_size;
+
+	buffer = g_slice_alloc(real_size);
+	if (buffer == NULL)
+		return -1;
+
+	/* Keep the pending data, moved to the start of the new storage */
+	ring_buffer_read(buf, buffer, len);
+	g_slice_free1(buf->size, buf->buffer);
+
+	buf->buffer = buffer;
+	buf->size = real_size;
+	buf->mask = real_size - 1;
+	buf->out = 0;
+	buf->in = len;
+
+	return real_size;
+}
@@ -105,3 +105,18 @@ int ring_buffer_len_no_wrap(struct ring_buffer *buf);
  * read counter was actually advanced.
  */
 int ring_buffer_drain(struct ring_buffer *buf, unsigned int len);
+
+/*!
+ * Fills the free space of the ring buffer, both sides of the wrap point,
+ * from the file descriptor fd with a single readv.  Returns the number of
+ * bytes read, 0 on end of file or when the buffer is full, or -1 with
+ * errno set if the read failed
+ */
+int ring_buffer_fill(struct ring_buffer *buf, int fd);
+
+/*!
+ * Changes the capacity of the ring buffer to size, rounded up to a power
+ * of two, keeping the data inside the buffer.  Returns the new capacity or
+ * -1 if the data does not fit or allocation failed
+ */
+int ring_buffer_resize(struct ring_buffer *buf, unsigned int size);
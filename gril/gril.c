@@ -32,6 +32,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <unistd.h>
@@ -54,6 +55,12 @@
 #define	RADIO_GID 1001
 #define	RADIO_UID 1001
 
+/* Maximum number of requests written to rild with a single writev */
+#define RIL_MAX_WRITE_BATCH	16
+
+/* Parcels larger than this are considered garbage and skipped */
+#define RIL_MAX_PARCEL_SIZE	(1024 * 1024)
+
 struct ril_request {
 	gchar *data;
 	guint data_len;
@@ -63,6 +70,8 @@ struct ril_request {
 	GRilResponseFunc callback;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GList *link;				/* Node in its queue */
+	gboolean sent;				/* In out_queue? */
 };
 
 struct ril_notify_node {
@@ -86,13 +95,18 @@ struct ril_s {
 	guint next_notify_id;			/* Next notify id */
 	guint next_gid;				/* Next group id */
 	GRilIO *io;				/* GRil IO */
-	GQueue *command_queue;			/* Command queue */
+	GQueue *command_queue;			/* Commands not yet sent */
 	GQueue *out_queue;			/* Commands sent/been sent */
+	GHashTable *pending;			/* Requests indexed by serial */
 	guint req_bytes_written;		/* bytes written from req */
 	GHashTable *notify_list;		/* List of notification reg */
 	GRilDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
-	guint read_so_far;			/* Number of bytes processed */
+	gchar *rx_buf;				/* Side buffer for parcels */
+	gsize rx_size;				/* Side buffer capacity */
+	gsize rx_len;				/* Bytes reassembled so far */
+	gsize rx_plen;				/* Parcel length, 0 if idle */
+	gboolean rx_discard;			/* Skipping bad parcel */
 	gboolean suspended;			/* Are we suspended? */
 	gboolean debug;
 	gboolean trace;
@@ -323,6 +337,11 @@ static void ril_cleanup(struct ril_s *p)
 		p->out_queue = NULL;
 	}
 
+	if (p->pending) {
+		g_hash_table_destroy(p->pending);
+		p->pending = NULL;
+	}
+
 	/* Cleanup registered notifications */
 	if (p->notify_list) {
 		g_hash_table_destroy(p->notify_list);
@@ -335,6 +354,12 @@ static void ril_cleanup(struct ril_s *p)
 	}
 }
 
+static void ril_free(struct ril_s *p)
+{
+	g_free(p->rx_buf);
+	g_free(p);
+}
+
 void g_ril_set_disconnect_function(GRil *ril, GRilDisconnectFunc disconnect,
 					gpointer user_data)
 {
@@ -356,56 +381,52 @@ static void io_disconnect(gpointer user_data)
 		ril->user_disconnect(ril->user_disconnect_data);
 }
 
-static void handle_response(struct ril_s *p, struct ril_msg *message)
+static void ril_request_unlink(struct ril_s *p, struct ril_request *req)
 {
-	guint count = g_queue_get_length(p->command_queue);
-	struct ril_request *req;
-	gboolean found = FALSE;
-	guint i, len;
-	gint id;
-
-	for (i = 0; i < count; i++) {
-		req = g_queue_peek_nth(p->command_queue, i);
+	g_hash_table_remove(p->pending, GINT_TO_POINTER(req->id));
 
-		if (req->id == message->serial_no) {
-			found = TRUE;
-			message->req = req->req;
+	if (req->sent)
+		g_queue_delete_link(p->out_queue, req->link);
+	else
+		g_queue_delete_link(p->command_queue, req->link);
 
-			if (message->error != RIL_E_SUCCESS)
-				RIL_TRACE(p, "[%d,%04d]< %s failed %s",
-					p->slot, message->serial_no,
-					request_id_to_string(p, message->req),
-					ril_error_to_string(message->error));
+	req->link = NULL;
+}
 
-			req = g_queue_pop_nth(p->command_queue, i);
-			if (req->callback)
-				req->callback(message, req->user_data);
+static void handle_response(struct ril_s *p, struct ril_msg *message)
+{
+	struct ril_request *req;
 
-			len = g_queue_get_length(p->out_queue);
+	req = g_hash_table_lookup(p->pending,
+					GINT_TO_POINTER(message->serial_no));
+	if (req == NULL) {
+		ofono_error("No matching request for reply: %s serial_no: %d!",
+			request_id_to_string(p, message->req),
+			message->serial_no);
+		return;
+	}
 
-			for (i = 0; i < len; i++) {
-				id = GPOINTER_TO_INT(g_queue_peek_nth(
-							p->out_queue, i));
-				if (id == req->id) {
-					g_queue_pop_nth(p->out_queue, i);
-					break;
-				}
-			}
+	message->req = req->req;
 
-			ril_request_destroy(req);
+	if (message->error != RIL_E_SUCCESS)
+		RIL_TRACE(p, "[%d,%04d]< %s failed %s",
+			p->slot, message->serial_no,
+			request_id_to_string(p, message->req),
+			ril_error_to_string(message->error));
 
-			if (g_queue_peek_head(p->command_queue))
-				ril_wakeup_writer(p);
+	/*
+	 * Unlink before calling back, the callback is free to send new
+	 * requests or cancel its group.
+	 */
+	ril_request_unlink(p, req);
 
-			break;
-		}
-	}
+	if (req->callback)
+		req->callback(message, req->user_data);
 
-	if (found == FALSE)
-		ofono_error("No matching request for reply: %s serial_no: %d!",
-			request_id_to_string(p, message->req),
-			message->serial_no);
+	ril_request_destroy(req);
 
+	if (g_queue_peek_head(p->command_queue))
+		ril_wakeup_writer(p);
 }
 
 static gboolean node_check_destroyed(struct ril_notify_node *node,
@@ -455,16 +476,21 @@ static void handle_unsol_req(struct ril_s *p, struct ril_msg *message)
 					GUINT_TO_POINTER(TRUE));
 }
 
+/*
+ * message->buf points straight into the ring buffer, at the start of the
+ * parcel header.  Strip the header in place and hand the payload to the
+ * callbacks without copying it, they must not keep message->buf around.
+ */
 static void dispatch(struct ril_s *p, struct ril_msg *message)
 {
 	int32_t *unsolicited_field, *id_num_field;
 	gchar *bufp = message->buf;
-	gchar *datap;
-	gsize data_len;
+	gsize hdr_len;
 
-	if (message->buf_len == 0) {
-		ofono_error("RIL error: incoming message with size 0");
-		goto error;
+	if (message->buf_len < 8) {
+		ofono_error("RIL error: incoming message with size %d",
+				(int) message->buf_len);
+		return;
 	}
 
 	/* This could be done with a struct/union... */
@@ -485,8 +511,14 @@ static void dispatch(struct ril_s *p, struct ril_msg *message)
 		 * and req/ev ), so subtract the length of the header from the
 		 * overall length to calculate the length of the Event Data.
 		 */
-		data_len = message->buf_len - 8;
+		hdr_len = 8;
 	} else {
+		if (message->buf_len < 12) {
+			ofono_error("RIL error: short response, size %d",
+					(int) message->buf_len);
+			return;
+		}
+
 		message->serial_no = (int) *id_num_field;
 
 		bufp += 4;
@@ -498,248 +530,229 @@ static void dispatch(struct ril_s *p, struct ril_msg *message)
 		 * from the overall length to calculate the length of the Event
 		 * Data.
 		 */
-		data_len = message->buf_len - 12;
+		hdr_len = 12;
 	}
 
-	/* advance to start of data.. */
-	bufp += 4;
-
-	/*
-	 * Now, use buffer for event data if present
-	 */
-	if (data_len) {
-		datap = g_try_malloc(data_len);
-		if (datap == NULL)
-			goto error;
+	message->buf_len -= hdr_len;
 
-		/* Copy event bytes from message->buf into new buffer */
-		memcpy(datap, bufp, data_len);
-
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
-		/* ...and replace with new buffer */
-		message->buf = datap;
-		message->buf_len = data_len;
-	} else {
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
-		/* To know if there was no data when parsing */
+	/* To know if there was no data when parsing */
+	if (message->buf_len)
+		message->buf += hdr_len;
+	else
 		message->buf = NULL;
-		message->buf_len = 0;
-	}
 
 	if (message->unsolicited == TRUE)
 		handle_unsol_req(p, message);
 	else
 		handle_response(p, message);
+}
 
-error:
-	g_free(message->buf);
-	g_free(message);
+/* Returns the length field of the record at the head of the ring buffer */
+static guint32 peek_record_length(struct ring_buffer *rbuf)
+{
+	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
+	guint32 plen;
+	guchar *dest = (guchar *) &plen;
+
+	if (wrap >= 4)
+		memcpy(dest, ring_buffer_read_ptr(rbuf, 0), 4);
+	else {
+		memcpy(dest, ring_buffer_read_ptr(rbuf, 0), wrap);
+		memcpy(dest + wrap, ring_buffer_read_ptr(rbuf, wrap), 4 - wrap);
+	}
+
+	/* Length is in TCP byte order (Big Endian) */
+	return ntohl(plen);
 }
 
-static struct ril_msg *read_fixed_record(struct ril_s *p,
-						const guchar *bytes, gsize *len)
+/*
+ * Records which wrap around the end of the ring buffer, or which are too
+ * large to ever fit in it, are reassembled into a side buffer instead.
+ * The side buffer is kept around for reuse unless it had to be grown
+ * past the size of the ring buffer.
+ */
+static void start_reassembly(struct ril_s *p, gsize plen)
 {
-	struct ril_msg *message;
-	unsigned message_len, plen;
+	p->rx_plen = plen;
+	p->rx_len = 0;
+	p->rx_discard = FALSE;
+
+	if (plen > RIL_MAX_PARCEL_SIZE) {
+		ofono_error("RIL parcel too big (%zu), discarding", plen);
+		p->rx_discard = TRUE;
+		return;
+	}
 
-	/* First four bytes are length in TCP byte order (Big Endian) */
-	plen = ntohl(*((uint32_t *) (void *) bytes));
-	bytes += 4;
+	if (p->rx_size >= plen)
+		return;
 
-	/*
-	 * TODO: Verify that 8k is the max message size from rild.
-	 *
-	 * This condition shouldn't happen.  If it does
-	 * there are three options:
-	 *
-	 * 1) Exit; ofono will restart via DBus (this is what we do now)
-	 * 2) Consume the bytes & continue
-	 * 3) force a disconnect
-	 */
-	if (plen > GRIL_BUFFER_SIZE - 4) {
-		ofono_error("ERROR RIL parcel bigger than buffer (%u), exiting",
-				plen);
-		exit(1);
+	g_free(p->rx_buf);
+	p->rx_size = 0;
+
+	p->rx_buf = g_try_malloc(plen);
+	if (p->rx_buf == NULL) {
+		ofono_error("Can't allocate %zu bytes for RIL parcel", plen);
+		p->rx_discard = TRUE;
+		return;
 	}
 
-	/*
-	 * If we don't have the whole fixed record in the ringbuffer
-	 * then return NULL & leave ringbuffer as is.
-	 */
+	p->rx_size = plen;
+}
 
-	message_len = *len - 4;
-	if (message_len < plen)
-		return NULL;
+static void continue_reassembly(struct ril_s *p, struct ring_buffer *rbuf)
+{
+	struct ril_msg message;
+	gsize n = MIN((gsize) ring_buffer_len(rbuf), p->rx_plen - p->rx_len);
+
+	if (p->rx_discard)
+		ring_buffer_drain(rbuf, n);
+	else
+		ring_buffer_read(rbuf, p->rx_buf + p->rx_len, n);
 
-	message = g_malloc(sizeof(struct ril_msg));
+	p->rx_len += n;
 
-	/* allocate ril_msg->buffer */
-	message->buf_len = plen;
-	message->buf = g_malloc(plen);
+	if (p->rx_len < p->rx_plen)
+		return;
+
+	p->rx_plen = 0;
+
+	if (p->rx_discard)
+		return;
 
-	/* Copy bytes into message buffer */
-	memmove(message->buf, (const void *) bytes, plen);
+	memset(&message, 0, sizeof(message));
+	message.buf = p->rx_buf;
+	message.buf_len = p->rx_len;
 
-	/* Indicate to caller size of record we extracted */
-	*len = plen + 4;
-	return message;
+	dispatch(p, &message);
+
+	if (p->rx_size > GRIL_BUFFER_SIZE) {
+		g_free(p->rx_buf);
+		p->rx_buf = NULL;
+		p->rx_size = 0;
+	}
 }
 
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
-	struct ril_msg *message;
+	struct ril_msg message;
 	struct ril_s *p = user_data;
-	unsigned int len = ring_buffer_len(rbuf);
-	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
-	guchar *buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
+	gsize len, plen;
 
 	p->in_read_handler = TRUE;
 
-	while (p->suspended == FALSE && (p->read_so_far < len)) {
-		gsize rbytes = MIN(len - p->read_so_far, wrap - p->read_so_far);
+	while (p->suspended == FALSE) {
+		len = ring_buffer_len(rbuf);
 
-		if (rbytes < 4) {
-			DBG("Not enough bytes for header length: len: %d", len);
-			return;
+		if (p->rx_plen > 0) {
+			if (len == 0)
+				break;
+
+			continue_reassembly(p, rbuf);
+			continue;
 		}
 
+		if (len < 4)
+			break;
+
+		plen = peek_record_length(rbuf);
+
 		/*
-		 * This function attempts to read the next full length
-		 * fixed message from the stream.  if not all bytes are
-		 * available, it returns NULL.  otherwise it allocates
-		 * and returns a ril_message with the copied bytes, and
-		 * drains those bytes from the ring_buffer
+		 * The common case, the whole record sits contiguously in the
+		 * ring buffer.  Dispatch it from there and drain it once the
+		 * callbacks are done with it.
+		 *
+		 * Parcels are padded to 4 bytes and the ring buffer size is a
+		 * power of two, so records stay 32-bit aligned in the buffer.
 		 */
-		message = read_fixed_record(p, buf, &rbytes);
-
-		/* wait for the rest of the record... */
-		if (message == NULL)
-			break;
+		if (plen + 4 <= (gsize) ring_buffer_len_no_wrap(rbuf)) {
+			memset(&message, 0, sizeof(message));
+			message.buf = (gchar *) ring_buffer_read_ptr(rbuf, 4);
+			message.buf_len = plen;
 
-		buf += rbytes;
-		p->read_so_far += rbytes;
+			dispatch(p, &message);
 
-		/* TODO: need to better understand how wrap works! */
-		if (p->read_so_far == wrap) {
-			buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
-			wrap = len;
+			ring_buffer_drain(rbuf, plen + 4);
+			continue;
 		}
 
-		dispatch(p, message);
-
-		ring_buffer_drain(rbuf, p->read_so_far);
+		/* wait for the rest of the record... */
+		if (len < plen + 4 &&
+				plen + 4 <= (gsize) ring_buffer_capacity(rbuf))
+			break;
 
-		len -= p->read_so_far;
-		wrap -= p->read_so_far;
-		p->read_so_far = 0;
+		/* ...unless it wraps or will never fit, then copy it out */
+		ring_buffer_drain(rbuf, 4);
+		start_reassembly(p, plen);
 	}
 
 	p->in_read_handler = FALSE;
 
 	if (p->destroyed)
-		g_free(p);
+		ril_free(p);
 }
 
 /*
  * This function is a GIOFunc and may be called directly or via an IO watch.
  * The return value controls whether the watch stays active ( TRUE ), or is
  * removed ( FALSE ).
+ *
+ * command_queue only holds requests which have not been fully written, in
+ * the order they were sent, so its head is always the next one to write.
+ * As many queued requests as fit into one batch are written at once, and
+ * the ones that made it onto the wire are moved over to out_queue.
  */
 static gboolean can_write_data(gpointer data)
 {
 	struct ril_s *ril = data;
+	struct iovec iov[RIL_MAX_WRITE_BATCH];
 	struct ril_request *req;
-	gsize bytes_written, towrite, len;
-	guint qlen, oqlen;
-	gint id;
-	gboolean written = TRUE;
-	guint i, j;
-
-	qlen = g_queue_get_length(ril->command_queue);
-	if (qlen < 1)
-		return FALSE;
-
-	/* if the whole request was not written */
-	if (ril->req_bytes_written != 0) {
-
-		for (i = 0; i < qlen; i++) {
-			req = g_queue_peek_nth(ril->command_queue, i);
-			if (req) {
-				id = GPOINTER_TO_INT(g_queue_peek_head(
-							ril->out_queue));
-				if (req->id == id)
-					goto out;
-			} else {
-				return FALSE;
-			}
-		}
-	}
-	/* if no requests already sent */
-	oqlen = g_queue_get_length(ril->out_queue);
-	if (oqlen < 1) {
-		req = g_queue_peek_head(ril->command_queue);
-		if (req == NULL)
-			return FALSE;
+	gsize bytes_written, offset;
+	GList *l;
+	int n = 0;
 
-		g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
+	offset = ril->req_bytes_written;
 
-		goto out;
-	}
+	for (l = g_queue_peek_head_link(ril->command_queue);
+			l && n < RIL_MAX_WRITE_BATCH; l = l->next) {
+		req = l->data;
 
-	for (i = 0; i < qlen; i++) {
-		req = g_queue_peek_nth(ril->command_queue, i);
-		if (req == NULL)
-			return FALSE;
+		iov[n].iov_base = req->data + offset;
+		iov[n].iov_len = req->data_len - offset;
+		offset = 0;
+		n += 1;
 
-		for (j = 0; j < oqlen; j++) {
-			id = GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, j));
-			if (req->id == id) {
-				written = TRUE;
-				break;
-			} else {
-				written = FALSE;
-			}
-		}
+#ifdef WRITE_SCHEDULER_DEBUG
+		if (iov[0].iov_len > 5)
+			iov[0].iov_len = 5;
 
-		if (written == FALSE)
-			break;
+		break;
+#endif
 	}
 
-	/* watcher fired though requests already written */
-	if (written == TRUE)
+	if (n == 0)
 		return FALSE;
 
-	g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
+	bytes_written = g_ril_io_writev(ril->io, iov, n);
 
-out:
-	len = req->data_len;
+	if (bytes_written == 0)
+		return FALSE;
 
-	towrite = len - ril->req_bytes_written;
+	bytes_written += ril->req_bytes_written;
 
-#ifdef WRITE_SCHEDULER_DEBUG
-	if (towrite > 5)
-		towrite = 5;
-#endif
+	while ((req = g_queue_peek_head(ril->command_queue)) != NULL) {
+		if (bytes_written < req->data_len)
+			break;
 
-	bytes_written = g_ril_io_write(ril->io,
-					req->data + ril->req_bytes_written,
-					towrite);
+		bytes_written -= req->data_len;
 
-	if (bytes_written == 0)
-		return FALSE;
+		l = g_queue_pop_head_link(ril->command_queue);
+		g_queue_push_tail_link(ril->out_queue, l);
+		req->sent = TRUE;
+	}
 
-	ril->req_bytes_written += bytes_written;
-	if (bytes_written < towrite)
-		return TRUE;
-	else
-		ril->req_bytes_written = 0;
+	ril->req_bytes_written = bytes_written;
 
-	return FALSE;
+	return g_queue_peek_head(ril->command_queue) != NULL;
 }
 
 static void ril_wakeup_writer(struct ril_s *ril)
@@ -786,7 +799,7 @@ static void ril_unref(struct ril_s *ril)
 	if (ril->in_read_handler)
 		ril->destroyed = TRUE;
 	else
-		g_free(ril);
+		ril_free(ril);
 }
 
 static gboolean node_compare_by_group(struct ril_notify_node *node,
@@ -891,6 +904,8 @@ static struct ril_s *create_ril(const char *sock_path)
 		goto error;
 	}
 
+	ril->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	ril->notify_list = g_hash_table_new_full(g_int_hash, g_int_equal,
 							g_free,
 							ril_notify_destroy);
@@ -928,38 +943,35 @@ static struct ril_notify *ril_notify_create(struct ril_s *ril,
 
 static void ril_cancel_group(struct ril_s *ril, guint group)
 {
-	int n = 0;
-	guint len, i;
+	GList *l, *next;
 	struct ril_request *req;
-	gboolean sent;
 
 	if (ril->command_queue == NULL)
 		return;
 
-	while ((req = g_queue_peek_nth(ril->command_queue, n)) != NULL) {
-		if (req->id == 0 || req->gid != group) {
-			n += 1;
+	/* Sent requests stay around until their reply frees them */
+	for (l = g_queue_peek_head_link(ril->out_queue); l; l = l->next) {
+		req = l->data;
+
+		if (req->id != 0 && req->gid == group)
+			req->callback = NULL;
+	}
+
+	for (l = g_queue_peek_head_link(ril->command_queue); l; l = next) {
+		next = l->next;
+		req = l->data;
+
+		if (req->id == 0 || req->gid != group)
 			continue;
-		}
 
 		req->callback = NULL;
-		sent = FALSE;
-
-		len = g_queue_get_length(ril->out_queue);
-		for (i = 0; i < len; i++) {
-			if (GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, i))
-					== req->id) {
-				n += 1;
-				sent = TRUE;
-				break;
-			}
-		 }
 
-		if (sent)
+		/* Partially written, the rest still has to go out */
+		if (l == g_queue_peek_head_link(ril->command_queue) &&
+				ril->req_bytes_written > 0)
 			continue;
 
-		g_queue_remove(ril->command_queue, req);
+		ril_request_unlink(ril, req);
 		ril_request_destroy(req);
 	}
 }
@@ -1149,6 +1161,8 @@ gint g_ril_send(GRil *ril, const gint reqid, struct parcel *rilp,
 	p->next_cmd_id++;
 
 	g_queue_push_tail(p->command_queue, r);
+	r->link = g_queue_peek_tail_link(p->command_queue);
+	g_hash_table_insert(p->pending, GINT_TO_POINTER(r->id), r);
 
 	ril_wakeup_writer(p);
 
@@ -36,6 +36,7 @@ struct _GRilIO;
 typedef struct _GRilIO GRilIO;
 
 struct ring_buffer;
+struct iovec;
 
 typedef void (*GRilIOReadFunc)(struct ring_buffer *buffer, gpointer user_data);
 typedef gboolean (*GRilIOWriteFunc)(gpointer user_data);
@@ -58,6 +59,7 @@ void g_ril_io_set_write_done(GRilIO *io, GRilDisconnectFunc func,
 void g_ril_io_drain_ring_buffer(GRilIO *io, guint len);
 
 gsize g_ril_io_write(GRilIO *io, const gchar *data, gsize count);
+gsize g_ril_io_writev(GRilIO *io, const struct iovec *iov, int iovcnt);
 
 gboolean g_ril_io_set_disconnect_function(GRilIO *io,
 			GRilDisconnectFunc disconnect, gpointer user_data);
@@ -45,13 +45,37 @@
 
 #define PAD_SIZE(s) (((s)+3)&~3)
 
+/*
+ * Request parcels are built and freed again on every g_ril_send, so keep a
+ * few of their buffers around instead of going back to the allocator.
+ */
+#define PARCEL_INITIAL_CAPACITY	256
+#define PARCEL_POOL_SIZE	4
+#define PARCEL_POOL_MAX_CAPACITY	4096
+
 typedef uint16_t char16_t;
 
+struct parcel_buf {
+	char *data;
+	size_t capacity;
+};
+
+static struct parcel_buf parcel_pool[PARCEL_POOL_SIZE];
+static unsigned int parcel_pool_len;
+
 void parcel_init(struct parcel *p)
 {
-	p->data = g_malloc0(sizeof(int32_t));
+	if (parcel_pool_len > 0) {
+		struct parcel_buf *buf = &parcel_pool[--parcel_pool_len];
+
+		p->data = buf->data;
+		p->capacity = buf->capacity;
+	} else {
+		p->data = g_malloc(PARCEL_INITIAL_CAPACITY);
+		p->capacity = PARCEL_INITIAL_CAPACITY;
+	}
+
 	p->size = 0;
-	p->capacity = sizeof(int32_t);
 	p->offset = 0;
 	p->malformed = 0;
 }
@@ -63,9 +87,31 @@ void parcel_grow(struct parcel *p, size_t size)
 	p->capacity += size;
 }
 
+void parcel_reserve(struct parcel *p, size_t size)
+{
+	size_t capacity = p->capacity ? p->capacity : PARCEL_INITIAL_CAPACITY;
+
+	if (p->offset + size <= p->capacity)
+		return;
+
+	while (capacity < p->offset + size)
+		capacity <<= 1;
+
+	parcel_grow(p, capacity - p->capacity);
+}
+
 void parcel_free(struct parcel *p)
 {
-	g_free(p->data);
+	if (p->data != NULL && p->capacity <= PARCEL_POOL_MAX_CAPACITY &&
+			parcel_pool_len < PARCEL_POOL_SIZE) {
+		struct parcel_buf *buf = &parcel_pool[parcel_pool_len++];
+
+		buf->data = p->data;
+		buf->capacity = p->capacity;
+	} else
+		g_free(p->data);
+
+	p->data = NULL;
 	p->size = 0;
 	p->capacity = 0;
 	p->offset = 0;
@@ -91,111 +137,207 @@ int32_t parcel_r_int32(struct parcel *p)
 
 int parcel_w_int32(struct parcel *p, int32_t val)
 {
-	for (;;) {
-
-		if (p->offset + sizeof(int32_t) < p->capacity) {
-			/* There's enough space */
-			*((int32_t *) (void *) (p->data + p->offset)) = val;
-			p->offset += sizeof(int32_t);
-			p->size += sizeof(int32_t);
-			break;
-		} else {
-			/* Grow data and retry */
-			parcel_grow(p, sizeof(int32_t));
-		}
-	}
+	parcel_reserve(p, sizeof(int32_t));
+
+	*((int32_t *) (void *) (p->data + p->offset)) = val;
+	p->offset += sizeof(int32_t);
+	p->size += sizeof(int32_t);
+
 	return 0;
 }
 
+/*
+ * Returns the number of UTF-16 code units needed for the UTF-8 string str,
+ * or -1 if str is not valid UTF-8.
+ */
+static long utf8_utf16_len(const char *str)
+{
+	const char *end;
+	long len16 = 0;
+
+	if (g_utf8_validate(str, -1, &end) == FALSE)
+		return -1;
+
+	while (str < end) {
+		/* 4 byte sequences are the ones outside of the BMP */
+		if (((unsigned char) *str & 0xf8) == 0xf0)
+			len16 += 2;
+		else
+			len16 += 1;
+
+		str = g_utf8_next_char(str);
+	}
+
+	return len16;
+}
+
 int parcel_w_string(struct parcel *p, const char *str)
 {
-	gunichar2 *gs16;
-	glong gs16_len;
+	char16_t *out;
+	long len16;
 	size_t len;
-	size_t gs16_size;
+	size_t padded;
 
 	if (str == NULL) {
 		parcel_w_int32(p, -1);
 		return 0;
 	}
 
-	gs16 = g_utf8_to_utf16(str, -1, NULL, &gs16_len, NULL);
-
-	if (parcel_w_int32(p, gs16_len) == -1)
+	len16 = utf8_utf16_len(str);
+	if (len16 < 0) {
+		ofono_error("%s: wrong UTF8 coding", __func__);
+		parcel_w_int32(p, -1);
 		return -1;
+	}
 
-	gs16_size = gs16_len * sizeof(char16_t);
-	len = gs16_size + sizeof(char16_t);
-	for (;;) {
-		size_t padded = PAD_SIZE(len);
-
-		if (p->offset + len < p->capacity) {
-			/* There's enough space */
-			memcpy(p->data + p->offset, gs16, gs16_size);
-			*((char16_t *) (void *)
-				(p->data + p->offset + gs16_size)) = 0;
-			p->offset += padded;
-			p->size += padded;
-			if (padded != len) {
-
-#if BYTE_ORDER == BIG_ENDIAN
-				static const uint32_t mask[4] = {
-					0x00000000, 0xffffff00,
-					0xffff0000, 0xff000000
-				};
-#endif
-#if BYTE_ORDER == LITTLE_ENDIAN
-				static const uint32_t mask[4] = {
-					0x00000000, 0x00ffffff,
-					0x0000ffff, 0x000000ff
-				};
-#endif
+	len = (len16 + 1) * sizeof(char16_t);
+	padded = PAD_SIZE(len);
 
-				*((uint32_t *) (void *)
-					(p->data + p->offset - 4)) &=
-							mask[padded - len];
-			}
-			break;
+	/* Reserve length field and string up front, then transcode in */
+	parcel_reserve(p, sizeof(int32_t) + padded);
+	parcel_w_int32(p, len16);
 
-		} else {
-			/* Grow data and retry */
-			parcel_grow(p, padded);
+	out = (char16_t *) (void *) (p->data + p->offset);
+
+	for (; *str; str = g_utf8_next_char(str)) {
+		gunichar c = g_utf8_get_char(str);
+
+		if (c < 0x10000) {
+			*out++ = c;
+			continue;
 		}
+
+		c -= 0x10000;
+		*out++ = 0xd800 + (c >> 10);
+		*out++ = 0xdc00 + (c & 0x3ff);
 	}
 
-	g_free(gs16);
+	/* NUL terminator plus padding */
+	memset(out, 0, padded - len16 * sizeof(char16_t));
+
+	p->offset += padded;
+	p->size += padded;
+
 	return 0;
 }
 
-char *parcel_r_string(struct parcel *p)
+/*
+ * Returns the number of bytes needed to store the UTF-16 string str of
+ * len16 code units as UTF-8, not including the terminating NUL, or -1 if
+ * str is not valid UTF-16.  Like g_utf16_to_utf8, conversion stops at the
+ * first NUL code unit.
+ */
+static long utf16_utf8_len(const char16_t *str, int len16)
 {
-	char *ret;
-	int len16 = parcel_r_int32(p);
-	int strbytes;
+	long len = 0;
+	int i;
+
+	for (i = 0; i < len16 && str[i]; i++) {
+		char16_t c = str[i];
+
+		if (c < 0x80)
+			len += 1;
+		else if (c < 0x800)
+			len += 2;
+		else if (c < 0xd800 || c >= 0xe000)
+			len += 3;
+		else if (c < 0xdc00 && i + 1 < len16 &&
+				str[i + 1] >= 0xdc00 && str[i + 1] < 0xe000) {
+			len += 4;
+			i += 1;
+		} else
+			return -1;
+	}
+
+	return len;
+}
+
+/* str must have been checked with utf16_utf8_len beforehand */
+static char *utf16_to_utf8_buf(const char16_t *str, int len16, char *out)
+{
+	int i;
+
+	for (i = 0; i < len16 && str[i]; i++) {
+		gunichar c = str[i];
+
+		if (c >= 0xd800 && c < 0xdc00) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (str[i + 1] - 0xdc00);
+			i += 1;
+		}
+
+		out += g_unichar_to_utf8(c, out);
+	}
+
+	*out++ = '\0';
+
+	return out;
+}
+
+/*
+ * Checks the string at the current offset and returns the UTF-16 data and
+ * its UTF-8 length, without consuming it.  Returns NULL for a null string
+ * or on error, setting p->malformed in the latter case.
+ */
+static const char16_t *parcel_peek_string(struct parcel *p, int *len16,
+						long *utf8_len)
+{
+	const char16_t *str16;
+	size_t strbytes;
+
+	*len16 = parcel_r_int32(p);
 
 	if (p->malformed)
 		return NULL;
 
 	/* This is how a null string is sent */
-	if (len16 < 0)
+	if (*len16 < 0)
 		return NULL;
 
-	strbytes = PAD_SIZE((len16 + 1) * sizeof(char16_t));
+	strbytes = PAD_SIZE((*len16 + 1) * sizeof(char16_t));
 	if (p->offset + strbytes > p->size) {
 		ofono_error("%s: parcel is too small", __func__);
 		p->malformed = 1;
 		return NULL;
 	}
 
-	ret = g_utf16_to_utf8((gunichar2 *) (void *) (p->data + p->offset),
-				len16, NULL, NULL, NULL);
-	if (ret == NULL) {
+	str16 = (const char16_t *) (void *) (p->data + p->offset);
+
+	*utf8_len = utf16_utf8_len(str16, *len16);
+	if (*utf8_len < 0) {
 		ofono_error("%s: wrong UTF16 coding", __func__);
 		p->malformed = 1;
 		return NULL;
 	}
 
-	p->offset += strbytes;
+	return str16;
+}
+
+static void parcel_skip_string(struct parcel *p, int len16)
+{
+	p->offset += PAD_SIZE((len16 + 1) * sizeof(char16_t));
+}
+
+char *parcel_r_string(struct parcel *p)
+{
+	const char16_t *str16;
+	char *ret;
+	int len16;
+	long utf8_len;
+
+	str16 = parcel_peek_string(p, &len16, &utf8_len);
+	if (str16 == NULL)
+		return NULL;
+
+	ret = g_try_malloc(utf8_len + 1);
+	if (ret == NULL) {
+		ofono_error("%s: out of memory (%ld bytes)", __func__,
+				utf8_len + 1);
+		p->malformed = 1;
+		return NULL;
+	}
+
+	utf16_to_utf8_buf(str16, len16, ret);
+	parcel_skip_string(p, len16);
 
 	return ret;
 }
@@ -207,21 +349,13 @@ int parcel_w_raw(struct parcel *p, const void *data, size_t len)
 		return 0;
 	}
 
+	parcel_reserve(p, sizeof(int32_t) + len);
 	parcel_w_int32(p, len);
 
-	for (;;) {
-
-		if (p->offset + len < p->capacity) {
-			/* There's enough space */
-			memcpy(p->data + p->offset, data, len);
-			p->offset += len;
-			p->size += len;
-			break;
-		} else {
-			/* Grow data and retry */
-			parcel_grow(p, len);
-		}
-	}
+	memcpy(p->data + p->offset, data, len);
+	p->offset += len;
+	p->size += len;
+
 	return 0;
 }
 
@@ -257,26 +391,62 @@ size_t parcel_data_avail(struct parcel *p)
 	return p->size - p->offset;
 }
 
+/*
+ * The array and all of its strings are returned in a single allocation:
+ * a first pass over the parcel sizes the strings, a second one transcodes
+ * them straight into place.
+ */
 struct parcel_str_array *parcel_r_str_array(struct parcel *p)
 {
 	int i;
 	struct parcel_str_array *str_arr;
 	int num_str = parcel_r_int32(p);
+	size_t start, total;
+	const char16_t *str16;
+	int len16;
+	long utf8_len;
+	char *out;
 
 	if (p->malformed || num_str <= 0)
 		return NULL;
 
-	str_arr = g_try_malloc0(sizeof(*str_arr) + num_str * sizeof(char *));
+	if ((size_t) num_str > parcel_data_avail(p) / sizeof(int32_t)) {
+		ofono_error("%s: parcel is too small", __func__);
+		p->malformed = 1;
+		return NULL;
+	}
+
+	start = p->offset;
+	total = sizeof(*str_arr) + num_str * sizeof(char *);
+
+	for (i = 0; i < num_str; ++i) {
+		str16 = parcel_peek_string(p, &len16, &utf8_len);
+		if (p->malformed)
+			return NULL;
+
+		if (str16 == NULL)
+			continue;
+
+		total += utf8_len + 1;
+		parcel_skip_string(p, len16);
+	}
+
+	str_arr = g_try_malloc0(total);
 	if (str_arr == NULL)
 		return NULL;
 
+	p->offset = start;
 	str_arr->num_str = num_str;
-	for (i = 0; i < num_str; ++i)
-		str_arr->str[i] = parcel_r_string(p);
+	out = (char *) &str_arr->str[num_str];
 
-	if (p->malformed) {
-		parcel_free_str_array(str_arr);
-		return NULL;
+	for (i = 0; i < num_str; ++i) {
+		str16 = parcel_peek_string(p, &len16, &utf8_len);
+		if (str16 == NULL)
+			continue;
+
+		str_arr->str[i] = out;
+		out = utf16_to_utf8_buf(str16, len16, out);
+		parcel_skip_string(p, len16);
 	}
 
 	return str_arr;
@@ -284,10 +454,5 @@ struct parcel_str_array *parcel_r_str_array(struct parcel *p)
 
 void parcel_free_str_array(struct parcel_str_array *str_arr)
 {
-	if (str_arr) {
-		int i;
-		for (i = 0; i < str_arr->num_str; ++i)
-			g_free(str_arr->str[i]);
-		g_free(str_arr);
-	}
+	g_free(str_arr);
 }
@@ -39,6 +39,7 @@ struct parcel_str_array {
 
 void parcel_init(struct parcel *p);
 void parcel_grow(struct parcel *p, size_t size);
+void parcel_reserve(struct parcel *p, size_t size);
 void parcel_free(struct parcel *p);
 int32_t parcel_r_int32(struct parcel *p);
 int parcel_w_int32(struct parcel *p, int32_t val);
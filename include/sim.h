@@ -128,6 +128,11 @@ typedef void (*ofono_sim_locked_cb_t)(const struct ofono_error *error,
 
 struct ofono_sim_driver {
 	const char *name;
+	/*
+	 * Record and block reads simfs may have outstanding at once, unset
+	 * for drivers that can only handle one request at a time
+	 */
+	unsigned int max_pending_reads;
 	int (*probe)(struct ofono_sim *sim, unsigned int vendor, void *data);
 	void (*remove)(struct ofono_sim *sim);
 	void (*read_file_info)(struct ofono_sim *sim, int fileid,
@@ -0,0 +1,511 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "apndb-index.h"
+
+#ifndef APNDB_INDEX_DIR
+#define APNDB_INDEX_DIR		STORAGEDIR "/apndb"
+#endif
+
+#define APNDB_INDEX_MAGIC	0x49444e41	/* "ANDI" */
+#define APNDB_INDEX_VERSION	1
+#define APNDB_INDEX_KEY_LEN	16
+
+/*
+ * The index file is a header followed by entries sorted by key and then
+ * by offset, so that all fragments for a key are found with one binary
+ * search and come out in the order the source lists them.  It is only
+ * ever used on the machine that wrote it, hence native byte order.
+ */
+struct apndb_index_header {
+	guint32 magic;
+	guint32 version;
+	guint64 mtime;
+	guint64 size;
+	guint32 count;
+	guint32 reserved;
+};
+
+struct apndb_index_entry {
+	char key[APNDB_INDEX_KEY_LEN];
+	guint32 offset;
+	guint32 length;
+};
+
+struct key_data {
+	const struct apndb_index_desc *desc;
+	GArray *entries;
+	guint32 offset;
+	guint32 length;
+};
+
+static char *index_path(const char *path, const char *fragment)
+{
+	char *name = g_strdelimit(g_strdup(path), "/", '_');
+	char *ret;
+
+	ret = g_strdup_printf(APNDB_INDEX_DIR "/%s.%s", name, fragment);
+	g_free(name);
+
+	return ret;
+}
+
+static gboolean entry_exists(GArray *entries, guint32 offset, const char *key)
+{
+	int i;
+
+	/* Several keys of one fragment are always added back to back */
+	for (i = entries->len - 1; i >= 0; i--) {
+		struct apndb_index_entry *entry =
+			&g_array_index(entries, struct apndb_index_entry, i);
+
+		if (entry->offset != offset)
+			break;
+
+		if (strcmp(entry->key, key) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void key_start(GMarkupParseContext *context, const gchar *element_name,
+			const gchar **attribute_names,
+			const gchar **attribute_values,
+			gpointer userdata, GError **error)
+{
+	struct key_data *kd = userdata;
+	const char *values[G_N_ELEMENTS(kd->desc->key_attrs)];
+	struct apndb_index_entry entry;
+	char *key;
+	int i, j;
+
+	if (g_str_equal(element_name, kd->desc->key_element) == FALSE)
+		return;
+
+	for (i = 0; kd->desc->key_attrs[i]; i++) {
+		values[i] = NULL;
+
+		for (j = 0; attribute_names[j]; j++) {
+			if (g_str_equal(attribute_names[j],
+					kd->desc->key_attrs[i]) == FALSE)
+				continue;
+
+			values[i] = attribute_values[j];
+			break;
+		}
+
+		/* Without a complete key this element can never match */
+		if (values[i] == NULL)
+			return;
+	}
+
+	values[i] = NULL;
+	key = g_strjoinv(",", (char **) values);
+
+	/* Lookups with over-long keys bypass the index, so drop them here */
+	if (strlen(key) >= APNDB_INDEX_KEY_LEN ||
+			entry_exists(kd->entries, kd->offset, key) == TRUE)
+		goto out;
+
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.key, key);
+	entry.offset = kd->offset;
+	entry.length = kd->length;
+
+	g_array_append_val(kd->entries, entry);
+
+out:
+	g_free(key);
+}
+
+static const GMarkupParser key_parser = {
+	key_start,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+};
+
+static const char *find_str(const char *p, const char *end, const char *str)
+{
+	gsize len = strlen(str);
+
+	while ((p = memchr(p, str[0], end - p)) != NULL) {
+		if ((gsize) (end - p) < len)
+			return NULL;
+
+		if (memcmp(p, str, len) == 0)
+			return p;
+
+		p++;
+	}
+
+	return NULL;
+}
+
+static const char *find_tag_end(const char *p, const char *end)
+{
+	char quote = 0;
+
+	for (; p < end; p++) {
+		if (quote != 0) {
+			if (*p == quote)
+				quote = 0;
+		} else if (*p == '"' || *p == '\'')
+			quote = *p;
+		else if (*p == '>')
+			return p;
+	}
+
+	return NULL;
+}
+
+static gboolean has_prefix(const char *p, const char *end, const char *prefix)
+{
+	gsize len = strlen(prefix);
+
+	return (gsize) (end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+
+static gint entry_compare(gconstpointer a, gconstpointer b)
+{
+	const struct apndb_index_entry *ea = a;
+	const struct apndb_index_entry *eb = b;
+	int r = strcmp(ea->key, eb->key);
+
+	if (r != 0)
+		return r;
+
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Finds every fragment element with a light scan that only has to know
+ * about comments, CDATA and processing instructions, and leaves pulling
+ * the keys out of each fragment to GMarkup.
+ */
+static GArray *index_build(const char *db, gsize len,
+				const struct apndb_index_desc *desc)
+{
+	const char *end = db + len;
+	const char *p = db;
+	gsize name_len = strlen(desc->fragment);
+	char *close_tag = g_strconcat("</", desc->fragment, NULL);
+	GMarkupParseContext *context;
+	struct key_data kd;
+	const char *frag_end;
+	gboolean ok;
+	char c;
+
+	kd.desc = desc;
+	kd.entries = g_array_new(FALSE, FALSE,
+					sizeof(struct apndb_index_entry));
+
+	while (p < end && (p = memchr(p, '<', end - p)) != NULL) {
+		if (has_prefix(p, end, "<!--")) {
+			p = find_str(p + 4, end, "-->");
+			if (p == NULL)
+				goto error;
+
+			p += 3;
+			continue;
+		}
+
+		if (has_prefix(p, end, "<![CDATA[")) {
+			p = find_str(p + 9, end, "]]>");
+			if (p == NULL)
+				goto error;
+
+			p += 3;
+			continue;
+		}
+
+		if (has_prefix(p, end, "<?")) {
+			p = find_str(p + 2, end, "?>");
+			if (p == NULL)
+				goto error;
+
+			p += 2;
+			continue;
+		}
+
+		if ((gsize) (end - p) <= name_len + 1 ||
+				memcmp(p + 1, desc->fragment, name_len) != 0) {
+			p++;
+			continue;
+		}
+
+		c = p[name_len + 1];
+		if (g_ascii_isspace(c) == FALSE && c != '/' && c != '>') {
+			p++;
+			continue;
+		}
+
+		frag_end = find_tag_end(p, end);
+		if (frag_end == NULL)
+			goto error;
+
+		if (frag_end[-1] != '/') {
+			frag_end = find_str(frag_end, end, close_tag);
+			if (frag_end == NULL)
+				goto error;
+
+			frag_end = find_tag_end(frag_end, end);
+			if (frag_end == NULL)
+				goto error;
+		}
+
+		frag_end++;
+
+		kd.offset = p - db;
+		kd.length = frag_end - p;
+
+		context = g_markup_parse_context_new(&key_parser, 0, &kd, NULL);
+		ok = g_markup_parse_context_parse(context, p, kd.length, NULL);
+
+		if (ok == TRUE)
+			ok = g_markup_parse_context_end_parse(context, NULL);
+
+		g_markup_parse_context_free(context);
+
+		/* Leave reporting malformed input to the full parse */
+		if (ok == FALSE)
+			goto error;
+
+		p = frag_end;
+	}
+
+	g_free(close_tag);
+	g_array_sort(kd.entries, entry_compare);
+
+	return kd.entries;
+
+error:
+	g_free(close_tag);
+	g_array_free(kd.entries, TRUE);
+
+	return NULL;
+}
+
+static void index_save(const char *filename, const struct stat *st,
+			GArray *entries)
+{
+	struct apndb_index_header *hdr;
+	gsize len = sizeof(*hdr) + entries->len *
+					sizeof(struct apndb_index_entry);
+	char *buf;
+
+	if (g_mkdir_with_parents(APNDB_INDEX_DIR, 0755) < 0)
+		return;
+
+	buf = g_malloc0(len);
+
+	hdr = (struct apndb_index_header *) buf;
+	hdr->magic = APNDB_INDEX_MAGIC;
+	hdr->version = APNDB_INDEX_VERSION;
+	hdr->mtime = st->st_mtime;
+	hdr->size = st->st_size;
+	hdr->count = entries->len;
+
+	memcpy(buf + sizeof(*hdr), entries->data,
+			entries->len * sizeof(struct apndb_index_entry));
+
+	/* Written to a temporary file and renamed, so never seen partial */
+	g_file_set_contents(filename, buf, len, NULL);
+
+	g_free(buf);
+}
+
+static void *index_load(const char *filename, const struct stat *source,
+			gsize *out_len)
+{
+	const struct apndb_index_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (gsize) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+
+	if (hdr->magic != APNDB_INDEX_MAGIC ||
+			hdr->version != APNDB_INDEX_VERSION ||
+			hdr->mtime != (guint64) source->st_mtime ||
+			hdr->size != (guint64) source->st_size ||
+			(gsize) st.st_size != sizeof(*hdr) + hdr->count *
+					sizeof(struct apndb_index_entry)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*out_len = st.st_size;
+
+	return map;
+}
+
+static gboolean index_foreach(const struct apndb_index_entry *entries,
+				guint32 count, const char *db, gsize len,
+				const char *key, apndb_index_parse_func func,
+				gpointer user_data, GError **error)
+{
+	guint32 lo = 0;
+	guint32 hi = count;
+	guint32 mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (strncmp(entries[mid].key, key, APNDB_INDEX_KEY_LEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < count; lo++) {
+		const struct apndb_index_entry *entry = &entries[lo];
+
+		if (strncmp(entry->key, key, APNDB_INDEX_KEY_LEN) != 0)
+			break;
+
+		if (entry->offset > len || entry->length > len - entry->offset)
+			continue;
+
+		if (func(db + entry->offset, entry->length,
+						user_data, error) == FALSE)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean apndb_index_parse(const char *path,
+				const struct apndb_index_desc *desc,
+				const char *key, apndb_index_parse_func func,
+				gpointer user_data, GError **error)
+{
+	struct stat st;
+	char *db;
+	int fd;
+	char *filename;
+	void *map;
+	gsize map_len;
+	GArray *entries;
+	gboolean ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		g_set_error(error, G_FILE_ERROR,
+				g_file_error_from_errno(errno),
+				"open(%s) failed: %s", path,
+				g_strerror(errno));
+		return FALSE;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		g_set_error(error, G_FILE_ERROR,
+				g_file_error_from_errno(errno),
+				"fstat(%s) failed: %s", path,
+				g_strerror(errno));
+		return FALSE;
+	}
+
+	db = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (db == MAP_FAILED) {
+		close(fd);
+		g_set_error(error, G_FILE_ERROR,
+				g_file_error_from_errno(errno),
+				"mmap(%s) failed: %s", path,
+				g_strerror(errno));
+		return FALSE;
+	}
+
+	if (strlen(key) >= APNDB_INDEX_KEY_LEN ||
+			(guint64) st.st_size > G_MAXUINT32) {
+		ret = func(db, st.st_size, user_data, error);
+		goto done;
+	}
+
+	filename = index_path(path, desc->fragment);
+
+	map = index_load(filename, &st, &map_len);
+	if (map != NULL) {
+		const struct apndb_index_header *hdr = map;
+
+		ret = index_foreach((const void *) (hdr + 1), hdr->count,
+					db, st.st_size, key, func,
+					user_data, error);
+		munmap(map, map_len);
+		goto out;
+	}
+
+	entries = index_build(db, st.st_size, desc);
+	if (entries == NULL) {
+		ret = func(db, st.st_size, user_data, error);
+		goto out;
+	}
+
+	index_save(filename, &st, entries);
+
+	ret = index_foreach((const void *) entries->data, entries->len,
+				db, st.st_size, key, func, user_data, error);
+	g_array_free(entries, TRUE);
+
+out:
+	g_free(filename);
+
+done:
+	munmap(db, st.st_size);
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,54 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __APNDB_INDEX_H
+#define __APNDB_INDEX_H
+
+/*
+ * Describes which elements of an XML database get indexed.  Every
+ * <fragment> element is recorded under each key found on a <key_element>
+ * inside it (or on itself), the key being the values of key_attrs joined
+ * with ','.
+ */
+struct apndb_index_desc {
+	const char *fragment;
+	const char *key_element;
+	const char *key_attrs[3];
+};
+
+typedef gboolean (*apndb_index_parse_func)(const char *data, gsize len,
+						gpointer user_data,
+						GError **error);
+
+/*
+ * Calls func for every fragment of path indexed under key, in file order.
+ * Without a usable index on disk the index is built in memory, and saved
+ * for the next lookup when possible.  Only when the file can't be indexed
+ * at all (malformed markup, a key too long for the index or a file over
+ * 4 GiB) is func called once with the whole file, so it must cope with
+ * both.
+ */
+gboolean apndb_index_parse(const char *path,
+				const struct apndb_index_desc *desc,
+				const char *key, apndb_index_parse_func func,
+				gpointer user_data, GError **error);
+
+#endif /* __APNDB_INDEX_H */
@@ -24,12 +24,6 @@
 #endif
 
 #include <string.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <errno.h>
-#include <unistd.h>
 
 #include <glib.h>
 
@@ -43,6 +37,7 @@
 #endif
 
 #include "mbpi.h"
+#include "apndb-index.h"
 
 #define _(x) case x: return (#x)
 
@@ -59,6 +54,23 @@ struct gsm_data {
 	gboolean allow_duplicates;
 };
 
+struct parse_data {
+	const GMarkupParser *parser;
+	gpointer userdata;
+};
+
+static const struct apndb_index_desc gsm_index = {
+	.fragment = "gsm",
+	.key_element = "network-id",
+	.key_attrs = { "mcc", "mnc", NULL },
+};
+
+static const struct apndb_index_desc cdma_index = {
+	.fragment = "provider",
+	.key_element = "sid",
+	.key_attrs = { "value", NULL },
+};
+
 struct cdma_data {
 	const char *match_sid;
 	char *provider_name;
@@ -415,9 +427,14 @@ static void gsm_end(GMarkupParseContext *context, const gchar *element_name,
 		}
 	}
 
-	if (gsm->match_type == OFONO_GPRS_CONTEXT_TYPE_ANY ||
-			gsm->match_type == ap->type)
-		gsm->apns = g_slist_append(gsm->apns, ap);
+	if (gsm->match_type != OFONO_GPRS_CONTEXT_TYPE_ANY &&
+			gsm->match_type != ap->type) {
+		mbpi_ap_free(ap);
+		return;
+	}
+
+	/* Collected in reverse, mbpi_lookup_apn() restores the file order */
+	gsm->apns = g_slist_prepend(gsm->apns, ap);
 }
 
 static const GMarkupParser gsm_parser = {
@@ -558,65 +575,44 @@ static const GMarkupParser toplevel_cdma_parser = {
 	NULL,
 };
 
-static gboolean mbpi_parse(const GMarkupParser *parser, gpointer userdata,
-				GError **error)
+static gboolean parse_fragment(const char *data, gsize len,
+				gpointer user_data, GError **error)
 {
-	struct stat st;
-	char *db;
-	int fd;
+	struct parse_data *pd = user_data;
 	GMarkupParseContext *context;
 	gboolean ret;
 
-	fd = open(MBPI_DATABASE, O_RDONLY);
-	if (fd < 0) {
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"open(%s) failed: %s", MBPI_DATABASE,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	if (fstat(fd, &st) < 0) {
-		close(fd);
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"fstat(%s) failed: %s", MBPI_DATABASE,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	db = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (db == MAP_FAILED) {
-		close(fd);
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"mmap(%s) failed: %s", MBPI_DATABASE,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	context = g_markup_parse_context_new(parser,
+	context = g_markup_parse_context_new(pd->parser,
 						G_MARKUP_TREAT_CDATA_AS_TEXT,
-						userdata, NULL);
+						pd->userdata, NULL);
 
-	ret = g_markup_parse_context_parse(context, db, st.st_size, error);
+	ret = g_markup_parse_context_parse(context, data, len, error);
 
 	if (ret == TRUE)
-		g_markup_parse_context_end_parse(context, error);
+		ret = g_markup_parse_context_end_parse(context, error);
 
-	munmap(db, st.st_size);
-	close(fd);
 	g_markup_parse_context_free(context);
 
 	return ret;
 }
 
+static gboolean mbpi_parse(const GMarkupParser *parser, gpointer userdata,
+				const struct apndb_index_desc *desc,
+				const char *key, GError **error)
+{
+	struct parse_data pd = { parser, userdata };
+
+	return apndb_index_parse(MBPI_DATABASE, desc, key, parse_fragment,
+					&pd, error);
+}
+
 GSList *mbpi_lookup_apn(const char *mcc, const char *mnc,
 			enum ofono_gprs_context_type type,
 			gboolean allow_duplicates, GError **error)
 {
 	struct gsm_data gsm;
 	GSList *l;
+	char *key;
 
 	memset(&gsm, 0, sizeof(gsm));
 	gsm.match_mcc = mcc;
@@ -624,7 +620,10 @@ GSList *mbpi_lookup_apn(const char *mcc, const char *mnc,
 	gsm.match_type = type;
 	gsm.allow_duplicates = allow_duplicates;
 
-	if (mbpi_parse(&toplevel_gsm_parser, &gsm, error) == FALSE) {
+	key = g_strdup_printf("%s,%s", mcc, mnc);
+
+	if (mbpi_parse(&toplevel_gsm_parser, &gsm, &gsm_index, key,
+							error) == FALSE) {
 		for (l = gsm.apns; l; l = l->next)
 			mbpi_ap_free(l->data);
 
@@ -632,7 +631,9 @@ GSList *mbpi_lookup_apn(const char *mcc, const char *mnc,
 		gsm.apns = NULL;
 	}
 
-	return gsm.apns;
+	g_free(key);
+
+	return g_slist_reverse(gsm.apns);
 }
 
 char *mbpi_lookup_cdma_provider_name(const char *sid, GError **error)
@@ -642,7 +643,9 @@ char *mbpi_lookup_cdma_provider_name(const char *sid, GError **error)
 	memset(&cdma, 0, sizeof(cdma));
 	cdma.match_sid = sid;
 
-	if (mbpi_parse(&toplevel_cdma_parser, &cdma, error) == FALSE) {
+	if (mbpi_parse(&toplevel_cdma_parser, &cdma, &cdma_index, sid,
+						error) == FALSE ||
+			cdma.match_found == FALSE) {
 		g_free(cdma.provider_name);
 		cdma.provider_name = NULL;
 	}
@@ -26,13 +26,7 @@
 #endif
 
 #include <string.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <errno.h>
 #include <stdlib.h>
-#include <unistd.h>
 
 #include <glib.h>
 
@@ -42,6 +36,7 @@
 #include <ofono/log.h>
 
 #include "ubuntu-apndb.h"
+#include "apndb-index.h"
 
 #ifndef SYSTEM_APNDB_PATH
 #define SYSTEM_APNDB_PATH     "/system/etc/apns-conf.xml"
@@ -59,6 +54,12 @@ struct apndb_data {
 	gboolean mvno_found;
 };
 
+static const struct apndb_index_desc apn_index = {
+	.fragment = "apn",
+	.key_element = "apn",
+	.key_attrs = { "mcc", "mnc", NULL },
+};
+
 void ubuntu_apndb_ap_free(gpointer data)
 {
 	struct apndb_provision_data *ap = data;
@@ -451,7 +452,7 @@ static void toplevel_apndb_start(GMarkupParseContext *context,
 		apndb->mvno_found = TRUE;
 	}
 
-	apndb->apns = g_slist_append(apndb->apns, ap);
+	apndb->apns = g_slist_prepend(apndb->apns, ap);
 }
 
 static void toplevel_apndb_end(GMarkupParseContext *context,
@@ -468,61 +469,44 @@ static const GMarkupParser toplevel_apndb_parser = {
 	NULL,
 };
 
-static gboolean ubuntu_apndb_parse(const GMarkupParser *parser,
-					gpointer userdata,
-					const char *apndb_path,
-					GError **error)
+static gboolean parse_fragment(const char *data, gsize len,
+				gpointer user_data, GError **error)
 {
-	struct stat st;
-	char *db;
-	int fd;
 	GMarkupParseContext *context;
 	gboolean ret;
 
-	fd = open(apndb_path, O_RDONLY);
-	if (fd < 0) {
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"open(%s) failed: %s", apndb_path,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	if (fstat(fd, &st) < 0) {
-		close(fd);
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"fstat(%s) failed: %s", apndb_path,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	db = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (db == MAP_FAILED) {
-		close(fd);
-		g_set_error(error, G_FILE_ERROR,
-				g_file_error_from_errno(errno),
-				"mmap(%s) failed: %s", apndb_path,
-				g_strerror(errno));
-		return FALSE;
-	}
-
-	context = g_markup_parse_context_new(parser,
+	context = g_markup_parse_context_new(&toplevel_apndb_parser,
 						G_MARKUP_TREAT_CDATA_AS_TEXT,
-						userdata, NULL);
+						user_data, NULL);
 
-	ret = g_markup_parse_context_parse(context, db, st.st_size, error);
+	ret = g_markup_parse_context_parse(context, data, len, error);
 
 	if (ret == TRUE)
-		g_markup_parse_context_end_parse(context, error);
+		ret = g_markup_parse_context_end_parse(context, error);
 
-	munmap(db, st.st_size);
-	close(fd);
 	g_markup_parse_context_free(context);
 
 	return ret;
 }
 
+static gboolean ubuntu_apndb_parse(struct apndb_data *apndb,
+					const char *apndb_path,
+					GError **error)
+{
+	char *key = g_strdup_printf("%s,%s", apndb->match_mcc,
+						apndb->match_mnc);
+	gboolean ret;
+
+	ret = apndb_index_parse(apndb_path, &apn_index, key, parse_fragment,
+					apndb, error);
+	g_free(key);
+
+	/* APNs are prepended while parsing, restore the database order */
+	apndb->apns = g_slist_reverse(apndb->apns);
+
+	return ret;
+}
+
 GSList *ubuntu_apndb_lookup_apn(const char *mcc, const char *mnc,
 			const char *spn, const char *imsi, const char *gid1,
 			GError **error)
@@ -552,9 +536,7 @@ GSList *ubuntu_apndb_lookup_apn(const char *mcc, const char *mnc,
 	if (apndb_path == NULL)
 		apndb_path = CUSTOM_APNDB_PATH;
 
-	if (ubuntu_apndb_parse(&toplevel_apndb_parser, &custom_apndb,
-				apndb_path,
-				error) == FALSE) {
+	if (ubuntu_apndb_parse(&custom_apndb, apndb_path, error) == FALSE) {
 		g_slist_free_full(custom_apndb.apns, ubuntu_apndb_ap_free);
 		custom_apndb.apns = NULL;
 
@@ -583,9 +565,7 @@ GSList *ubuntu_apndb_lookup_apn(const char *mcc, const char *mnc,
 	if (apndb_path == NULL)
 		apndb_path = SYSTEM_APNDB_PATH;
 
-	if (ubuntu_apndb_parse(&toplevel_apndb_parser, &apndb,
-				apndb_path,
-				error) == FALSE) {
+	if (ubuntu_apndb_parse(&apndb, apndb_path, error) == FALSE) {
 		g_slist_free_full(apndb.apns, ubuntu_apndb_ap_free);
 		apndb.apns = NULL;
 	}
@@ -68,6 +68,7 @@ struct ofono_cbs {
 	GSList *efcbmir_contents;
 	unsigned short efcbmid_length;
 	GSList *efcbmid_contents;
+	struct cbs_topic_set *efcbmid_set;
 	gboolean efcbmid_update;
 	guint reset_source;
 	int lac;
@@ -191,7 +192,7 @@ void ofono_cbs_notify(struct ofono_cbs *cbs, const unsigned char *pdu,
 		return;
 	}
 
-	if (cbs_topic_in_range(c.message_identifier, cbs->efcbmid_contents)) {
+	if (cbs_topic_in_range(c.message_identifier, cbs->efcbmid_set)) {
 		if (cbs->sim == NULL)
 			return;
 
@@ -606,6 +607,8 @@ static void cbs_unregister(struct ofono_atom *atom)
 		g_slist_foreach(cbs->efcbmid_contents, (GFunc) g_free, NULL);
 		g_slist_free(cbs->efcbmid_contents);
 		cbs->efcbmid_contents = NULL;
+		cbs_topic_set_free(cbs->efcbmid_set);
+		cbs->efcbmid_set = NULL;
 	}
 
 	if (cbs->sim_context) {
@@ -882,6 +885,7 @@ static void sim_cbmid_read_cb(int ok, int length, int record,
 		goto done;
 
 	cbs->efcbmid_contents = g_slist_reverse(contents);
+	cbs->efcbmid_set = cbs_topic_set_new(cbs->efcbmid_contents);
 
 	str = cbs_topic_ranges_to_string(cbs->efcbmid_contents);
 	DBG("Got cbmid: %s", str);
@@ -910,6 +914,8 @@ static void cbs_efcbmid_changed(int id, void *userdata)
 		g_slist_foreach(cbs->efcbmid_contents, (GFunc) g_free, NULL);
 		g_slist_free(cbs->efcbmid_contents);
 		cbs->efcbmid_contents = NULL;
+		cbs_topic_set_free(cbs->efcbmid_set);
+		cbs->efcbmid_set = NULL;
 	}
 
 	cbs->efcbmid_update = TRUE;
@@ -33,6 +33,7 @@
 #include <gdbus.h>
 
 #include "ofono.h"
+#include "storage.h"
 
 #define SHUTDOWN_GRACE_SECONDS 10
 
@@ -169,7 +170,8 @@ int main(int argc, char **argv)
 	DBusError error;
 	guint signal;
 
-#ifdef NEED_THREADS
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	/* The storage writer thread needs this on older GLib */
 	if (g_thread_supported() == FALSE)
 		g_thread_init(NULL);
 #endif
@@ -256,6 +258,8 @@ int main(int argc, char **argv)
 
 	__ofono_modemwatch_cleanup();
 
+	storage_cleanup();
+
 	__ofono_dbus_cleanup();
 	dbus_connection_unref(conn);
 
@@ -29,6 +29,13 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 #include <glib.h>
 #include <gdbus.h>
@@ -36,12 +43,20 @@
 #include "ofono.h"
 
 #include "common.h"
+#include "storage.h"
+
+#ifndef DBUS_TYPE_UNIX_FD
+#define DBUS_TYPE_UNIX_FD -1
+#endif
 
 #define LEN_MAX 128
 #define TYPE_INTERNATIONAL 145
 
 #define PHONEBOOK_FLAG_CACHED 0x1
 
+#define PHONEBOOK_CHUNK_SIZE 4096
+#define PHONEBOOK_SPOOL_DIR STORAGEDIR "/phonebook"
+
 static GSList *g_drivers = NULL;
 
 enum phonebook_number_type {
@@ -56,8 +71,12 @@ struct ofono_phonebook {
 	DBusMessage *pending;
 	int storage_index; /* go through all supported storage */
 	int flags;
-	GString *vcards; /* entries with vcard 3.0 format */
+	GString *vcards; /* entries with vcard 3.0 format not yet spooled */
+	int spool_fd; /* anonymous file with all the entries, if any */
+	gsize spool_len;
+	gboolean spool_error;
 	GSList *merge_list; /* cache the entries that may need a merge */
+	GHashTable *merge_table; /* merge_list entries by their text */
 	const struct ofono_phonebook_driver *driver;
 	void *driver_data;
 	struct ofono_atom *atom;
@@ -270,18 +289,180 @@ static void destroy_merged_entry(struct phonebook_person *person)
 	g_free(person);
 }
 
+/*
+ * The vCards are written in chunks to an anonymous spool file as they are
+ * generated.  The spool is an O_TMPFILE in a private directory under the
+ * state directory, so that ImportFd never holds the whole phonebook in
+ * memory and contact data never ends up on a shared filesystem such as
+ * $TMPDIR.  Where that can't be created the spool is a memfd, which is
+ * backed by memory, and without either the vCards simply stay in the
+ * GString.  Import reads the spool back into a single buffer for its reply.
+ */
+static void spool_close(struct ofono_phonebook *pb)
+{
+	if (pb->spool_fd < 0)
+		return;
+
+	close(pb->spool_fd);
+	pb->spool_fd = -1;
+}
+
+static int spool_create(void)
+{
+	int fd = -1;
+
+#ifdef O_TMPFILE
+	if (create_dirs(PHONEBOOK_SPOOL_DIR "/", S_IRWXU) == 0)
+		fd = open(PHONEBOOK_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC,
+						S_IRUSR | S_IWUSR);
+
+	if (fd >= 0)
+		return fd;
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("ofono-phonebook", MFD_CLOEXEC);
+#endif
+
+	return fd;
+}
+
+static void spool_open(struct ofono_phonebook *pb)
+{
+	spool_close(pb);
+
+	pb->spool_fd = spool_create();
+	if (pb->spool_fd < 0)
+		ofono_warn("Creating phonebook spool failed: %s",
+					strerror(errno));
+
+	pb->spool_len = 0;
+	pb->spool_error = FALSE;
+	g_string_truncate(pb->vcards, 0);
+}
+
+static void spool_flush(struct ofono_phonebook *pb, gboolean force)
+{
+	const char *data = pb->vcards->str;
+	gsize len = pb->vcards->len;
+	ssize_t written;
+
+	if (pb->spool_fd < 0)
+		return;
+
+	if (len == 0 || (force == FALSE && len < PHONEBOOK_CHUNK_SIZE))
+		return;
+
+	while (len > 0 && pb->spool_error == FALSE) {
+		written = write(pb->spool_fd, data, len);
+
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ofono_error("Writing phonebook entries failed: %s",
+					strerror(errno));
+			pb->spool_error = TRUE;
+			break;
+		}
+
+		data += written;
+		len -= written;
+		pb->spool_len += written;
+	}
+
+	g_string_truncate(pb->vcards, 0);
+}
+
+static char *spool_read(struct ofono_phonebook *pb)
+{
+	char *vcards;
+	gsize offset = 0;
+	ssize_t r;
+
+	vcards = g_try_malloc(pb->spool_len + 1);
+	if (vcards == NULL)
+		return NULL;
+
+	while (offset < pb->spool_len) {
+		r = pread(pb->spool_fd, vcards + offset,
+				pb->spool_len - offset, offset);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0) {
+			g_free(vcards);
+			return NULL;
+		}
+
+		offset += r;
+	}
+
+	vcards[offset] = '\0';
+
+	return vcards;
+}
+
+static DBusMessage *generate_export_fd_reply(struct ofono_phonebook *pb,
+							DBusMessage *msg)
+{
+	DBusMessage *reply;
+	char path[32];
+	int fd;
+
+	if (pb->spool_fd < 0)
+		return __ofono_error_failed(msg);
+
+	/* A descriptor of its own, so each reader has its own offset */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", pb->spool_fd);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return __ofono_error_failed(msg);
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply != NULL)
+		dbus_message_append_args(reply, DBUS_TYPE_UNIX_FD, &fd,
+							DBUS_TYPE_INVALID);
+
+	close(fd);
+
+	return reply;
+}
+
 static DBusMessage *generate_export_entries_reply(struct ofono_phonebook *pb,
 							DBusMessage *msg)
 {
 	DBusMessage *reply;
 	DBusMessageIter iter;
+	const char *entries;
+	char *vcards = NULL;
+
+	if (dbus_message_has_member(msg, "ImportFd"))
+		return generate_export_fd_reply(pb, msg);
+
+	/* Without a spool all the entries are still in the GString */
+	if (pb->spool_fd < 0)
+		entries = pb->vcards->str;
+	else {
+		vcards = spool_read(pb);
+		if (vcards == NULL)
+			return __ofono_error_failed(msg);
+
+		entries = vcards;
+	}
 
 	reply = dbus_message_new_method_return(msg);
-	if (reply == NULL)
+	if (reply == NULL) {
+		g_free(vcards);
 		return NULL;
+	}
 
 	dbus_message_iter_init_append(reply, &iter);
-	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, pb->vcards);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &entries);
+
+	g_free(vcards);
 
 	return reply;
 }
@@ -363,22 +544,21 @@ void ofono_phonebook_entry(struct ofono_phonebook *phonebook, int index,
 	 * are deemed as entries of one person.
 	 */
 	if (need_merge(text)) {
-		GSList *l;
 		size_t len_text = strlen(text) - 2;
 		struct phonebook_person *person;
+		char *base = g_strndup(text, len_text);
 
-		for (l = phonebook->merge_list; l; l = l->next) {
-			person = l->data;
-			if (!strncmp(text, person->text, len_text) &&
-					(strlen(person->text) == len_text))
-				break;
-		}
+		person = g_hash_table_lookup(phonebook->merge_table, base);
 
-		if (l == NULL) {
+		if (person == NULL) {
 			person = g_new0(struct phonebook_person, 1);
 			phonebook->merge_list =
 				g_slist_prepend(phonebook->merge_list, person);
-			person->text = g_strndup(text, len_text);
+			person->text = base;
+			g_hash_table_insert(phonebook->merge_table,
+						person->text, person);
+		} else {
+			g_free(base);
 		}
 
 		merge_field_number(&(person->number_list), number, type,
@@ -407,11 +587,14 @@ void ofono_phonebook_entry(struct ofono_phonebook *phonebook, int index,
 	vcard_printf_email(phonebook->vcards, email);
 	vcard_printf_sip_uri(phonebook->vcards, sip_uri);
 	vcard_printf_end(phonebook->vcards);
+
+	spool_flush(phonebook, FALSE);
 }
 
 static void export_phonebook_cb(const struct ofono_error *error, void *data)
 {
 	struct ofono_phonebook *phonebook = data;
+	GSList *l;
 
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR)
 		ofono_error("export_entries_one_storage_cb with %s failed",
@@ -419,8 +602,13 @@ static void export_phonebook_cb(const struct ofono_error *error, void *data)
 
 	/* convert the collected entries that are already merged to vcard */
 	phonebook->merge_list = g_slist_reverse(phonebook->merge_list);
-	g_slist_foreach(phonebook->merge_list, (GFunc) print_merged_entry,
-				phonebook->vcards);
+
+	for (l = phonebook->merge_list; l; l = l->next) {
+		print_merged_entry(l->data, phonebook->vcards);
+		spool_flush(phonebook, FALSE);
+	}
+
+	g_hash_table_remove_all(phonebook->merge_table);
 	g_slist_foreach(phonebook->merge_list, (GFunc) destroy_merged_entry,
 				NULL);
 	g_slist_free(phonebook->merge_list);
@@ -442,6 +630,15 @@ static void export_phonebook(struct ofono_phonebook *phonebook)
 		return;
 	}
 
+	spool_flush(phonebook, TRUE);
+
+	if (phonebook->spool_error) {
+		spool_close(phonebook);
+		reply = __ofono_error_failed(phonebook->pending);
+		__ofono_dbus_pending_reply(&phonebook->pending, reply);
+		return;
+	}
+
 	reply = generate_export_entries_reply(phonebook, phonebook->pending);
 	if (reply == NULL) {
 		dbus_message_unref(phonebook->pending);
@@ -470,7 +667,8 @@ static DBusMessage *import_entries(DBusConnection *conn, DBusMessage *msg,
 		return NULL;
 	}
 
-	g_string_set_size(phonebook->vcards, 0);
+	spool_open(phonebook);
+
 	phonebook->storage_index = 0;
 
 	phonebook->pending = dbus_message_ref(msg);
@@ -479,10 +677,23 @@ static DBusMessage *import_entries(DBusConnection *conn, DBusMessage *msg,
 	return NULL;
 }
 
+static DBusMessage *import_entries_fd(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	/* Only D-Bus >= 1.3 supports fd-passing */
+	if (DBUS_TYPE_UNIX_FD == -1)
+		return __ofono_error_not_implemented(msg);
+
+	return import_entries(conn, msg, data);
+}
+
 static const GDBusMethodTable phonebook_methods[] = {
 	{ GDBUS_ASYNC_METHOD("Import",
 			NULL, GDBUS_ARGS({ "entries", "s" }),
 			import_entries) },
+	{ GDBUS_ASYNC_METHOD("ImportFd",
+			NULL, GDBUS_ARGS({ "fd", "h" }),
+			import_entries_fd) },
 	{ }
 };
 
@@ -532,6 +743,8 @@ static void phonebook_remove(struct ofono_atom *atom)
 	if (pb->driver && pb->driver->remove)
 		pb->driver->remove(pb);
 
+	spool_close(pb);
+	g_hash_table_destroy(pb->merge_table);
 	g_string_free(pb->vcards, TRUE);
 	g_free(pb);
 }
@@ -552,6 +765,8 @@ struct ofono_phonebook *ofono_phonebook_create(struct ofono_modem *modem,
 		return NULL;
 
 	pb->vcards = g_string_new(NULL);
+	pb->spool_fd = -1;
+	pb->merge_table = g_hash_table_new(g_str_hash, g_str_equal);
 	pb->atom = __ofono_modem_add_atom(modem, OFONO_ATOM_TYPE_PHONEBOOK,
 						phonebook_remove, pb);
 
@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/mman.h>
 
 #include "ofono.h"
 
@@ -45,14 +46,20 @@
 #define SIM_CACHE_BASEPATH STORAGEDIR "/%s-%i"
 #define SIM_CACHE_VERSION SIM_CACHE_BASEPATH "/version"
 #define SIM_CACHE_PATH SIM_CACHE_BASEPATH "/%04x"
+#define SIM_CACHE_FILE SIM_CACHE_BASEPATH "/efcache"
+#define SIM_CACHE_MAGIC 0x43454653	/* "SFEC" */
+#define SIM_CACHE_MAX_FILES 128
+#define SIM_CACHE_CHUNK 16384
+#define SIM_CACHE_SYNC_TIMEOUT 5
 #define SIM_CACHE_HEADER_SIZE 39
 #define SIM_FILE_INFO_SIZE 7
 #define SIM_IMAGE_CACHE_BASEPATH STORAGEDIR "/%s-%i/images"
 #define SIM_IMAGE_CACHE_PATH SIM_IMAGE_CACHE_BASEPATH "/%d.xpm"
 
-#define SIM_FS_VERSION 2
+#define SIM_FS_VERSION 3
 
 static gboolean sim_fs_op_next(gpointer user_data);
+static void sim_fs_cache_close(struct sim_fs *fs);
 static gboolean sim_fs_op_read_record(gpointer user);
 static gboolean sim_fs_op_read_block(gpointer user_data);
 
@@ -66,6 +73,8 @@ struct sim_fs_op {
 	int length;
 	int record_length;
 	int current;
+	int next;
+	int pending;
 	unsigned char path[6];
 	unsigned char path_len;
 	gconstpointer cb;
@@ -80,16 +89,57 @@ static void sim_fs_op_free(struct sim_fs_op *node)
 	g_free(node);
 }
 
+/*
+ * All cached EFs of a SIM live in one file, mapped for the lifetime of the
+ * sim_fs.  Each EF gets an area laid out like the old per-EF cache files:
+ * the file info, the bitmap of blocks or records present and the data.
+ */
+struct sim_cache_entry {
+	guint16 id;
+	guint16 in_use;
+	guint32 offset;
+	guint32 size;
+};
+
+struct sim_cache_header {
+	guint32 magic;
+	guint32 size;
+	guint32 wasted;
+	guint32 reserved;
+	struct sim_cache_entry files[SIM_CACHE_MAX_FILES];
+};
+
 struct sim_fs {
 	GQueue *op_q;
 	gint op_source;
-	unsigned char bitmap[32];
-	int fd;
+	int ef;
+	int cache_fd;
+	unsigned char *cache;
+	gsize cache_len;
+	char *cache_imsi;
+	enum ofono_sim_phase cache_phase;
+	guint sync_source;
 	struct ofono_sim *sim;
 	const struct ofono_sim_driver *driver;
+	int max_pending;
 	GSList *contexts;
 };
 
+/*
+ * Each record or block read handed to the driver carries its own index,
+ * since with several of them outstanding they may complete in any order
+ */
+struct sim_fs_read_req {
+	struct sim_fs *fs;
+	int index;
+};
+
+enum sim_fs_slot {
+	SIM_FS_SLOT_PENDING = 0,
+	SIM_FS_SLOT_DONE,
+	SIM_FS_SLOT_FAILED,
+};
+
 void sim_fs_free(struct sim_fs *fs)
 {
 	if (fs == NULL)
@@ -113,6 +163,8 @@ void sim_fs_free(struct sim_fs *fs)
 	while (fs->contexts)
 		sim_fs_context_free(fs->contexts->data);
 
+	sim_fs_cache_close(fs);
+
 	g_free(fs);
 }
 
@@ -137,7 +189,13 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 
 	fs->sim = sim;
 	fs->driver = driver;
-	fs->fd = -1;
+	fs->ef = -1;
+	fs->cache_fd = -1;
+
+	if (driver != NULL && driver->max_pending_reads > 1)
+		fs->max_pending = driver->max_pending_reads;
+	else
+		fs->max_pending = 1;
 
 	return fs;
 }
@@ -241,15 +299,15 @@ static void sim_fs_end_current(struct sim_fs *fs)
 {
 	struct sim_fs_op *op = g_queue_pop_head(fs->op_q);
 
+	if (fs->op_source) {
+		g_source_remove(fs->op_source);
+		fs->op_source = 0;
+	}
+
 	if (g_queue_get_length(fs->op_q) > 0)
 		fs->op_source = g_idle_add(sim_fs_op_next, fs);
 
-	if (fs->fd != -1) {
-		TFR(close(fs->fd));
-		fs->fd = -1;
-	}
-
-	memset(fs->bitmap, 0, sizeof(fs->bitmap));
+	fs->ef = -1;
 
 	sim_fs_op_free(op);
 }
@@ -258,60 +316,335 @@ static void sim_fs_op_error(struct sim_fs *fs)
 {
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
-		return;
-	}
-
-	if (op->info_only == TRUE)
+	if (op->info_only == TRUE && op->cb != NULL)
 		((ofono_sim_read_info_cb_t) op->cb)
 			(0, 0, 0, 0, op->userdata);
-	else if (op->is_read == TRUE)
+	else if (op->is_read == TRUE && op->cb != NULL)
 		((ofono_sim_file_read_cb_t) op->cb)
 			(0, 0, 0, 0, 0, op->userdata);
-	else
+	else if (op->cb != NULL)
 		((ofono_sim_file_write_cb_t) op->cb)
 			(0, op->userdata);
 
-	sim_fs_end_current(fs);
+	op->cb = NULL;
+
+	/* Reads still with the driver refer to op, it goes once they're back */
+	if (op->pending == 0)
+		sim_fs_end_current(fs);
 }
 
-static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
-				const unsigned char *data, int num_bytes)
+static struct sim_fs_read_req *sim_fs_read_req_new(struct sim_fs *fs,
+							int index)
+{
+	struct sim_fs_read_req *req = g_new0(struct sim_fs_read_req, 1);
+
+	req->fs = fs;
+	req->index = index;
+
+	return req;
+}
+
+static struct sim_cache_header *sim_fs_cache_header(struct sim_fs *fs)
+{
+	return (struct sim_cache_header *) fs->cache;
+}
+
+static gboolean sim_fs_cache_sync(gpointer user_data)
+{
+	struct sim_fs *fs = user_data;
+
+	fs->sync_source = 0;
+	msync(fs->cache, fs->cache_len, MS_ASYNC);
+
+	return FALSE;
+}
+
+static void sim_fs_cache_dirty(struct sim_fs *fs)
+{
+	if (fs->sync_source > 0)
+		return;
+
+	fs->sync_source = g_timeout_add_seconds(SIM_CACHE_SYNC_TIMEOUT,
+						sim_fs_cache_sync, fs);
+}
+
+static void sim_fs_cache_close(struct sim_fs *fs)
+{
+	if (fs->cache == NULL)
+		return;
+
+	if (fs->sync_source > 0) {
+		g_source_remove(fs->sync_source);
+		sim_fs_cache_sync(fs);
+	}
+
+	munmap(fs->cache, fs->cache_len);
+	TFR(close(fs->cache_fd));
+
+	fs->cache = NULL;
+	fs->cache_len = 0;
+	fs->cache_fd = -1;
+	fs->ef = -1;
+
+	g_free(fs->cache_imsi);
+	fs->cache_imsi = NULL;
+}
+
+static gboolean sim_fs_cache_resize(struct sim_fs *fs, gsize size)
 {
-	int offset;
-	int bit;
-	ssize_t r;
-	unsigned char b;
+	void *map;
+
+	size = (size + SIM_CACHE_CHUNK - 1) / SIM_CACHE_CHUNK * SIM_CACHE_CHUNK;
 
-	if (fs->fd == -1)
+	if (size == fs->cache_len)
+		return TRUE;
+
+	if (size > fs->cache_len && TFR(ftruncate(fs->cache_fd, size)) < 0)
 		return FALSE;
 
-	if (lseek(fs->fd, block * block_len +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
+	map = mremap(fs->cache, fs->cache_len, size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED)
 		return FALSE;
 
-	r = TFR(write(fs->fd, data, num_bytes));
+	if (size < fs->cache_len)
+		TFR(ftruncate(fs->cache_fd, size));
+
+	fs->cache = map;
+	fs->cache_len = size;
+
+	return TRUE;
+}
+
+static gboolean sim_fs_cache_valid(struct sim_fs *fs)
+{
+	struct sim_cache_header *hdr = sim_fs_cache_header(fs);
+	int i;
 
-	if (r != num_bytes)
+	if (hdr->magic != SIM_CACHE_MAGIC || hdr->size < sizeof(*hdr) ||
+			hdr->size > fs->cache_len || hdr->wasted > hdr->size)
 		return FALSE;
 
-	/* update present bit for this block */
-	offset = block / 8;
-	bit = block % 8;
+	for (i = 0; i < SIM_CACHE_MAX_FILES; i++) {
+		struct sim_cache_entry *entry = &hdr->files[i];
+
+		if (entry->in_use == 0)
+			continue;
+
+		if (entry->offset < sizeof(*hdr) ||
+				entry->size < SIM_CACHE_HEADER_SIZE ||
+				entry->offset > hdr->size ||
+				entry->size > hdr->size - entry->offset)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Slide the areas still in use down over the ones given up */
+static void sim_fs_cache_compact(struct sim_fs *fs)
+{
+	struct sim_cache_header *hdr = sim_fs_cache_header(fs);
+	struct sim_cache_entry *sorted[SIM_CACHE_MAX_FILES];
+	guint32 pos = sizeof(*hdr);
+	int n = 0;
+	int i, j;
+
+	for (i = 0; i < SIM_CACHE_MAX_FILES; i++) {
+		struct sim_cache_entry *entry = &hdr->files[i];
+
+		if (entry->in_use == 0)
+			continue;
+
+		for (j = n; j > 0 && sorted[j - 1]->offset > entry->offset; j--)
+			sorted[j] = sorted[j - 1];
+
+		sorted[j] = entry;
+		n += 1;
+	}
 
-	/* lseek to correct byte (skip file info) */
-	lseek(fs->fd, offset + SIM_FILE_INFO_SIZE, SEEK_SET);
+	for (i = 0; i < n; i++) {
+		if (sorted[i]->offset != pos)
+			memmove(fs->cache + pos, fs->cache + sorted[i]->offset,
+					sorted[i]->size);
 
-	b = fs->bitmap[offset];
-	b |= 1 << bit;
+		sorted[i]->offset = pos;
+		pos += sorted[i]->size;
+	}
+
+	hdr->size = pos;
+	hdr->wasted = 0;
 
-	r = TFR(write(fs->fd, &b, sizeof(b)));
+	sim_fs_cache_resize(fs, pos);
+	sim_fs_cache_dirty(fs);
+}
 
-	if (r != sizeof(b))
+static gboolean sim_fs_cache_open(struct sim_fs *fs)
+{
+	const char *imsi = ofono_sim_get_imsi(fs->sim);
+	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+	struct sim_cache_header *hdr;
+	struct stat st;
+	char *path;
+	void *map;
+	int fd;
+
+	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+		return FALSE;
+
+	if (fs->cache != NULL) {
+		if (fs->cache_phase == phase &&
+				g_str_equal(fs->cache_imsi, imsi) == TRUE)
+			return TRUE;
+
+		sim_fs_cache_close(fs);
+	}
+
+	path = g_strdup_printf(SIM_CACHE_FILE, imsi, phase);
+	fd = TFR(open(path, O_RDWR | O_CREAT, SIM_CACHE_MODE));
+	g_free(path);
+
+	if (fd == -1)
+		return FALSE;
+
+	if (fstat(fd, &st) < 0 || (st.st_size < SIM_CACHE_CHUNK &&
+			TFR(ftruncate(fd, SIM_CACHE_CHUNK)) < 0)) {
+		TFR(close(fd));
+		return FALSE;
+	}
+
+	if (st.st_size < SIM_CACHE_CHUNK)
+		st.st_size = SIM_CACHE_CHUNK;
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (map == MAP_FAILED) {
+		TFR(close(fd));
 		return FALSE;
+	}
+
+	fs->cache_fd = fd;
+	fs->cache = map;
+	fs->cache_len = st.st_size;
+	fs->cache_imsi = g_strdup(imsi);
+	fs->cache_phase = phase;
 
-	fs->bitmap[offset] = b;
+	hdr = sim_fs_cache_header(fs);
+
+	if (sim_fs_cache_valid(fs) == FALSE) {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = SIM_CACHE_MAGIC;
+		hdr->size = sizeof(*hdr);
+		sim_fs_cache_dirty(fs);
+	} else if (hdr->wasted > hdr->size / 2)
+		sim_fs_cache_compact(fs);
+
+	return TRUE;
+}
+
+static int sim_fs_cache_lookup(struct sim_fs *fs, int id)
+{
+	struct sim_cache_header *hdr = sim_fs_cache_header(fs);
+	int i;
+
+	for (i = 0; i < SIM_CACHE_MAX_FILES; i++)
+		if (hdr->files[i].in_use && hdr->files[i].id == id)
+			return i;
+
+	return -1;
+}
+
+static void sim_fs_cache_remove(struct sim_fs *fs, int ef)
+{
+	struct sim_cache_header *hdr = sim_fs_cache_header(fs);
+
+	if (fs->ef == ef)
+		fs->ef = -1;
+
+	hdr->files[ef].in_use = 0;
+	hdr->wasted += hdr->files[ef].size;
+	sim_fs_cache_dirty(fs);
+}
+
+static int sim_fs_cache_alloc(struct sim_fs *fs, int id, guint32 size)
+{
+	struct sim_cache_header *hdr = sim_fs_cache_header(fs);
+	int ef = sim_fs_cache_lookup(fs, id);
+	int i;
+
+	if (ef >= 0) {
+		if (hdr->files[ef].size >= size)
+			return ef;
+
+		sim_fs_cache_remove(fs, ef);
+	}
+
+	for (i = 0, ef = -1; i < SIM_CACHE_MAX_FILES; i++) {
+		if (hdr->files[i].in_use == 0) {
+			ef = i;
+			break;
+		}
+	}
+
+	if (ef < 0 || sim_fs_cache_resize(fs, hdr->size + size) == FALSE)
+		return -1;
+
+	/* The mapping may have moved */
+	hdr = sim_fs_cache_header(fs);
+
+	hdr->files[ef].id = id;
+	hdr->files[ef].in_use = 1;
+	hdr->files[ef].offset = hdr->size;
+	hdr->files[ef].size = size;
+	hdr->size += size;
+
+	return ef;
+}
+
+static unsigned char *sim_fs_cache_area(struct sim_fs *fs, guint32 *size)
+{
+	struct sim_cache_entry *entry =
+				&sim_fs_cache_header(fs)->files[fs->ef];
+
+	if (size != NULL)
+		*size = entry->size;
+
+	return fs->cache + entry->offset;
+}
+
+static gboolean sim_fs_cache_present(struct sim_fs *fs, int block)
+{
+	unsigned char *area;
+
+	if (fs->ef == -1 || block < 0 || block >= 256)
+		return FALSE;
+
+	area = sim_fs_cache_area(fs, NULL);
+
+	return (area[SIM_FILE_INFO_SIZE + block / 8] & (1 << block % 8)) != 0;
+}
+
+static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
+				const unsigned char *data, int num_bytes)
+{
+	unsigned char *area;
+	guint32 size;
+
+	if (fs->ef == -1 || block < 0 || block >= 256)
+		return FALSE;
+
+	area = sim_fs_cache_area(fs, &size);
+
+	if ((guint32) (block * block_len + num_bytes) >
+			size - SIM_CACHE_HEADER_SIZE)
+		return FALSE;
+
+	memcpy(area + SIM_CACHE_HEADER_SIZE + block * block_len,
+			data, num_bytes);
+
+	/* update present bit for this block */
+	area[SIM_FILE_INFO_SIZE + block / 8] |= 1 << block % 8;
+
+	sim_fs_cache_dirty(fs);
 
 	return TRUE;
 }
@@ -356,182 +689,276 @@ static void sim_fs_op_read_record_cb(const struct ofono_error *error,
 	sim_fs_end_current(fs);
 }
 
+static void sim_fs_block_range(struct sim_fs_op *op, int block,
+				int *bufoff, int *dataoff, int *len)
+{
+	int block_start = block * 256;
+	int end = op->offset + op->num_bytes;
+
+	if (block == op->offset / 256) {
+		*bufoff = 0;
+		*dataoff = op->offset % 256;
+	} else {
+		*bufoff = block_start - op->offset;
+		*dataoff = 0;
+	}
+
+	*len = MIN(block_start + 256, end) - (block_start + *dataoff);
+}
+
+static gboolean sim_fs_read_cached_block(struct sim_fs *fs,
+						struct sim_fs_op *op, int block)
+{
+	unsigned char *area;
+	int bufoff;
+	int dataoff;
+	int toread;
+
+	if (sim_fs_cache_present(fs, block) == FALSE)
+		return FALSE;
+
+	sim_fs_block_range(op, block, &bufoff, &dataoff, &toread);
+
+	DBG("bufoff: %d, dataoff: %d, toread: %d", bufoff, dataoff, toread);
+
+	area = sim_fs_cache_area(fs, NULL);
+	memcpy(op->buffer + bufoff,
+		area + SIM_CACHE_HEADER_SIZE + block * 256 + dataoff, toread);
+
+	return TRUE;
+}
+
+static void sim_fs_op_blocks_done(struct sim_fs *fs)
+{
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	int end_block = (op->offset + (op->num_bytes - 1)) / 256;
+	ofono_sim_file_read_cb_t cb = op->cb;
+
+	/* Keep the driver busy while there are blocks left to ask for */
+	if (cb != NULL && op->next <= end_block) {
+		if (fs->op_source == 0 && op->pending < fs->max_pending)
+			fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+
+		return;
+	}
+
+	if (op->pending > 0)
+		return;
+
+	if (cb == NULL) {
+		sim_fs_end_current(fs);
+		return;
+	}
+
+	cb(1, op->num_bytes, 0, op->buffer, op->record_length, op->userdata);
+
+	sim_fs_end_current(fs);
+}
+
 static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 					const unsigned char *data, int len,
 					void *user)
 {
-	struct sim_fs *fs = user;
+	struct sim_fs_read_req *req = user;
+	struct sim_fs *fs = req->fs;
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	int start_block;
-	int end_block;
+	int block = req->index;
 	int bufoff;
 	int dataoff;
 	int tocopy;
 
+	g_free(req);
+	op->pending -= 1;
+
 	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
 		sim_fs_op_error(fs);
 		return;
 	}
 
-	start_block = op->offset / 256;
-	end_block = (op->offset + (op->num_bytes - 1)) / 256;
-
-	if (op->current == start_block) {
-		bufoff = 0;
-		dataoff = op->offset % 256;
-		tocopy = MIN(256 - op->offset % 256,
-				op->num_bytes - op->current * 256);
-	} else {
-		bufoff = (op->current - start_block - 1) * 256 +
-				op->offset % 256;
-		dataoff = 0;
-		tocopy = MIN(256, op->num_bytes - op->current * 256);
-	}
+	sim_fs_block_range(op, block, &bufoff, &dataoff, &tocopy);
 
 	DBG("bufoff: %d, dataoff: %d, tocopy: %d",
 				bufoff, dataoff, tocopy);
 
 	memcpy(op->buffer + bufoff, data + dataoff, tocopy);
-	cache_block(fs, op->current, 256, data, len);
-
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
-		return;
-	}
+	cache_block(fs, block, 256, data, len);
 
-	op->current++;
-
-	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
-
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
-
-		sim_fs_end_current(fs);
-	} else {
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
-	}
+	sim_fs_op_blocks_done(fs);
 }
 
 static gboolean sim_fs_op_read_block(gpointer user_data)
 {
 	struct sim_fs *fs = user_data;
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	int start_block;
 	int end_block;
 	unsigned short read_bytes;
 
 	fs->op_source = 0;
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_blocks_done(fs);
 		return FALSE;
 	}
 
-	start_block = op->offset / 256;
 	end_block = (op->offset + (op->num_bytes - 1)) / 256;
 
-	if (op->current == start_block) {
+	if (op->buffer == NULL) {
 		op->buffer = g_try_new0(unsigned char, op->num_bytes);
 
 		if (op->buffer == NULL) {
 			sim_fs_op_error(fs);
 			return FALSE;
 		}
+
+		op->next = op->current;
 	}
 
-	while (fs->fd != -1 && op->current <= end_block) {
-		int offset = op->current / 8;
-		int bit = 1 << op->current % 8;
-		int bufoff;
-		int seekoff;
-		int toread;
+	/*
+	 * Hold the op while issuing, drivers may call back right away and
+	 * the op must not be finished from under us
+	 */
+	op->pending += 1;
 
-		if ((fs->bitmap[offset] & bit) == 0)
-			break;
+	while (op->cb != NULL && op->next <= end_block &&
+			op->pending <= fs->max_pending) {
+		int block = op->next;
 
-		if (op->current == start_block) {
-			bufoff = 0;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256 +
-				op->offset % 256;
-			toread = MIN(256 - op->offset % 256,
-					op->num_bytes - op->current * 256);
-		} else {
-			bufoff = (op->current - start_block - 1) * 256 +
-					op->offset % 256;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256;
-			toread = MIN(256, op->num_bytes - op->current * 256);
+		if (sim_fs_read_cached_block(fs, op, block) == TRUE) {
+			op->next += 1;
+			continue;
 		}
 
-		DBG("bufoff: %d, seekoff: %d, toread: %d",
-				bufoff, seekoff, toread);
-
-		if (lseek(fs->fd, seekoff, SEEK_SET) == (off_t) -1)
-			break;
+		if (fs->driver->read_file_transparent == NULL) {
+			op->pending -= 1;
+			sim_fs_op_error(fs);
+			return FALSE;
+		}
 
-		if (TFR(read(fs->fd, op->buffer + bufoff, toread)) != toread)
-			break;
+		op->next += 1;
+		op->pending += 1;
 
-		op->current += 1;
+		read_bytes = MIN(op->length - block * 256, 256);
+		fs->driver->read_file_transparent(fs->sim, op->id,
+						block * 256, read_bytes,
+						op->path_len ? op->path : NULL,
+						op->path_len,
+						sim_fs_op_read_block_cb,
+						sim_fs_read_req_new(fs, block));
 	}
 
-	if (op->current > end_block) {
-		ofono_sim_file_read_cb_t cb = op->cb;
+	op->pending -= 1;
+	sim_fs_op_blocks_done(fs);
 
-		cb(1, op->num_bytes, 0, op->buffer,
-				op->record_length, op->userdata);
+	return FALSE;
+}
 
-		sim_fs_end_current(fs);
+/*
+ * Records are read into a window of max_pending slots, each followed by
+ * its state, and handed out strictly in order as the head of it fills in
+ */
+static unsigned char *sim_fs_op_slot(struct sim_fs *fs, struct sim_fs_op *op,
+					int record, unsigned char **state)
+{
+	int slot = (record - 1) % fs->max_pending;
 
-		return FALSE;
-	}
+	*state = op->buffer + fs->max_pending * op->record_length + slot;
 
-	if (fs->driver->read_file_transparent == NULL) {
-		sim_fs_op_error(fs);
+	return op->buffer + slot * op->record_length;
+}
+
+static gboolean sim_fs_read_cached_record(struct sim_fs *fs,
+						struct sim_fs_op *op,
+						int record, unsigned char *buf)
+{
+	unsigned char *area;
+
+	if (sim_fs_cache_present(fs, record - 1) == FALSE)
 		return FALSE;
-	}
 
-	read_bytes = MIN(op->length - op->current * 256, 256);
-	fs->driver->read_file_transparent(fs->sim, op->id,
-						op->current * 256,
-						read_bytes,
-						op->path_len ? op->path : NULL,
-						op->path_len,
-						sim_fs_op_read_block_cb, fs);
+	area = sim_fs_cache_area(fs, NULL);
+	memcpy(buf, area + SIM_CACHE_HEADER_SIZE +
+			(record - 1) * op->record_length, op->record_length);
 
-	return FALSE;
+	return TRUE;
 }
 
-static void sim_fs_op_retrieve_cb(const struct ofono_error *error,
-					const unsigned char *data, int len,
-					void *user)
+static gboolean sim_fs_op_flush_records(struct sim_fs *fs)
+{
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	unsigned char *state;
+	unsigned char *buf;
+
+	while (op->cb != NULL && op->current < op->next) {
+		ofono_sim_file_read_cb_t cb = op->cb;
+
+		buf = sim_fs_op_slot(fs, op, op->current, &state);
+
+		if (*state == SIM_FS_SLOT_PENDING)
+			break;
+
+		if (*state == SIM_FS_SLOT_FAILED) {
+			sim_fs_op_error(fs);
+			return FALSE;
+		}
+
+		*state = SIM_FS_SLOT_PENDING;
+
+		cb(1, op->length, op->current, buf, op->record_length,
+			op->userdata);
+
+		op->current += 1;
+	}
+
+	return TRUE;
+}
+
+static void sim_fs_op_deliver_records(struct sim_fs *fs)
 {
-	struct sim_fs *fs = user;
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
 	int total = op->length / op->record_length;
-	ofono_sim_file_read_cb_t cb = op->cb;
 
-	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
-		sim_fs_op_error(fs);
+	if (sim_fs_op_flush_records(fs) == FALSE)
 		return;
-	}
 
-	cache_block(fs, op->current - 1, op->record_length,
-			data, op->record_length);
+	if (op->cb != NULL && op->next <= total) {
+		if (fs->op_source == 0 &&
+				op->next - op->current < fs->max_pending)
+			fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
 
-	if (cb == NULL) {
-		sim_fs_end_current(fs);
 		return;
 	}
 
-	cb(1, op->length, op->current, data, op->record_length, op->userdata);
+	if (op->pending == 0)
+		sim_fs_end_current(fs);
+}
 
-	if (op->current < total) {
-		op->current += 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+static void sim_fs_op_retrieve_cb(const struct ofono_error *error,
+					const unsigned char *data, int len,
+					void *user)
+{
+	struct sim_fs_read_req *req = user;
+	struct sim_fs *fs = req->fs;
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	int record = req->index;
+	unsigned char *state;
+	unsigned char *buf;
+
+	g_free(req);
+	op->pending -= 1;
+
+	buf = sim_fs_op_slot(fs, op, record, &state);
+
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
+		*state = SIM_FS_SLOT_FAILED;
 	} else {
-		sim_fs_end_current(fs);
+		cache_block(fs, record - 1, op->record_length,
+				data, op->record_length);
+
+		memcpy(buf, data, op->record_length);
+		*state = SIM_FS_SLOT_DONE;
 	}
+
+	sim_fs_op_deliver_records(fs);
 }
 
 static gboolean sim_fs_op_read_record(gpointer user)
@@ -540,72 +967,88 @@ static gboolean sim_fs_op_read_record(gpointer user)
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
 	const struct ofono_sim_driver *driver = fs->driver;
 	int total = op->length / op->record_length;
-	unsigned char buf[256];
+	unsigned char *state;
+	unsigned char *buf;
 
 	fs->op_source = 0;
 
 	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+		sim_fs_op_deliver_records(fs);
 		return FALSE;
 	}
 
-	while (fs->fd != -1 && op->current <= total) {
-		int offset = (op->current - 1) / 8;
-		int bit = 1 << ((op->current - 1) % 8);
-		ofono_sim_file_read_cb_t cb = op->cb;
+	if (op->buffer == NULL) {
+		op->buffer = g_try_malloc0(fs->max_pending *
+						(op->record_length + 1));
 
-		if ((fs->bitmap[offset] & bit) == 0)
-			break;
+		if (op->buffer == NULL) {
+			sim_fs_op_error(fs);
+			return FALSE;
+		}
 
-		if (lseek(fs->fd, (op->current - 1) * op->record_length +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-			break;
+		op->next = op->current;
+	}
 
-		if (TFR(read(fs->fd, buf, op->record_length)) !=
-				op->record_length)
-			break;
+	/* See sim_fs_op_read_block */
+	op->pending += 1;
 
-		cb(1, op->length, op->current,
-				buf, op->record_length, op->userdata);
+	while (op->cb != NULL && op->next <= total &&
+			op->next - op->current < fs->max_pending) {
+		int record = op->next;
 
-		op->current += 1;
-	}
+		buf = sim_fs_op_slot(fs, op, record, &state);
+		op->next += 1;
 
-	if (op->current > total) {
-		sim_fs_end_current(fs);
+		if (sim_fs_read_cached_record(fs, op, record, buf) == TRUE) {
+			*state = SIM_FS_SLOT_DONE;
 
-		return FALSE;
-	}
+			/* Hand out cached runs right away to keep the window free */
+			if (record == op->current &&
+					sim_fs_op_flush_records(fs) == FALSE)
+				break;
 
-	switch (op->structure) {
-	case OFONO_SIM_FILE_STRUCTURE_FIXED:
-		if (driver->read_file_linear == NULL) {
-			sim_fs_op_error(fs);
-			return FALSE;
+			continue;
 		}
 
-		driver->read_file_linear(fs->sim, op->id, op->current,
+		*state = SIM_FS_SLOT_PENDING;
+
+		switch (op->structure) {
+		case OFONO_SIM_FILE_STRUCTURE_FIXED:
+			if (driver->read_file_linear == NULL)
+				break;
+
+			op->pending += 1;
+			driver->read_file_linear(fs->sim, op->id, record,
 						op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_retrieve_cb, fs);
-		break;
-	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
-		if (driver->read_file_cyclic == NULL) {
-			sim_fs_op_error(fs);
-			return FALSE;
-		}
+						sim_fs_op_retrieve_cb,
+						sim_fs_read_req_new(fs, record));
+			continue;
+		case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
+			if (driver->read_file_cyclic == NULL)
+				break;
 
-		driver->read_file_cyclic(fs->sim, op->id, op->current,
+			op->pending += 1;
+			driver->read_file_cyclic(fs->sim, op->id, record,
 						op->record_length,
 						op->path_len ? op->path : NULL,
 						op->path_len,
-						sim_fs_op_retrieve_cb, fs);
+						sim_fs_op_retrieve_cb,
+						sim_fs_read_req_new(fs, record));
+			continue;
+		default:
+			ofono_error("Unrecognized file structure, "
+					"this can't happen");
+		}
+
+		*state = SIM_FS_SLOT_FAILED;
 		break;
-	default:
-		ofono_error("Unrecognized file structure, this can't happen");
 	}
 
+	op->pending -= 1;
+	sim_fs_op_deliver_records(fs);
+
 	return FALSE;
 }
 
@@ -625,7 +1068,6 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	enum sim_file_access rehabilitate;
 	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
 	gboolean cache;
-	char *path;
 
 	/* TS 11.11, Section 9.3 */
 	update = file_access_condition_decode(access[0] & 0xf);
@@ -653,19 +1095,16 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	fileinfo[5] = record_length & 0xff;
 	fileinfo[6] = file_status;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-	fs->fd = TFR(open(path, O_WRONLY | O_CREAT | O_TRUNC, SIM_CACHE_MODE));
-	g_free(path);
-
-	if (fs->fd == -1)
+	if (sim_fs_cache_open(fs) == FALSE)
 		return;
 
-	if (TFR(write(fs->fd, fileinfo, SIM_CACHE_HEADER_SIZE)) ==
-			SIM_CACHE_HEADER_SIZE)
+	fs->ef = sim_fs_cache_alloc(fs, op->id,
+					SIM_CACHE_HEADER_SIZE + length);
+	if (fs->ef == -1)
 		return;
 
-	TFR(close(fs->fd));
-	fs->fd = -1;
+	memcpy(sim_fs_cache_area(fs, NULL), fileinfo, SIM_CACHE_HEADER_SIZE);
+	sim_fs_cache_dirty(fs);
 }
 
 static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
@@ -734,43 +1173,25 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 
 static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	char *path;
-	int fd;
-	ssize_t len;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	const unsigned char *fileinfo;
+	guint32 size;
+	int ef;
 	int error_type;
 	int file_length;
 	enum ofono_sim_file_structure structure;
 	int record_length;
 	unsigned char file_status;
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+	if (sim_fs_cache_open(fs) == FALSE)
 		return FALSE;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-
-	if (path == NULL)
+	ef = sim_fs_cache_lookup(fs, op->id);
+	if (ef == -1)
 		return FALSE;
 
-	fd = TFR(open(path, O_RDWR));
-	g_free(path);
-
-	if (fd == -1) {
-		if (errno != ENOENT)
-			DBG("Error %i opening cache file for "
-					"fileid %04x, IMSI %s",
-					errno, op->id, imsi);
-
-		return FALSE;
-	}
-
-	len = TFR(read(fd, fileinfo, SIM_CACHE_HEADER_SIZE));
-
-	if (len != SIM_CACHE_HEADER_SIZE)
-		goto error;
+	fs->ef = ef;
+	fileinfo = sim_fs_cache_area(fs, &size);
 
 	error_type = fileinfo[0];
 	file_length = (fileinfo[1] << 8) | fileinfo[2];
@@ -781,14 +1202,14 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
 		record_length = file_length;
 
-	if (record_length == 0 || file_length < record_length)
-		goto error;
+	if (record_length == 0 || file_length < record_length ||
+			size < (guint32) SIM_CACHE_HEADER_SIZE + file_length) {
+		sim_fs_cache_remove(fs, ef);
+		return FALSE;
+	}
 
 	op->length = file_length;
 	op->record_length = record_length;
-	memcpy(fs->bitmap, fileinfo + SIM_FILE_INFO_SIZE,
-			SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE);
-	fs->fd = fd;
 
 	if (error_type != OFONO_ERROR_TYPE_NO_ERROR ||
 			structure != op->structure) {
@@ -819,10 +1240,6 @@ static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 	}
 
 	return TRUE;
-
-error:
-	TFR(close(fd));
-	return FALSE;
 }
 
 static gboolean sim_fs_op_next(gpointer user_data)
@@ -1228,14 +1645,24 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 {
 	const char *imsi = ofono_sim_get_imsi(fs->sim);
 	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
+	char *path;
 	struct dirent **entries;
-	int len = scandir(path, &entries, NULL, alphasort);
+	int len;
 
+	if (fs->cache != NULL && fs->cache_phase == phase &&
+			g_strcmp0(fs->cache_imsi, imsi) == 0)
+		sim_fs_cache_close(fs);
+
+	path = g_strdup_printf(SIM_CACHE_FILE, imsi, phase);
+	remove(path);
+	g_free(path);
+
+	path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
+	len = scandir(path, &entries, NULL, alphasort);
 	g_free(path);
 
 	if (len > 0) {
-		/* Remove all file ids */
+		/* Remove all file ids left over from the one file per EF cache */
 		while (len--) {
 			remove_cachefile(imsi, phase, entries[len]);
 			g_free(entries[len]);
@@ -1249,12 +1676,14 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 
 void sim_fs_cache_flush_file(struct sim_fs *fs, int id)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, id);
+	int ef;
 
-	remove(path);
-	g_free(path);
+	if (sim_fs_cache_open(fs) == FALSE)
+		return;
+
+	ef = sim_fs_cache_lookup(fs, id);
+	if (ef >= 0)
+		sim_fs_cache_remove(fs, ef);
 }
 
 void sim_fs_image_cache_flush(struct sim_fs *fs)
@@ -36,6 +36,9 @@
 struct sim_eons {
 	struct sim_eons_operator_info *pnn_list;
 	GSList *opl_list;
+	unsigned int opl_count;
+	GHashTable *opl_index;
+	guint64 opl_wildcards;
 	gboolean pnn_valid;
 	int pnn_max;
 };
@@ -51,6 +54,26 @@ struct opl_operator {
 	guint16 lac_tac_low;
 	guint16 lac_tac_high;
 	guint8 id;
+	unsigned int order;
+};
+
+/*
+ * The OPL records of one PLMN, wildcard digits included, with their LAC/TAC
+ * ranges flattened into sorted segments.  Each segment holds the first
+ * record in file order covering it, or NULL.
+ */
+struct opl_segment {
+	guint32 start;
+	const struct opl_operator *opl;
+};
+
+struct opl_group {
+	char mcc[OFONO_MAX_MCC_LENGTH + 1];
+	char mnc[OFONO_MAX_MNC_LENGTH + 1];
+	const struct opl_operator *whole;
+	GSList *ranged;
+	struct opl_segment *segments;
+	unsigned int num_segments;
 };
 
 #define MF	1
@@ -1058,6 +1081,198 @@ static struct opl_operator *opl_operator_alloc(const guint8 *record)
 	return oper;
 }
 
+static gboolean opl_covers_plmn(const struct opl_operator *opl)
+{
+	return opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe;
+}
+
+/* Bit i is set for each wildcard digit, mcc first then mnc */
+static unsigned int opl_wildcard_mask(const char *mcc, const char *mnc)
+{
+	unsigned int mask = 0;
+	int i;
+
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
+		if (mcc[i] == 'b')
+			mask |= 1 << i;
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
+		if (mnc[i] == 'b')
+			mask |= 1 << (OFONO_MAX_MCC_LENGTH + i);
+
+	return mask;
+}
+
+/* Fills in the key for the PLMN with the digits of mask as wildcards */
+static gboolean opl_wildcard_key(struct opl_group *key, const char *mcc,
+					const char *mnc, unsigned int mask)
+{
+	int i;
+
+	memset(key, 0, sizeof(*key));
+	strncpy(key->mcc, mcc, OFONO_MAX_MCC_LENGTH);
+	strncpy(key->mnc, mnc, OFONO_MAX_MNC_LENGTH);
+
+	/* A wildcard only stands for a digit that is present */
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
+
+		if (key->mcc[i] == '\0')
+			return FALSE;
+
+		key->mcc[i] = 'b';
+	}
+
+	mask >>= OFONO_MAX_MCC_LENGTH;
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
+
+		if (key->mnc[i] == '\0')
+			return FALSE;
+
+		key->mnc[i] = 'b';
+	}
+
+	return TRUE;
+}
+
+static guint opl_group_hash(gconstpointer v)
+{
+	const struct opl_group *group = v;
+	guint h = 0;
+	int i;
+
+	for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
+		h = h * 31 + group->mcc[i];
+
+	for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
+		h = h * 31 + group->mnc[i];
+
+	return h;
+}
+
+static gboolean opl_group_equal(gconstpointer v1, gconstpointer v2)
+{
+	const struct opl_group *g1 = v1;
+	const struct opl_group *g2 = v2;
+
+	if (memcmp(g1->mcc, g2->mcc, OFONO_MAX_MCC_LENGTH))
+		return FALSE;
+
+	return memcmp(g1->mnc, g2->mnc, OFONO_MAX_MNC_LENGTH) == 0;
+}
+
+static void opl_group_free(gpointer data)
+{
+	struct opl_group *group = data;
+
+	g_slist_free(group->ranged);
+	g_free(group->segments);
+	g_free(group);
+}
+
+static gint opl_operator_compare(gconstpointer a, gconstpointer b)
+{
+	const struct opl_operator *opa = a;
+	const struct opl_operator *opb = b;
+
+	return (opa->order > opb->order) - (opa->order < opb->order);
+}
+
+static int opl_boundary_compare(const void *a, const void *b)
+{
+	guint32 ba = *(const guint32 *) a;
+	guint32 bb = *(const guint32 *) b;
+
+	return (ba > bb) - (ba < bb);
+}
+
+static void opl_group_build_segments(struct opl_group *group)
+{
+	unsigned int num_ranged = g_slist_length(group->ranged);
+	guint32 *bounds;
+	unsigned int num_bounds;
+	unsigned int i, j;
+	GSList *l;
+
+	if (num_ranged == 0)
+		return;
+
+	group->ranged = g_slist_sort(group->ranged, opl_operator_compare);
+
+	bounds = g_new(guint32, num_ranged * 2);
+	num_bounds = 0;
+
+	for (l = group->ranged; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
+
+		bounds[num_bounds++] = opl->lac_tac_low;
+		bounds[num_bounds++] = opl->lac_tac_high + 1;
+	}
+
+	qsort(bounds, num_bounds, sizeof(guint32), opl_boundary_compare);
+
+	group->segments = g_new0(struct opl_segment, num_bounds);
+
+	/* Give each elementary segment the first record covering it */
+	for (i = 0; i < num_bounds; i++) {
+		const struct opl_operator *found = NULL;
+
+		if (i > 0 && bounds[i] == bounds[i - 1])
+			continue;
+
+		for (l = group->ranged; l; l = l->next) {
+			const struct opl_operator *opl = l->data;
+
+			if (bounds[i] >= opl->lac_tac_low &&
+					bounds[i] <= opl->lac_tac_high) {
+				found = opl;
+				break;
+			}
+		}
+
+		j = group->num_segments;
+
+		/* Merge with the previous segment when it is the same */
+		if (j > 0 && group->segments[j - 1].opl == found)
+			continue;
+
+		group->segments[j].start = bounds[i];
+		group->segments[j].opl = found;
+		group->num_segments += 1;
+	}
+
+	g_free(bounds);
+	g_slist_free(group->ranged);
+	group->ranged = NULL;
+}
+
+static const struct opl_operator *opl_group_lookup(
+						const struct opl_group *group,
+						guint16 lac)
+{
+	unsigned int low = 0;
+	unsigned int high = group->num_segments;
+
+	/* Find the last segment starting at or before lac */
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+
+		if (group->segments[mid].start <= lac)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		return NULL;
+
+	return group->segments[low - 1].opl;
+}
+
 void sim_eons_add_opl_record(struct sim_eons *eons,
 				const guint8 *contents, int length)
 {
@@ -1070,12 +1285,68 @@ void sim_eons_add_opl_record(struct sim_eons *eons,
 		return;
 	}
 
+	oper->order = eons->opl_count++;
 	eons->opl_list = g_slist_prepend(eons->opl_list, oper);
+
+	/* The index has to be rebuilt with the new record */
+	if (eons->opl_index) {
+		g_hash_table_destroy(eons->opl_index);
+		eons->opl_index = NULL;
+	}
 }
 
+/*
+ * Indexes the OPL records by PLMN.  Every wildcard pattern found is
+ * remembered, so that a lookup only has to try one group per pattern, and
+ * the LAC/TAC ranges of each group are turned into sorted segments.
+ */
 void sim_eons_optimize(struct sim_eons *eons)
 {
-	eons->opl_list = g_slist_reverse(eons->opl_list);
+	struct opl_group key;
+	struct opl_group *group;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *l;
+
+	if (eons->opl_index)
+		g_hash_table_destroy(eons->opl_index);
+
+	eons->opl_index = g_hash_table_new_full(opl_group_hash,
+						opl_group_equal,
+						opl_group_free, NULL);
+	eons->opl_wildcards = 0;
+
+	for (l = eons->opl_list; l; l = l->next) {
+		const struct opl_operator *opl = l->data;
+
+		eons->opl_wildcards |= (guint64) 1 <<
+					opl_wildcard_mask(opl->mcc, opl->mnc);
+
+		memset(&key, 0, sizeof(key));
+		memcpy(key.mcc, opl->mcc, sizeof(key.mcc));
+		memcpy(key.mnc, opl->mnc, sizeof(key.mnc));
+
+		group = g_hash_table_lookup(eons->opl_index, &key);
+
+		if (group == NULL) {
+			group = g_memdup(&key, sizeof(key));
+			g_hash_table_insert(eons->opl_index, group, group);
+		}
+
+		if (opl_covers_plmn(opl) == FALSE) {
+			group->ranged = g_slist_prepend(group->ranged,
+							(gpointer) opl);
+			continue;
+		}
+
+		if (group->whole == NULL || group->whole->order > opl->order)
+			group->whole = opl;
+	}
+
+	g_hash_table_iter_init(&iter, eons->opl_index);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		opl_group_build_segments(value);
 }
 
 void sim_eons_free(struct sim_eons *eons)
@@ -1090,6 +1361,9 @@ void sim_eons_free(struct sim_eons *eons)
 
 	g_free(eons->pnn_list);
 
+	if (eons->opl_index)
+		g_hash_table_destroy(eons->opl_index);
+
 	g_slist_foreach(eons->opl_list, (GFunc)g_free, NULL);
 	g_slist_free(eons->opl_list);
 
@@ -1101,45 +1375,54 @@ static const struct sim_eons_operator_info *
 				const char *mcc, const char *mnc,
 				gboolean have_lac, guint16 lac)
 {
-	GSList *l;
-	const struct opl_operator *opl;
-	int i;
+	const struct opl_operator *opl = NULL;
+	const struct opl_operator *found;
+	const struct opl_group *group;
+	struct opl_group key;
+	unsigned int mask;
 
 	if (eons == NULL)
 		return NULL;
 
-	for (l = eons->opl_list; l; l = l->next) {
-		opl = l->data;
+	if (eons->opl_index == NULL)
+		sim_eons_optimize(eons);
 
-		for (i = 0; i < OFONO_MAX_MCC_LENGTH; i++)
-			if (mcc[i] != opl->mcc[i] &&
-					!(opl->mcc[i] == 'b' && mcc[i]))
-				break;
-		if (i < OFONO_MAX_MCC_LENGTH)
+	/*
+	 * Try the PLMN itself and then with the digits of every wildcard
+	 * pattern in use replaced.  The first matching record in file order
+	 * wins.
+	 */
+	for (mask = 0; mask < 64; mask++) {
+		if ((eons->opl_wildcards & ((guint64) 1 << mask)) == 0)
 			continue;
 
-		for (i = 0; i < OFONO_MAX_MNC_LENGTH; i++)
-			if (mnc[i] != opl->mnc[i] &&
-					!(opl->mnc[i] == 'b' && mnc[i]))
-				break;
-		if (i < OFONO_MAX_MNC_LENGTH)
+		if (opl_wildcard_key(&key, mcc, mnc, mask) == FALSE)
 			continue;
 
-		if (opl->lac_tac_low == 0 && opl->lac_tac_high == 0xfffe)
-			break;
+		group = g_hash_table_lookup(eons->opl_index, &key);
 
-		if (have_lac == FALSE)
+		if (group == NULL)
 			continue;
 
-		if ((lac >= opl->lac_tac_low) && (lac <= opl->lac_tac_high))
-			break;
+		found = group->whole;
+
+		if (have_lac) {
+			const struct opl_operator *ranged;
+
+			ranged = opl_group_lookup(group, lac);
+
+			if (ranged && (found == NULL ||
+					ranged->order < found->order))
+				found = ranged;
+		}
+
+		if (found && (opl == NULL || found->order < opl->order))
+			opl = found;
 	}
 
-	if (l == NULL)
+	if (opl == NULL)
 		return NULL;
 
-	opl = l->data;
-
 	/* 0 is not a valid record id */
 	if (opl->id == 0)
 		return NULL;
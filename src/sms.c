@@ -50,6 +50,9 @@
 #define TXQ_MAX_RETRIES 4
 #define NETWORK_TIMEOUT 332
 
+/* Final status reports may trail the end of the validity period */
+#define SR_EXPIRATION_GRACE (24 * 3600)
+
 static gboolean tx_next(gpointer user_data);
 
 static GSList *g_drivers = NULL;
@@ -84,6 +87,7 @@ struct ofono_sms {
 	struct ofono_atom *atom;
 	ofono_bool_t use_delivery_reports;
 	struct status_report_assembly *sr_assembly;
+	struct sms_tx_journal *tx_journal;
 	GHashTable *messages;
 	struct ofono_watchlist *text_handlers;
 	struct ofono_watchlist *datagram_handlers;
@@ -653,8 +657,7 @@ static void sms_tx_queue_remove_entry(struct ofono_sms *sms, GList *entry_list,
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS) {
 		struct message *m;
 
-		sms_tx_backup_free(sms->imsi, entry->id, entry->flags,
-					ofono_uuid_to_str(&entry->uuid));
+		sms_tx_backup_free(sms->tx_journal, entry->id);
 
 		m = g_hash_table_lookup(sms->messages, &entry->uuid);
 
@@ -671,6 +674,28 @@ done:
 	tx_queue_entry_destroy(entry);
 }
 
+/*
+ * Status reports are waited for as long as the validity period of the
+ * submitted PDU, plus a grace period.  When the validity period is left to
+ * the service centre they are waited for until MaxPendingStatusReports
+ * makes room for newer messages.
+ */
+static time_t sr_expiration(const struct pending_pdu *pdu, time_t now)
+{
+	struct sms s;
+	time_t expiration;
+
+	if (sms_decode(pdu->pdu, pdu->pdu_len, TRUE,
+					pdu->tpdu_len, &s) == FALSE)
+		return 0;
+
+	expiration = sms_submit_expiration(&s.submit, now);
+	if (expiration == 0)
+		return 0;
+
+	return expiration + SR_EXPIRATION_GRACE;
+}
+
 static void tx_finished(const struct ofono_error *error, int mr, void *data)
 {
 	struct ofono_sms *sms = data;
@@ -713,19 +738,22 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 	}
 
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS)
-		sms_tx_backup_remove(sms->imsi, entry->id, entry->flags,
-						ofono_uuid_to_str(&entry->uuid),
+		sms_tx_backup_remove(sms->tx_journal, entry->id,
 						entry->cur_pdu);
 
 	entry->cur_pdu += 1;
 	entry->retry = 0;
 
-	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR)
+	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR) {
+		time_t now = time(NULL);
+
+		status_report_assembly_expire(sms->sr_assembly, now);
 		status_report_assembly_add_fragment(sms->sr_assembly,
-							entry->uuid.uuid,
-							&entry->receiver,
-							mr, time(NULL),
-							entry->num_pdus);
+				entry->uuid.uuid, &entry->receiver, mr,
+				sr_expiration(&entry->pdus[entry->cur_pdu - 1],
+						now),
+				entry->num_pdus);
+	}
 
 	if (entry->cur_pdu < entry->num_pdus) {
 		sms->tx_source = g_timeout_add(0, tx_next, sms);
@@ -1445,6 +1473,8 @@ static void handle_sms_status_report(struct ofono_sms *sms,
 
 	DBG("");
 
+	status_report_assembly_expire(sms->sr_assembly, time(NULL));
+
 	if (status_report_assembly_report(sms->sr_assembly, incoming, uuid.uuid,
 						&delivered) == FALSE)
 		return;
@@ -1770,6 +1800,11 @@ static void sms_remove(struct ofono_atom *atom)
 		sms->sr_assembly = NULL;
 	}
 
+	if (sms->tx_journal) {
+		sms_tx_journal_free(sms->tx_journal);
+		sms->tx_journal = NULL;
+	}
+
 	g_free(sms);
 }
 
@@ -1840,6 +1875,7 @@ static void mw_watch(struct ofono_atom *atom,
 static void sms_load_settings(struct ofono_sms *sms, const char *imsi)
 {
 	GError *error;
+	int max_pending;
 
 	sms->settings = storage_open(imsi, SETTINGS_STORE);
 
@@ -1892,6 +1928,19 @@ static void sms_load_settings(struct ofono_sms *sms, const char *imsi)
 		g_key_file_set_integer(sms->settings, SETTINGS_GROUP,
 					"Alphabet", sms->alphabet);
 	}
+
+	error = NULL;
+	max_pending = g_key_file_get_integer(sms->settings, SETTINGS_GROUP,
+					"MaxPendingStatusReports", &error);
+
+	if (error || max_pending < 0) {
+		g_clear_error(&error);
+		max_pending = STATUS_REPORT_ASSEMBLY_MAX_PENDING;
+		g_key_file_set_integer(sms->settings, SETTINGS_GROUP,
+					"MaxPendingStatusReports", max_pending);
+	}
+
+	status_report_assembly_set_max_pending(sms->sr_assembly, max_pending);
 }
 
 static void bearer_init_callback(const struct ofono_error *error, void *data)
@@ -1907,7 +1956,7 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 
 	DBG("");
 
-	backupq = sms_tx_queue_load(sms->imsi);
+	backupq = sms_tx_queue_load(sms->tx_journal);
 
 	if (backupq == NULL)
 		return;
@@ -1920,7 +1969,7 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 		txq_entry = tx_queue_entry_new(backup_entry->msg_list,
 							backup_entry->flags);
 		if (txq_entry == NULL)
-			goto loop_out;
+			goto drop;
 
 		txq_entry->flags &= ~OFONO_SMS_SUBMIT_FLAG_REUSE_UUID;
 		memcpy(&txq_entry->uuid.uuid, &backup_entry->uuid,
@@ -1930,21 +1979,28 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 		if (m == NULL) {
 			tx_queue_entry_destroy(txq_entry);
 
-			goto loop_out;
+			goto drop;
 		}
 
 		if (message_dbus_register(m) == FALSE) {
 			tx_queue_entry_destroy(txq_entry);
 
-			goto loop_out;
+			goto drop;
 		}
 
 		message_set_data(m, txq_entry);
 		g_hash_table_insert(sms->messages, &txq_entry->uuid, m);
 
-		txq_entry->id = sms->tx_counter++;
+		/* Keep the ids of the backup, new messages go after them */
+		txq_entry->id = backup_entry->id;
+		sms->tx_counter = backup_entry->id + 1;
 		g_queue_push_tail(sms->txq, txq_entry);
 
+		goto loop_out;
+
+drop:
+		sms_tx_backup_free(sms->tx_journal, backup_entry->id);
+
 loop_out:
 		g_slist_foreach(backup_entry->msg_list, (GFunc)g_free, NULL);
 		g_slist_free(backup_entry->msg_list);
@@ -2005,11 +2061,13 @@ void ofono_sms_register(struct ofono_sms *sms)
 		sms->assembly = sms_assembly_new(imsi);
 
 		sms->sr_assembly = status_report_assembly_new(imsi);
+		sms->tx_journal = sms_tx_journal_new(imsi);
 
 		sms_load_settings(sms, imsi);
 	} else {
 		sms->assembly = sms_assembly_new(NULL);
 		sms->sr_assembly = status_report_assembly_new(NULL);
+		sms->tx_journal = sms_tx_journal_new(NULL);
 		sms->bearer = 3; /* Default to CS then PS */
 	}
 
@@ -2098,9 +2156,10 @@ int __ofono_sms_txq_submit(struct ofono_sms *sms, GSList *list,
 
 			pdu = &entry->pdus[i];
 
-			sms_tx_backup_store(sms->imsi, entry->id, entry->flags,
-						uuid_str, i, pdu->pdu,
-						pdu->pdu_len, pdu->tpdu_len);
+			sms_tx_backup_store(sms->tx_journal, entry->id,
+						entry->flags, uuid_str, i,
+						pdu->pdu, pdu->pdu_len,
+						pdu->tpdu_len);
 		}
 	}
 
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -42,15 +43,15 @@
 
 #define SMS_BACKUP_MODE 0600
 #define SMS_BACKUP_PATH STORAGEDIR "/%s/sms_assembly"
-#define SMS_BACKUP_PATH_DIR SMS_BACKUP_PATH "/%s-%i-%i"
-#define SMS_BACKUP_PATH_FILE SMS_BACKUP_PATH_DIR "/%03i"
+#define SMS_BACKUP_JOURNAL SMS_BACKUP_PATH "/journal"
+#define SMS_JOURNAL_MAX_DEAD 256
 
 #define SMS_SR_BACKUP_PATH STORAGEDIR "/%s/sms_sr"
 #define SMS_SR_BACKUP_PATH_FILE SMS_SR_BACKUP_PATH "/%s-%s"
 
 #define SMS_TX_BACKUP_PATH STORAGEDIR "/%s/tx_queue"
-#define SMS_TX_BACKUP_PATH_DIR SMS_TX_BACKUP_PATH "/%lu-%lu-%s"
-#define SMS_TX_BACKUP_PATH_FILE SMS_TX_BACKUP_PATH_DIR "/%03i"
+#define SMS_TX_BACKUP_JOURNAL SMS_TX_BACKUP_PATH "/journal"
+#define SMS_TX_JOURNAL_MIN_DEAD 64
 
 #define SMS_ADDR_FMT "%24[0-9A-F]"
 #define SMS_MSGID_FMT "%40[0-9A-F]"
@@ -495,6 +496,57 @@ static gboolean decode_validity_period(const unsigned char *pdu, int len,
 	return FALSE;
 }
 
+static time_t relative_vp_to_seconds(guint8 vp)
+{
+	if (vp <= 143)
+		return (vp + 1) * 5 * 60;
+
+	if (vp <= 167)
+		return 12 * 3600 + (vp - 143) * 30 * 60;
+
+	if (vp <= 196)
+		return (vp - 166) * 24 * 3600;
+
+	return (vp - 192) * 7 * 24 * 3600;
+}
+
+/*
+ * Returns the time at which a message submitted at the given time stops
+ * being valid at the service centre, or 0 if the validity period is left
+ * to the service centre.  See 3GPP TS 23.040 section 9.2.3.12.
+ */
+time_t sms_submit_expiration(const struct sms_submit *submit, time_t sent)
+{
+	const guint8 *enhanced = submit->vp.enhanced;
+	time_t expiration;
+
+	switch (submit->vpf) {
+	case SMS_VALIDITY_PERIOD_FORMAT_ABSENT:
+		return 0;
+	case SMS_VALIDITY_PERIOD_FORMAT_RELATIVE:
+		return sent + relative_vp_to_seconds(submit->vp.relative);
+	case SMS_VALIDITY_PERIOD_FORMAT_ABSOLUTE:
+		expiration = sms_scts_to_time(&submit->vp.absolute, NULL);
+		return expiration > 0 ? expiration : 0;
+	case SMS_VALIDITY_PERIOD_FORMAT_ENHANCED:
+		switch (enhanced[0] & 0x7) {
+		case 1:
+			return sent + relative_vp_to_seconds(enhanced[1]);
+		case 2:
+			return sent + enhanced[1];
+		case 3:
+			return sent +
+				sms_decode_semi_octet(enhanced[1]) * 3600 +
+				sms_decode_semi_octet(enhanced[2]) * 60 +
+				sms_decode_semi_octet(enhanced[3]);
+		}
+
+		break;
+	}
+
+	return 0;
+}
+
 static gboolean encode_validity_period(const struct sms_validity_period *vp,
 					enum sms_validity_period_format vpf,
 					unsigned char *pdu, int *offset)
@@ -2380,6 +2432,349 @@ gboolean sms_address_to_hex_string(const struct sms_address *in, char *straddr)
 	return TRUE;
 }
 
+static guint sms_assembly_node_hash(gconstpointer v)
+{
+	const struct sms_assembly_node *node = v;
+
+	return g_str_hash(node->addr.address) ^ (node->ref << 8) ^
+		(node->addr.number_type << 4) ^ node->addr.numbering_plan;
+}
+
+static gboolean sms_assembly_node_equal(gconstpointer v1, gconstpointer v2)
+{
+	const struct sms_assembly_node *a = v1;
+	const struct sms_assembly_node *b = v2;
+
+	if (a->ref != b->ref)
+		return FALSE;
+
+	if (a->addr.number_type != b->addr.number_type)
+		return FALSE;
+
+	if (a->addr.numbering_plan != b->addr.numbering_plan)
+		return FALSE;
+
+	return strcmp(a->addr.address, b->addr.address) == 0;
+}
+
+static void sms_assembly_node_free(gpointer data)
+{
+	struct sms_assembly_node *node = data;
+
+	g_slist_foreach(node->fragment_list, (GFunc) g_free, 0);
+	g_slist_free(node->fragment_list);
+	g_free(node);
+}
+
+/*
+ * Records of the journals below start with a magic and a CRC-16 over the
+ * rest of the record, so that a torn or garbled record ends the replay
+ * instead of misaligning every record after it.
+ */
+#define SMS_JOURNAL_MAGIC 0x4A53
+
+struct sms_journal_frame {
+	guint16 magic;
+	guint16 crc;
+} __attribute__((packed));
+
+/* CRC-16/CCITT, as used for HDLC framing */
+static guint16 sms_journal_crc(const unsigned char *buf, gsize len)
+{
+	guint16 crc = 0xffff;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x8408 : 0);
+	}
+
+	return crc;
+}
+
+static void sms_journal_seal(unsigned char *buf, gsize len)
+{
+	struct sms_journal_frame frame;
+
+	frame.magic = SMS_JOURNAL_MAGIC;
+	frame.crc = sms_journal_crc(buf + sizeof(frame), len - sizeof(frame));
+
+	memcpy(buf, &frame, sizeof(frame));
+}
+
+static gboolean sms_journal_verify(const unsigned char *buf, gsize len)
+{
+	struct sms_journal_frame frame;
+
+	memcpy(&frame, buf, sizeof(frame));
+
+	if (frame.magic != SMS_JOURNAL_MAGIC)
+		return FALSE;
+
+	return frame.crc == sms_journal_crc(buf + sizeof(frame),
+						len - sizeof(frame));
+}
+
+/*
+ * Appends a record to a journal.  Whatever part of the record made it to
+ * the file on a short write is cut off again, so that the records
+ * appended after it can still be replayed.
+ */
+static gboolean sms_journal_write(int fd, const unsigned char *buf,
+					gsize len)
+{
+	ssize_t written = TFR(write(fd, buf, len));
+	off_t end;
+
+	if (written == (ssize_t) len)
+		return TRUE;
+
+	if (written > 0) {
+		end = lseek(fd, 0, SEEK_END);
+
+		if (end >= written)
+			TFR(ftruncate(fd, end - written));
+	}
+
+	return FALSE;
+}
+
+/*
+ * Fragments of incomplete messages are backed up to an append-only journal:
+ * a record per stored fragment, and a record dropping all fragments of a
+ * message once it is completed or expired.  The journal is replayed on
+ * startup and rewritten from memory when enough of it is dead.
+ */
+enum sms_journal_op {
+	SMS_JOURNAL_FRAGMENT = 1,
+	SMS_JOURNAL_DROP = 2,
+};
+
+struct sms_journal_record {
+	struct sms_journal_frame frame;
+	guint8 op;
+	guint8 addr_len;
+	guint8 addr[12];
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	gint64 ts;
+	guint8 len;
+} __attribute__((packed));
+
+#define SMS_JOURNAL_RECORD_MAX (sizeof(struct sms_journal_record) + 177)
+
+static int sms_journal_encode(unsigned char *buf, enum sms_journal_op op,
+				const struct sms_assembly_node *node,
+				const struct sms *sms, guint8 seq)
+{
+	struct sms_journal_record rec;
+	int offset = 0;
+	int len = 0;
+
+	memset(&rec, 0, sizeof(rec));
+
+	if (sms_encode_address_field(&node->addr, FALSE, rec.addr,
+					&offset) == FALSE)
+		return -1;
+
+	if (sms)
+		len = sms_serialize(buf + sizeof(rec), sms);
+
+	rec.op = op;
+	rec.addr_len = offset;
+	rec.ref = node->ref;
+	rec.max = node->max_fragments;
+	rec.seq = seq;
+	rec.ts = node->ts;
+	rec.len = len;
+
+	memcpy(buf, &rec, sizeof(rec));
+	sms_journal_seal(buf, sizeof(rec) + len);
+
+	return sizeof(rec) + len;
+}
+
+static void sms_journal_append(struct sms_assembly *assembly,
+				enum sms_journal_op op,
+				const struct sms_assembly_node *node,
+				const struct sms *sms, guint8 seq)
+{
+	unsigned char buf[SMS_JOURNAL_RECORD_MAX];
+	int len;
+
+	if (assembly->journal_fd == -1)
+		return;
+
+	len = sms_journal_encode(buf, op, node, sms, seq);
+	if (len < 0)
+		return;
+
+	/* Have the next check rewrite the journal without the record */
+	if (sms_journal_write(assembly->journal_fd, buf, len) == FALSE)
+		assembly->journal_dead = MAX(assembly->journal_dead,
+						SMS_JOURNAL_MAX_DEAD);
+}
+
+static void sms_journal_open(struct sms_assembly *assembly)
+{
+	char *path = g_strdup_printf(SMS_BACKUP_JOURNAL, assembly->imsi);
+
+	if (create_dirs(path, SMS_BACKUP_MODE | S_IXUSR) == 0)
+		assembly->journal_fd = TFR(open(path,
+					O_WRONLY | O_CREAT | O_APPEND,
+					SMS_BACKUP_MODE));
+
+	g_free(path);
+}
+
+/* Rewrite the journal with just the fragments still being assembled */
+static gboolean sms_journal_compact(struct sms_assembly *assembly)
+{
+	GByteArray *journal = g_byte_array_new();
+	unsigned char buf[SMS_JOURNAL_RECORD_MAX];
+	GHashTableIter iter;
+	gpointer value;
+	gboolean ok;
+
+	g_hash_table_iter_init(&iter, assembly->assembly_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct sms_assembly_node *node = value;
+		GSList *l = node->fragment_list;
+		int seq;
+		int len;
+
+		for (seq = 0; seq < node->max_fragments && l; seq++) {
+			if (!(node->bitmap[seq / 32] & (1 << (seq % 32))))
+				continue;
+
+			len = sms_journal_encode(buf, SMS_JOURNAL_FRAGMENT,
+							node, l->data, seq);
+			if (len > 0)
+				g_byte_array_append(journal, buf, len);
+
+			l = l->next;
+		}
+	}
+
+	if (assembly->journal_fd != -1) {
+		TFR(close(assembly->journal_fd));
+		assembly->journal_fd = -1;
+	}
+
+	ok = write_file(journal->data, journal->len, SMS_BACKUP_MODE,
+				SMS_BACKUP_JOURNAL, assembly->imsi) ==
+			(ssize_t) journal->len;
+
+	if (ok) {
+		assembly->journal_dead = 0;
+		sms_journal_open(assembly);
+	}
+
+	g_byte_array_free(journal, TRUE);
+
+	return ok;
+}
+
+static void sms_journal_check(struct sms_assembly *assembly)
+{
+	if (assembly->journal_dead < SMS_JOURNAL_MAX_DEAD)
+		return;
+
+	sms_journal_compact(assembly);
+}
+
+static void sms_journal_drop(struct sms_assembly *assembly,
+				const struct sms_assembly_node *node)
+{
+	struct sms_assembly_node *cur;
+
+	cur = g_hash_table_lookup(assembly->assembly_table, node);
+	if (cur == NULL)
+		return;
+
+	assembly->journal_dead += cur->num_fragments + 1;
+	g_hash_table_remove(assembly->assembly_table, cur);
+}
+
+static gboolean sms_journal_replay(struct sms_assembly *assembly)
+{
+	char *path = g_strdup_printf(SMS_BACKUP_JOURNAL, assembly->imsi);
+	struct sms_journal_record rec;
+	struct sms_assembly_node key;
+	struct sms segment;
+	gchar *contents;
+	gsize length;
+	gsize pos = 0;
+	GSList *completed;
+	gboolean ok;
+	int offset;
+
+	ok = g_file_get_contents(path, &contents, &length, NULL);
+	g_free(path);
+
+	if (ok == FALSE)
+		return FALSE;
+
+	/* A record cut short by a crash, or damaged, ends the replay */
+	while (length - pos >= sizeof(rec)) {
+		memcpy(&rec, contents + pos, sizeof(rec));
+
+		if (length - pos - sizeof(rec) < rec.len)
+			break;
+
+		if (sms_journal_verify((unsigned char *) contents + pos,
+					sizeof(rec) + rec.len) == FALSE)
+			break;
+
+		pos += sizeof(rec);
+		offset = 0;
+
+		memset(&key, 0, sizeof(key));
+		key.ref = rec.ref;
+
+		if (sms_decode_address_field(rec.addr, rec.addr_len, &offset,
+						FALSE, &key.addr) == FALSE)
+			goto next;
+
+		switch (rec.op) {
+		case SMS_JOURNAL_FRAGMENT:
+			if (!sms_deserialize((unsigned char *) contents + pos,
+						&segment, rec.len))
+				break;
+
+			completed = sms_assembly_add_fragment_backup(assembly,
+						&segment, rec.ts, &key.addr,
+						rec.ref, rec.max, rec.seq,
+						FALSE);
+
+			g_slist_foreach(completed, (GFunc) g_free, 0);
+			g_slist_free(completed);
+			break;
+		case SMS_JOURNAL_DROP:
+			sms_journal_drop(assembly, &key);
+			break;
+		}
+
+next:
+		pos += rec.len;
+	}
+
+	if (pos != length)
+		assembly->journal_dead += 1;
+
+	g_free(contents);
+
+	return TRUE;
+}
+
+/*
+ * Restores a message backed up by the one directory per message scheme.
+ * The files are left in place until the journal holding them is written.
+ */
 static void sms_assembly_load(struct sms_assembly *assembly,
 				const struct dirent *dir)
 {
@@ -2425,28 +2820,20 @@ static void sms_assembly_load(struct sms_assembly *assembly,
 		if (*endp != '\0')
 			continue;
 
-		r = read_file(buf, sizeof(buf), SMS_BACKUP_PATH "/%s/%s",
-				assembly->imsi,
-				dir->d_name, segments[i]->d_name);
-		if (r < 0)
-			continue;
-
-		if (!sms_deserialize(buf, &segment, r))
-			continue;
-
 		path = g_strdup_printf(SMS_BACKUP_PATH "/%s/%s",
 				assembly->imsi,
 				dir->d_name, segments[i]->d_name);
-		r = stat(path, &segment_stat);
-		g_free(path);
 
-		if (r != 0)
-			continue;
+		r = read_file(buf, sizeof(buf), "%s", path);
 
-		/* Errors cannot occur here */
-		sms_assembly_add_fragment_backup(assembly, &segment,
+		if (r >= 0 && sms_deserialize(buf, &segment, r) &&
+				stat(path, &segment_stat) == 0)
+			/* Errors cannot occur here */
+			sms_assembly_add_fragment_backup(assembly, &segment,
 						segment_stat.st_mtime,
 						&addr, ref, max, seq, FALSE);
+
+		g_free(path);
 	}
 
 	for (i = 0; i < len; i++)
@@ -2455,105 +2842,135 @@ static void sms_assembly_load(struct sms_assembly *assembly,
 	free(segments);
 }
 
-static gboolean sms_assembly_store(struct sms_assembly *assembly,
-				struct sms_assembly_node *node,
-				const struct sms *sms, guint8 seq)
+/* Removes a message directory migrated by sms_assembly_load() */
+static void sms_assembly_unlink(struct sms_assembly *assembly,
+				const struct dirent *dir)
 {
-	unsigned char buf[177];
-	int len;
 	DECLARE_SMS_ADDR_STR(straddr);
-
-	if (assembly->imsi == NULL)
-		return FALSE;
-
-	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
-		return FALSE;
-
-	len = sms_serialize(buf, sms);
-
-	if (write_file(buf, len, SMS_BACKUP_MODE,
-				SMS_BACKUP_PATH_FILE, assembly->imsi, straddr,
-				node->ref, node->max_fragments, seq) != len)
-		return FALSE;
-
-	return TRUE;
-}
-
-static void sms_assembly_backup_free(struct sms_assembly *assembly,
-					struct sms_assembly_node *node)
-{
+	guint16 ref;
+	guint8 max;
 	char *path;
-	int seq;
-	DECLARE_SMS_ADDR_STR(straddr);
+	struct dirent **segments;
+	char *endp;
+	int len;
+	int i;
 
-	if (assembly->imsi == NULL)
+	if (dir->d_type != DT_DIR)
 		return;
 
-	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
+	if (sscanf(dir->d_name, SMS_ADDR_FMT "-%hi-%hhi",
+				straddr, &ref, &max) < 3)
 		return;
 
-	for (seq = 0; seq < node->max_fragments; seq++) {
-		int offset = seq / 32;
-		int bit = 1 << (seq % 32);
+	path = g_strdup_printf(SMS_BACKUP_PATH "/%s",
+			assembly->imsi, dir->d_name);
+	len = scandir(path, &segments, NULL, versionsort);
+
+	for (i = 0; i < len; i++) {
+		char *segment;
+
+		if (segments[i]->d_type == DT_REG) {
+			strtol(segments[i]->d_name, &endp, 10);
 
-		if (node->bitmap[offset] & bit) {
-			path = g_strdup_printf(SMS_BACKUP_PATH_FILE,
-					assembly->imsi, straddr,
-					node->ref, node->max_fragments, seq);
-			unlink(path);
-			g_free(path);
+			if (*endp == '\0') {
+				segment = g_strdup_printf("%s/%s", path,
+							segments[i]->d_name);
+				unlink(segment);
+				g_free(segment);
+			}
 		}
+
+		free(segments[i]);
 	}
 
-	path = g_strdup_printf(SMS_BACKUP_PATH_DIR, assembly->imsi, straddr,
-				node->ref, node->max_fragments);
+	if (len >= 0)
+		free(segments);
+
 	rmdir(path);
 	g_free(path);
 }
 
+static void sms_assembly_store(struct sms_assembly *assembly,
+				struct sms_assembly_node *node,
+				const struct sms *sms, guint8 seq)
+{
+	sms_journal_append(assembly, SMS_JOURNAL_FRAGMENT, node, sms, seq);
+}
+
+static void sms_assembly_backup_free(struct sms_assembly *assembly,
+					struct sms_assembly_node *node,
+					unsigned int stored)
+{
+	if (stored == 0)
+		return;
+
+	sms_journal_append(assembly, SMS_JOURNAL_DROP, node, NULL, 0);
+	assembly->journal_dead += stored + 1;
+}
+
 struct sms_assembly *sms_assembly_new(const char *imsi)
 {
 	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
 	char *path;
-	struct dirent **entries;
-	int len;
+	struct dirent **entries = NULL;
+	gboolean migrated = FALSE;
+	int len = 0;
+	int i;
 
-	if (imsi) {
-		ret->imsi = imsi;
+	ret->assembly_table = g_hash_table_new_full(sms_assembly_node_hash,
+						sms_assembly_node_equal,
+						NULL, sms_assembly_node_free);
+	ret->journal_fd = -1;
 
-		/* Restore state from backup */
+	if (imsi == NULL)
+		return ret;
 
+	ret->imsi = imsi;
+
+	/* Restore state from backup */
+	if (sms_journal_replay(ret) == FALSE) {
 		path = g_strdup_printf(SMS_BACKUP_PATH, imsi);
 		len = scandir(path, &entries, NULL, alphasort);
 		g_free(path);
 
-		if (len < 0)
-			return ret;
+		if (len >= 0) {
+			for (i = len - 1; i >= 0; i--)
+				sms_assembly_load(ret, entries[i]);
 
-		while (len--) {
-			sms_assembly_load(ret, entries[len]);
-			free(entries[len]);
+			migrated = TRUE;
 		}
-
-		free(entries);
 	}
 
-	return ret;
-}
-
-void sms_assembly_free(struct sms_assembly *assembly)
-{
-	GSList *l;
+	/*
+	 * Anything dropped or completed while replaying left dead records.
+	 * The old backups only go once the journal replacing them is in
+	 * place; until then no journal is started, so that the migration
+	 * is retried on the next start.
+	 */
+	if (migrated) {
+		if (sms_journal_compact(ret) == TRUE)
+			for (i = 0; i < len; i++)
+				sms_assembly_unlink(ret, entries[i]);
 
-	for (l = assembly->assembly_list; l; l = l->next) {
-		struct sms_assembly_node *node = l->data;
+		for (i = 0; i < len; i++)
+			free(entries[i]);
 
-		g_slist_foreach(node->fragment_list, (GFunc) g_free, 0);
-		g_slist_free(node->fragment_list);
-		g_free(node);
-	}
+		free(entries);
+	} else if (ret->journal_dead > 0)
+		sms_journal_compact(ret);
+
+	if (ret->journal_fd == -1 && migrated == FALSE)
+		sms_journal_open(ret);
 
-	g_slist_free(assembly->assembly_list);
+	return ret;
+}
+
+void sms_assembly_free(struct sms_assembly *assembly)
+{
+	if (assembly->journal_fd != -1)
+		TFR(close(assembly->journal_fd));
+
+	g_hash_table_destroy(assembly->assembly_table);
 	g_free(assembly);
 }
 
@@ -2574,32 +2991,19 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 {
 	unsigned int offset = seq / 32;
 	unsigned int bit = 1 << (seq % 32);
-	GSList *l;
-	GSList *prev;
 	struct sms *newsms;
+	struct sms_assembly_node key;
 	struct sms_assembly_node *node;
 	GSList *completed;
 	unsigned int position;
 	unsigned int i;
-	unsigned int j;
 
-	prev = NULL;
+	memcpy(&key.addr, addr, sizeof(struct sms_address));
+	key.ref = ref;
 
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		node = l->data;
-
-		if (node->addr.number_type != addr->number_type)
-			continue;
-
-		if (node->addr.numbering_plan != addr->numbering_plan)
-			continue;
-
-		if (strcmp(node->addr.address, addr->address))
-			continue;
-
-		if (ref != node->ref)
-			continue;
+	node = g_hash_table_lookup(assembly->assembly_table, &key);
 
+	if (node) {
 		/*
 		 * Message Reference and address the same, but max is not
 		 * ignore the SMS completely
@@ -2612,39 +3016,27 @@ static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
 			return NULL;
 
 		/*
-		 * Iterate over the bitmap to find in which position
-		 * should the fragment be inserted -- basically we
-		 * walk each bit in the bitmap until the bit we care
-		 * about (offset:bit) and count which are stored --
-		 * that gives us in which position we have to insert.
+		 * Count the fragments already stored ahead of this one in
+		 * the bitmap, that is where the fragment gets inserted.
 		 */
 		position = 0;
 		for (i = 0; i < offset; i++)
-			for (j = 0; j < 32; j++)
-				if (node->bitmap[i] & (1 << j))
-					position += 1;
-
-		for (j = 1; j < bit; j = j << 1)
-			if (node->bitmap[offset] & j)
-				position += 1;
+			position += __builtin_popcount(node->bitmap[i]);
 
-		goto out;
-	}
-
-	node = g_new0(struct sms_assembly_node, 1);
-	memcpy(&node->addr, addr, sizeof(struct sms_address));
-	node->ts = ts;
-	node->ref = ref;
-	node->max_fragments = max;
+		position += __builtin_popcount(node->bitmap[offset] &
+						(bit - 1));
+	} else {
+		node = g_new0(struct sms_assembly_node, 1);
+		memcpy(&node->addr, addr, sizeof(struct sms_address));
+		node->ts = ts;
+		node->ref = ref;
+		node->max_fragments = max;
 
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
+		g_hash_table_insert(assembly->assembly_table, node, node);
 
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
+		position = 0;
+	}
 
-out:
 	newsms = g_new(struct sms, 1);
 
 	memcpy(newsms, sms, sizeof(struct sms));
@@ -2661,16 +3053,20 @@ out:
 	}
 
 	completed = node->fragment_list;
+	node->fragment_list = NULL;
 
-	sms_assembly_backup_free(assembly, node);
+	/* All fragments but the last one were backed up */
+	sms_assembly_backup_free(assembly, node, node->num_fragments - 1);
 
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
+	g_hash_table_remove(assembly->assembly_table, node);
+
+	/*
+	 * Not while the journal is replayed or migrated: the table is only
+	 * half rebuilt then, and sms_assembly_new() compacts once it is done.
+	 */
+	if (backup && assembly->imsi)
+		sms_journal_check(assembly);
 
-	g_free(node);
-	g_slist_free_1(l);
 	return completed;
 }
 
@@ -2681,37 +3077,23 @@ out:
  */
 void sms_assembly_expire(struct sms_assembly *assembly, time_t before)
 {
-	GSList *cur;
-	GSList *prev;
-	GSList *tmp;
+	GHashTableIter iter;
+	gpointer value;
 
-	prev = NULL;
-	cur = assembly->assembly_list;
+	g_hash_table_iter_init(&iter, assembly->assembly_table);
 
-	while (cur) {
-		struct sms_assembly_node *node = cur->data;
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct sms_assembly_node *node = value;
 
-		if (node->ts > before) {
-			prev = cur;
-			cur = cur->next;
+		if (node->ts > before)
 			continue;
-		}
 
-		sms_assembly_backup_free(assembly, node);
-
-		g_slist_foreach(node->fragment_list, (GFunc) g_free, 0);
-		g_slist_free(node->fragment_list);
-		g_free(node);
-
-		if (prev)
-			prev->next = cur->next;
-		else
-			assembly->assembly_list = cur->next;
-
-		tmp = cur;
-		cur = cur->next;
-		g_slist_free_1(tmp);
+		sms_assembly_backup_free(assembly, node, node->num_fragments);
+		g_hash_table_iter_remove(&iter);
 	}
+
+	if (assembly->imsi)
+		sms_journal_check(assembly);
 }
 
 static gboolean sha1_equal(gconstpointer v1, gconstpointer v2)
@@ -2728,17 +3110,286 @@ static guint sha1_hash(gconstpointer v)
 	return h;
 }
 
-static void sr_assembly_load_backup(GHashTable *assembly_table,
+/*
+ * Besides the per address tables, every message waiting for status reports
+ * is indexed by each message reference it still expects, together with the
+ * last six characters of its address.  This makes matching a report a
+ * single lookup, even when the network changed the address format.  A
+ * timer wheel, with each slot kept sorted by expiration, lets expiry stop
+ * at the first message still valid, and the pending queue, ordered by age,
+ * bounds the number of messages tracked.
+ */
+#define SR_WHEEL_TICK 60
+#define SR_WHEEL_SIZE 256
+#define SR_SUFFIX_LEN 6
+
+struct sr_mr_bucket {
+	unsigned char mr;
+	char suffix[SR_SUFFIX_LEN + 1];
+	GQueue nodes;		/* Oldest first */
+};
+
+struct sr_assembly_node {
+	struct id_table_node data;
+	unsigned char msgid[SMS_MSGID_LEN];
+	const char *addr;	/* Owned by the assembly table */
+	GHashTable *id_table;
+	GList *wheel_link;
+	unsigned int wheel_slot;
+	GList *pending_link;
+};
+
+static guint sr_mr_bucket_hash(gconstpointer v)
+{
+	const struct sr_mr_bucket *bucket = v;
+
+	return g_str_hash(bucket->suffix) * 31 + bucket->mr;
+}
+
+static gboolean sr_mr_bucket_equal(gconstpointer v1, gconstpointer v2)
+{
+	const struct sr_mr_bucket *b1 = v1;
+	const struct sr_mr_bucket *b2 = v2;
+
+	if (b1->mr != b2->mr)
+		return FALSE;
+
+	return strcmp(b1->suffix, b2->suffix) == 0;
+}
+
+static void sr_mr_bucket_free(gpointer data)
+{
+	struct sr_mr_bucket *bucket = data;
+
+	g_queue_clear(&bucket->nodes);
+	g_free(bucket);
+}
+
+static void sr_mr_key_init(struct sr_mr_bucket *key, const char *addr,
+				unsigned int len, unsigned char mr)
+{
+	unsigned int addr_len = strlen(addr);
+
+	if (len > addr_len)
+		len = addr_len;
+
+	memset(key, 0, sizeof(*key));
+	key->mr = mr;
+	memcpy(key->suffix, addr + addr_len - len, len);
+}
+
+static void sr_index_add(struct status_report_assembly *assembly,
+				struct sr_assembly_node *node, unsigned char mr)
+{
+	struct sr_mr_bucket key;
+	struct sr_mr_bucket *bucket;
+
+	sr_mr_key_init(&key, node->addr, SR_SUFFIX_LEN, mr);
+	bucket = g_hash_table_lookup(assembly->mr_table, &key);
+
+	if (bucket == NULL) {
+		bucket = g_memdup(&key, sizeof(key));
+		g_hash_table_insert(assembly->mr_table, bucket, bucket);
+	}
+
+	g_queue_push_tail(&bucket->nodes, node);
+}
+
+static void sr_index_remove(struct status_report_assembly *assembly,
+				struct sr_assembly_node *node, unsigned char mr)
+{
+	struct sr_mr_bucket key;
+	struct sr_mr_bucket *bucket;
+
+	sr_mr_key_init(&key, node->addr, SR_SUFFIX_LEN, mr);
+	bucket = g_hash_table_lookup(assembly->mr_table, &key);
+
+	if (bucket == NULL)
+		return;
+
+	g_queue_remove(&bucket->nodes, node);
+
+	if (g_queue_is_empty(&bucket->nodes))
+		g_hash_table_remove(assembly->mr_table, bucket);
+}
+
+static void sr_wheel_insert(struct status_report_assembly *assembly,
+				struct sr_assembly_node *node,
+				time_t expiration)
+{
+	time_t tick = MAX(expiration / SR_WHEEL_TICK, assembly->wheel_tick);
+	GQueue *slot;
+	GList *l;
+
+	if (node->wheel_link) {
+		g_queue_delete_link(&assembly->wheel[node->wheel_slot],
+					node->wheel_link);
+		node->wheel_link = NULL;
+	}
+
+	node->data.expiration = expiration;
+
+	/* Never expires, only the limit on pending messages drops it */
+	if (expiration == 0)
+		return;
+	node->wheel_slot = tick % SR_WHEEL_SIZE;
+	slot = &assembly->wheel[node->wheel_slot];
+
+	/* Expiration times mostly grow, so search from the tail */
+	for (l = slot->tail; l; l = l->prev) {
+		struct sr_assembly_node *prev = l->data;
+
+		if (prev->data.expiration <= expiration)
+			break;
+	}
+
+	if (l == NULL) {
+		g_queue_push_head(slot, node);
+		node->wheel_link = slot->head;
+	} else {
+		g_queue_insert_after(slot, l, node);
+		node->wheel_link = l->next;
+	}
+}
+
+static gboolean sr_assembly_add_fragment_backup(const char *imsi,
+					const struct id_table_node *node,
+					const struct sms_address *addr,
+					const unsigned char *msgid)
+{
+	int len = sizeof(struct id_table_node);
+	DECLARE_SMS_ADDR_STR(straddr);
+	char msgid_str[SMS_MSGID_LEN * 2 + 1];
+
+	if (imsi == NULL)
+		return FALSE;
+
+	if (sms_address_to_hex_string(addr, straddr) == FALSE)
+		return FALSE;
+
+	if (encode_hex_own_buf(msgid, SMS_MSGID_LEN, 0, msgid_str) == NULL)
+		return FALSE;
+
+	/* storagedir/%s/sms_sr/%s-%s */
+	if (write_file((unsigned char *) node, len, SMS_BACKUP_MODE,
+			SMS_SR_BACKUP_PATH_FILE, imsi,
+			straddr, msgid_str) != len)
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean sr_assembly_remove_fragment_backup(const char *imsi,
+					const struct sms_address *addr,
+					const unsigned char *sha1)
+{
+	char *path;
+	DECLARE_SMS_ADDR_STR(straddr);
+	char msgid_str[SMS_MSGID_LEN * 2 + 1];
+
+	if (imsi == NULL)
+		return FALSE;
+
+	if (sms_address_to_hex_string(addr, straddr) == FALSE)
+		return FALSE;
+
+	if (encode_hex_own_buf(sha1, SMS_MSGID_LEN, 0, msgid_str) == FALSE)
+		return FALSE;
+
+	path = g_strdup_printf(SMS_SR_BACKUP_PATH_FILE,
+					imsi, straddr, msgid_str);
+
+	unlink(path);
+	g_free(path);
+
+	return TRUE;
+}
+
+static void sr_assembly_remove(struct status_report_assembly *assembly,
+				struct sr_assembly_node *node)
+{
+	GHashTable *id_table = node->id_table;
+	const char *straddr = node->addr;
+	struct sms_address addr;
+	unsigned int mr;
+
+	for (mr = 0; mr < 256; mr++)
+		if (node->data.mrs[mr / 32] & (1 << (mr % 32)))
+			sr_index_remove(assembly, node, mr);
+
+	if (node->wheel_link)
+		g_queue_delete_link(&assembly->wheel[node->wheel_slot],
+					node->wheel_link);
+
+	g_queue_delete_link(assembly->pending, node->pending_link);
+
+	sms_address_from_string(&addr, straddr);
+	sr_assembly_remove_fragment_backup(assembly->imsi, &addr, node->msgid);
+
+	g_hash_table_remove(id_table, node->msgid);
+
+	if (g_hash_table_size(id_table) == 0)
+		g_hash_table_remove(assembly->assembly_table, straddr);
+}
+
+static struct sr_assembly_node *sr_assembly_node_get(
+				struct status_report_assembly *assembly,
+				const char *straddr,
+				const unsigned char *msgid)
+{
+	GHashTable *id_table;
+	gpointer key;
+	struct sr_assembly_node *node;
+
+	id_table = g_hash_table_lookup(assembly->assembly_table, straddr);
+
+	if (id_table != NULL) {
+		node = g_hash_table_lookup(id_table, msgid);
+
+		if (node != NULL)
+			return node;
+	}
+
+	/* Make room by dropping the oldest messages */
+	while (assembly->max_pending > 0 &&
+			g_queue_get_length(assembly->pending) >=
+							assembly->max_pending)
+		sr_assembly_remove(assembly,
+					g_queue_peek_head(assembly->pending));
+
+	/* Create hashtable keyed by the to address if required */
+	if (g_hash_table_lookup_extended(assembly->assembly_table, straddr,
+				&key, (gpointer *) &id_table) == FALSE) {
+		key = g_strdup(straddr);
+		id_table = g_hash_table_new_full(sha1_hash, sha1_equal,
+							NULL, g_free);
+		g_hash_table_insert(assembly->assembly_table, key, id_table);
+	}
+
+	node = g_new0(struct sr_assembly_node, 1);
+	memcpy(node->msgid, msgid, SMS_MSGID_LEN);
+	node->addr = key;
+	node->id_table = id_table;
+	node->data.deliverable = TRUE;
+
+	g_hash_table_insert(id_table, node->msgid, node);
+
+	g_queue_push_tail(assembly->pending, node);
+	node->pending_link = assembly->pending->tail;
+
+	return node;
+}
+
+static void sr_assembly_load_backup(struct status_report_assembly *assembly,
 					const char *imsi,
 					const struct dirent *addr_dir)
 {
 	struct sms_address addr;
 	DECLARE_SMS_ADDR_STR(straddr);
-	struct id_table_node *node;
-	GHashTable *id_table;
+	struct id_table_node data;
+	struct sr_assembly_node *node;
 	int r;
-	char *assembly_table_key;
-	unsigned int *id_table_key;
+	unsigned int mr;
 	char msgid_str[SMS_MSGID_LEN * 2 + 1];
 	unsigned char msgid[SMS_MSGID_LEN];
 	char endc;
@@ -2767,35 +3418,44 @@ static void sr_assembly_load_backup(GHashTable *assembly_table,
 				NULL, 0, msgid) == NULL)
 		return;
 
-	node = g_new0(struct id_table_node, 1);
+	memset(&data, 0, sizeof(data));
 
-	r = read_file((unsigned char *) node,
+	r = read_file((unsigned char *) &data,
 			sizeof(struct id_table_node),
 			SMS_SR_BACKUP_PATH "/%s",
 			imsi, addr_dir->d_name);
 
-	if (r < 0) {
-		g_free(node);
+	if (r < 0)
 		return;
-	}
 
-	id_table = g_hash_table_lookup(assembly_table,
-					sms_address_to_string(&addr));
+	node = sr_assembly_node_get(assembly, sms_address_to_string(&addr),
+					msgid);
+	memcpy(&node->data, &data, sizeof(data));
 
-	/* Create hashtable keyed by the to address if required */
-	if (id_table == NULL) {
-		id_table = g_hash_table_new_full(sha1_hash, sha1_equal,
-							g_free, g_free);
+	for (mr = 0; mr < 256; mr++)
+		if (node->data.mrs[mr / 32] & (1 << (mr % 32)))
+			sr_index_add(assembly, node, mr);
 
-		assembly_table_key = g_strdup(sms_address_to_string(&addr));
-		g_hash_table_insert(assembly_table, assembly_table_key,
-					id_table);
-	}
+	sr_wheel_insert(assembly, node, node->data.expiration);
+}
+
+/* Orders by expiration, those that never expire come last */
+static gint sr_assembly_node_compare(gconstpointer a, gconstpointer b,
+					gpointer user_data)
+{
+	time_t exp_a = ((const struct sr_assembly_node *) a)->data.expiration;
+	time_t exp_b = ((const struct sr_assembly_node *) b)->data.expiration;
+
+	if (exp_a == exp_b)
+		return 0;
+
+	if (exp_a == 0)
+		return 1;
 
-	/* Node ready, create key and add them to the table */
-	id_table_key = g_memdup(msgid, SMS_MSGID_LEN);
+	if (exp_b == 0)
+		return -1;
 
-	g_hash_table_insert(id_table, id_table_key, node);
+	return exp_a < exp_b ? -1 : 1;
 }
 
 struct status_report_assembly *status_report_assembly_new(const char *imsi)
@@ -2803,11 +3463,18 @@ struct status_report_assembly *status_report_assembly_new(const char *imsi)
 	char *path;
 	int len;
 	struct dirent **addresses;
+	GList *l;
 	struct status_report_assembly *ret =
 				g_new0(struct status_report_assembly, 1);
 
 	ret->assembly_table = g_hash_table_new_full(g_str_hash, g_str_equal,
 				g_free, (GDestroyNotify) g_hash_table_destroy);
+	ret->mr_table = g_hash_table_new_full(sr_mr_bucket_hash,
+						sr_mr_bucket_equal,
+						sr_mr_bucket_free, NULL);
+	ret->wheel = g_new0(GQueue, SR_WHEEL_SIZE);
+	ret->wheel_tick = time(NULL) / SR_WHEEL_TICK;
+	ret->pending = g_queue_new();
 
 	if (imsi) {
 		ret->imsi = imsi;
@@ -2819,82 +3486,69 @@ struct status_report_assembly *status_report_assembly_new(const char *imsi)
 		g_free(path);
 
 		if (len < 0)
-			return ret;
+			goto done;
 
 		/*
 		 * Go through different addresses. Each address can relate to
-		 * 1-n msg_ids.
+		 * 1-n msg_ids.  Nothing is dropped while loading, the limit
+		 * configured by the caller is only applied once all of them
+		 * are back.
 		 */
 
 		while (len--) {
-			sr_assembly_load_backup(ret->assembly_table, imsi,
-								addresses[len]);
+			sr_assembly_load_backup(ret, imsi, addresses[len]);
 			g_free(addresses[len]);
 		}
 
 		g_free(addresses);
-	}
-
-	return ret;
-}
-
-static gboolean sr_assembly_add_fragment_backup(const char *imsi,
-					const struct id_table_node *node,
-					const struct sms_address *addr,
-					const unsigned char *msgid)
-{
-	int len = sizeof(struct id_table_node);
-	DECLARE_SMS_ADDR_STR(straddr);
-	char msgid_str[SMS_MSGID_LEN * 2 + 1];
 
-	if (imsi == NULL)
-		return FALSE;
+		/* Oldest first, as they would have been queued */
+		g_queue_sort(ret->pending, sr_assembly_node_compare, NULL);
 
-	if (sms_address_to_hex_string(addr, straddr) == FALSE)
-		return FALSE;
+		for (l = ret->pending->head; l; l = l->next) {
+			struct sr_assembly_node *node = l->data;
 
-	if (encode_hex_own_buf(msgid, SMS_MSGID_LEN, 0, msgid_str) == NULL)
-		return FALSE;
+			node->pending_link = l;
+		}
+	}
 
-	/* storagedir/%s/sms_sr/%s-%s */
-	if (write_file((unsigned char *) node, len, SMS_BACKUP_MODE,
-			SMS_SR_BACKUP_PATH_FILE, imsi,
-			straddr, msgid_str) != len)
-		return FALSE;
+done:
+	ret->max_pending = STATUS_REPORT_ASSEMBLY_MAX_PENDING;
 
-	return TRUE;
+	return ret;
 }
 
-static gboolean sr_assembly_remove_fragment_backup(const char *imsi,
-					const struct sms_address *addr,
-					const unsigned char *sha1)
+void status_report_assembly_free(struct status_report_assembly *assembly)
 {
-	char *path;
-	DECLARE_SMS_ADDR_STR(straddr);
-	char msgid_str[SMS_MSGID_LEN * 2 + 1];
-
-	if (imsi == NULL)
-		return FALSE;
-
-	if (sms_address_to_hex_string(addr, straddr) == FALSE)
-		return FALSE;
-
-	if (encode_hex_own_buf(sha1, SMS_MSGID_LEN, 0, msgid_str) == FALSE)
-		return FALSE;
+	int i;
 
-	path = g_strdup_printf(SMS_SR_BACKUP_PATH_FILE,
-					imsi, straddr, msgid_str);
+	g_hash_table_destroy(assembly->assembly_table);
+	g_hash_table_destroy(assembly->mr_table);
 
-	unlink(path);
-	g_free(path);
+	for (i = 0; i < SR_WHEEL_SIZE; i++)
+		g_queue_clear(&assembly->wheel[i]);
 
-	return TRUE;
+	g_free(assembly->wheel);
+	g_queue_free(assembly->pending);
+	g_free(assembly);
 }
 
-void status_report_assembly_free(struct status_report_assembly *assembly)
+/*
+ * Drops the oldest messages until at most max are waiting for status
+ * reports.  A max of 0 removes the limit.
+ */
+void status_report_assembly_set_max_pending(
+				struct status_report_assembly *assembly,
+				unsigned int max)
 {
-	g_hash_table_destroy(assembly->assembly_table);
-	g_free(assembly);
+	assembly->max_pending = max;
+
+	if (max == 0)
+		return;
+
+	while (g_queue_get_length(assembly->pending) > max)
+		sr_assembly_remove(assembly,
+					g_queue_peek_head(assembly->pending));
 }
 
 static gboolean sr_st_to_delivered(enum sms_st st, gboolean *delivered)
@@ -2918,27 +3572,39 @@ static gboolean sr_st_to_delivered(enum sms_st st, gboolean *delivered)
 	return FALSE;
 }
 
-static struct id_table_node *find_by_mr_and_mark(GHashTable *id_table,
-						unsigned char mr,
-						GHashTableIter *out_iter,
-						unsigned char **out_id)
+/*
+ * Looks for the oldest message that expects mr and whose address ends with
+ * the last len characters of r_addr.  Unless fuzzy is set the whole
+ * address must match, otherwise exactly one of the two addresses has to
+ * be in international format.
+ */
+static struct sr_assembly_node *sr_index_find(
+				struct status_report_assembly *assembly,
+				const char *r_addr, unsigned int len,
+				unsigned char mr, gboolean fuzzy)
 {
-	unsigned int offset = mr / 32;
-	unsigned int bit = 1 << (mr % 32);
-	gpointer key, value;
-	struct id_table_node *node;
+	struct sr_mr_bucket key;
+	struct sr_mr_bucket *bucket;
+	GList *l;
 
-	g_hash_table_iter_init(out_iter, id_table);
-	while (g_hash_table_iter_next(out_iter, &key, &value)) {
-		node = value;
+	sr_mr_key_init(&key, r_addr, len, mr);
+	bucket = g_hash_table_lookup(assembly->mr_table, &key);
 
-		/* Address and MR matched */
-		if (node->mrs[offset] & bit) {
-			node->mrs[offset] ^= bit;
-			*out_id = key;
+	if (bucket == NULL)
+		return NULL;
 
-			return node;
+	for (l = bucket->nodes.head; l; l = l->next) {
+		struct sr_assembly_node *node = l->data;
+
+		if (fuzzy == FALSE) {
+			if (strcmp(node->addr, r_addr) == 0)
+				return node;
+
+			continue;
 		}
+
+		if ((node->addr[0] == '+') != (r_addr[0] == '+'))
+			return node;
 	}
 
 	return NULL;
@@ -2952,51 +3618,49 @@ static struct id_table_node *find_by_mr_and_mark(GHashTable *id_table,
  * addresses and received address. If address contains less than six digits,
  * compare only existing digits.
  */
-static struct id_table_node *fuzzy_lookup(struct status_report_assembly *assy,
-						const struct sms *sr,
-						const char **out_addr,
-						GHashTableIter *out_iter,
-						unsigned char **out_msgid)
-{
-	GHashTableIter iter_addr;
-	gpointer key, value;
-	const char *r_addr;
-
-	r_addr = sms_address_to_string(&sr->status_report.raddr);
-	g_hash_table_iter_init(&iter_addr, assy->assembly_table);
-
-	while (g_hash_table_iter_next(&iter_addr, &key, &value)) {
-		const char *s_addr = key;
-		GHashTable *id_table = value;
-		unsigned int len, r_len, s_len;
-		unsigned int i;
-		struct id_table_node *node;
-
-		if (r_addr[0] == '+' && s_addr[0] == '+')
-			continue;
+static struct sr_assembly_node *fuzzy_lookup(
+				struct status_report_assembly *assembly,
+				const char *r_addr, unsigned char mr)
+{
+	unsigned int r_len = strlen(r_addr);
+	unsigned int len;
+	struct sr_assembly_node *node;
+	GHashTableIter iter;
+	gpointer key;
 
-		if (r_addr[0] != '+' && s_addr[0] != '+')
-			continue;
+	/*
+	 * Addresses are indexed by their last six characters, shorter ones
+	 * in full, so try the suffixes of the received address in turn.
+	 */
+	for (len = MIN(r_len, SR_SUFFIX_LEN); len > 0; len--) {
+		node = sr_index_find(assembly, r_addr, len, mr, TRUE);
 
-		r_len = strlen(r_addr);
-		s_len = strlen(s_addr);
+		if (node != NULL)
+			return node;
+	}
 
-		len = MIN(6, MIN(r_len, s_len));
+	if (r_len >= SR_SUFFIX_LEN)
+		return NULL;
 
-		for (i = 0; i < len; i++)
-			if (s_addr[s_len - i - 1] != r_addr[r_len - i - 1])
-				break;
+	/* A short received address may still be the end of a longer one */
+	g_hash_table_iter_init(&iter, assembly->mr_table);
 
-		/* Not all digits matched. */
-		if (i < len)
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		struct sr_mr_bucket *bucket = key;
+		unsigned int s_len = strlen(bucket->suffix);
+		GList *l;
+
+		if (bucket->mr != mr || s_len <= r_len)
 			continue;
 
-		/* Address matched. Check message reference. */
-		node = find_by_mr_and_mark(id_table, sr->status_report.mr,
-						out_iter, out_msgid);
-		if (node != NULL) {
-			*out_addr = s_addr;
-			return node;
+		if (strcmp(bucket->suffix + s_len - r_len, r_addr) != 0)
+			continue;
+
+		for (l = bucket->nodes.head; l; l = l->next) {
+			node = l->data;
+
+			if ((node->addr[0] == '+') != (r_addr[0] == '+'))
+				return node;
 		}
 	}
 
@@ -3008,14 +3672,14 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 					unsigned char *out_msgid,
 					gboolean *out_delivered)
 {
+	unsigned char mr = sr->status_report.mr;
+	unsigned int offset = mr / 32;
+	unsigned int bit = 1 << (mr % 32);
 	const char *straddr;
-	GHashTable *id_table;
-	GHashTableIter iter;
 	struct sms_address addr;
-	struct id_table_node *node;
+	struct sr_assembly_node *node;
 	gboolean delivered;
 	gboolean pending;
-	unsigned char *msgid = 0;
 	int i;
 
 	/* We ignore temporary or tempfinal status reports */
@@ -3023,153 +3687,447 @@ gboolean status_report_assembly_report(struct status_report_assembly *assembly,
 		return FALSE;
 
 	straddr = sms_address_to_string(&sr->status_report.raddr);
-	id_table = g_hash_table_lookup(assembly->assembly_table, straddr);
 
-	if (id_table != NULL)
-		node = find_by_mr_and_mark(id_table, sr->status_report.mr,
-						&iter, &msgid);
+	if (g_hash_table_lookup(assembly->assembly_table, straddr) != NULL)
+		node = sr_index_find(assembly, straddr, SR_SUFFIX_LEN,
+					mr, FALSE);
 	else
-		node = fuzzy_lookup(assembly, sr, &straddr, &iter, &msgid);
+		node = fuzzy_lookup(assembly, straddr, mr);
 
 	/* Unable to find a message reference belonging to this address */
 	if (node == NULL)
 		return FALSE;
 
-	node->deliverable = node->deliverable && delivered;
+	/* Address and MR matched */
+	sr_index_remove(assembly, node, mr);
+	node->data.mrs[offset] ^= bit;
+
+	node->data.deliverable = node->data.deliverable && delivered;
 
 	/* If we haven't sent the entire message yet, wait until sent */
-	if (node->sent_mrs < node->total_mrs)
+	if (node->data.sent_mrs < node->data.total_mrs)
 		return FALSE;
 
 	/* Figure out if we are expecting more status reports */
 	for (i = 0, pending = FALSE; i < 8; i++) {
 		/* There are still pending mr(s). */
-		if (node->mrs[i] != 0) {
+		if (node->data.mrs[i] != 0) {
 			pending = TRUE;
 			break;
 		}
 	}
 
-	sms_address_from_string(&addr, straddr);
-
-	if (pending == TRUE && node->deliverable == TRUE) {
+	if (pending == TRUE && node->data.deliverable == TRUE) {
 		/*
 		 * More status reports expected, and already received
 		 * reports completed. Update backup file.
 		 */
-		sr_assembly_add_fragment_backup(assembly->imsi, node,
-						&addr, msgid);
+		sms_address_from_string(&addr, node->addr);
+		sr_assembly_add_fragment_backup(assembly->imsi, &node->data,
+						&addr, node->msgid);
 
 		return FALSE;
 	}
 
 	if (out_delivered)
-		*out_delivered = node->deliverable;
+		*out_delivered = node->data.deliverable;
+
+	if (out_msgid)
+		memcpy(out_msgid, node->msgid, SMS_MSGID_LEN);
+
+	sr_assembly_remove(assembly, node);
+
+	return TRUE;
+}
+
+/*
+ * An expiration of 0 keeps the message waiting until its status reports
+ * arrive or the limit on pending messages drops it.
+ */
+void status_report_assembly_add_fragment(
+					struct status_report_assembly *assembly,
+					const unsigned char *msgid,
+					const struct sms_address *to,
+					unsigned char mr, time_t expiration,
+					unsigned char total_mrs)
+{
+	unsigned int offset = mr / 32;
+	unsigned int bit = 1 << (mr % 32);
+	struct sr_assembly_node *node;
+
+	node = sr_assembly_node_get(assembly, sms_address_to_string(to),
+					msgid);
+
+	/* Freshly created node */
+	if (node->data.sent_mrs == 0)
+		node->data.total_mrs = total_mrs;
+
+	if ((node->data.mrs[offset] & bit) == 0) {
+		node->data.mrs[offset] |= bit;
+		sr_index_add(assembly, node, mr);
+	}
+
+	node->data.sent_mrs++;
+	sr_wheel_insert(assembly, node, expiration);
+	sr_assembly_add_fragment_backup(assembly->imsi, &node->data,
+						to, msgid);
+}
+
+/*
+ * Drops the messages that expired at or before the given time.  Only the
+ * wheel slots for the ticks elapsed since the previous call are visited,
+ * and each of them only up to its first message still valid.
+ */
+void status_report_assembly_expire(struct status_report_assembly *assembly,
+					time_t before)
+{
+	time_t end = MAX(before / SR_WHEEL_TICK, assembly->wheel_tick);
+	time_t tick = assembly->wheel_tick;
+	struct sr_assembly_node *node;
+	GQueue *slot;
+
+	if (end - tick >= SR_WHEEL_SIZE)
+		tick = end - SR_WHEEL_SIZE + 1;
+
+	for (; tick <= end; tick++) {
+		slot = &assembly->wheel[tick % SR_WHEEL_SIZE];
+
+		while ((node = g_queue_peek_head(slot)) != NULL &&
+				node->data.expiration <= before)
+			sr_assembly_remove(assembly, node);
+	}
+
+	assembly->wheel_tick = end;
+}
+
+/*
+ * The outgoing queue is backed up to an append-only journal.  Messages are
+ * identified by their queue id, which only ever grows, so the order of the
+ * queue is that of the ids and nothing needs renaming.  Every PDU stored
+ * adds a record, as does every PDU sent and every message leaving the
+ * queue.  Once more than half of the journal is dead it is rewritten with
+ * only the PDUs still waiting to be sent.
+ */
+enum sms_tx_journal_op {
+	SMS_TX_JOURNAL_STORE = 1,
+	SMS_TX_JOURNAL_REMOVE = 2,
+	SMS_TX_JOURNAL_FREE = 3,
+};
+
+struct sms_tx_journal_record {
+	struct sms_journal_frame frame;
+	guint8 op;
+	guint8 seq;
+	guint8 len;
+	guint8 reserved;
+	guint32 flags;
+	guint64 id;
+	unsigned char uuid[SMS_MSGID_LEN];
+} __attribute__((packed));
+
+struct sms_tx_journal_entry {
+	unsigned long id;
+	const struct sms_tx_journal_record *header;
+	GSList *records;	/* Still to be sent, highest seq first */
+};
+
+static void sms_tx_journal_entry_free(gpointer data)
+{
+	struct sms_tx_journal_entry *entry = data;
+
+	g_slist_free(entry->records);
+	g_free(entry);
+}
+
+static gint sms_tx_journal_entry_compare(gconstpointer a, gconstpointer b)
+{
+	const struct sms_tx_journal_entry *ea = a;
+	const struct sms_tx_journal_entry *eb = b;
+
+	if (ea->id == eb->id)
+		return 0;
+
+	return ea->id < eb->id ? -1 : 1;
+}
+
+static void sms_tx_journal_entry_remove(struct sms_tx_journal_entry *entry,
+					guint8 seq)
+{
+	GSList *l;
+
+	for (l = entry->records; l; l = l->next) {
+		const struct sms_tx_journal_record *rec = l->data;
+
+		if (rec->seq == seq) {
+			entry->records = g_slist_delete_link(entry->records, l);
+			return;
+		}
+	}
+}
+
+/*
+ * Returns the messages still queued in contents, ordered by id, and the
+ * number of records that are no longer needed in dead.
+ */
+static GList *sms_tx_journal_replay(const char *contents, gsize length,
+					unsigned int *dead)
+{
+	GHashTable *entries;
+	struct sms_tx_journal_entry *entry;
+	struct sms_tx_journal_record rec;
+	const struct sms_tx_journal_record *cur;
+	unsigned int total = 0;
+	unsigned int live = 0;
+	gsize pos = 0;
+	GList *ret;
+	GList *l;
+
+	entries = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+					sms_tx_journal_entry_free);
+
+	/* A record cut short by a crash, or damaged, ends the replay */
+	while (length - pos >= sizeof(rec)) {
+		cur = (const struct sms_tx_journal_record *) (contents + pos);
+		memcpy(&rec, cur, sizeof(rec));
+
+		if (length - pos - sizeof(rec) < rec.len)
+			break;
+
+		if (sms_journal_verify((const unsigned char *) cur,
+					sizeof(rec) + rec.len) == FALSE)
+			break;
+
+		pos += sizeof(rec) + rec.len;
+		total += 1;
+
+		entry = g_hash_table_lookup(entries, GSIZE_TO_POINTER(rec.id));
+
+		switch (rec.op) {
+		case SMS_TX_JOURNAL_STORE:
+			if (entry == NULL) {
+				entry = g_new0(struct sms_tx_journal_entry, 1);
+				entry->id = rec.id;
+				entry->header = cur;
+				g_hash_table_insert(entries,
+						GSIZE_TO_POINTER(entry->id),
+						entry);
+			}
+
+			entry->records = g_slist_prepend(entry->records,
+							(gpointer) cur);
+			break;
+		case SMS_TX_JOURNAL_REMOVE:
+			if (entry)
+				sms_tx_journal_entry_remove(entry, rec.seq);
+			break;
+		case SMS_TX_JOURNAL_FREE:
+			g_hash_table_remove(entries, GSIZE_TO_POINTER(rec.id));
+			break;
+		}
+	}
+
+	if (pos != length)
+		total += 1;
+
+	ret = g_hash_table_get_values(entries);
+	g_hash_table_steal_all(entries);
+	g_hash_table_destroy(entries);
+
+	for (l = ret; l; l = l->next) {
+		entry = l->data;
+		live += g_slist_length(entry->records);
+	}
+
+	*dead = total - live;
+
+	return g_list_sort(ret, sms_tx_journal_entry_compare);
+}
+
+static void sms_tx_journal_entries_free(GList *entries)
+{
+	g_list_foreach(entries, (GFunc) sms_tx_journal_entry_free, NULL);
+	g_list_free(entries);
+}
+
+static void sms_tx_journal_open(struct sms_tx_journal *journal)
+{
+	char *path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, journal->imsi);
+
+	if (create_dirs(path, SMS_BACKUP_MODE | S_IXUSR) == 0)
+		journal->fd = TFR(open(path, O_WRONLY | O_CREAT | O_APPEND,
+					SMS_BACKUP_MODE));
+
+	g_free(path);
+}
+
+/* Replace the journal with the records of the messages given */
+static void sms_tx_journal_write(struct sms_tx_journal *journal,
+					GList *entries)
+{
+	GByteArray *buf = g_byte_array_new();
+	GList *l;
+	GSList *r;
+
+	for (l = entries; l; l = l->next) {
+		struct sms_tx_journal_entry *entry = l->data;
+		GSList *records = g_slist_reverse(g_slist_copy(entry->records));
+
+		for (r = records; r; r = r->next) {
+			const struct sms_tx_journal_record *rec = r->data;
+
+			g_byte_array_append(buf, (const guint8 *) rec,
+						sizeof(*rec) + rec->len);
+		}
+
+		g_slist_free(records);
+	}
+
+	if (journal->fd != -1) {
+		TFR(close(journal->fd));
+		journal->fd = -1;
+	}
+
+	if (write_file(buf->data, buf->len, SMS_BACKUP_MODE,
+				SMS_TX_BACKUP_JOURNAL, journal->imsi) ==
+			(ssize_t) buf->len)
+		journal->dead = 0;
+
+	sms_tx_journal_open(journal);
+
+	g_byte_array_free(buf, TRUE);
+}
+
+/*
+ * Drops the records of PDUs already sent and of messages no longer queued,
+ * in case the records saying so didn't make it to the journal.
+ */
+static GList *sms_tx_journal_reconcile(struct sms_tx_journal *journal,
+					GList *entries)
+{
+	struct sms_tx_journal_entry *entry;
+	gpointer count;
+	GSList *r;
+	GList *l;
+	GList *next;
+
+	for (l = entries; l; l = next) {
+		next = l->next;
+		entry = l->data;
+
+		if (g_hash_table_lookup_extended(journal->pending,
+						GSIZE_TO_POINTER(entry->id),
+						NULL, &count) == FALSE) {
+			sms_tx_journal_entry_free(entry);
+			entries = g_list_delete_link(entries, l);
+			continue;
+		}
+
+		/* PDUs go out in order, the ones left have the highest seqs */
+		r = g_slist_nth(entry->records, GPOINTER_TO_UINT(count));
+
+		while (r) {
+			GSList *rnext = r->next;
+
+			entry->records = g_slist_delete_link(entry->records, r);
+			r = rnext;
+		}
+	}
+
+	return entries;
+}
+
+static void sms_tx_journal_compact(struct sms_tx_journal *journal)
+{
+	char *path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, journal->imsi);
+	unsigned int dead;
+	GList *entries;
+	gchar *contents;
+	gsize length;
 
-	if (out_msgid)
-		memcpy(out_msgid, msgid, SMS_MSGID_LEN);
+	if (g_file_get_contents(path, &contents, &length, NULL) == FALSE) {
+		g_free(path);
+		return;
+	}
 
-	sr_assembly_remove_fragment_backup(assembly->imsi, &addr, msgid);
-	id_table = g_hash_table_iter_get_hash_table(&iter);
-	g_hash_table_iter_remove(&iter);
+	g_free(path);
 
-	if (g_hash_table_size(id_table) == 0)
-		g_hash_table_remove(assembly->assembly_table, straddr);
+	entries = sms_tx_journal_replay(contents, length, &dead);
+	entries = sms_tx_journal_reconcile(journal, entries);
+	sms_tx_journal_write(journal, entries);
+	sms_tx_journal_entries_free(entries);
 
-	return TRUE;
+	g_free(contents);
 }
 
-void status_report_assembly_add_fragment(
-					struct status_report_assembly *assembly,
-					const unsigned char *msgid,
-					const struct sms_address *to,
-					unsigned char mr, time_t expiration,
-					unsigned char total_mrs)
+static gboolean sms_tx_journal_append(struct sms_tx_journal *journal,
+					enum sms_tx_journal_op op,
+					unsigned long id, unsigned long flags,
+					const unsigned char *uuid, guint8 seq,
+					const unsigned char *data, int len)
 {
-	unsigned int offset = mr / 32;
-	unsigned int bit = 1 << (mr % 32);
-	GHashTable *id_table;
-	struct id_table_node *node;
-	unsigned char *id_table_key;
+	unsigned char buf[sizeof(struct sms_tx_journal_record) + 177];
+	struct sms_tx_journal_record rec;
 
-	id_table = g_hash_table_lookup(assembly->assembly_table,
-					sms_address_to_string(to));
+	if (journal->fd == -1)
+		goto failed;
 
-	/* Create hashtable keyed by the to address if required */
-	if (id_table == NULL) {
-		id_table = g_hash_table_new_full(sha1_hash, sha1_equal,
-								g_free, g_free);
-		g_hash_table_insert(assembly->assembly_table,
-					g_strdup(sms_address_to_string(to)),
-					id_table);
-	}
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.seq = seq;
+	rec.len = len;
+	rec.flags = flags;
+	rec.id = id;
 
-	node = g_hash_table_lookup(id_table, msgid);
+	if (uuid)
+		memcpy(rec.uuid, uuid, SMS_MSGID_LEN);
 
-	/* Create node in the message id hashtable if required */
-	if (node == NULL) {
-		id_table_key = g_memdup(msgid, SMS_MSGID_LEN);
+	memcpy(buf, &rec, sizeof(rec));
 
-		node = g_new0(struct id_table_node, 1);
-		node->total_mrs = total_mrs;
-		node->deliverable = TRUE;
+	if (len > 0)
+		memcpy(buf + sizeof(rec), data, len);
 
-		g_hash_table_insert(id_table, id_table_key, node);
-	}
+	sms_journal_seal(buf, sizeof(rec) + len);
+
+	if (sms_journal_write(journal->fd, buf, sizeof(rec) + len) == TRUE)
+		return TRUE;
+
+failed:
+	/* Have the next check rewrite the journal without the record */
+	journal->dead = G_MAXINT;
 
-	/* id_table and node both exists */
-	node->mrs[offset] |= bit;
-	node->expiration = expiration;
-	node->sent_mrs++;
-	sr_assembly_add_fragment_backup(assembly->imsi, node, to, msgid);
+	return FALSE;
 }
 
-void status_report_assembly_expire(struct status_report_assembly *assembly,
-					time_t before)
+static void sms_tx_journal_check(struct sms_tx_journal *journal)
 {
-	GHashTable *id_table;
-	GHashTableIter iter_addr, iter_node;
-	struct sms_address addr;
-	char *straddr;
-	gpointer key;
-	struct id_table_node *node;
+	if (journal->dead < SMS_TX_JOURNAL_MIN_DEAD ||
+			journal->dead <= journal->live)
+		return;
+
+	sms_tx_journal_compact(journal);
+}
 
-	g_hash_table_iter_init(&iter_addr, assembly->assembly_table);
+struct sms_tx_journal *sms_tx_journal_new(const char *imsi)
+{
+	struct sms_tx_journal *journal = g_new0(struct sms_tx_journal, 1);
 
-	/*
-	 * Go through different addresses. Each address can relate to
-	 * 1-n msg_ids.
-	 */
-	while (g_hash_table_iter_next(&iter_addr, (gpointer) &straddr,
-					(gpointer) &id_table)) {
+	journal->fd = -1;
+	journal->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-		sms_address_from_string(&addr, straddr);
-		g_hash_table_iter_init(&iter_node, id_table);
+	if (imsi)
+		journal->imsi = g_strdup(imsi);
 
-		/* Go through different messages. */
-		while (g_hash_table_iter_next(&iter_node, &key,
-						(gpointer) &node)) {
-			/*
-			 * If message is expired, removed it from the
-			 * hash-table and remove the backup-file
-			 */
-			if (node->expiration <= before) {
-				g_hash_table_iter_remove(&iter_node);
+	return journal;
+}
 
-				sr_assembly_remove_fragment_backup(
-								assembly->imsi,
-								&addr,
-								key);
-			}
-		}
+void sms_tx_journal_free(struct sms_tx_journal *journal)
+{
+	if (journal->fd != -1)
+		TFR(close(journal->fd));
 
-		/*
-		 * If all messages are removed, remove address
-		 * from the hash-table.
-		 */
-		if (g_hash_table_size(id_table) == 0)
-			g_hash_table_iter_remove(&iter_addr);
-	}
+	g_hash_table_destroy(journal->pending);
+	g_free(journal->imsi);
+	g_free(journal);
 }
 
 static int sms_tx_load_filter(const struct dirent *dent)
@@ -3188,46 +4146,52 @@ static int sms_tx_load_filter(const struct dirent *dent)
 }
 
 /*
- * Each directory contains a file per pdu.
+ * Moves a message queued by the one directory per message scheme over to
+ * the journal.  Each directory contains a file per pdu.
  */
-static GSList *sms_tx_load(const char *imsi, const struct dirent *dir)
+static GSList *sms_tx_load(struct sms_tx_journal *journal,
+				const struct dirent *dir, unsigned long id,
+				unsigned long flags, const unsigned char *uuid)
 {
 	GSList *list = NULL;
 	struct dirent **pdus;
 	char *path;
-	int len, r;
+	char *file;
+	int len, r, i;
 	unsigned char buf[177];
 	struct sms s;
 
-	if (dir->d_type != DT_DIR)
-		return NULL;
-
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH "/%s", imsi, dir->d_name);
+	path = g_strdup_printf(SMS_TX_BACKUP_PATH "/%s",
+					journal->imsi, dir->d_name);
 	len = scandir(path, &pdus, sms_tx_load_filter, versionsort);
-	g_free(path);
 
-	if (len < 0)
+	if (len < 0) {
+		g_free(path);
 		return NULL;
+	}
 
-	while (len--) {
-		r = read_file(buf, sizeof(buf), SMS_TX_BACKUP_PATH "/%s/%s",
-					imsi, dir->d_name, pdus[len]->d_name);
-
-		if (r < 0)
-			goto free_pdu;
-
-		if (sms_deserialize_outgoing(buf, &s, r) == FALSE)
-			goto free_pdu;
-
-		list = g_slist_prepend(list, g_memdup(&s, sizeof(s)));
+	for (i = 0; i < len; i++) {
+		file = g_strdup_printf("%s/%s", path, pdus[i]->d_name);
+		r = read_file(buf, sizeof(buf), "%s", file);
+
+		if (r >= 0 && sms_deserialize_outgoing(buf, &s, r)) {
+			list = g_slist_prepend(list, g_memdup(&s, sizeof(s)));
+			sms_tx_journal_append(journal, SMS_TX_JOURNAL_STORE,
+						id, flags, uuid,
+						atoi(pdus[i]->d_name), buf, r);
+		}
 
-free_pdu:
-		g_free(pdus[len]);
+		unlink(file);
+		g_free(file);
+		g_free(pdus[i]);
 	}
 
 	g_free(pdus);
 
-	return list;
+	rmdir(path);
+	g_free(path);
+
+	return g_slist_reverse(list);
 }
 
 static int sms_tx_queue_filter(const struct dirent *dirent)
@@ -3241,157 +4205,226 @@ static int sms_tx_queue_filter(const struct dirent *dirent)
 	return 1;
 }
 
-/*
- * populate the queue with tx_backup_entry from stored backup
- * data.
- */
-GQueue *sms_tx_queue_load(const char *imsi)
+static void sms_tx_queue_migrate(struct sms_tx_journal *journal,
+					GQueue *queue)
 {
-	GQueue *retq = 0;
 	char *path;
 	struct dirent **entries;
 	int len;
 	int i;
 	unsigned long id;
 
-	if (imsi == NULL)
-		return NULL;
-
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH, imsi);
-
+	path = g_strdup_printf(SMS_TX_BACKUP_PATH, journal->imsi);
 	len = scandir(path, &entries, sms_tx_queue_filter, versionsort);
+	g_free(path);
+
 	if (len < 0)
-		goto nodir_exit;
+		return;
 
-	retq = g_queue_new();
+	sms_tx_journal_open(journal);
 
 	for (i = 0, id = 0; i < len; i++) {
 		char uuid[SMS_MSGID_LEN * 2 + 1];
 		GSList *msg_list;
 		unsigned long oldid;
 		unsigned long flags;
-		char *oldpath, *newpath;
 		struct txq_backup_entry *entry;
 		struct dirent *dir = entries[i];
 		char endc;
 
 		if (sscanf(dir->d_name, "%lu-%lu-" SMS_MSGID_FMT "%c",
 					&oldid, &flags, uuid, &endc) != 3)
-			continue;
+			goto next;
 
 		if (strlen(uuid) !=  2 * SMS_MSGID_LEN)
-			continue;
-
-		msg_list = sms_tx_load(imsi, dir);
-		if (msg_list == NULL)
-			continue;
+			goto next;
 
 		entry = g_new0(struct txq_backup_entry, 1);
+		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
+
+		msg_list = sms_tx_load(journal, dir, id, flags, entry->uuid);
+		if (msg_list == NULL) {
+			g_free(entry);
+			goto next;
+		}
+
 		entry->msg_list = msg_list;
 		entry->flags = flags;
-		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
+		entry->id = id++;
 
-		g_queue_push_tail(retq, entry);
+		g_queue_push_tail(queue, entry);
 
-		/* Don't bother re-shuffling the ids if they are the same */
-		if (oldid == id) {
-			id++;
-			continue;
+next:
+		g_free(entries[i]);
+	}
+
+	g_free(entries);
+}
+
+/*
+ * populate the queue with tx_backup_entry from stored backup
+ * data.
+ */
+GQueue *sms_tx_queue_load(struct sms_tx_journal *journal)
+{
+	GQueue *retq;
+	char *path;
+	gchar *contents;
+	gsize length;
+	GList *entries;
+	GList *l;
+	GSList *r;
+
+	if (journal->imsi == NULL)
+		return NULL;
+
+	retq = g_queue_new();
+
+	path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, journal->imsi);
+
+	if (g_file_get_contents(path, &contents, &length, NULL) == FALSE) {
+		g_free(path);
+		sms_tx_queue_migrate(journal, retq);
+		goto done;
+	}
+
+	g_free(path);
+
+	entries = sms_tx_journal_replay(contents, length, &journal->dead);
+
+	for (l = entries; l; l = l->next) {
+		struct sms_tx_journal_entry *entry = l->data;
+		struct txq_backup_entry *backup;
+		GSList *msg_list = NULL;
+		struct sms s;
+
+		for (r = entry->records; r; r = r->next) {
+			const struct sms_tx_journal_record *rec = r->data;
+
+			if (sms_deserialize_outgoing((const guint8 *) (rec + 1),
+							&s, rec->len) == FALSE)
+				continue;
+
+			msg_list = g_slist_prepend(msg_list,
+						g_memdup(&s, sizeof(s)));
 		}
 
-		oldpath = g_strdup_printf("%s/%s", path, dir->d_name);
-		newpath = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-						imsi, id++, flags, uuid);
+		if (msg_list == NULL)
+			continue;
 
-		/* rename directory to reflect new position in queue */
-		rename(oldpath, newpath);
+		backup = g_new0(struct txq_backup_entry, 1);
+		backup->msg_list = msg_list;
+		backup->flags = entry->header->flags;
+		backup->id = entry->id;
+		memcpy(backup->uuid, entry->header->uuid, SMS_MSGID_LEN);
 
-		g_free(newpath);
-		g_free(oldpath);
+		g_queue_push_tail(retq, backup);
 	}
 
-	for (i = 0; i < len; i++)
-		g_free(entries[i]);
+	if (journal->dead > 0)
+		sms_tx_journal_write(journal, entries);
+	else
+		sms_tx_journal_open(journal);
 
-	g_free(entries);
+	sms_tx_journal_entries_free(entries);
+	g_free(contents);
+
+done:
+	for (l = retq->head; l; l = l->next) {
+		struct txq_backup_entry *backup = l->data;
+		unsigned int count = g_slist_length(backup->msg_list);
+
+		g_hash_table_insert(journal->pending,
+					GSIZE_TO_POINTER(backup->id),
+					GUINT_TO_POINTER(count));
+		journal->live += count;
+	}
+
+	/* In case appending failed while migrating */
+	sms_tx_journal_check(journal);
 
-nodir_exit:
-	g_free(path);
 	return retq;
 }
 
-gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq, const unsigned char *pdu,
-				int pdu_len, int tpdu_len)
+gboolean sms_tx_backup_store(struct sms_tx_journal *journal,
+				unsigned long id, unsigned long flags,
+				const char *uuid, guint8 seq,
+				const unsigned char *pdu, int pdu_len,
+				int tpdu_len)
 {
 	unsigned char buf[177];
-	int len;
+	unsigned char msgid[SMS_MSGID_LEN];
+	gpointer count;
 
-	if (!imsi)
+	if (journal->imsi == NULL)
+		return FALSE;
+
+	if (journal->fd == -1)
+		sms_tx_journal_open(journal);
+
+	if (journal->fd == -1)
 		return FALSE;
 
 	memcpy(buf + 1, pdu, pdu_len);
 	buf[0] = tpdu_len;
-	len = pdu_len + 1;
 
-	/*
-	 * file name is: imsi/tx_queue/order-flags-uuid/pdu
-	 */
-	if (write_file(buf, len, SMS_BACKUP_MODE, SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq) != len)
+	decode_hex_own_buf(uuid, -1, NULL, 0, msgid);
+
+	if (sms_tx_journal_append(journal, SMS_TX_JOURNAL_STORE, id, flags,
+					msgid, seq, buf, pdu_len + 1) == FALSE) {
+		sms_tx_journal_check(journal);
 		return FALSE;
+	}
+
+	count = g_hash_table_lookup(journal->pending, GSIZE_TO_POINTER(id));
+	g_hash_table_insert(journal->pending, GSIZE_TO_POINTER(id),
+				GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+	journal->live += 1;
 
 	return TRUE;
 }
 
-void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid)
+void sms_tx_backup_free(struct sms_tx_journal *journal, unsigned long id)
 {
-	char *path;
-	struct dirent **entries;
-	int len;
-
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-					imsi, id, flags, uuid);
-
-	len = scandir(path, &entries, NULL, versionsort);
-
-	if (len < 0)
-		goto nodir_exit;
-
-	/* skip '..' and '.' entries */
-	while (len-- > 2) {
-		struct dirent *dir = entries[len];
-		char *file = g_strdup_printf("%s/%s", path, dir->d_name);
+	gpointer count;
 
-		unlink(file);
-		g_free(file);
+	if (g_hash_table_lookup_extended(journal->pending,
+						GSIZE_TO_POINTER(id),
+						NULL, &count) == FALSE)
+		return;
 
-		g_free(entries[len]);
-	}
+	g_hash_table_remove(journal->pending, GSIZE_TO_POINTER(id));
 
-	g_free(entries[1]);
-	g_free(entries[0]);
-	g_free(entries);
+	sms_tx_journal_append(journal, SMS_TX_JOURNAL_FREE, id, 0, NULL, 0,
+				NULL, 0);
 
-	rmdir(path);
+	journal->live -= GPOINTER_TO_UINT(count);
+	journal->dead += GPOINTER_TO_UINT(count) + 1;
 
-nodir_exit:
-	g_free(path);
+	sms_tx_journal_check(journal);
 }
 
-void sms_tx_backup_remove(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
+void sms_tx_backup_remove(struct sms_tx_journal *journal, unsigned long id,
 				guint8 seq)
 {
-	char *path;
+	gpointer count;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq);
-	unlink(path);
+	count = g_hash_table_lookup(journal->pending, GSIZE_TO_POINTER(id));
+	if (count == NULL)
+		return;
 
-	g_free(path);
+	g_hash_table_insert(journal->pending, GSIZE_TO_POINTER(id),
+				GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+
+	journal->live -= 1;
+
+	if (sms_tx_journal_append(journal, SMS_TX_JOURNAL_REMOVE, id, 0, NULL,
+					seq, NULL, 0) == FALSE) {
+		sms_tx_journal_check(journal);
+		return;
+	}
+
+	journal->dead += 2;
 }
 
 static inline GSList *sms_list_append(GSList *l, const struct sms *in)
@@ -4209,27 +5242,46 @@ static inline gboolean cbs_is_update_newer(unsigned int n, unsigned int o)
 	return FALSE;
 }
 
+#define CBS_SERIAL_KEY(serial) GUINT_TO_POINTER((serial) & (~0xf))
+
 struct cbs_assembly *cbs_assembly_new(void)
 {
-	return g_new0(struct cbs_assembly, 1);
+	struct cbs_assembly *assembly = g_new0(struct cbs_assembly, 1);
+
+	assembly->assembly_table = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
+	assembly->recv_plmn = g_hash_table_new(g_direct_hash, g_direct_equal);
+	assembly->recv_loc = g_hash_table_new(g_direct_hash, g_direct_equal);
+	assembly->recv_cell = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return assembly;
+}
+
+static void cbs_assembly_node_free(gpointer data, gpointer user_data)
+{
+	struct cbs_assembly_node *node = data;
+
+	g_slist_foreach(node->pages, (GFunc) g_free, NULL);
+	g_slist_free(node->pages);
+	g_free(node);
 }
 
 void cbs_assembly_free(struct cbs_assembly *assembly)
 {
-	GSList *l;
+	GHashTableIter iter;
+	gpointer value;
 
-	for (l = assembly->assembly_list; l; l = l->next) {
-		struct cbs_assembly_node *node = l->data;
+	g_hash_table_iter_init(&iter, assembly->assembly_table);
 
-		g_slist_foreach(node->pages, (GFunc) g_free, 0);
-		g_slist_free(node->pages);
-		g_free(node);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		g_slist_foreach(value, cbs_assembly_node_free, NULL);
+		g_slist_free(value);
 	}
 
-	g_slist_free(assembly->assembly_list);
-	g_slist_free(assembly->recv_plmn);
-	g_slist_free(assembly->recv_loc);
-	g_slist_free(assembly->recv_cell);
+	g_hash_table_destroy(assembly->assembly_table);
+	g_hash_table_destroy(assembly->recv_plmn);
+	g_hash_table_destroy(assembly->recv_loc);
+	g_hash_table_destroy(assembly->recv_cell);
 
 	g_free(assembly);
 }
@@ -4259,33 +5311,16 @@ static gint cbs_compare_node_by_update(gconstpointer a, gconstpointer b)
 	return 0;
 }
 
-static gint cbs_compare_recv_by_serial(gconstpointer a, gconstpointer b)
-{
-	unsigned int old_serial = GPOINTER_TO_UINT(a);
-	unsigned int new_serial = GPOINTER_TO_UINT(b);
-
-	if ((old_serial & (~0xf)) == (new_serial & (~0xf)))
-		return 0;
-
-	return 1;
-}
-
-static void cbs_assembly_expire(struct cbs_assembly *assembly,
-				GCompareFunc func, gconstpointer *userdata)
+/* Frees the nodes of the list func matches and returns what is left */
+static GSList *cbs_assembly_expire_list(GSList *list, GCompareFunc func,
+					gconstpointer userdata)
 {
 	GSList *l;
 	GSList *prev;
 	GSList *tmp;
 
-	/*
-	 * Take care of the case where several updates are being
-	 * reassembled at the same time. If the newer one is assembled
-	 * first, then the subsequent old update is discarded, make
-	 * sure that we're also discarding the assembly node for the
-	 * partially assembled ones
-	 */
 	prev = NULL;
-	l = assembly->assembly_list;
+	l = list;
 
 	while (l) {
 		struct cbs_assembly_node *node = l->data;
@@ -4299,15 +5334,35 @@ static void cbs_assembly_expire(struct cbs_assembly *assembly,
 		if (prev)
 			prev->next = l->next;
 		else
-			assembly->assembly_list = l->next;
+			list = l->next;
 
-		g_slist_foreach(node->pages, (GFunc) g_free, NULL);
-		g_slist_free(node->pages);
-		g_free(node->pages);
+		cbs_assembly_node_free(node, NULL);
 		tmp = l;
 		l = l->next;
 		g_slist_free_1(tmp);
 	}
+
+	return list;
+}
+
+static void cbs_assembly_expire_gs(struct cbs_assembly *assembly,
+					enum cbs_geo_scope gs)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, assembly->assembly_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GSList *list = value;
+
+		/* All the nodes of a list share the geographical scope */
+		list = cbs_assembly_expire_list(list, cbs_compare_node_by_gs,
+						GUINT_TO_POINTER(gs));
+
+		if (list == NULL)
+			g_hash_table_iter_remove(&iter);
+	}
 }
 
 void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
@@ -4324,36 +5379,29 @@ void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
 	 * next cell according to whether the next cell is in the same Service
 	 * Area as the current cell)
 	 *
-	 * NOTE 4: According to 3GPP TS 23.003 [2] a Service Area consists of
+	 * NOTE 4: According to 3GPP TS 23.003 [2] a Service Area consists of
 	 * one cell only.
 	 */
 
 	if (plmn) {
 		lac = TRUE;
-		g_slist_free(assembly->recv_plmn);
-		assembly->recv_plmn = NULL;
+		g_hash_table_remove_all(assembly->recv_plmn);
 
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
-				GUINT_TO_POINTER(CBS_GEO_SCOPE_PLMN));
+		cbs_assembly_expire_gs(assembly, CBS_GEO_SCOPE_PLMN);
 	}
 
 	if (lac) {
 		/* If LAC changed, then cell id has changed */
 		ci = TRUE;
-		g_slist_free(assembly->recv_loc);
-		assembly->recv_loc = NULL;
+		g_hash_table_remove_all(assembly->recv_loc);
 
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
-				GUINT_TO_POINTER(CBS_GEO_SCOPE_SERVICE_AREA));
+		cbs_assembly_expire_gs(assembly, CBS_GEO_SCOPE_SERVICE_AREA);
 	}
 
 	if (ci) {
-		g_slist_free(assembly->recv_cell);
-		assembly->recv_cell = NULL;
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
-				GUINT_TO_POINTER(CBS_GEO_SCOPE_CELL_IMMEDIATE));
-		cbs_assembly_expire(assembly, cbs_compare_node_by_gs,
-				GUINT_TO_POINTER(CBS_GEO_SCOPE_CELL_NORMAL));
+		g_hash_table_remove_all(assembly->recv_cell);
+		cbs_assembly_expire_gs(assembly, CBS_GEO_SCOPE_CELL_IMMEDIATE);
+		cbs_assembly_expire_gs(assembly, CBS_GEO_SCOPE_CELL_NORMAL);
 	}
 }
 
@@ -4364,38 +5412,39 @@ GSList *cbs_assembly_add_page(struct cbs_assembly *assembly,
 	struct cbs_assembly_node *node;
 	GSList *completed;
 	unsigned int new_serial;
-	GSList **recv;
+	gpointer key;
+	gpointer old_serial;
+	gboolean seen;
+	GHashTable *recv;
+	GSList *list;
 	GSList *l;
-	GSList *prev;
 	int position;
+	int j;
 
 	new_serial = cbs->gs << 14;
 	new_serial |= cbs->message_code << 4;
 	new_serial |= cbs->update_number;
 	new_serial |= cbs->message_identifier << 16;
+	key = CBS_SERIAL_KEY(new_serial);
 
 	if (cbs->gs == CBS_GEO_SCOPE_PLMN)
-		recv = &assembly->recv_plmn;
+		recv = assembly->recv_plmn;
 	else if (cbs->gs == CBS_GEO_SCOPE_SERVICE_AREA)
-		recv = &assembly->recv_loc;
+		recv = assembly->recv_loc;
 	else
-		recv = &assembly->recv_cell;
+		recv = assembly->recv_cell;
 
 	/* Have we seen this message before? */
-	l = g_slist_find_custom(*recv, GUINT_TO_POINTER(new_serial),
-				cbs_compare_recv_by_serial);
+	seen = g_hash_table_lookup_extended(recv, key, NULL, &old_serial);
 
 	/* If we have, is the message newer? */
-	if (l && !cbs_is_update_newer(new_serial, GPOINTER_TO_UINT(l->data)))
+	if (seen && !cbs_is_update_newer(new_serial,
+						GPOINTER_TO_UINT(old_serial)))
 		return NULL;
 
 	/* Easy case first, page 1 of 1 */
 	if (cbs->max_pages == 1 && cbs->page == 1) {
-		if (l)
-			l->data = GUINT_TO_POINTER(new_serial);
-		else
-			*recv = g_slist_prepend(*recv,
-						GUINT_TO_POINTER(new_serial));
+		g_hash_table_insert(recv, key, GUINT_TO_POINTER(new_serial));
 
 		newcbs = g_new(struct cbs, 1);
 		memcpy(newcbs, cbs, sizeof(struct cbs));
@@ -4404,37 +5453,31 @@ GSList *cbs_assembly_add_page(struct cbs_assembly *assembly,
 		return completed;
 	}
 
-	prev = NULL;
-	position = 0;
+	list = g_hash_table_lookup(assembly->assembly_table, key);
 
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		int j;
+	/* At most one node per update number */
+	for (l = list; l; l = l->next) {
 		node = l->data;
 
-		if (new_serial != node->serial)
-			continue;
-
-		if (node->bitmap & (1 << cbs->page))
-			return NULL;
+		if (new_serial == node->serial)
+			break;
+	}
 
-		for (j = 1; j < cbs->page; j++)
-			if (node->bitmap & (1 << j))
-				position += 1;
+	if (l == NULL) {
+		node = g_new0(struct cbs_assembly_node, 1);
+		node->serial = new_serial;
 
-		goto out;
+		list = g_slist_prepend(list, node);
+		g_hash_table_insert(assembly->assembly_table, key, list);
 	}
 
-	node = g_new0(struct cbs_assembly_node, 1);
-	node->serial = new_serial;
-
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
+	if (node->bitmap & (1 << cbs->page))
+		return NULL;
 
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
+	for (j = 1, position = 0; j < cbs->page; j++)
+		if (node->bitmap & (1 << j))
+			position += 1;
 
-out:
 	newcbs = g_new(struct cbs, 1);
 	memcpy(newcbs, cbs, sizeof(struct cbs));
 	node->pages = g_slist_insert(node->pages, newcbs, position);
@@ -4444,18 +5487,24 @@ out:
 		return NULL;
 
 	completed = node->pages;
+	node->pages = NULL;
 
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
+	/*
+	 * Take care of the case where several updates are being
+	 * reassembled at the same time. If the newer one is assembled
+	 * first, then the subsequent old update is discarded, make
+	 * sure that we're also discarding the assembly node for the
+	 * partially assembled ones
+	 */
+	list = cbs_assembly_expire_list(list, cbs_compare_node_by_update,
+					GUINT_TO_POINTER(new_serial));
 
-	g_free(node);
-	g_slist_free_1(l);
+	if (list == NULL)
+		g_hash_table_remove(assembly->assembly_table, key);
+	else
+		g_hash_table_insert(assembly->assembly_table, key, list);
 
-	cbs_assembly_expire(assembly, cbs_compare_node_by_update,
-				GUINT_TO_POINTER(new_serial));
-	*recv = g_slist_prepend(*recv, GUINT_TO_POINTER(new_serial));
+	g_hash_table_insert(recv, key, GUINT_TO_POINTER(new_serial));
 
 	return completed;
 }
@@ -4681,24 +5730,87 @@ char *cbs_topic_ranges_to_string(GSList *ranges)
 	return ret;
 }
 
-static gint cbs_topic_compare(gconstpointer a, gconstpointer b)
+static int cbs_topic_range_compare(const void *a, const void *b)
 {
-	const struct cbs_topic_range *range = a;
-	unsigned short topic = GPOINTER_TO_UINT(b);
+	const struct cbs_topic_range *ra = a;
+	const struct cbs_topic_range *rb = b;
 
-	if (topic >= range->min && topic <= range->max)
-		return 0;
+	return (int) ra->min - (int) rb->min;
+}
 
-	return 1;
+/*
+ * Sorts the ranges into an array, merging those that overlap or touch, so
+ * that a topic can be looked up with a binary search.
+ */
+struct cbs_topic_set *cbs_topic_set_new(GSList *ranges)
+{
+	struct cbs_topic_set *set = g_new0(struct cbs_topic_set, 1);
+	struct cbs_topic_range *ra;
+	unsigned int len = g_slist_length(ranges);
+	unsigned int i;
+	GSList *l;
+
+	if (len == 0)
+		return set;
+
+	ra = g_new(struct cbs_topic_range, len);
+
+	for (l = ranges, i = 0; l; l = l->next, i++)
+		memcpy(&ra[i], l->data, sizeof(struct cbs_topic_range));
+
+	qsort(ra, len, sizeof(struct cbs_topic_range),
+		cbs_topic_range_compare);
+
+	for (i = 1; i < len; i++) {
+		struct cbs_topic_range *last = &ra[set->len];
+
+		if (ra[i].min <= last->max + 1) {
+			last->max = MAX(last->max, ra[i].max);
+			continue;
+		}
+
+		ra[++set->len] = ra[i];
+	}
+
+	set->len += 1;
+	set->ranges = ra;
+
+	return set;
 }
 
-gboolean cbs_topic_in_range(unsigned int topic, GSList *ranges)
+void cbs_topic_set_free(struct cbs_topic_set *set)
 {
-	if (ranges == NULL)
+	if (set == NULL)
+		return;
+
+	g_free(set->ranges);
+	g_free(set);
+}
+
+gboolean cbs_topic_in_range(unsigned int topic,
+				const struct cbs_topic_set *set)
+{
+	unsigned int low = 0;
+	unsigned int high;
+
+	if (set == NULL)
 		return FALSE;
 
-	return g_slist_find_custom(ranges, GUINT_TO_POINTER(topic),
-					cbs_topic_compare) != NULL;
+	high = set->len;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		const struct cbs_topic_range *range = &set->ranges[mid];
+
+		if (topic < range->min)
+			high = mid;
+		else if (topic > range->max)
+			low = mid + 1;
+		else
+			return TRUE;
+	}
+
+	return FALSE;
 }
 
 char *ussd_decode(int dcs, int len, const unsigned char *data)
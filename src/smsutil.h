@@ -21,6 +21,7 @@
 
 #define CBS_MAX_GSM_CHARS 93
 #define SMS_MSGID_LEN 20
+#define STATUS_REPORT_ASSEMBLY_MAX_PENDING 4096
 
 enum sms_type {
 	SMS_TYPE_DELIVER = 0,
@@ -374,7 +375,9 @@ struct sms_assembly_node {
 
 struct sms_assembly {
 	const char *imsi;
-	GSList *assembly_list;
+	GHashTable *assembly_table;
+	int journal_fd;
+	unsigned int journal_dead;
 };
 
 struct id_table_node {
@@ -388,6 +391,11 @@ struct id_table_node {
 struct status_report_assembly {
 	const char *imsi;
 	GHashTable *assembly_table;
+	GHashTable *mr_table;
+	GQueue *wheel;
+	time_t wheel_tick;
+	GQueue *pending;
+	unsigned int max_pending;
 };
 
 struct cbs {
@@ -407,11 +415,15 @@ struct cbs_assembly_node {
 	GSList *pages;
 };
 
+/*
+ * Keyed by the serial without the update number, so that all the updates
+ * of a message are found together.
+ */
 struct cbs_assembly {
-	GSList *assembly_list;
-	GSList *recv_plmn;
-	GSList *recv_loc;
-	GSList *recv_cell;
+	GHashTable *assembly_table;
+	GHashTable *recv_plmn;
+	GHashTable *recv_loc;
+	GHashTable *recv_cell;
 };
 
 struct cbs_topic_range {
@@ -419,10 +431,25 @@ struct cbs_topic_range {
 	unsigned short max;
 };
 
+/* Sorted, non-overlapping ranges */
+struct cbs_topic_set {
+	struct cbs_topic_range *ranges;
+	unsigned int len;
+};
+
 struct txq_backup_entry {
 	GSList *msg_list;
 	unsigned char uuid[SMS_MSGID_LEN];
 	unsigned long flags;
+	unsigned long id;
+};
+
+struct sms_tx_journal {
+	char *imsi;
+	int fd;
+	GHashTable *pending;
+	unsigned int live;
+	unsigned int dead;
 };
 
 static inline gboolean is_bit_set(unsigned char oct, int bit)
@@ -474,6 +501,7 @@ gboolean sms_encode_scts(const struct sms_scts *in, unsigned char *pdu,
 int sms_udl_in_bytes(guint8 ud_len, guint8 dcs);
 
 time_t sms_scts_to_time(const struct sms_scts *scts, struct tm *remote);
+time_t sms_submit_expiration(const struct sms_submit *submit, time_t sent);
 
 const char *sms_address_to_string(const struct sms_address *addr);
 void sms_address_from_string(struct sms_address *addr, const char *str);
@@ -533,17 +561,21 @@ void status_report_assembly_add_fragment(struct status_report_assembly
 					unsigned char total_mrs);
 void status_report_assembly_expire(struct status_report_assembly *assembly,
 					time_t before);
-
-gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq, const unsigned char *pdu,
-				int pdu_len, int tpdu_len);
-void sms_tx_backup_remove(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
+void status_report_assembly_set_max_pending(
+				struct status_report_assembly *assembly,
+				unsigned int max);
+
+struct sms_tx_journal *sms_tx_journal_new(const char *imsi);
+void sms_tx_journal_free(struct sms_tx_journal *journal);
+gboolean sms_tx_backup_store(struct sms_tx_journal *journal,
+				unsigned long id, unsigned long flags,
+				const char *uuid, guint8 seq,
+				const unsigned char *pdu, int pdu_len,
+				int tpdu_len);
+void sms_tx_backup_remove(struct sms_tx_journal *journal, unsigned long id,
 				guint8 seq);
-void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid);
-GQueue *sms_tx_queue_load(const char *imsi);
+void sms_tx_backup_free(struct sms_tx_journal *journal, unsigned long id);
+GQueue *sms_tx_queue_load(struct sms_tx_journal *journal);
 
 GSList *sms_text_prepare(const char *to, const char *utf8, guint16 ref,
 				gboolean use_16bit,
@@ -583,7 +615,10 @@ void cbs_assembly_location_changed(struct cbs_assembly *assembly, gboolean plmn,
 char *cbs_topic_ranges_to_string(GSList *ranges);
 GSList *cbs_extract_topic_ranges(const char *ranges);
 GSList *cbs_optimize_ranges(GSList *ranges);
-gboolean cbs_topic_in_range(unsigned int topic, GSList *ranges);
+struct cbs_topic_set *cbs_topic_set_new(GSList *ranges);
+void cbs_topic_set_free(struct cbs_topic_set *set);
+gboolean cbs_topic_in_range(unsigned int topic,
+				const struct cbs_topic_set *set);
 
 char *ussd_decode(int dcs, int len, const unsigned char *data);
 gboolean ussd_encode(const char *str, long *items_written, unsigned char *pdu);
@@ -159,61 +159,282 @@ error_create_dirs:
 	return r;
 }
 
+/*
+ * Settings stores are written back lazily: storage_sync only marks a store
+ * dirty and the contents are serialized and written once per
+ * STORAGE_SYNC_TIMEOUT, so that a burst of property changes costs a
+ * single write.  The writes are done off the main loop by a writer
+ * thread, in the order they were queued.
+ */
+#define STORAGE_SYNC_TIMEOUT 2
+
+/* The unit tests point this at a scratch directory */
+#ifndef STORAGE_ROOT
+#define STORAGE_ROOT STORAGEDIR
+#endif
+
+struct storage_file {
+	char *path;
+	GKeyFile *keyfile;	/* Synced, but not serialized yet */
+	char *data;		/* Latest contents */
+	gsize length;
+	gboolean dirty;
+	unsigned int writes;	/* Queued to the writer thread */
+};
+
+static GHashTable *storage_files;
+static guint storage_source;
+
+static char *storage_path(const char *imsi, const char *store)
+{
+	if (imsi)
+		return g_strdup_printf(STORAGE_ROOT "/%s/%s", imsi, store);
+
+	return g_strdup_printf(STORAGE_ROOT "/%s", store);
+}
+
+static void storage_file_free(gpointer data)
+{
+	struct storage_file *file = data;
+
+	g_free(file->path);
+	g_free(file->data);
+	g_free(file);
+}
+
+static void storage_file_serialize(struct storage_file *file)
+{
+	if (file->keyfile == NULL)
+		return;
+
+	g_free(file->data);
+	file->data = g_key_file_to_data(file->keyfile, &file->length, NULL);
+	file->keyfile = NULL;
+}
+
+static void storage_write(const char *path, const char *data, gsize length)
+{
+	if (create_dirs(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+		return;
+
+	g_file_set_contents(path, data, length, NULL);
+}
+
+struct storage_write_job {
+	char *path;
+	char *data;
+	gsize length;
+};
+
+static GThreadPool *storage_writer;
+static GAsyncQueue *storage_done;	/* Jobs written by the writer thread */
+
+static void storage_write_job_done(struct storage_write_job *job)
+{
+	struct storage_file *file;
+
+	file = g_hash_table_lookup(storage_files, job->path);
+
+	if (file && --file->writes == 0 && file->dirty == FALSE)
+		g_hash_table_remove(storage_files, job->path);
+
+	g_free(job->path);
+	g_free(job->data);
+	g_free(job);
+}
+
+static gboolean storage_write_done(gpointer user_data)
+{
+	GAsyncQueue *done = user_data;
+	struct storage_write_job *job;
+
+	/* Drained already by storage_cleanup if it ran in between */
+	while ((job = g_async_queue_try_pop(done)))
+		storage_write_job_done(job);
+
+	return FALSE;
+}
+
+static void storage_writer_func(gpointer data, gpointer user_data)
+{
+	struct storage_write_job *job = data;
+	GAsyncQueue *done = user_data;
+
+	storage_write(job->path, job->data, job->length);
+
+	/* Let the main loop know that the contents are on disk */
+	g_async_queue_push(done, job);
+	g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, storage_write_done,
+				g_async_queue_ref(done),
+				(GDestroyNotify) g_async_queue_unref);
+}
+
+static gboolean storage_file_queue(struct storage_file *file)
+{
+	struct storage_write_job *job;
+
+	if (storage_done == NULL)
+		storage_done = g_async_queue_new();
+
+	if (storage_writer == NULL)
+		storage_writer = g_thread_pool_new(storage_writer_func,
+							storage_done,
+							1, FALSE, NULL);
+
+	if (storage_writer == NULL)
+		return FALSE;
+
+	job = g_new0(struct storage_write_job, 1);
+	job->path = g_strdup(file->path);
+	job->data = g_strdup(file->data);
+	job->length = file->length;
+
+	file->writes += 1;
+	g_thread_pool_push(storage_writer, job, NULL);
+
+	return TRUE;
+}
+
+static void storage_file_flush(struct storage_file *file)
+{
+	storage_file_serialize(file);
+
+	if (file->dirty == FALSE)
+		return;
+
+	file->dirty = FALSE;
+
+	if (storage_file_queue(file) == FALSE)
+		storage_write(file->path, file->data, file->length);
+}
+
+static gboolean storage_flush_pending(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	storage_source = 0;
+
+	g_hash_table_iter_init(&iter, storage_files);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct storage_file *file = value;
+
+		storage_file_flush(file);
+
+		if (file->writes == 0)
+			g_hash_table_iter_remove(&iter);
+	}
+
+	return FALSE;
+}
+
 GKeyFile *storage_open(const char *imsi, const char *store)
 {
 	GKeyFile *keyfile;
+	struct storage_file *file = NULL;
 	char *path;
 
 	if (store == NULL)
 		return NULL;
 
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
+	path = storage_path(imsi, store);
 
 	keyfile = g_key_file_new();
 
-	if (path) {
+	if (storage_files)
+		file = g_hash_table_lookup(storage_files, path);
+
+	/* Contents not on disk yet take precedence */
+	if (file) {
+		storage_file_serialize(file);
+		g_key_file_load_from_data(keyfile, file->data, file->length,
+						0, NULL);
+	} else if (path)
 		g_key_file_load_from_file(keyfile, path, 0, NULL);
-		g_free(path);
-	}
+
+	g_free(path);
 
 	return keyfile;
 }
 
 void storage_sync(const char *imsi, const char *store, GKeyFile *keyfile)
 {
+	struct storage_file *file;
 	char *path;
-	char *data;
-	gsize length = 0;
-
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
 
+	path = storage_path(imsi, store);
 	if (path == NULL)
 		return;
 
-	if (create_dirs(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
-		g_free(path);
-		return;
-	}
+	if (storage_files == NULL)
+		storage_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL,
+							storage_file_free);
 
-	data = g_key_file_to_data(keyfile, &length, NULL);
+	file = g_hash_table_lookup(storage_files, path);
 
-	g_file_set_contents(path, data, length, NULL);
+	if (file == NULL) {
+		file = g_new0(struct storage_file, 1);
+		file->path = path;
+		g_hash_table_insert(storage_files, file->path, file);
+	} else
+		g_free(path);
 
-	g_free(data);
-	g_free(path);
+	file->keyfile = keyfile;
+	file->dirty = TRUE;
+
+	if (storage_source == 0)
+		storage_source = g_timeout_add_seconds(STORAGE_SYNC_TIMEOUT,
+							storage_flush_pending,
+							NULL);
 }
 
 void storage_close(const char *imsi, const char *store, GKeyFile *keyfile,
 			gboolean save)
 {
+	struct storage_file *file = NULL;
+	char *path;
+
 	if (save == TRUE)
 		storage_sync(imsi, store, keyfile);
 
+	path = storage_path(imsi, store);
+
+	if (storage_files)
+		file = g_hash_table_lookup(storage_files, path);
+
+	/* A pending sync must not outlive the keyfile */
+	if (file && file->keyfile == keyfile)
+		storage_file_serialize(file);
+
+	g_free(path);
+
 	g_key_file_free(keyfile);
 }
+
+void storage_cleanup(void)
+{
+	if (storage_files == NULL)
+		return;
+
+	if (storage_source > 0)
+		g_source_remove(storage_source);
+
+	storage_flush_pending(NULL);
+
+	if (storage_writer) {
+		g_thread_pool_free(storage_writer, FALSE, TRUE);
+		storage_writer = NULL;
+	}
+
+	/* Reap the completions of the writes just finished */
+	if (storage_done) {
+		storage_write_done(storage_done);
+		g_async_queue_unref(storage_done);
+		storage_done = NULL;
+	}
+
+	g_hash_table_destroy(storage_files);
+	storage_files = NULL;
+}
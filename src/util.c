@@ -90,6 +90,40 @@ struct conversion_table {
 	unsigned int single_len_g;
 };
 
+#define CONVERSION_PAGE_SIZE	256
+#define CONVERSION_NUM_PAGES	(0x10000 / CONVERSION_PAGE_SIZE)
+#define GSM_DIALECT_MAX		GSM_DIALECT_PORTUGUESE
+
+/*
+ * Direct lookup maps for a locking shift / single shift dialect pair,
+ * built from the tables below the first time the pair is used.
+ */
+struct conversion_map {
+	/* GSM to Unicode, for plain and for 0x1B escaped characters */
+	unsigned short locking[128];
+	unsigned short single[128];
+
+	/*
+	 * Unicode to GSM, split in pages of 256 code points.  Pages with
+	 * no convertible code points are left NULL.  Single shift
+	 * characters are stored as 0x1Bxx.
+	 */
+	unsigned short *to_gsm[CONVERSION_NUM_PAGES];
+};
+
+static struct conversion_map *conversion_maps[GSM_DIALECT_MAX + 1]
+						[GSM_DIALECT_MAX + 1];
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+/* Value of a hex digit plus one, zero for anything else */
+static const unsigned char hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
 /* GSM to Unicode extension table, for GSM sequences starting with 0x1B */
 static const struct codepoint def_ext_gsm[] = {
 	{ 0x0A, 0x000C },		/* See NOTE 3 in 23.038 */
@@ -454,53 +488,6 @@ static const struct codepoint por_unicode[] = {
 	{ 0x00FC, 0x7E }, { 0x0394, 0x10 }, { 0x20AC, 0x18 }, { 0x221E, 0x15 }
 };
 
-static int compare_codepoints(const void *a, const void *b)
-{
-	const struct codepoint *ca = (const struct codepoint *) a;
-	const struct codepoint *cb = (const struct codepoint *) b;
-
-	return (ca->from > cb->from) - (ca->from < cb->from);
-}
-
-static unsigned short codepoint_lookup(struct codepoint *key,
-					const struct codepoint *table,
-					unsigned int len)
-{
-	struct codepoint *result = NULL;
-
-	result = bsearch(key, table, len, sizeof(struct codepoint),
-				compare_codepoints);
-
-	return result ? result->to : GUND;
-}
-
-static unsigned short gsm_locking_shift_lookup(struct conversion_table *t,
-						unsigned char k)
-{
-	return t->locking_g[k];
-}
-
-static unsigned short gsm_single_shift_lookup(struct conversion_table *t,
-						unsigned char k)
-{
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->single_g, t->single_len_g);
-}
-
-static unsigned short unicode_locking_shift_lookup(struct conversion_table *t,
-							unsigned short k)
-{
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->locking_u, t->locking_len_u);
-}
-
-static unsigned short unicode_single_shift_lookup(struct conversion_table *t,
-							unsigned short k)
-{
-	struct codepoint key = { k, 0 };
-	return codepoint_lookup(&key, t->single_u, t->single_len_u);
-}
-
 static gboolean populate_locking_shift(struct conversion_table *t,
 					enum gsm_dialect lang)
 {
@@ -574,6 +561,91 @@ static gboolean conversion_table_init(struct conversion_table *t,
 			populate_single_shift(t, single);
 }
 
+static void conversion_map_add(struct conversion_map *map,
+				const struct codepoint *table,
+				unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned short c = table[i].from;
+		unsigned short **page = &map->to_gsm[c / CONVERSION_PAGE_SIZE];
+		unsigned int j;
+
+		if (*page == NULL) {
+			*page = g_new(unsigned short, CONVERSION_PAGE_SIZE);
+
+			for (j = 0; j < CONVERSION_PAGE_SIZE; j++)
+				(*page)[j] = GUND;
+		}
+
+		/* The locking shift table takes precedence */
+		if ((*page)[c % CONVERSION_PAGE_SIZE] == GUND)
+			(*page)[c % CONVERSION_PAGE_SIZE] = table[i].to;
+	}
+}
+
+static const struct conversion_map *conversion_map_get(
+						enum gsm_dialect locking,
+						enum gsm_dialect single)
+{
+	struct conversion_table t;
+	struct conversion_map *map;
+	unsigned int i;
+
+	if (locking > GSM_DIALECT_MAX || single > GSM_DIALECT_MAX)
+		return NULL;
+
+	map = conversion_maps[locking][single];
+	if (map != NULL)
+		return map;
+
+	if (conversion_table_init(&t, locking, single) == FALSE)
+		return NULL;
+
+	map = g_new0(struct conversion_map, 1);
+
+	memcpy(map->locking, t.locking_g, sizeof(map->locking));
+
+	/*
+	 * According to the comment in the table from 3GPP 23.038,
+	 * Section 6.2.1.1:
+	 * "In the event that an MS receives a code where a symbol is not
+	 * represented in the above table then the MS shall display either
+	 * the character shown in the main GSM 7 bit default  alphabet
+	 * table in subclause 6.2.1., or the character from the National
+	 * Language Locking Shift Table in the case where the locking shift
+	 * mechanism as defined in subclause 6.2.1.2.3 is used."
+	 */
+	memcpy(map->single, t.locking_g, sizeof(map->single));
+
+	for (i = 0; i < t.single_len_g; i++)
+		map->single[t.single_g[i].from] = t.single_g[i].to;
+
+	conversion_map_add(map, t.locking_u, t.locking_len_u);
+	conversion_map_add(map, t.single_u, t.single_len_u);
+
+	conversion_maps[locking][single] = map;
+
+	return map;
+}
+
+static inline unsigned short conversion_map_to_gsm(
+					const struct conversion_map *map,
+					gunichar c)
+{
+	const unsigned short *page;
+
+	if (c > 0xffff)
+		return GUND;
+
+	page = map->to_gsm[c / CONVERSION_PAGE_SIZE];
+	if (page == NULL)
+		return GUND;
+
+	return page[c % CONVERSION_PAGE_SIZE];
+}
+
 /*!
  * Converts text coded using GSM codec into UTF8 encoded text, using
  * the given language identifiers for single shift and locking shift
@@ -593,14 +665,13 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 					enum gsm_dialect locking_lang,
 					enum gsm_dialect single_lang)
 {
+	const struct conversion_map *map;
 	char *res = NULL;
 	char *out;
 	long i = 0;
-	long res_length;
-
-	struct conversion_table t;
 
-	if (conversion_table_init(&t, locking_lang, single_lang) == FALSE)
+	map = conversion_map_get(locking_lang, single_lang);
+	if (map == NULL)
 		return NULL;
 
 	if (len < 0 && !terminator)
@@ -615,60 +686,29 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 		len = i;
 	}
 
-	for (i = 0, res_length = 0; i < len; i++) {
-		unsigned short c;
-
-		if (text[i] > 0x7f)
-			goto error;
-
-		if (text[i] == 0x1b) {
-			++i;
-			if (i >= len)
-				goto error;
-
-			c = gsm_single_shift_lookup(&t, text[i]);
-
-			/*
-			 * According to the comment in the table from
-			 * 3GPP 23.038, Section 6.2.1.1:
-			 * "In the event that an MS receives a code where
-			 * a symbol is not represented in the above table
-			 * then the MS shall display either the character
-			 * shown in the main GSM 7 bit default  alphabet
-			 * table in subclause 6.2.1., or the character from
-			 * the National Language Locking Shift Table in the
-			 * case where the locking shift mechanism as defined
-			 * in subclause 6.2.1.2.3 is used."
-			 */
-			if (c == GUND)
-				c = gsm_locking_shift_lookup(&t, text[i]);
-		} else
-			c = gsm_locking_shift_lookup(&t, text[i]);
-
-		res_length += UTF8_LENGTH(c);
-	}
-
-	res = g_try_malloc(res_length + 1);
+	/* Every character takes at most 3 bytes in UTF-8 */
+	res = g_try_malloc(len * 3 + 1);
 	if (res == NULL)
 		goto error;
 
 	out = res;
 
-	i = 0;
-	while (out < res + res_length) {
+	for (i = 0; i < len; i++) {
 		unsigned short c;
 
+		if (text[i] > 0x7f)
+			goto error;
+
 		if (text[i] == 0x1b) {
-			c = gsm_single_shift_lookup(&t, text[++i]);
+			++i;
+			if (i >= len || text[i] > 0x7f)
+				goto error;
 
-			if (c == GUND)
-				c = gsm_locking_shift_lookup(&t, text[i]);
+			c = map->single[text[i]];
 		} else
-			c = gsm_locking_shift_lookup(&t, text[i]);
+			c = map->locking[text[i]];
 
 		out += g_unichar_to_utf8(c, out);
-
-		++i;
 	}
 
 	*out = '\0';
@@ -676,11 +716,18 @@ char *convert_gsm_to_utf8_with_lang(const unsigned char *text, long len,
 	if (items_written)
 		*items_written = out - res;
 
-error:
 	if (items_read)
 		*items_read = i;
 
 	return res;
+
+error:
+	g_free(res);
+
+	if (items_read)
+		*items_read = i;
+
+	return NULL;
 }
 
 char *convert_gsm_to_utf8(const unsigned char *text, long len,
@@ -694,87 +741,49 @@ char *convert_gsm_to_utf8(const unsigned char *text, long len,
 						GSM_DIALECT_DEFAULT);
 }
 
-/*!
- * Converts UTF-8 encoded text to GSM alphabet.  The result is unpacked,
- * with the 7th bit always 0.  If terminator is not 0, a terminator character
- * is appended to the result.  This should be in the range 0x80-0xf0
- *
- * Returns the encoded data or NULL if the data could not be encoded.  The
- * data must be freed by the caller.  If items_read is not NULL, it contains
- * the actual number of bytes read.  If items_written is not NULL, contains
- * the number of bytes written.
- */
-unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
+static unsigned char *utf8_to_gsm(const char *text, long len,
 					long *items_read, long *items_written,
 					unsigned char terminator,
-					enum gsm_dialect locking_lang,
-					enum gsm_dialect single_lang)
+					const struct conversion_map *map)
 {
-	struct conversion_table t;
-	long nchars = 0;
 	const char *in;
 	unsigned char *out;
-	unsigned char *res = NULL;
-	long res_len;
-	long i;
+	unsigned char *res;
+	long max_len;
+
+	if (len < 0)
+		max_len = strlen(text);
+	else
+		max_len = strnlen(text, len);
+
+	/* Each byte of UTF-8 takes at most 2 septets */
+	res = g_try_malloc(max_len * 2 + (terminator ? 1 : 0));
+	if (res == NULL) {
+		if (items_read)
+			*items_read = 0;
 
-	if (conversion_table_init(&t, locking_lang, single_lang) == FALSE)
 		return NULL;
+	}
 
 	in = text;
-	res_len = 0;
+	out = res;
 
 	while ((len < 0 || text + len - in > 0) && *in) {
 		long max = len < 0 ? 6 : text + len - in;
 		gunichar c = g_utf8_get_char_validated(in, max);
-		unsigned short converted = GUND;
+		unsigned short converted;
 
 		if (c & 0x80000000)
 			goto err_out;
 
-		if (c > 0xffff)
-			goto err_out;
-
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
-
+		converted = conversion_map_to_gsm(map, c);
 		if (converted == GUND)
 			goto err_out;
 
 		if (converted & 0x1b00)
-			res_len += 2;
-		else
-			res_len += 1;
-
-		in = g_utf8_next_char(in);
-		nchars += 1;
-	}
+			*out++ = 0x1b;
 
-	res = g_try_malloc(res_len + (terminator ? 1 : 0));
-	if (res == NULL)
-		goto err_out;
-
-	in = text;
-	out = res;
-	for (i = 0; i < nchars; i++) {
-		unsigned short converted;
-
-		gunichar c = g_utf8_get_char(in);
-
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
-
-		if (converted & 0x1b00) {
-			*out = 0x1b;
-			++out;
-		}
-
-		*out = converted;
-		++out;
+		*out++ = converted;
 
 		in = g_utf8_next_char(in);
 	}
@@ -785,11 +794,44 @@ unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
 	if (items_written)
 		*items_written = out - res;
 
-err_out:
 	if (items_read)
 		*items_read = in - text;
 
 	return res;
+
+err_out:
+	g_free(res);
+
+	if (items_read)
+		*items_read = in - text;
+
+	return NULL;
+}
+
+/*!
+ * Converts UTF-8 encoded text to GSM alphabet.  The result is unpacked,
+ * with the 7th bit always 0.  If terminator is not 0, a terminator character
+ * is appended to the result.  This should be in the range 0x80-0xf0
+ *
+ * Returns the encoded data or NULL if the data could not be encoded.  The
+ * data must be freed by the caller.  If items_read is not NULL, it contains
+ * the actual number of bytes read.  If items_written is not NULL, contains
+ * the number of bytes written.
+ */
+unsigned char *convert_utf8_to_gsm_with_lang(const char *text, long len,
+					long *items_read, long *items_written,
+					unsigned char terminator,
+					enum gsm_dialect locking_lang,
+					enum gsm_dialect single_lang)
+{
+	const struct conversion_map *map;
+
+	map = conversion_map_get(locking_lang, single_lang);
+	if (map == NULL)
+		return NULL;
+
+	return utf8_to_gsm(text, len, items_read, items_written, terminator,
+				map);
 }
 
 unsigned char *convert_utf8_to_gsm(const char *text, long len,
@@ -826,44 +868,84 @@ unsigned char *convert_utf8_to_gsm_best_lang(const char *utf8, long len,
 					enum gsm_dialect *used_locking,
 					enum gsm_dialect *used_single)
 {
-	enum gsm_dialect locking = GSM_DIALECT_DEFAULT;
-	enum gsm_dialect single = GSM_DIALECT_DEFAULT;
+	enum gsm_dialect locking[3];
+	enum gsm_dialect single[3];
+	const struct conversion_map *maps[3];
+	long failed_at[3];
+	unsigned int alive;
+	unsigned int n = 0;
+	unsigned int k;
 	unsigned char *encoded;
+	const char *in;
 
-	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
-						items_written, terminator,
-						locking, single);
-	if (encoded != NULL)
-		goto out;
+	locking[n] = GSM_DIALECT_DEFAULT;
+	single[n++] = GSM_DIALECT_DEFAULT;
 
-	if (hint == GSM_DIALECT_DEFAULT)
-		return NULL;
+	if (hint != GSM_DIALECT_DEFAULT) {
+		locking[n] = GSM_DIALECT_DEFAULT;
+		single[n++] = hint;
+
+		/* Spanish dialect uses the default locking shift table */
+		if (hint != GSM_DIALECT_SPANISH) {
+			locking[n] = hint;
+			single[n++] = hint;
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		maps[k] = conversion_map_get(locking[k], single[k]);
+		if (maps[k] == NULL)
+			break;
+	}
 
-	single = hint;
-	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
-						items_written, terminator,
-						locking, single);
-	if (encoded != NULL)
-		goto out;
+	n = k;
 
-	/* Spanish dialect uses the default locking shift table */
-	if (hint == GSM_DIALECT_SPANISH)
-		return NULL;
+	/* Find out which candidates can encode the text in a single sweep */
+	alive = (1 << n) - 1;
+	in = utf8;
+
+	while (alive && (len < 0 || utf8 + len - in > 0) && *in) {
+		long max = len < 0 ? 6 : utf8 + len - in;
+		gunichar c = g_utf8_get_char_validated(in, max);
 
-	locking = hint;
-	encoded = convert_utf8_to_gsm_with_lang(utf8, len, items_read,
-						items_written, terminator,
-						locking, single);
+		for (k = 0; k < n; k++) {
+			if (!(alive & (1 << k)))
+				continue;
 
+			if ((c & 0x80000000) ||
+					conversion_map_to_gsm(maps[k], c) == GUND) {
+				alive &= ~(1 << k);
+				failed_at[k] = in - utf8;
+			}
+		}
+
+		if (c & 0x80000000)
+			break;
+
+		in = g_utf8_next_char(in);
+	}
+
+	for (k = 0; k < n; k++)
+		if (alive & (1 << k))
+			break;
+
+	if (k == n) {
+		if (items_read)
+			*items_read = failed_at[n - 1];
+
+		return NULL;
+	}
+
+	encoded = utf8_to_gsm(utf8, len, items_read, items_written,
+				terminator, maps[k]);
 	if (encoded == NULL)
 		return NULL;
 
-out:
 	if (used_locking != NULL)
-		*used_locking = locking;
+		*used_locking = locking[k];
 
 	if (used_single != NULL)
-		*used_single = single;
+		*used_single = single[k];
 
 	return encoded;
 }
@@ -882,37 +964,24 @@ unsigned char *decode_hex_own_buf(const char *in, long len, long *items_written,
 					unsigned char terminator,
 					unsigned char *buf)
 {
+	const unsigned char *hex = (const unsigned char *) in;
 	long i, j;
-	char c;
-	unsigned char b;
+	unsigned char hi;
+	unsigned char lo;
 
 	if (len < 0)
 		len = strlen(in);
 
 	len &= ~0x1;
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = toupper(in[i]);
-
-		if (c >= '0' && c <= '9')
-			b = c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = 10 + c - 'A';
-		else
-			return NULL;
-
-		i += 1;
-
-		c = toupper(in[i]);
+	for (i = 0, j = 0; i < len; i += 2, j++) {
+		hi = hex_values[hex[i]];
+		lo = hex_values[hex[i + 1]];
 
-		if (c >= '0' && c <= '9')
-			b = b * 16 + c - '0';
-		else if (c >= 'A' && c <= 'F')
-			b = b * 16 + 10 + c - 'A';
-		else
+		if (hi == 0 || lo == 0)
 			return NULL;
 
-		buf[j] = b;
+		buf[j] = ((hi - 1) << 4) | (lo - 1);
 	}
 
 	if (terminator)
@@ -928,7 +997,6 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 				unsigned char terminator)
 {
 	long i;
-	char c;
 	unsigned char *buf;
 
 	if (len < 0)
@@ -937,9 +1005,7 @@ unsigned char *decode_hex(const char *in, long len, long *items_written,
 	len &= ~0x1;
 
 	for (i = 0; i < len; i++) {
-		c = toupper(in[i]);
-
-		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))
+		if (hex_values[(unsigned char) in[i]])
 			continue;
 
 		return NULL;
@@ -960,7 +1026,6 @@ char *encode_hex_own_buf(const unsigned char *in, long len,
 				unsigned char terminator, char *buf)
 {
 	long i, j;
-	char c;
 
 	if (len < 0) {
 		i = 0;
@@ -971,22 +1036,9 @@ char *encode_hex_own_buf(const unsigned char *in, long len,
 		len = i;
 	}
 
-	for (i = 0, j = 0; i < len; i++, j++) {
-		c = (in[i] >> 4) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
-
-		j += 1;
-
-		c = (in[i]) & 0xf;
-
-		if (c <= 9)
-			buf[j] = '0' + c;
-		else
-			buf[j] = 'A' + c - 10;
+	for (i = 0, j = 0; i < len; i++, j += 2) {
+		buf[j] = hex_digits[in[i] >> 4];
+		buf[j + 1] = hex_digits[in[i] & 0xf];
 	}
 
 	buf[j] = '\0';
@@ -1013,6 +1065,25 @@ char *encode_hex(const unsigned char *in, long len, unsigned char terminator)
 	return encode_hex_own_buf(in, len, terminator, buf);
 }
 
+/* Unpacks the 8 septets held by 7 octets */
+static inline void unpack_7bit_group(const unsigned char *in,
+					unsigned char *out)
+{
+	guint64 v = (guint64) in[0] | (guint64) in[1] << 8 |
+			(guint64) in[2] << 16 | (guint64) in[3] << 24 |
+			(guint64) in[4] << 32 | (guint64) in[5] << 40 |
+			(guint64) in[6] << 48;
+
+	out[0] = v & 0x7f;
+	out[1] = (v >> 7) & 0x7f;
+	out[2] = (v >> 14) & 0x7f;
+	out[3] = (v >> 21) & 0x7f;
+	out[4] = (v >> 28) & 0x7f;
+	out[5] = (v >> 35) & 0x7f;
+	out[6] = (v >> 42) & 0x7f;
+	out[7] = (v >> 49) & 0x7f;
+}
+
 unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 					int byte_offset, gboolean ussd,
 					long max_to_unpack, long *items_written,
@@ -1032,6 +1103,18 @@ unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 		max_to_unpack = len * 8 / 7;
 
 	for (i = 0; (i < len) && ((out-buf) < max_to_unpack); i++) {
+		/*
+		 * On a septet boundary, unpack whole groups of 7 octets
+		 * at once.  The loop increment accounts for the 7th octet.
+		 */
+		if (bits == 7 && len - i >= 7 &&
+				max_to_unpack - (out - buf) >= 8) {
+			unpack_7bit_group(in + i, out);
+			out += 8;
+			i += 6;
+			continue;
+		}
+
 		/* Grab what we have in the current octet */
 		*out = (in[i] & ((1 << bits) - 1)) << (7 - bits);
 
@@ -1079,7 +1162,8 @@ unsigned char *unpack_7bit_own_buf(const unsigned char *in, long len,
 	 * the message ends on an octet boundary with <CR> as the last
 	 * character.
 	 */
-	if (ussd && (((out - buf) % 8) == 0) && (*(out - 1) == '\r'))
+	if (ussd && out > buf && (((out - buf) % 8) == 0) &&
+			(*(out - 1) == '\r'))
 		out = out - 1;
 
 	if (terminator)
@@ -1102,6 +1186,36 @@ unsigned char *unpack_7bit(const unsigned char *in, long len, int byte_offset,
 				items_written, terminator, buf);
 }
 
+/*
+ * Packs 8 septets into 7 octets, starting at bit shift of the first one.
+ * The bits below shift are kept, and the bits spilling over into the 8th
+ * octet are stored there.
+ */
+static inline void pack_7bit_group(const unsigned char *in, int shift,
+					unsigned char *out)
+{
+	guint64 v = (guint64) (in[0] & 0x7f) | (guint64) (in[1] & 0x7f) << 7 |
+			(guint64) (in[2] & 0x7f) << 14 |
+			(guint64) (in[3] & 0x7f) << 21 |
+			(guint64) (in[4] & 0x7f) << 28 |
+			(guint64) (in[5] & 0x7f) << 35 |
+			(guint64) (in[6] & 0x7f) << 42 |
+			(guint64) (in[7] & 0x7f) << 49;
+
+	v <<= shift;
+
+	out[0] = (shift ? out[0] : 0) | (v & 0xff);
+	out[1] = v >> 8;
+	out[2] = v >> 16;
+	out[3] = v >> 24;
+	out[4] = v >> 32;
+	out[5] = v >> 40;
+	out[6] = v >> 48;
+
+	if (shift)
+		out[7] = v >> 56;
+}
+
 unsigned char *pack_7bit_own_buf(const unsigned char *in, long len,
 					int byte_offset, gboolean ussd,
 					long *items_written,
@@ -1134,6 +1248,18 @@ unsigned char *pack_7bit_own_buf(const unsigned char *in, long len,
 	}
 
 	for (i = 0; i < len; i++) {
+		/*
+		 * Every 8 septets the packing is back at the same bit
+		 * position, pack whole groups of 8 at once from there.
+		 * The loop increment accounts for the 8th septet.
+		 */
+		if ((i % 8) == 0 && len - i >= 8) {
+			pack_7bit_group(in + i, bits == 7 ? 0 : bits + 1, out);
+			out += 7;
+			i += 7;
+			continue;
+		}
+
 		if (bits != 7) {
 			*out |= (in[i] & ((1 << (7 - bits)) - 1)) <<
 					(bits + 1);
@@ -1213,7 +1339,7 @@ unsigned char *pack_7bit(const unsigned char *in, long len, int byte_offset,
 
 char *sim_string_to_utf8(const unsigned char *buffer, int length)
 {
-	struct conversion_table t;
+	const struct conversion_map *map;
 	int i;
 	int j;
 	int num_chars;
@@ -1223,8 +1349,8 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 	char *utf8 = NULL;
 	char *out;
 
-	if (conversion_table_init(&t, GSM_DIALECT_DEFAULT,
-					GSM_DIALECT_DEFAULT) == FALSE)
+	map = conversion_map_get(GSM_DIALECT_DEFAULT, GSM_DIALECT_DEFAULT);
+	if (map == NULL)
 		return NULL;
 
 	if (length < 1)
@@ -1306,17 +1432,17 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 
 		if (buffer[i] == 0x1b) {
 			++i;
-			if (i >= length)
+			if (i >= length || buffer[i] & 0x80)
 				return NULL;
 
-			c = gsm_single_shift_lookup(&t, buffer[i++]);
+			c = map->single[buffer[i++]];
 
 			if (c == 0)
 				return NULL;
 
 			j += 2;
 		} else {
-			c = gsm_locking_shift_lookup(&t, buffer[i++]);
+			c = map->locking[buffer[i++]];
 			j += 1;
 		}
 
@@ -1345,9 +1471,9 @@ char *sim_string_to_utf8(const unsigned char *buffer, int length)
 			c = (buffer[i++] & 0x7f) + ucs2_offset;
 		else if (buffer[i] == 0x1b) {
 			++i;
-			c = gsm_single_shift_lookup(&t, buffer[i++]);
+			c = map->single[buffer[i++]];
 		} else
-			c = gsm_locking_shift_lookup(&t, buffer[i++]);
+			c = map->locking[buffer[i++]];
 
 		out += g_unichar_to_utf8(c, out);
 	}
@@ -1419,69 +1545,39 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 					enum gsm_dialect locking_lang,
 					enum gsm_dialect single_lang)
 {
-	struct conversion_table t;
-	long nchars = 0;
-	const unsigned char *in;
+	const struct conversion_map *map;
 	unsigned char *out;
-	unsigned char *res = NULL;
-	long res_len;
+	unsigned char *res;
 	long i;
 
-	if (conversion_table_init(&t, locking_lang, single_lang) == FALSE)
+	map = conversion_map_get(locking_lang, single_lang);
+	if (map == NULL)
 		return NULL;
 
 	if (len < 1 || len % 2)
 		return NULL;
 
-	in = text;
-	res_len = 0;
-
-	for (i = 0; i < len; i += 2) {
-		gunichar c = (in[i] << 8) | in[i + 1];
-		unsigned short converted = GUND;
-
-		if (c > 0xffff)
-			goto err_out;
-
-		converted = unicode_locking_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
-
-		if (converted == GUND)
-			goto err_out;
-
-		if (converted & 0x1b00)
-			res_len += 2;
-		else
-			res_len += 1;
-
-		nchars += 1;
-	}
-
-	res = g_try_malloc(res_len + (terminator ? 1 : 0));
-	if (res == NULL)
+	/* Each character takes at most 2 septets */
+	res = g_try_malloc(len + 1);
+	if (res == NULL) {
+		i = 0;
 		goto err_out;
+	}
 
-	in = text;
 	out = res;
 
 	for (i = 0; i < len; i += 2) {
-		gunichar c = (in[i] << 8) | in[i + 1];
-		unsigned short converted = GUND;
-
-		converted = unicode_locking_shift_lookup(&t, c);
+		gunichar c = (text[i] << 8) | text[i + 1];
+		unsigned short converted;
 
+		converted = conversion_map_to_gsm(map, c);
 		if (converted == GUND)
-			converted = unicode_single_shift_lookup(&t, c);
+			goto err_out;
 
-		if (converted & 0x1b00) {
-			*out = 0x1b;
-			++out;
-		}
+		if (converted & 0x1b00)
+			*out++ = 0x1b;
 
-		*out = converted;
-		++out;
+		*out++ = converted;
 	}
 
 	if (terminator)
@@ -1490,11 +1586,18 @@ unsigned char *convert_ucs2_to_gsm_with_lang(const unsigned char *text,
 	if (items_written)
 		*items_written = out - res;
 
-err_out:
 	if (items_read)
 		*items_read = i;
 
 	return res;
+
+err_out:
+	g_free(res);
+
+	if (items_read)
+		*items_read = i;
+
+	return NULL;
 }
 
 unsigned char *convert_ucs2_to_gsm(const unsigned char *text, long len,
@@ -0,0 +1,147 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "util.h"
+
+/*
+ * Micro-benchmark for the 7-bit packing and hex codecs, run on buffers
+ * the size of an SMS PDU.  Not part of the test suite.
+ */
+
+#define BENCH_DATA_LEN		140
+#define BENCH_SEPTETS		160
+
+static unsigned int iterations = 1000000;
+
+static unsigned char septets[BENCH_SEPTETS];
+static unsigned char packed[BENCH_DATA_LEN];
+static unsigned char unpacked[BENCH_SEPTETS + 1];
+static char hex[BENCH_DATA_LEN * 2 + 1];
+static unsigned char binary[BENCH_DATA_LEN + 1];
+
+static void report(const char *name, gint64 start, long bytes)
+{
+	gint64 elapsed = g_get_monotonic_time() - start;
+	double mb = (double) bytes * iterations / (1024 * 1024);
+
+	if (elapsed <= 0)
+		elapsed = 1;
+
+	printf("%-16s %8.1f ns/call %10.1f MB/s\n", name,
+			(double) elapsed * 1000 / iterations,
+			mb * 1000000 / elapsed);
+}
+
+static void bench_pack(int byte_offset)
+{
+	long written;
+	unsigned int i;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < iterations; i++)
+		pack_7bit_own_buf(septets, BENCH_SEPTETS - byte_offset * 8 / 7,
+					byte_offset, FALSE, &written, 0,
+					packed);
+
+	report(byte_offset ? "pack (udh)" : "pack", start, BENCH_SEPTETS);
+}
+
+static void bench_unpack(int byte_offset)
+{
+	long written;
+	unsigned int i;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < iterations; i++)
+		unpack_7bit_own_buf(packed, BENCH_DATA_LEN - byte_offset,
+					byte_offset, FALSE, BENCH_SEPTETS,
+					&written, 0, unpacked);
+
+	report(byte_offset ? "unpack (udh)" : "unpack", start,
+		BENCH_DATA_LEN);
+}
+
+static void bench_encode_hex(void)
+{
+	unsigned int i;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < iterations; i++)
+		encode_hex_own_buf(packed, BENCH_DATA_LEN, 0, hex);
+
+	report("encode_hex", start, BENCH_DATA_LEN);
+}
+
+static void bench_decode_hex(void)
+{
+	long written;
+	unsigned int i;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < iterations; i++)
+		decode_hex_own_buf(hex, BENCH_DATA_LEN * 2, &written, 0,
+					binary);
+
+	report("decode_hex", start, BENCH_DATA_LEN * 2);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+
+	if (iterations == 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < BENCH_SEPTETS; i++)
+		septets[i] = (i * 37 + 11) & 0x7f;
+
+	bench_pack(0);
+	bench_unpack(0);
+	bench_pack(6);
+	bench_unpack(6);
+	bench_encode_hex();
+	bench_decode_hex();
+
+	return 0;
+}
@@ -0,0 +1,378 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2015 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <ofono/types.h>
+
+#include <gril.h>
+
+#define FLOOD_NUM_REQUESTS	10000
+#define FLOOD_REQUEST_ID	RIL_REQUEST_GET_CURRENT_CALLS
+#define LARGE_PARCEL_SIZE	(3 * GRIL_BUFFER_SIZE)
+#define LARGE_PARCEL_COUNT	5
+#define LARGE_UNSOL_ID		RIL_UNSOL_CELL_INFO_LIST
+#define RIL_SERVER_SOCK_PATH	"/tmp/unittestgril"
+
+/* Warning: length is stored in network order */
+struct req_hdr {
+	uint32_t length;
+	uint32_t reqid;
+	uint32_t serial;
+};
+
+/* Warning: length is stored in network order */
+struct rsp_hdr {
+	uint32_t length;
+	uint32_t unsolicited;
+	uint32_t serial;
+	uint32_t error;
+};
+
+/* Warning: length is stored in network order */
+struct unsol_hdr {
+	uint32_t length;
+	uint32_t unsolicited;
+	uint32_t req;
+};
+
+struct test_data {
+	GMainLoop *loop;
+	GRil *ril;
+	int server_sk;
+	int client_fd;
+	char *sock_name;
+
+	/* Fake rild side */
+	unsigned char rbuf[4096];
+	gsize rbuf_len;
+	guint num_received;
+	unsigned char *wbuf;
+	gsize wbuf_len;
+	gsize wbuf_written;
+	guint read_watch;
+	guint write_watch;
+
+	/* GRil side */
+	guint num_replies;
+	guint num_errors;
+};
+
+static gboolean server_flush(struct test_data *fd)
+{
+	ssize_t written;
+
+	while (fd->wbuf_written < fd->wbuf_len) {
+		written = write(fd->client_fd, fd->wbuf + fd->wbuf_written,
+					fd->wbuf_len - fd->wbuf_written);
+		if (written < 0) {
+			g_assert(errno == EAGAIN);
+			return FALSE;
+		}
+
+		fd->wbuf_written += written;
+	}
+
+	return TRUE;
+}
+
+static gboolean server_write(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *fd = user_data;
+
+	g_assert(!(cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)));
+
+	if (server_flush(fd) == FALSE)
+		return TRUE;
+
+	fd->write_watch = 0;
+
+	return FALSE;
+}
+
+static void server_write_all(struct test_data *fd)
+{
+	GIOChannel *io;
+
+	if (server_flush(fd) == TRUE || fd->write_watch > 0)
+		return;
+
+	io = g_io_channel_unix_new(fd->client_fd);
+	fd->write_watch = g_io_add_watch(io, G_IO_OUT | G_IO_HUP | G_IO_ERR |
+					G_IO_NVAL, server_write, fd);
+	g_io_channel_unref(io);
+}
+
+static gboolean server_read(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *fd = user_data;
+	struct req_hdr hdr;
+	struct rsp_hdr *rsp;
+	gsize offset = 0;
+	ssize_t rbytes;
+
+	g_assert(!(cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)));
+
+	rbytes = read(fd->client_fd, fd->rbuf + fd->rbuf_len,
+					sizeof(fd->rbuf) - fd->rbuf_len);
+	if (rbytes < 0) {
+		g_assert(errno == EAGAIN);
+		return TRUE;
+	}
+
+	g_assert(rbytes > 0);
+	fd->rbuf_len += rbytes;
+
+	while (fd->rbuf_len - offset >= sizeof(hdr)) {
+		memcpy(&hdr, fd->rbuf + offset, sizeof(hdr));
+
+		/* Requests sent without a parcel are just the header */
+		g_assert(ntohl(hdr.length) == sizeof(hdr) - sizeof(hdr.length));
+		g_assert(hdr.reqid == FLOOD_REQUEST_ID);
+		g_assert(fd->num_received < FLOOD_NUM_REQUESTS);
+
+		rsp = (struct rsp_hdr *) (fd->wbuf + fd->wbuf_len);
+		fd->wbuf_len += sizeof(*rsp);
+		fd->num_received++;
+
+		rsp->length = htonl(sizeof(*rsp) - sizeof(rsp->length));
+		rsp->unsolicited = 0;
+		rsp->serial = hdr.serial;
+		rsp->error = 0;
+
+		offset += sizeof(hdr);
+	}
+
+	fd->rbuf_len -= offset;
+	memmove(fd->rbuf, fd->rbuf + offset, fd->rbuf_len);
+
+	server_write_all(fd);
+
+	if (fd->num_received < FLOOD_NUM_REQUESTS)
+		return TRUE;
+
+	fd->read_watch = 0;
+
+	return FALSE;
+}
+
+static gboolean server_connected(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *fd = user_data;
+	GIOChannel *io;
+
+	g_assert(cond == G_IO_IN);
+
+	fd->client_fd = accept(fd->server_sk, NULL, NULL);
+	g_assert(fd->client_fd >= 0);
+
+	g_assert(fcntl(fd->client_fd, F_SETFL, O_NONBLOCK) == 0);
+
+	io = g_io_channel_unix_new(fd->client_fd);
+	fd->read_watch = g_io_add_watch(io, G_IO_IN | G_IO_HUP | G_IO_ERR |
+						G_IO_NVAL, server_read, fd);
+	g_io_channel_unref(io);
+
+	/* Anything queued before the connection goes out right away */
+	server_write_all(fd);
+
+	return FALSE;
+}
+
+static void server_create(struct test_data *fd, gsize wbuf_size)
+{
+	struct sockaddr_un addr;
+	GIOChannel *io;
+
+	fd->client_fd = -1;
+	fd->wbuf = g_malloc0(wbuf_size);
+
+	fd->server_sk = socket(AF_UNIX, SOCK_STREAM, 0);
+	g_assert(fd->server_sk >= 0);
+
+	fd->sock_name = g_strdup_printf(RIL_SERVER_SOCK_PATH "%u",
+						(unsigned) getpid());
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, fd->sock_name, sizeof(addr.sun_path) - 1);
+
+	unlink(addr.sun_path);
+
+	g_assert(bind(fd->server_sk, (struct sockaddr *) &addr,
+							sizeof(addr)) == 0);
+	g_assert(listen(fd->server_sk, 1) == 0);
+
+	io = g_io_channel_unix_new(fd->server_sk);
+	g_io_add_watch(io, G_IO_IN, server_connected, fd);
+	g_io_channel_unref(io);
+}
+
+static void server_destroy(struct test_data *fd)
+{
+	if (fd->read_watch > 0)
+		g_source_remove(fd->read_watch);
+
+	if (fd->write_watch > 0)
+		g_source_remove(fd->write_watch);
+
+	close(fd->client_fd);
+	close(fd->server_sk);
+	unlink(fd->sock_name);
+
+	g_free(fd->sock_name);
+	g_free(fd->wbuf);
+}
+
+static void flood_reply_cb(struct ril_msg *message, gpointer user_data)
+{
+	struct test_data *fd = user_data;
+
+	g_assert(message->unsolicited == FALSE);
+	g_assert(message->req == FLOOD_REQUEST_ID);
+
+	if (message->error != RIL_E_SUCCESS)
+		fd->num_errors++;
+
+	if (++fd->num_replies == FLOOD_NUM_REQUESTS)
+		g_main_loop_quit(fd->loop);
+}
+
+static void test_reply_flood(void)
+{
+	struct test_data fd;
+	double elapsed;
+	guint i;
+
+	memset(&fd, 0, sizeof(fd));
+	fd.loop = g_main_loop_new(NULL, FALSE);
+
+	server_create(&fd, sizeof(struct rsp_hdr) * FLOOD_NUM_REQUESTS);
+
+	fd.ril = g_ril_new(fd.sock_name, OFONO_RIL_VENDOR_AOSP);
+	g_assert(fd.ril != NULL);
+
+	g_test_timer_start();
+
+	for (i = 0; i < FLOOD_NUM_REQUESTS; i++)
+		g_assert(g_ril_send(fd.ril, FLOOD_REQUEST_ID, NULL,
+					flood_reply_cb, &fd, NULL) > 0);
+
+	g_main_loop_run(fd.loop);
+
+	elapsed = g_test_timer_elapsed();
+	g_test_minimized_result(elapsed, "%u outstanding replies in %.3fs",
+					FLOOD_NUM_REQUESTS, elapsed);
+
+	g_assert(fd.num_received == FLOOD_NUM_REQUESTS);
+	g_assert(fd.num_replies == FLOOD_NUM_REQUESTS);
+	g_assert(fd.num_errors == 0);
+
+	g_ril_unref(fd.ril);
+	server_destroy(&fd);
+	g_main_loop_unref(fd.loop);
+}
+
+static void large_unsol_cb(struct ril_msg *message, gpointer user_data)
+{
+	struct test_data *fd = user_data;
+	gsize i;
+
+	g_assert(message->unsolicited == TRUE);
+	g_assert(message->buf_len == LARGE_PARCEL_SIZE);
+
+	for (i = 0; i < message->buf_len; i++)
+		g_assert((guchar) message->buf[i] ==
+				(guchar) (i + fd->num_replies));
+
+	if (++fd->num_replies == LARGE_PARCEL_COUNT)
+		g_main_loop_quit(fd->loop);
+}
+
+/*
+ * Send several unsolicited parcels, each one larger than the ring buffer
+ * and so also ending up in the middle of it, back to back.
+ */
+static void test_large_parcel(void)
+{
+	struct test_data fd;
+	struct unsol_hdr *hdr;
+	guint i;
+	gsize j;
+
+	memset(&fd, 0, sizeof(fd));
+	fd.loop = g_main_loop_new(NULL, FALSE);
+
+	server_create(&fd, LARGE_PARCEL_COUNT *
+				(sizeof(*hdr) + LARGE_PARCEL_SIZE));
+
+	for (i = 0; i < LARGE_PARCEL_COUNT; i++) {
+		hdr = (struct unsol_hdr *) (fd.wbuf + fd.wbuf_len);
+		hdr->length = htonl(sizeof(*hdr) - sizeof(hdr->length) +
+							LARGE_PARCEL_SIZE);
+		hdr->unsolicited = 1;
+		hdr->req = LARGE_UNSOL_ID;
+		fd.wbuf_len += sizeof(*hdr);
+
+		for (j = 0; j < LARGE_PARCEL_SIZE; j++)
+			fd.wbuf[fd.wbuf_len++] = j + i;
+	}
+
+	fd.ril = g_ril_new(fd.sock_name, OFONO_RIL_VENDOR_AOSP);
+	g_assert(fd.ril != NULL);
+
+	g_assert(g_ril_register(fd.ril, LARGE_UNSOL_ID,
+					large_unsol_cb, &fd) > 0);
+
+	g_main_loop_run(fd.loop);
+
+	g_assert(fd.num_replies == LARGE_PARCEL_COUNT);
+
+	g_ril_unref(fd.ril);
+	server_destroy(&fd);
+	g_main_loop_unref(fd.loop);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testgril/reply_flood", test_reply_flood);
+	g_test_add_func("/testgril/large_parcel", test_large_parcel);
+
+	return g_test_run();
+}
@@ -0,0 +1,183 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "crc-ccitt.h"
+#include "gathdlc.h"
+
+#define FRAME_SIZE	1500
+#define FRAME_COUNT	2000
+
+struct loopback {
+	GMainLoop *loop;
+	GAtHDLC *tx;
+	GAtHDLC *rx;
+	unsigned char frame[FRAME_SIZE];
+	guint num_sent;
+	guint num_received;
+	guint send_source;
+};
+
+static void make_frame(unsigned char *frame, guint seq, gboolean escaped)
+{
+	static const unsigned char specials[] = { 0x7e, 0x7d, 0x00, 0x11,
+							0x13, 0x0d, 0x1f };
+	unsigned int i;
+
+	/* Unescaped traffic stays clear of flags, escapes and controls */
+	for (i = 0; i < FRAME_SIZE; i++) {
+		if (escaped)
+			frame[i] = specials[(i + seq) % sizeof(specials)];
+		else
+			frame[i] = 0x20 + (i + seq) % 0x5d;
+	}
+}
+
+static gboolean send_frames(gpointer user_data)
+{
+	struct loopback *lb = user_data;
+
+	while (lb->num_sent < FRAME_COUNT) {
+		if (g_at_hdlc_send(lb->tx, lb->frame, FRAME_SIZE) == FALSE)
+			return TRUE;
+
+		lb->num_sent++;
+	}
+
+	lb->send_source = 0;
+
+	return FALSE;
+}
+
+static void receive_frame(const unsigned char *data, gsize size,
+							gpointer user_data)
+{
+	struct loopback *lb = user_data;
+
+	g_assert(size == FRAME_SIZE);
+	g_assert(memcmp(data, lb->frame, size) == 0);
+
+	if (++lb->num_received == FRAME_COUNT)
+		g_main_loop_quit(lb->loop);
+}
+
+static void run_loopback(gboolean escaped)
+{
+	struct loopback lb;
+	GIOChannel *io[2];
+	double elapsed;
+	int sv[2];
+
+	memset(&lb, 0, sizeof(lb));
+	make_frame(lb.frame, 0, escaped);
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	io[0] = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io[0], TRUE);
+	io[1] = g_io_channel_unix_new(sv[1]);
+	g_io_channel_set_close_on_unref(io[1], TRUE);
+
+	lb.loop = g_main_loop_new(NULL, FALSE);
+	lb.tx = g_at_hdlc_new(io[0]);
+	lb.rx = g_at_hdlc_new(io[1]);
+	g_assert(lb.tx != NULL && lb.rx != NULL);
+
+	/* Escape only what has to be escaped when testing the clear path */
+	if (escaped == FALSE) {
+		g_at_hdlc_set_xmit_accm(lb.tx, 0);
+		g_at_hdlc_set_recv_accm(lb.rx, 0);
+	}
+
+	g_at_hdlc_set_receive(lb.rx, receive_frame, &lb);
+
+	g_test_timer_start();
+
+	lb.send_source = g_idle_add(send_frames, &lb);
+	g_main_loop_run(lb.loop);
+
+	elapsed = g_test_timer_elapsed();
+	g_test_maximized_result(FRAME_SIZE * FRAME_COUNT / elapsed,
+				"%s: %u frames of %u bytes in %.3fs",
+				escaped ? "escaped" : "unescaped",
+				FRAME_COUNT, FRAME_SIZE, elapsed);
+
+	g_assert(lb.num_sent == FRAME_COUNT);
+	g_assert(lb.num_received == FRAME_COUNT);
+
+	if (lb.send_source > 0)
+		g_source_remove(lb.send_source);
+
+	g_at_hdlc_unref(lb.tx);
+	g_at_hdlc_unref(lb.rx);
+	g_io_channel_unref(io[0]);
+	g_io_channel_unref(io[1]);
+	g_main_loop_unref(lb.loop);
+}
+
+static void test_unescaped(void)
+{
+	run_loopback(FALSE);
+}
+
+static void test_escaped(void)
+{
+	run_loopback(TRUE);
+}
+
+static void test_crc(void)
+{
+	unsigned char buf[256];
+	unsigned int i, len;
+	guint16 fcs;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7 + 3;
+
+	/* The bulk CRC must agree with the byte-wise one for any length */
+	for (len = 0; len <= sizeof(buf); len++) {
+		fcs = 0xffff;
+
+		for (i = 0; i < len; i++)
+			fcs = crc_ccitt_byte(fcs, buf[i]);
+
+		g_assert(crc_ccitt(0xffff, buf, len) == fcs);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testhdlc/crc", test_crc);
+	g_test_add_func("/testhdlc/unescaped", test_unescaped);
+	g_test_add_func("/testhdlc/escaped", test_escaped);
+
+	return g_test_run();
+}
@@ -0,0 +1,452 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#define OFONO_API_SUBJECT_TO_CHANGE
+#include <ofono/modem.h>
+#include <ofono/gprs-provision.h>
+
+#include "plugins/mbpi.h"
+
+/*
+ * MBPI_DATABASE and APNDB_INDEX_DIR are pointed at scratch locations by
+ * the build, so the database below and its index can be written freely.
+ */
+
+static const char *test_db =
+	"<?xml version=\"1.0\"?>\n"
+	"<!-- <gsm><network-id mcc=\"234\" mnc=\"15\"/>"
+	"<apn value=\"commented\"/></gsm> -->\n"
+	"<serviceproviders format=\"2.0\">\n"
+	"<country code=\"gb\">\n"
+	" <provider>\n"
+	"  <name>Vodafone</name>\n"
+	"  <gsm>\n"
+	"   <network-id mcc=\"234\" mnc=\"15\"/>\n"
+	"   <apn value=\"internet\">\n"
+	"    <usage type=\"internet\"/>\n"
+	"    <name>Contract</name>\n"
+	"    <username>web</username>\n"
+	"    <password>web</password>\n"
+	"   </apn>\n"
+	"   <apn value=\"wap.vodafone.co.uk\">\n"
+	"    <usage type=\"wap\"/>\n"
+	"   </apn>\n"
+	"   <apn value=\"pp.vodafone.co.uk\">\n"
+	"    <name>PAYG</name>\n"
+	"    <authentication method=\"pap\"/>\n"
+	"   </apn>\n"
+	"   <apn value=\"mms.vodafone.net\">\n"
+	"    <usage type=\"mms\"/>\n"
+	"    <mmsc>http://mms.vodafone.co.uk/servlets/mms</mmsc>\n"
+	"    <mmsproxy>212.183.137.12:8799</mmsproxy>\n"
+	"   </apn>\n"
+	"  </gsm>\n"
+	" </provider>\n"
+	" <provider>\n"
+	"  <name>Shared</name>\n"
+	"  <gsm>\n"
+	"   <network-id mcc=\"234\" mnc=\"10\"/>\n"
+	"   <network-id mcc=\"234\" mnc=\"15\"/>\n"
+	"   <apn value=\"shared.internet\"/>\n"
+	"  </gsm>\n"
+	" </provider>\n"
+	"</country>\n"
+	"<country code=\"us\">\n"
+	" <provider>\n"
+	"  <name>First</name>\n"
+	"  <cdma>\n"
+	"   <sid value=\"4139\"/>\n"
+	"  </cdma>\n"
+	" </provider>\n"
+	" <provider>\n"
+	"  <name>Second</name>\n"
+	"  <cdma>\n"
+	"   <sid value=\"4140\"/>\n"
+	"   <sid value=\"22\"/>\n"
+	"  </cdma>\n"
+	" </provider>\n"
+	"</country>\n"
+	"</serviceproviders>\n";
+
+static const char *test_db_update =
+	"<serviceproviders format=\"2.0\">\n"
+	"<country code=\"gb\">\n"
+	" <provider>\n"
+	"  <name>Vodafone</name>\n"
+	"  <gsm>\n"
+	"   <network-id mcc=\"234\" mnc=\"15\"/>\n"
+	"   <apn value=\"new.internet\"/>\n"
+	"   <apn value=\"internet\"/>\n"
+	"  </gsm>\n"
+	" </provider>\n"
+	"</country>\n"
+	"</serviceproviders>\n";
+
+/* Collects APNs by walking the whole database, without the index */
+struct direct_data {
+	const char *mcc;
+	const char *mnc;
+	gboolean in_gsm;
+	gboolean match;
+	struct ofono_gprs_provision_data *ap;
+	char **text;
+	GSList *apns;
+};
+
+static const char *find_attr(const gchar **names, const gchar **values,
+				const char *attr)
+{
+	int i;
+
+	for (i = 0; names[i]; i++)
+		if (g_str_equal(names[i], attr))
+			return values[i];
+
+	return NULL;
+}
+
+static void direct_start(GMarkupParseContext *context,
+				const gchar *element_name,
+				const gchar **names, const gchar **values,
+				gpointer userdata, GError **error)
+{
+	struct direct_data *dd = userdata;
+	const char *type;
+
+	if (g_str_equal(element_name, "gsm")) {
+		dd->in_gsm = TRUE;
+		dd->match = FALSE;
+		return;
+	}
+
+	if (dd->in_gsm == FALSE)
+		return;
+
+	if (g_str_equal(element_name, "network-id")) {
+		if (g_strcmp0(find_attr(names, values, "mcc"), dd->mcc) == 0 &&
+				g_strcmp0(find_attr(names, values, "mnc"),
+						dd->mnc) == 0)
+			dd->match = TRUE;
+	} else if (g_str_equal(element_name, "apn") && dd->match) {
+		dd->ap = g_new0(struct ofono_gprs_provision_data, 1);
+		dd->ap->apn = g_strdup(find_attr(names, values, "value"));
+		dd->ap->type = OFONO_GPRS_CONTEXT_TYPE_INTERNET;
+		dd->ap->auth_method = OFONO_GPRS_AUTH_METHOD_CHAP;
+	} else if (dd->ap == NULL)
+		return;
+	else if (g_str_equal(element_name, "usage")) {
+		type = find_attr(names, values, "type");
+
+		if (g_strcmp0(type, "mms") == 0)
+			dd->ap->type = OFONO_GPRS_CONTEXT_TYPE_MMS;
+		else if (g_strcmp0(type, "wap") == 0)
+			dd->ap->type = OFONO_GPRS_CONTEXT_TYPE_WAP;
+	} else if (g_str_equal(element_name, "authentication")) {
+		if (g_strcmp0(find_attr(names, values, "method"), "pap") == 0)
+			dd->ap->auth_method = OFONO_GPRS_AUTH_METHOD_PAP;
+	} else if (g_str_equal(element_name, "name"))
+		dd->text = &dd->ap->name;
+	else if (g_str_equal(element_name, "username"))
+		dd->text = &dd->ap->username;
+	else if (g_str_equal(element_name, "password"))
+		dd->text = &dd->ap->password;
+	else if (g_str_equal(element_name, "mmsc"))
+		dd->text = &dd->ap->message_center;
+	else if (g_str_equal(element_name, "mmsproxy"))
+		dd->text = &dd->ap->message_proxy;
+}
+
+static void direct_end(GMarkupParseContext *context,
+				const gchar *element_name,
+				gpointer userdata, GError **error)
+{
+	struct direct_data *dd = userdata;
+
+	dd->text = NULL;
+
+	if (g_str_equal(element_name, "gsm"))
+		dd->in_gsm = FALSE;
+	else if (g_str_equal(element_name, "apn") && dd->ap) {
+		dd->apns = g_slist_append(dd->apns, dd->ap);
+		dd->ap = NULL;
+	}
+}
+
+static void direct_text(GMarkupParseContext *context, const gchar *text,
+			gsize text_len, gpointer userdata, GError **error)
+{
+	struct direct_data *dd = userdata;
+
+	if (dd->text)
+		*dd->text = g_strndup(text, text_len);
+}
+
+static const GMarkupParser direct_parser = {
+	direct_start,
+	direct_end,
+	direct_text,
+	NULL,
+	NULL,
+};
+
+static GSList *direct_lookup(const char *mcc, const char *mnc)
+{
+	struct direct_data dd;
+	GMarkupParseContext *context;
+	char *db;
+	gsize len;
+
+	memset(&dd, 0, sizeof(dd));
+	dd.mcc = mcc;
+	dd.mnc = mnc;
+
+	g_assert(g_file_get_contents(MBPI_DATABASE, &db, &len, NULL));
+
+	context = g_markup_parse_context_new(&direct_parser, 0, &dd, NULL);
+	g_assert(g_markup_parse_context_parse(context, db, len, NULL));
+	g_assert(g_markup_parse_context_end_parse(context, NULL));
+	g_markup_parse_context_free(context);
+
+	g_free(db);
+
+	return dd.apns;
+}
+
+static void free_apns(GSList *apns)
+{
+	g_slist_free_full(apns, (GDestroyNotify) mbpi_ap_free);
+}
+
+static void compare_apns(GSList *apns, GSList *expected)
+{
+	g_assert(g_slist_length(apns) == g_slist_length(expected));
+
+	for (; apns; apns = apns->next, expected = expected->next) {
+		struct ofono_gprs_provision_data *ap = apns->data;
+		struct ofono_gprs_provision_data *ex = expected->data;
+
+		if (g_test_verbose())
+			g_print("%s (%s)\n", ap->apn, mbpi_ap_type(ap->type));
+
+		g_assert_cmpstr(ap->apn, ==, ex->apn);
+		g_assert_cmpstr(ap->name, ==, ex->name);
+		g_assert_cmpstr(ap->username, ==, ex->username);
+		g_assert_cmpstr(ap->password, ==, ex->password);
+		g_assert_cmpstr(ap->message_center, ==, ex->message_center);
+		g_assert_cmpstr(ap->message_proxy, ==, ex->message_proxy);
+		g_assert(ap->type == ex->type);
+		g_assert(ap->auth_method == ex->auth_method);
+	}
+}
+
+static char *index_path(const char *fragment)
+{
+	char *name = g_strdelimit(g_strdup(MBPI_DATABASE), "/", '_');
+	char *path = g_strdup_printf("%s/%s.%s", APNDB_INDEX_DIR, name,
+					fragment);
+
+	g_free(name);
+
+	return path;
+}
+
+static void remove_index(void)
+{
+	char *path;
+
+	path = index_path("gsm");
+	unlink(path);
+	g_free(path);
+
+	path = index_path("provider");
+	unlink(path);
+	g_free(path);
+}
+
+static void write_db(const char *contents)
+{
+	g_assert(g_file_set_contents(MBPI_DATABASE, contents, -1, NULL));
+
+	/* Start without an index, it gets built by the first lookup */
+	remove_index();
+}
+
+static void check_lookup(const char *mcc, const char *mnc)
+{
+	char *path = index_path("gsm");
+	GSList *expected = direct_lookup(mcc, mnc);
+	GSList *apns;
+	GError *error = NULL;
+
+	/* The first lookup builds and saves the index... */
+	apns = mbpi_lookup_apn(mcc, mnc, OFONO_GPRS_CONTEXT_TYPE_ANY,
+				TRUE, &error);
+	g_assert_no_error(error);
+	g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
+
+	compare_apns(apns, expected);
+	free_apns(apns);
+
+	/* ...and the second one reads it back */
+	apns = mbpi_lookup_apn(mcc, mnc, OFONO_GPRS_CONTEXT_TYPE_ANY,
+				TRUE, &error);
+	g_assert_no_error(error);
+
+	compare_apns(apns, expected);
+	free_apns(apns);
+	free_apns(expected);
+
+	unlink(path);
+	g_free(path);
+}
+
+static void test_lookup_apn(void)
+{
+	write_db(test_db);
+
+	check_lookup("234", "15");
+	check_lookup("234", "10");
+	check_lookup("310", "260");
+}
+
+static void test_lookup_apn_order(void)
+{
+	GSList *apns;
+	struct ofono_gprs_provision_data *ap;
+	GError *error = NULL;
+
+	write_db(test_db);
+
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_ANY,
+				TRUE, &error);
+	g_assert_no_error(error);
+	g_assert(g_slist_length(apns) == 5);
+
+	ap = apns->data;
+	g_assert_cmpstr(ap->apn, ==, "internet");
+	g_assert_cmpstr(ap->name, ==, "Contract");
+
+	ap = g_slist_last(apns)->data;
+	g_assert_cmpstr(ap->apn, ==, "shared.internet");
+
+	free_apns(apns);
+
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_INTERNET,
+				TRUE, &error);
+	g_assert_no_error(error);
+	g_assert(g_slist_length(apns) == 3);
+
+	ap = apns->next->data;
+	g_assert_cmpstr(ap->apn, ==, "pp.vodafone.co.uk");
+	g_assert(ap->auth_method == OFONO_GPRS_AUTH_METHOD_PAP);
+
+	free_apns(apns);
+
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_MMS,
+				FALSE, &error);
+	g_assert_no_error(error);
+	g_assert(g_slist_length(apns) == 1);
+
+	free_apns(apns);
+
+	/* Two internet contexts are a duplicate */
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_ANY,
+				FALSE, &error);
+	g_assert(apns == NULL);
+	g_assert(error != NULL);
+	g_clear_error(&error);
+}
+
+static void test_stale_index(void)
+{
+	GSList *apns;
+	struct ofono_gprs_provision_data *ap;
+	GError *error = NULL;
+
+	write_db(test_db);
+
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_ANY,
+				TRUE, &error);
+	g_assert_no_error(error);
+	free_apns(apns);
+
+	/* Replacing the database must not leave the old index in use */
+	g_assert(g_file_set_contents(MBPI_DATABASE, test_db_update, -1,
+					NULL));
+
+	apns = mbpi_lookup_apn("234", "15", OFONO_GPRS_CONTEXT_TYPE_ANY,
+				TRUE, &error);
+	g_assert_no_error(error);
+	g_assert(g_slist_length(apns) == 2);
+
+	ap = apns->data;
+	g_assert_cmpstr(ap->apn, ==, "new.internet");
+
+	free_apns(apns);
+}
+
+static void test_lookup_cdma_provider_name(void)
+{
+	char *name;
+
+	write_db(test_db);
+
+	name = mbpi_lookup_cdma_provider_name("4139", NULL);
+	g_assert_cmpstr(name, ==, "First");
+	g_free(name);
+
+	name = mbpi_lookup_cdma_provider_name("22", NULL);
+	g_assert_cmpstr(name, ==, "Second");
+	g_free(name);
+
+	name = mbpi_lookup_cdma_provider_name("1", NULL);
+	g_assert(name == NULL);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testmbpi/Lookup APN", test_lookup_apn);
+	g_test_add_func("/testmbpi/Lookup APN Order", test_lookup_apn_order);
+	g_test_add_func("/testmbpi/Stale Index", test_stale_index);
+	g_test_add_func("/testmbpi/Lookup CDMA Provider Name",
+				test_lookup_cdma_provider_name);
+
+	ret = g_test_run();
+
+	remove_index();
+	rmdir(APNDB_INDEX_DIR);
+	unlink(MBPI_DATABASE);
+
+	return ret;
+}
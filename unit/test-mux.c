@@ -554,6 +554,151 @@ static void test_extract_advanced(void)
 	g_assert(total == sizeof(advanced_input2) - 1);
 }
 
+/* Several quoted frames back to back, as delivered by a single read */
+static void test_extract_advanced_quoted(void)
+{
+	guint8 input[4 * sizeof(advanced_quoted_data_result)];
+	int len = 0;
+	int total = 0;
+	int nread;
+	int count = 0;
+	guint8 dlc;
+	guint8 ctrl;
+	guint8 *frame;
+	int frame_size;
+
+	while (len + sizeof(advanced_quoted_data_result) <= sizeof(input)) {
+		memcpy(input + len, advanced_quoted_data_result,
+				sizeof(advanced_quoted_data_result));
+		len += sizeof(advanced_quoted_data_result);
+	}
+
+	do {
+		frame = NULL;
+		nread = gsm0710_advanced_extract_frame(input + total,
+							len - total,
+							&dlc, &ctrl,
+							&frame, &frame_size);
+		total += nread;
+
+		if (frame == NULL)
+			break;
+
+		g_assert(dlc == 1);
+		g_assert(ctrl == GSM0710_DATA);
+		g_assert(frame_size == sizeof(advanced_quoted_data));
+		g_assert(memcmp(advanced_quoted_data, frame, frame_size) == 0);
+
+		count++;
+	} while (nread > 0);
+
+	g_assert(count == 4);
+	g_assert(total == len - 1);
+}
+
+#define DEMUX_DLCS		3
+#define DEMUX_FRAMES		12
+#define DEMUX_PAYLOAD		120
+
+struct demux_data {
+	int dispatched;
+	int received;
+};
+
+static gboolean demux_read_cb(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct demux_data *dd = user_data;
+	char buf[256];
+	gsize bytes_read;
+
+	dd->dispatched += 1;
+
+	while (g_io_channel_read_chars(channel, buf, sizeof(buf),
+				&bytes_read, NULL) == G_IO_STATUS_NORMAL)
+		dd->received += bytes_read;
+
+	return TRUE;
+}
+
+/*
+ * More frames than a single read of the mux buffer can take, interleaved
+ * over several DLCs and all sent at once.  They must all be demuxed in
+ * one wakeup, each DLC being woken up just once.
+ */
+static void test_demux_batch(void)
+{
+	struct demux_data dd[DEMUX_DLCS];
+	GIOChannel *dlcs[DEMUX_DLCS];
+	guint watches[DEMUX_DLCS];
+	guint8 payload[DEMUX_PAYLOAD];
+	guint8 *input;
+	GIOChannel *io;
+	GAtMux *m;
+	int len = 0;
+	int sk[2];
+	int i, j;
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sk) == 0);
+
+	io = g_io_channel_unix_new(sk[0]);
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+	g_io_channel_set_flags(io, G_IO_FLAG_NONBLOCK, NULL);
+
+	m = g_at_mux_new_gsm0710_basic(io, DEMUX_PAYLOAD);
+	g_io_channel_unref(io);
+
+	g_assert(m != NULL);
+	g_assert(g_at_mux_start(m));
+
+	memset(dd, 0, sizeof(dd));
+
+	for (i = 0; i < DEMUX_DLCS; i++) {
+		dlcs[i] = g_at_mux_create_channel(m);
+		g_assert(dlcs[i] != NULL);
+
+		g_io_channel_set_encoding(dlcs[i], NULL, NULL);
+		g_io_channel_set_buffered(dlcs[i], FALSE);
+
+		watches[i] = g_io_add_watch(dlcs[i], G_IO_IN,
+						demux_read_cb, &dd[i]);
+	}
+
+	memset(payload, 'A', sizeof(payload));
+	input = g_malloc(DEMUX_DLCS * DEMUX_FRAMES * (DEMUX_PAYLOAD + 8));
+
+	for (j = 0; j < DEMUX_FRAMES; j++)
+		for (i = 0; i < DEMUX_DLCS; i++)
+			len += gsm0710_basic_fill_frame(input + len, i + 1,
+							GSM0710_DATA, payload,
+							sizeof(payload));
+
+	g_assert(len > 4096);
+	g_assert(write(sk[1], input, len) == len);
+	g_free(input);
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	for (i = 0; i < DEMUX_DLCS; i++) {
+		if (g_test_verbose())
+			g_print("DLC %d: dispatched %d, received %d\n", i + 1,
+					dd[i].dispatched, dd[i].received);
+
+		g_assert(dd[i].dispatched == 1);
+		g_assert(dd[i].received == DEMUX_FRAMES * DEMUX_PAYLOAD);
+
+		g_source_remove(watches[i]);
+		g_io_channel_unref(dlcs[i]);
+	}
+
+	g_at_mux_shutdown(m);
+	g_at_mux_unref(m);
+
+	close(sk[1]);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -562,6 +707,9 @@ int main(int argc, char **argv)
 	g_test_add_func("/testmux/fill_advanced", test_fill_advanced);
 	g_test_add_func("/testmux/extract_basic", test_extract_basic);
 	g_test_add_func("/testmux/extract_advanced", test_extract_advanced);
+	g_test_add_func("/testmux/extract_advanced_quoted",
+					test_extract_advanced_quoted);
+	g_test_add_func("/testmux/demux_batch", test_demux_batch);
 	g_test_add_func("/testmux/basic", test_basic);
 	g_test_add_func("/testmux/basic:subprocess", test_mux);
 
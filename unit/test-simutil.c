@@ -385,6 +385,91 @@ static void test_eons(void)
 	sim_eons_free(eons_info);
 }
 
+static const unsigned char opl_records[][8] = {
+	/* 246 81, LAC 0x0010 to 0x0020 */
+	{ 0x42, 0xf6, 0x18, 0x00, 0x10, 0x00, 0x20, 0x02 },
+	/* 246 b1, whole PLMN */
+	{ 0x42, 0xf6, 0x1d, 0x00, 0x00, 0xff, 0xfe, 0x01 },
+	/* 246 81, LAC 0x0000 to 0xfffd */
+	{ 0x42, 0xf6, 0x18, 0x00, 0x00, 0xff, 0xfd, 0x02 },
+	/* 310 260, LAC 0x0100 to 0x01ff */
+	{ 0x13, 0x00, 0x62, 0x01, 0x00, 0x01, 0xff, 0x02 },
+	/* 310 260, LAC 0x0180 to 0x02ff */
+	{ 0x13, 0x00, 0x62, 0x01, 0x80, 0x02, 0xff, 0x01 },
+	/* 310 26b, whole PLMN, invalid record id */
+	{ 0x13, 0xd0, 0x62, 0x00, 0x00, 0xff, 0xfe, 0x00 },
+};
+
+/* 310 270, whole PLMN */
+static const unsigned char opl_late_record[] = {
+	0x13, 0x00, 0x72, 0x00, 0x00, 0xff, 0xfe, 0x01,
+};
+
+static void test_eons_opl(void)
+{
+	const struct sim_eons_operator_info *op_info;
+	struct sim_eons *eons_info;
+	unsigned int i;
+
+	eons_info = sim_eons_new(2);
+
+	sim_eons_add_pnn_record(eons_info, 1,
+			valid_efpnn[0], sizeof(valid_efpnn[0]));
+	sim_eons_add_pnn_record(eons_info, 2,
+			valid_efpnn[1], sizeof(valid_efpnn[1]));
+
+	for (i = 0; i < G_N_ELEMENTS(opl_records); i++)
+		sim_eons_add_opl_record(eons_info, opl_records[i],
+					sizeof(opl_records[i]));
+
+	sim_eons_optimize(eons_info);
+
+	/* Without a LAC only the records for the whole PLMN match */
+	op_info = sim_eons_lookup(eons_info, "246", "81");
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	/* The first record in file order wins */
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "81", 0x15);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "T-Mobile"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "81", 0x30);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "246", "82", 0x15);
+	g_assert(op_info == NULL);
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "310", "260", 0x1a0);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "T-Mobile"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "310", "260", 0x200);
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	op_info = sim_eons_lookup_with_lac(eons_info, "310", "260", 0x300);
+	g_assert(op_info == NULL);
+
+	op_info = sim_eons_lookup(eons_info, "310", "260");
+	g_assert(op_info == NULL);
+
+	/* Matches the wildcard record, which has no name */
+	op_info = sim_eons_lookup(eons_info, "310", "261");
+	g_assert(op_info == NULL);
+
+	/* Records added later are taken into account */
+	sim_eons_add_opl_record(eons_info, opl_late_record,
+				sizeof(opl_late_record));
+
+	op_info = sim_eons_lookup(eons_info, "310", "270");
+	g_assert(op_info);
+	g_assert(!strcmp(op_info->longname, "Solavei"));
+
+	sim_eons_free(eons_info);
+}
+
 static void test_ef_db(void)
 {
 	struct sim_ef_info *info;
@@ -508,6 +593,7 @@ int main(int argc, char **argv)
 	g_test_add_func("/testsimutil/ber tlv encode 3G Status response",
 			test_ber_tlv_builder_3g_status);
 	g_test_add_func("/testsimutil/EONS Handling", test_eons);
+	g_test_add_func("/testsimutil/EONS OPL Lookup", test_eons_opl);
 	g_test_add_func("/testsimutil/Elementary File DB", test_ef_db);
 	g_test_add_func("/testsimutil/3G Status response", test_3g_status_data);
 	g_test_add_func("/testsimutil/Application entries decoding",
@@ -27,12 +27,14 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
 
 #include "util.h"
 #include "smsutil.h"
+#include "storage.h"
 
 static const char *assembly_pdu1 = "038121F340048155550119906041001222048C0500"
 					"031E0301041804420430043A002C002004100"
@@ -88,7 +90,7 @@ static void test_serialize_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -115,12 +117,457 @@ static void test_serialize_assembly(void)
 	sms_assembly_free(assembly);
 }
 
+static void test_expire_assembly(void)
+{
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly = sms_assembly_new("5678");
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	GSList *l;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms);
+
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+					&sms.deliver.oaddr, ref, max, seq);
+	g_assert(l == NULL);
+
+	sms_assembly_free(assembly);
+
+	assembly = sms_assembly_new("5678");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+
+	/* The expired fragment must not come back */
+	assembly = sms_assembly_new("5678");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+}
+
+static GSList *add_fragment(struct sms_assembly *assembly,
+				const struct sms *sms, guint16 ref, guint8 seq)
+{
+	return sms_assembly_add_fragment(assembly, sms, time(NULL),
+					&sms->deliver.oaddr, ref, 2, seq);
+}
+
+static void free_fragments(GSList *l)
+{
+	g_slist_foreach(l, (GFunc) g_free, NULL);
+	g_slist_free(l);
+}
+
+static void test_replay_assembly(void)
+{
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly;
+	struct sms_assembly *first;
+	struct sms_assembly *second;
+	GSList *l;
+	guint16 ref;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms);
+
+	/* Start from an empty journal */
+	assembly = sms_assembly_new("7890");
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	sms_assembly_free(assembly);
+
+	/* Instances sharing the journal, each writing a part of it */
+	assembly = sms_assembly_new("7890");
+	first = sms_assembly_new("7890");
+	second = sms_assembly_new("7890");
+
+	/* Just short of the dead records that get the journal compacted */
+	for (ref = 0; ref < 127; ref++) {
+		g_assert(add_fragment(assembly, &sms, ref, 0) == NULL);
+
+		l = add_fragment(assembly, &sms, ref, 1);
+		g_assert(l != NULL);
+		free_fragments(l);
+	}
+
+	/* Both fragments of a message end up in the journal */
+	g_assert(add_fragment(first, &sms, 200, 0) == NULL);
+	g_assert(add_fragment(second, &sms, 200, 1) == NULL);
+
+	/* Replayed after the message above completed */
+	g_assert(add_fragment(assembly, &sms, 300, 0) == NULL);
+
+	sms_assembly_free(second);
+	sms_assembly_free(first);
+	sms_assembly_free(assembly);
+
+	assembly = sms_assembly_new("7890");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+	sms_assembly_free(assembly);
+
+	/* The journal written after the replay still has the fragment */
+	assembly = sms_assembly_new("7890");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	sms_assembly_free(assembly);
+}
+
+#define DAMAGED_JOURNAL_PATH STORAGEDIR "/6789/sms_assembly/journal"
+
+static void test_damaged_assembly(void)
+{
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly;
+	gchar *contents;
+	gsize length;
+	guint16 ref;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms);
+
+	assembly = sms_assembly_new("6789");
+	sms_assembly_expire(assembly, time(NULL) + 40);
+
+	for (ref = 1; ref <= 3; ref++)
+		g_assert(add_fragment(assembly, &sms, ref, 0) == NULL);
+
+	sms_assembly_free(assembly);
+
+	/* Garble the middle one of the three records */
+	g_assert(g_file_get_contents(DAMAGED_JOURNAL_PATH, &contents,
+					&length, NULL));
+	g_assert(length % 3 == 0);
+	contents[length / 3 + length / 6] ^= 0xff;
+	g_assert(g_file_set_contents(DAMAGED_JOURNAL_PATH, contents, length,
+					NULL));
+	g_free(contents);
+
+	/* The replay stops at the damaged record */
+	assembly = sms_assembly_new("6789");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+
+	/* And records appended from now on are replayed again */
+	g_assert(add_fragment(assembly, &sms, 4, 0) == NULL);
+	sms_assembly_free(assembly);
+
+	assembly = sms_assembly_new("6789");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 2);
+
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	sms_assembly_free(assembly);
+}
+
+#define LEGACY_BACKUP_PATH STORAGEDIR "/2345/sms_assembly"
+
+static void test_migrate_assembly(void)
+{
+	unsigned char pdu[177];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly;
+	DECLARE_SMS_ADDR_STR(straddr);
+	char *dir;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu + 1);
+	pdu[0] = assembly_pdu_len1;
+	sms_decode(pdu + 1, pdu_len, FALSE, assembly_pdu_len1, &sms);
+
+	g_assert(sms_address_to_hex_string(&sms.deliver.oaddr, straddr));
+	dir = g_strdup_printf(LEGACY_BACKUP_PATH "/%s-30-3", straddr);
+
+	/* A message backed up the old way, one file per fragment */
+	g_assert(write_file(pdu, pdu_len + 1, 0600, "%s/0", dir) ==
+							pdu_len + 1);
+
+	/* Nothing can be written in place of the journal */
+	rmdir(LEGACY_BACKUP_PATH "/journal");
+	g_assert(mkdir(LEGACY_BACKUP_PATH "/journal", 0700) == 0);
+
+	assembly = sms_assembly_new("2345");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+	sms_assembly_free(assembly);
+
+	/* So the old backup is kept */
+	g_assert(g_file_test(dir, G_FILE_TEST_IS_DIR));
+
+	rmdir(LEGACY_BACKUP_PATH "/journal");
+
+	assembly = sms_assembly_new("2345");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+	sms_assembly_free(assembly);
+
+	/* Gone once migrated to the journal */
+	g_assert(!g_file_test(dir, G_FILE_TEST_EXISTS));
+
+	assembly = sms_assembly_new("2345");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	sms_assembly_free(assembly);
+
+	g_free(dir);
+}
+
+static void test_restore_status_reports(void)
+{
+	struct status_report_assembly *sra = status_report_assembly_new("3456");
+	unsigned int count = STATUS_REPORT_ASSEMBLY_MAX_PENDING + 8;
+	unsigned char sha1[SMS_MSGID_LEN];
+	struct sms_address addr;
+	time_t now = time(NULL);
+	unsigned int i;
+
+	status_report_assembly_set_max_pending(sra, 0);
+
+	memset(sha1, 0, sizeof(sha1));
+	sms_address_from_string(&addr, "+4915259911630");
+
+	/* The names of the backups don't sort the way they were sent */
+	for (i = 0; i < count; i++) {
+		sha1[0] = i % 256;
+		sha1[1] = 255 - i / 256;
+		status_report_assembly_add_fragment(sra, sha1, &addr, i % 256,
+							now + 3600 + i, 1);
+	}
+
+	status_report_assembly_free(sra);
+
+	/* No backup is lost to the default limit while restoring */
+	sra = status_report_assembly_new("3456");
+	g_assert(g_queue_get_length(sra->pending) == count);
+
+	status_report_assembly_set_max_pending(sra, 0);
+	g_assert(g_queue_get_length(sra->pending) == count);
+
+	/* The oldest ones go first once a limit is applied */
+	status_report_assembly_set_max_pending(sra,
+					STATUS_REPORT_ASSEMBLY_MAX_PENDING);
+	g_assert(g_queue_get_length(sra->pending) ==
+					STATUS_REPORT_ASSEMBLY_MAX_PENDING);
+
+	status_report_assembly_expire(sra, now + 3600 + 8);
+	g_assert(g_queue_get_length(sra->pending) ==
+					STATUS_REPORT_ASSEMBLY_MAX_PENDING - 1);
+
+	status_report_assembly_free(sra);
+
+	sra = status_report_assembly_new("3456");
+	g_assert(g_queue_get_length(sra->pending) ==
+					STATUS_REPORT_ASSEMBLY_MAX_PENDING - 1);
+
+	/* Drops the remaining backups */
+	status_report_assembly_expire(sra, now + 3600 + count);
+	g_assert(g_queue_get_length(sra->pending) == 0);
+
+	status_report_assembly_free(sra);
+}
+
+static const char *tx_uuids[] = {
+	"0123456789ABCDEF0123456789ABCDEF01234567",
+	"89ABCDEF0123456789ABCDEF0123456789ABCDEF",
+};
+
+static void store_tx_message(struct sms_tx_journal *journal,
+				unsigned long id, const char *uuid,
+				const char *text)
+{
+	unsigned char pdu[176];
+	int pdu_len, tpdu_len;
+	GSList *msg_list;
+	GSList *l;
+	guint8 seq;
+
+	msg_list = sms_text_prepare("+15554449999", text, 42, FALSE, FALSE);
+	g_assert(msg_list != NULL);
+
+	for (l = msg_list, seq = 0; l; l = l->next, seq++) {
+		g_assert(sms_encode(l->data, &pdu_len, &tpdu_len, pdu));
+		g_assert(sms_tx_backup_store(journal, id, 0, uuid, seq, pdu,
+						pdu_len, tpdu_len));
+	}
+
+	g_slist_foreach(msg_list, (GFunc) g_free, NULL);
+	g_slist_free(msg_list);
+}
+
+static GQueue *reload_tx_queue(struct sms_tx_journal **journal)
+{
+	sms_tx_journal_free(*journal);
+	*journal = sms_tx_journal_new("9012");
+
+	return sms_tx_queue_load(*journal);
+}
+
+/* Also drops the backups when a journal is given */
+static void free_tx_queue(struct sms_tx_journal *journal, GQueue *queue)
+{
+	struct txq_backup_entry *entry;
+
+	while ((entry = g_queue_pop_head(queue))) {
+		if (journal)
+			sms_tx_backup_free(journal, entry->id);
+
+		g_slist_foreach(entry->msg_list, (GFunc) g_free, NULL);
+		g_slist_free(entry->msg_list);
+		g_free(entry);
+	}
+
+	g_queue_free(queue);
+}
+
+static void test_tx_queue(void)
+{
+	struct sms_tx_journal *journal = sms_tx_journal_new("9012");
+	unsigned char uuid[SMS_MSGID_LEN];
+	struct txq_backup_entry *entry;
+	GQueue *queue;
+	char text[400];
+	unsigned long id;
+
+	/* Start from a clean journal */
+	queue = sms_tx_queue_load(journal);
+	g_assert(queue != NULL);
+	free_tx_queue(journal, queue);
+
+	memset(text, 'a', sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+
+	store_tx_message(journal, 7, tx_uuids[0], text);
+	store_tx_message(journal, 8, tx_uuids[1], "Hello");
+
+	/* First PDU of the first message got sent */
+	sms_tx_backup_remove(journal, 7, 0);
+
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 2);
+
+	entry = g_queue_peek_nth(queue, 0);
+	g_assert(entry->id == 7);
+	g_assert(g_slist_length(entry->msg_list) == 2);
+	decode_hex_own_buf(tx_uuids[0], -1, NULL, 0, uuid);
+	g_assert(memcmp(entry->uuid, uuid, SMS_MSGID_LEN) == 0);
+
+	entry = g_queue_peek_nth(queue, 1);
+	g_assert(entry->id == 8);
+	g_assert(g_slist_length(entry->msg_list) == 1);
+
+	free_tx_queue(NULL, queue);
+
+	/* Enough churn to get the journal compacted along the way */
+	for (id = 9; id < 300; id++) {
+		store_tx_message(journal, id, tx_uuids[id % 2], "Hi");
+		sms_tx_backup_free(journal, id);
+	}
+
+	sms_tx_backup_free(journal, 7);
+
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 1);
+
+	entry = g_queue_peek_head(queue);
+	g_assert(entry->id == 8);
+
+	free_tx_queue(journal, queue);
+
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 0);
+	free_tx_queue(NULL, queue);
+
+	sms_tx_journal_free(journal);
+}
+
+#define DAMAGED_TX_JOURNAL_PATH STORAGEDIR "/9012/tx_queue/journal"
+
+static void test_tx_queue_damaged(void)
+{
+	struct sms_tx_journal *journal = sms_tx_journal_new("9012");
+	struct txq_backup_entry *entry;
+	GQueue *queue;
+	gchar *contents;
+	gsize length;
+	unsigned long id;
+
+	queue = sms_tx_queue_load(journal);
+	free_tx_queue(journal, queue);
+
+	for (id = 1; id <= 3; id++)
+		store_tx_message(journal, id, tx_uuids[0], "Hello");
+
+	/* Garble the middle one of the three records */
+	g_assert(g_file_get_contents(DAMAGED_TX_JOURNAL_PATH, &contents,
+					&length, NULL));
+	g_assert(length % 3 == 0);
+	contents[length / 3 + length / 6] ^= 0xff;
+	g_assert(g_file_set_contents(DAMAGED_TX_JOURNAL_PATH, contents,
+					length, NULL));
+	g_free(contents);
+
+	/* The replay stops at the damaged record */
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 1);
+	free_tx_queue(NULL, queue);
+
+	/* And records appended from now on are replayed again */
+	store_tx_message(journal, 4, tx_uuids[1], "Hello");
+
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 2);
+	free_tx_queue(NULL, queue);
+
+	store_tx_message(journal, 5, tx_uuids[0], "Hello");
+
+	/* None of the records below make it to the journal */
+	close(journal->fd);
+	journal->fd = -1;
+
+	sms_tx_backup_free(journal, 1);
+	sms_tx_backup_free(journal, 4);
+
+	/* But the journal gets rewritten with what is still queued */
+	queue = reload_tx_queue(&journal);
+	g_assert(g_queue_get_length(queue) == 1);
+
+	entry = g_queue_peek_head(queue);
+	g_assert(entry->id == 5);
+
+	free_tx_queue(journal, queue);
+	sms_tx_journal_free(journal);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/testsms/Test SMS Assembly Serialize",
 			test_serialize_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Expire",
+			test_expire_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Replay",
+			test_replay_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Damaged",
+			test_damaged_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Migrate",
+			test_migrate_assembly);
+	g_test_add_func("/testsms/Test Status Report Restore",
+			test_restore_status_reports);
+	g_test_add_func("/testsms/Test SMS TX Queue Backup", test_tx_queue);
+	g_test_add_func("/testsms/Test SMS TX Queue Damaged",
+			test_tx_queue_damaged);
 
 	return g_test_run();
 }
@@ -1100,17 +1100,17 @@ static void test_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	sms_assembly_expire(assembly, time(NULL) + 40);
 
-	g_assert(g_slist_length(assembly->assembly_list) == 0);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
 
 	sms_extract_concatenation(&sms, &ref, &max, &seq);
 	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
 					&sms.deliver.oaddr, ref, max, seq);
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -1478,7 +1478,7 @@ static void test_cbs_assembly(void)
 	/* Add an initial page to the assembly */
 	l = cbs_assembly_add_page(assembly, &dec1);
 	g_assert(l);
-	g_assert(g_slist_length(assembly->recv_cell) == 1);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 1);
 	g_slist_foreach(l, (GFunc)g_free, NULL);
 	g_slist_free(l);
 
@@ -1486,7 +1486,7 @@ static void test_cbs_assembly(void)
 	dec1.update_number = 8;
 	l = cbs_assembly_add_page(assembly, &dec1);
 	g_assert(l);
-	g_assert(g_slist_length(assembly->recv_cell) == 1);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 1);
 	g_slist_foreach(l, (GFunc)g_free, NULL);
 	g_slist_free(l);
 
@@ -1500,7 +1500,7 @@ static void test_cbs_assembly(void)
 	g_assert(l == NULL);
 
 	cbs_assembly_location_changed(assembly, TRUE, TRUE, TRUE);
-	g_assert(assembly->recv_cell == NULL);
+	g_assert(g_hash_table_size(assembly->recv_cell) == 0);
 
 	dec1.update_number = 9;
 	dec1.page = 3;
@@ -1631,6 +1631,45 @@ static void test_range_minimizer(void)
 	}
 }
 
+static const struct cbs_topic_range topic_set_ranges[] = {
+	{ 4370, 4370 }, { 50, 60 }, { 4371, 4380 }, { 1, 5 }, { 3, 3 },
+	{ 6, 6 }, { 55, 70 },
+};
+
+static void test_topic_set(void)
+{
+	struct cbs_topic_set *set;
+	GSList *r = NULL;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(topic_set_ranges); i++)
+		r = g_slist_prepend(r, (gpointer) &topic_set_ranges[i]);
+
+	set = cbs_topic_set_new(r);
+	g_slist_free(r);
+
+	g_assert(set->len == 3);
+	g_assert(set->ranges[0].min == 1 && set->ranges[0].max == 6);
+	g_assert(set->ranges[1].min == 50 && set->ranges[1].max == 70);
+	g_assert(set->ranges[2].min == 4370 && set->ranges[2].max == 4380);
+
+	g_assert(cbs_topic_in_range(0, set) == FALSE);
+	g_assert(cbs_topic_in_range(1, set) == TRUE);
+	g_assert(cbs_topic_in_range(6, set) == TRUE);
+	g_assert(cbs_topic_in_range(7, set) == FALSE);
+	g_assert(cbs_topic_in_range(49, set) == FALSE);
+	g_assert(cbs_topic_in_range(65, set) == TRUE);
+	g_assert(cbs_topic_in_range(4375, set) == TRUE);
+	g_assert(cbs_topic_in_range(4381, set) == FALSE);
+
+	cbs_topic_set_free(set);
+
+	set = cbs_topic_set_new(NULL);
+	g_assert(set->len == 0);
+	g_assert(cbs_topic_in_range(4370, set) == FALSE);
+	cbs_topic_set_free(set);
+}
+
 static void test_sr_assembly(void)
 {
 	const char *sr_pdu1 = "06040D91945152991136F00160124130340A0160124130"
@@ -1729,6 +1768,147 @@ static void test_sr_assembly(void)
 	status_report_assembly_free(sra);
 }
 
+static void test_sr_assembly_limits(void)
+{
+	/* international address, mr 4 */
+	const char *sr_pdu = "06040D91945152991136F00160124130340A0160124130"
+				"940A00";
+	struct sms sr;
+	unsigned char pdu[176];
+	long pdu_len;
+	struct status_report_assembly *sra;
+	gboolean delivered;
+	struct sms_address addr;
+	unsigned char sha1[SMS_MSGID_LEN];
+	unsigned char id[SMS_MSGID_LEN];
+	time_t now = time(NULL);
+	unsigned int i;
+
+	decode_hex_own_buf(sr_pdu, -1, &pdu_len, 0, pdu);
+	g_assert(sms_decode(pdu, pdu_len, FALSE, 26, &sr) == TRUE);
+
+	sra = status_report_assembly_new(NULL);
+	status_report_assembly_set_max_pending(sra, 8);
+
+	memset(sha1, 0, sizeof(sha1));
+	sms_address_from_string(&addr, "+4915259911630");
+
+	/* Sixteen messages with MR 0 to 15, only the newest eight are kept */
+	for (i = 0; i < 16; i++) {
+		sha1[0] = i;
+		status_report_assembly_add_fragment(sra, sha1, &addr, i,
+							now + i * 100, 1);
+	}
+
+	g_assert(g_queue_get_length(sra->pending) == 8);
+	g_assert(!status_report_assembly_report(sra, &sr, id, &delivered));
+
+	/* Only the messages expiring at or before the given time go */
+	status_report_assembly_expire(sra, now + 950);
+	g_assert(g_queue_get_length(sra->pending) == 6);
+
+	status_report_assembly_expire(sra, now + 1099);
+	g_assert(g_queue_get_length(sra->pending) == 5);
+
+	/* Far in the future, all slots of the wheel are visited */
+	status_report_assembly_expire(sra, now + 24 * 3600);
+	g_assert(g_queue_get_length(sra->pending) == 0);
+	g_assert(g_hash_table_size(sra->assembly_table) == 0);
+	g_assert(g_hash_table_size(sra->mr_table) == 0);
+
+	/* Sent in national format, reported in international format */
+	sms_address_from_string(&addr, "9911630");
+
+	for (i = 0; i < 4; i++) {
+		sha1[0] = i;
+		status_report_assembly_add_fragment(sra, sha1, &addr, 4,
+							now + 25 * 3600, 1);
+	}
+
+	/* The oldest message waiting for MR 4 gets the report */
+	g_assert(status_report_assembly_report(sra, &sr, id, &delivered));
+	g_assert(id[0] == 0);
+	g_assert(delivered == TRUE);
+
+	g_assert(status_report_assembly_report(sra, &sr, id, &delivered));
+	g_assert(id[0] == 1);
+	g_assert(g_queue_get_length(sra->pending) == 2);
+
+	status_report_assembly_set_max_pending(sra, 1);
+	g_assert(g_queue_get_length(sra->pending) == 1);
+
+	g_assert(status_report_assembly_report(sra, &sr, id, &delivered));
+	g_assert(id[0] == 3);
+	g_assert(g_hash_table_size(sra->assembly_table) == 0);
+
+	/* Without an expiration only a report or the limit drops it */
+	sha1[0] = 0;
+	status_report_assembly_add_fragment(sra, sha1, &addr, 4, 0, 1);
+
+	status_report_assembly_expire(sra, now + 365 * 24 * 3600);
+	g_assert(g_queue_get_length(sra->pending) == 1);
+
+	sha1[0] = 1;
+	status_report_assembly_add_fragment(sra, sha1, &addr, 5, now + 60, 1);
+	g_assert(g_queue_get_length(sra->pending) == 1);
+
+	status_report_assembly_expire(sra, now + 60);
+	g_assert(g_queue_get_length(sra->pending) == 0);
+
+	status_report_assembly_free(sra);
+}
+
+static void test_submit_expiration(void)
+{
+	struct sms_submit submit;
+	time_t now = time(NULL);
+
+	memset(&submit, 0, sizeof(submit));
+
+	submit.vpf = SMS_VALIDITY_PERIOD_FORMAT_ABSENT;
+	g_assert(sms_submit_expiration(&submit, now) == 0);
+
+	submit.vpf = SMS_VALIDITY_PERIOD_FORMAT_RELATIVE;
+
+	submit.vp.relative = 0;
+	g_assert(sms_submit_expiration(&submit, now) == now + 5 * 60);
+
+	submit.vp.relative = 143;
+	g_assert(sms_submit_expiration(&submit, now) == now + 12 * 3600);
+
+	submit.vp.relative = 0xA7;
+	g_assert(sms_submit_expiration(&submit, now) == now + 24 * 3600);
+
+	submit.vp.relative = 196;
+	g_assert(sms_submit_expiration(&submit, now) ==
+						now + 30 * 24 * 3600);
+
+	submit.vp.relative = 255;
+	g_assert(sms_submit_expiration(&submit, now) ==
+						now + 63 * 7 * 24 * 3600);
+
+	submit.vpf = SMS_VALIDITY_PERIOD_FORMAT_ENHANCED;
+
+	submit.vp.enhanced[0] = 0x01;
+	submit.vp.enhanced[1] = 0xA7;
+	g_assert(sms_submit_expiration(&submit, now) == now + 24 * 3600);
+
+	submit.vp.enhanced[0] = 0x02;
+	submit.vp.enhanced[1] = 90;
+	g_assert(sms_submit_expiration(&submit, now) == now + 90);
+
+	/* 01:30:15 in semi-octets */
+	submit.vp.enhanced[0] = 0x03;
+	submit.vp.enhanced[1] = 0x10;
+	submit.vp.enhanced[2] = 0x03;
+	submit.vp.enhanced[3] = 0x51;
+	g_assert(sms_submit_expiration(&submit, now) ==
+						now + 3600 + 30 * 60 + 15);
+
+	submit.vp.enhanced[0] = 0x00;
+	g_assert(sms_submit_expiration(&submit, now) == 0);
+}
+
 struct wap_push_data {
 	const char *pdu;
 	int len;
@@ -1890,8 +2070,12 @@ int main(int argc, char **argv)
 			test_cbs_padding_character);
 
 	g_test_add_func("/testsms/Range minimizer", test_range_minimizer);
+	g_test_add_func("/testsms/CBS Topic Set", test_topic_set);
 
 	g_test_add_func("/testsms/Status Report Assembly", test_sr_assembly);
+	g_test_add_func("/testsms/Status Report Assembly Limits",
+			test_sr_assembly_limits);
+	g_test_add_func("/testsms/Submit Expiration", test_submit_expiration);
 
 	g_test_add_data_func("/testsms/Test WAP Push 1", &wap_push_1,
 				test_wap_push);
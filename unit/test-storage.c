@@ -0,0 +1,226 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  Copyright (C) 2008-2011  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "storage.h"
+
+/* STORAGE_ROOT is pointed at a scratch directory by the build */
+#define TEST_IMSI "001010123456789"
+
+static GMainLoop *main_loop;
+static char *wait_path;
+static int wait_polls;
+
+static char *store_path(const char *store)
+{
+	return g_strdup_printf(STORAGE_ROOT "/" TEST_IMSI "/%s", store);
+}
+
+static int stored_value(const char *store)
+{
+	GKeyFile *keyfile;
+	char *path = store_path(store);
+	int value = -1;
+
+	keyfile = g_key_file_new();
+
+	if (g_key_file_load_from_file(keyfile, path, 0, NULL))
+		value = g_key_file_get_integer(keyfile, "Settings", "Value",
+						NULL);
+
+	g_key_file_free(keyfile);
+	g_free(path);
+
+	return value;
+}
+
+static void sync_value(const char *store, int value)
+{
+	GKeyFile *keyfile = storage_open(TEST_IMSI, store);
+
+	g_key_file_set_integer(keyfile, "Settings", "Value", value);
+	storage_sync(TEST_IMSI, store, keyfile);
+	storage_close(TEST_IMSI, store, keyfile, FALSE);
+}
+
+static int pending_value(const char *store)
+{
+	GKeyFile *keyfile = storage_open(TEST_IMSI, store);
+	int value;
+
+	value = g_key_file_get_integer(keyfile, "Settings", "Value", NULL);
+	storage_close(TEST_IMSI, store, keyfile, FALSE);
+
+	return value;
+}
+
+static gboolean poll_written(gpointer user_data)
+{
+	if (g_file_test(wait_path, G_FILE_TEST_EXISTS) == FALSE &&
+			++wait_polls < 100)
+		return TRUE;
+
+	g_main_loop_quit(main_loop);
+
+	return FALSE;
+}
+
+static void wait_written(const char *store)
+{
+	wait_path = store_path(store);
+	wait_polls = 0;
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+	g_timeout_add(100, poll_written, NULL);
+	g_main_loop_run(main_loop);
+	g_main_loop_unref(main_loop);
+	main_loop = NULL;
+
+	g_free(wait_path);
+	wait_path = NULL;
+}
+
+static void remove_store(const char *store)
+{
+	char *path = store_path(store);
+
+	unlink(path);
+	g_free(path);
+}
+
+static void test_coalesce(void)
+{
+	int i;
+
+	remove_store("coalesce");
+
+	for (i = 1; i <= 5; i++)
+		sync_value("coalesce", i);
+
+	/* Nothing hits the disk until the sync timeout fires */
+	g_assert(stored_value("coalesce") == -1);
+	g_assert(pending_value("coalesce") == 5);
+
+	wait_written("coalesce");
+
+	g_assert(stored_value("coalesce") == 5);
+	g_assert(pending_value("coalesce") == 5);
+
+	storage_cleanup();
+	remove_store("coalesce");
+}
+
+static void test_close_flush(void)
+{
+	GKeyFile *keyfile;
+
+	remove_store("close");
+
+	keyfile = storage_open(TEST_IMSI, "close");
+	g_key_file_set_integer(keyfile, "Settings", "Value", 42);
+	storage_close(TEST_IMSI, "close", keyfile, TRUE);
+
+	g_assert(stored_value("close") == -1);
+	g_assert(pending_value("close") == 42);
+
+	storage_cleanup();
+
+	g_assert(stored_value("close") == 42);
+
+	remove_store("close");
+}
+
+static void test_cleanup_flush(void)
+{
+	remove_store("cleanup1");
+	remove_store("cleanup2");
+
+	sync_value("cleanup1", 1);
+	sync_value("cleanup2", 2);
+	sync_value("cleanup1", 3);
+
+	g_assert(stored_value("cleanup1") == -1);
+	g_assert(stored_value("cleanup2") == -1);
+
+	storage_cleanup();
+
+	g_assert(stored_value("cleanup1") == 3);
+	g_assert(stored_value("cleanup2") == 2);
+
+	remove_store("cleanup1");
+	remove_store("cleanup2");
+}
+
+static gboolean other_source(gpointer user_data)
+{
+	gboolean *dispatched = user_data;
+
+	*dispatched = TRUE;
+
+	return TRUE;
+}
+
+static void test_cleanup_sources(void)
+{
+	gboolean dispatched = FALSE;
+	guint source;
+
+	remove_store("sources");
+
+	source = g_idle_add(other_source, &dispatched);
+
+	sync_value("sources", 7);
+	storage_cleanup();
+
+	/* Only the writes are waited for, nothing else gets dispatched */
+	g_assert(stored_value("sources") == 7);
+	g_assert(dispatched == FALSE);
+
+	g_source_remove(source);
+	remove_store("sources");
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/teststorage/Coalesce", test_coalesce);
+	g_test_add_func("/teststorage/Close Flush", test_close_flush);
+	g_test_add_func("/teststorage/Cleanup Flush", test_cleanup_flush);
+	g_test_add_func("/teststorage/Cleanup Sources", test_cleanup_sources);
+
+	ret = g_test_run();
+
+	rmdir(STORAGE_ROOT "/" TEST_IMSI);
+	rmdir(STORAGE_ROOT);
+
+	return ret;
+}
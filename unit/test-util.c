@@ -1012,6 +1012,122 @@ static void test_unicode_to_gsm(void)
 	}
 }
 
+static void test_pack_round_trip(void)
+{
+	unsigned char septets[40];
+	unsigned char *packed;
+	unsigned char *unpacked;
+	long packed_len;
+	long unpacked_len;
+	char *hex;
+	unsigned char *bin;
+	long bin_len;
+	int total_bits;
+	int len;
+	int offset;
+	int i;
+
+	for (i = 0; i < (int) sizeof(septets); i++)
+		septets[i] = (i * 37 + 11) & 0x7f;
+
+	/* Cover whole groups of 8 septets and the tails around them */
+	for (len = 1; len <= (int) sizeof(septets); len++) {
+		for (offset = 0; offset < 7; offset++) {
+			packed = pack_7bit(septets, len, offset, FALSE,
+						&packed_len, 0);
+			g_assert(packed != NULL);
+			/* The fill bits up to the septet boundary come first */
+			total_bits = len * 7 + (offset ? 7 - offset : 0);
+			g_assert(packed_len == (total_bits + 7) / 8);
+
+			unpacked = unpack_7bit(packed, packed_len, offset,
+						FALSE, len, &unpacked_len, 0);
+			g_assert(unpacked != NULL);
+			g_assert(unpacked_len == len);
+			g_assert(memcmp(unpacked, septets, len) == 0);
+
+			hex = encode_hex(packed, packed_len, 0);
+			g_assert(strlen(hex) == (size_t) packed_len * 2);
+
+			bin = decode_hex(hex, -1, &bin_len, 0);
+			g_assert(bin != NULL);
+			g_assert(bin_len == packed_len);
+			g_assert(memcmp(bin, packed, bin_len) == 0);
+
+			g_free(bin);
+			g_free(hex);
+			g_free(unpacked);
+			g_free(packed);
+		}
+	}
+
+	bin = decode_hex("0a1B", -1, &bin_len, 0);
+	g_assert(bin != NULL);
+	g_assert(bin_len == 2 && bin[0] == 0x0a && bin[1] == 0x1b);
+	g_free(bin);
+
+	g_assert(decode_hex("0g", -1, NULL, 0) == NULL);
+}
+
+static void test_best_lang(void)
+{
+	enum gsm_dialect locking;
+	enum gsm_dialect single;
+	unsigned char *res;
+	long nread;
+	long nwritten;
+
+	res = convert_utf8_to_gsm_best_lang("a[b", -1, &nread, &nwritten, 0,
+						GSM_DIALECT_TURKISH,
+						&locking, &single);
+	g_assert(res);
+	g_assert(nread == 3);
+	g_assert(nwritten == 4);
+	g_assert(res[1] == 0x1b && res[2] == 0x3c);
+	g_assert(locking == GSM_DIALECT_DEFAULT);
+	g_assert(single == GSM_DIALECT_DEFAULT);
+	g_free(res);
+
+	/* LATIN CAPITAL LETTER S WITH CEDILLA, Turkish single shift */
+	res = convert_utf8_to_gsm_best_lang("a\xc5\x9e", -1, &nread,
+						&nwritten, 0,
+						GSM_DIALECT_TURKISH,
+						&locking, &single);
+	g_assert(res);
+	g_assert(nread == 3);
+	g_assert(nwritten == 3);
+	g_assert(res[1] == 0x1b && res[2] == 0x53);
+	g_assert(locking == GSM_DIALECT_DEFAULT);
+	g_assert(single == GSM_DIALECT_TURKISH);
+	g_free(res);
+
+	res = convert_utf8_to_gsm_best_lang("a\xc5\x9e", -1, &nread,
+						&nwritten, 0,
+						GSM_DIALECT_SPANISH,
+						&locking, &single);
+	g_assert(res == NULL);
+	g_assert(nread == 1);
+
+	/* INFINITY, Portuguese locking shift only */
+	res = convert_utf8_to_gsm_best_lang("a\xe2\x88\x9e", -1, &nread,
+						&nwritten, 0,
+						GSM_DIALECT_PORTUGUESE,
+						&locking, &single);
+	g_assert(res);
+	g_assert(nread == 4);
+	g_assert(nwritten == 2);
+	g_assert(locking == GSM_DIALECT_PORTUGUESE);
+	g_assert(single == GSM_DIALECT_PORTUGUESE);
+	g_free(res);
+
+	res = convert_utf8_to_gsm_best_lang("a\xe2\x88\x9e", -1, &nread,
+						&nwritten, 0,
+						GSM_DIALECT_DEFAULT,
+						&locking, &single);
+	g_assert(res == NULL);
+	g_assert(nread == 1);
+}
+
 int main(int argc, char **argv)
 {
 	g_test_init(&argc, &argv, NULL);
@@ -1022,12 +1138,14 @@ int main(int argc, char **argv)
 			test_valid_turkish);
 	g_test_add_func("/testutil/Decode Encode", test_decode_encode);
 	g_test_add_func("/testutil/Pack Size", test_pack_size);
+	g_test_add_func("/testutil/Pack Round Trip", test_pack_round_trip);
 	g_test_add_func("/testutil/CBS CR Handling", test_cr_handling);
 	g_test_add_func("/testutil/SMS Handling", test_sms_handling);
 	g_test_add_func("/testutil/Offset Handling", test_offset_handling);
 	g_test_add_func("/testutil/SIM conversions", test_sim);
 	g_test_add_func("/testutil/Valid Unicode to GSM Conversion",
 			test_unicode_to_gsm);
+	g_test_add_func("/testutil/Best Dialect Conversion", test_best_lang);
 
 	return g_test_run();
 }